@@ -0,0 +1,894 @@
+/***********************************************
+*      __                             ___ __   *
+*     / /_  ____ ___  ____  ___  ____/ (_) /_  *
+*    / __ \/ __ `__ \/ __ \/ _ \/ __  / / __/  *
+*   / /_/ / / / / / / /_/ /  __/ /_/ / / /_    *
+*  /_.___/_/ /_/ /_/ .___/\___/\__,_/_/\__/    *
+*                 /_/                          *
+***********************************************/
+/* bmpbench - benchmarks for the bmpedit filters
+    Generates synthetic 24-bit images at several sizes, including widths
+    which need row padding, and times every filter on its own and several
+    combinations. Each is run through the filter chain and, for comparison,
+    by running each filter over the whole image one after another (the
+    spatial filters untiled), checking
+    that both give the same image (to within 1 where a SIMD kernel rounds
+    differently). Reports megapixels/s, cycles per pixel and peak memory,
+    and with -c writes the results as CSV. Also
+    times the SIMD row kernels, and with -k checks them against the scalar
+    filters. The fixed point HSL engine is timed against the float functions
+    it replaced, with and without its color cache, the combinations are
+    timed baked into 3D lookup tables, gathering the image statistics is
+    timed on its own, resizing is timed with each resize filter, and run-length
+   encoding is timed on indexed images against leaving them uncompressed. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#include "bmpedit.h"
+
+/* Filters and filter combinations to benchmark */
+static const struct {
+    const char *name;
+    int filter_flag;
+} combos[] = {
+    {"hsl", FLAG_HSL},
+    {"contrast", FLAG_CONTRAST},
+    {"wb", FLAG_WB},
+    {"gamma", FLAG_GAMMA},
+    {"threshold", FLAG_THRESHOLD},
+    {"greyscale", FLAG_GREYSCALE},
+    {"sepia", FLAG_SEPIA},
+    {"inverse", FLAG_INVERSE},
+    {"contrast+gamma", FLAG_CONTRAST | FLAG_GAMMA},
+    {"contrast+wb+gamma+inverse", FLAG_CONTRAST | FLAG_WB | FLAG_GAMMA | FLAG_INVERSE},
+    {"hsl+contrast+wb+gamma+sepia", FLAG_HSL | FLAG_CONTRAST | FLAG_WB | FLAG_GAMMA | FLAG_SEPIA},
+    {"levels", FLAG_LEVELS},
+    {"autocontrast", FLAG_AUTO_CONTRAST},
+    {"wb+levels+gamma", FLAG_WB | FLAG_LEVELS | FLAG_GAMMA},
+    {"all", 255},
+    {"blur", FLAG_BLUR},
+    {"boxblur", FLAG_BOX_BLUR},
+    {"sharpen", FLAG_SHARPEN},
+    {"unsharp", FLAG_UNSHARP},
+    {"blur+contrast+sharpen", FLAG_BLUR | FLAG_CONTRAST | FLAG_SHARPEN},
+};
+
+/* Returns the monotonic clock in seconds */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Image sizes benchmarked by default. The odd widths need row padding */
+static const int sizes[][2] = {{640, 480}, {1001, 751}, {1920, 1080}, {4001, 3000}};
+
+/* Returns the CPU timestamp counter, or 0 where there is none */
+static unsigned long long cycles(void) {
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Returns the peak resident memory of the process in KB */
+static long peak_rss(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* Fills the image with a repeatable pattern */
+static void synth_image(unsigned char *data, int width, int height, int stride) {
+    unsigned int seed = 12345;
+    for (int i = 0; i < height; i++) {
+        unsigned char *row = data + (size_t)i * stride;
+        for (int j = 0; j < width * 3; j++) {
+            seed = seed * 1103515245 + 12345;
+            row[j] = (unsigned char)((j + i) / 4 + (seed >> 27) + (j % 3) * 40);    // with a color cast
+        }
+    }
+}
+
+/* Runs every selected filter over the whole image in turn */
+static void run_sequential(int filter_flag, filter_params *params, image *img) {
+    if (filter_flag & FLAG_BLUR) blur_filter((*params).blur, img);
+    if (filter_flag & FLAG_BOX_BLUR) box_blur_filter((*params).box_radius, img);
+    if (filter_flag & FLAG_HSL) hsl_filter((*params).hue, (*params).saturation, (*params).lightness, img);
+    if (filter_flag & FLAG_CONTRAST) contrast_filter((*params).contrast, img);
+    if (filter_flag & FLAG_WB) wb_filter(img);
+    if (filter_flag & FLAG_LEVELS) levels_filter((*params).levels_clip, 1, img);
+    if (filter_flag & FLAG_AUTO_CONTRAST) levels_filter((*params).contrast_clip, 0, img);
+    if (filter_flag & FLAG_GAMMA) gamma_filter((*params).gamma, img);
+    if (filter_flag & FLAG_THRESHOLD) threshold_filter((*params).threshold, img);
+    if (filter_flag & FLAG_GREYSCALE) greyscale_filter(img);
+    if (filter_flag & FLAG_SEPIA) sepia_filter(img);
+    if (filter_flag & FLAG_INVERSE) inverse_filter(img);
+    if (filter_flag & FLAG_SHARPEN) sharpen_filter((*params).sharpen, img);
+    if (filter_flag & FLAG_UNSHARP) unsharp_filter((*params).unsharp[0], (*params).unsharp[1], (*params).unsharp[2], img);
+}
+
+/* A cube baked from a chain which mixes the channels, for the cube kernels */
+static color_cube *kernel_cube(void) {
+    static color_cube cube;
+    if (cube.nodes == NULL) {
+        filter_params params = {20, 10, -5, 40, 2.2, 0.5, 0};
+        filter_chain chain;
+        build_chain(&chain, FLAG_HSL | FLAG_CONTRAST | FLAG_SEPIA, &params);
+        if (cube_create(&cube, CUBE_SIZE) != 0) {
+            fprintf(stderr, "bmpbench: memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        cube_from_chain(&cube, &chain, 0, chain.count);
+        free_chain(&chain);
+    }
+    return &cube;
+}
+
+/* Unsharp masks a row of up to 4096 pixels on its own, as if the rows above
+   and below it were the same, through the two spatial kernels */
+static void spatial_row(simd_kernels *k, pixel *row, int width) {
+    static spatial_filter filter;
+    static unsigned char padded[3 * 4096 + 6 * MAX_RADIUS];
+    static unsigned short line[3 * 4096];
+    const unsigned short *window[2 * MAX_RADIUS + 1];
+    if (filter.radius == 0) spatial_gaussian(&filter, 1.0, 1.5, 2);
+    int radius = filter.radius, n = width * 3;
+    // The edge pixels repeat beyond the ends of the row
+    for (int j = 0; j < radius; j++) {
+        memcpy(padded + 3 * j, row, 3);
+        memcpy(padded + 3 * (radius + width + j), row + width - 1, 3);
+    }
+    memcpy(padded + 3 * radius, row, n);
+    (*k).convolve_line(padded, line, n, 3, filter.weights, radius);
+    for (int j = 0; j <= 2 * radius; j++) window[j] = line;
+    (*k).convolve_columns(window, filter.weights, radius, padded + 3 * radius, filter.amount, filter.threshold,
+                          (unsigned char *)row, n);
+}
+
+/* Resizes a row of up to 4096 pixels to two thirds of its width through the
+   two resampling kernels, with every row of the Lanczos window the same */
+static void resample_row(simd_kernels *k, pixel *row, int width) {
+    static resize_axis axis;
+    static unsigned short line[3 * 4096 + 4];
+    const unsigned char *window[16];
+    if (axis.in != width) {
+        resize_axis_free(&axis);
+        if (resize_axis_create(&axis, width, (2 * width + 2) / 3, RESIZE_LANCZOS) != 0) {
+            fprintf(stderr, "bmpbench: memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int j = 0; j < axis.taps; j++) window[j] = (const unsigned char *)row;
+    (*k).resample_columns(window, axis.weights, axis.taps, line, width * 3);
+    (*k).resample_line(line, (unsigned char *)row, &axis, 0, axis.out, 3);
+}
+
+/* Runs one of the SIMD kernels over a single row */
+static void run_kernel(simd_kernels *k, int which, pixel *row, int width) {
+    switch (which) {
+        case 0: (*k).greyscale(row, width); break;
+        case 1: (*k).sepia(row, width); break;
+        case 2: (*k).threshold(383, row, width); break;
+        case 3: (*k).contrast(contrast_coeff(40), row, width); break;
+        case 4: (*k).inverse(row, width); break;
+        case 5: (*k).cube(kernel_cube(), row, width); break;
+        case 6: spatial_row(k, row, width); break;
+        case 7: resample_row(k, row, width); break;
+    }
+}
+
+static const char *kernel_names[] = {"greyscale", "sepia", "threshold", "contrast", "inverse", "cube", "unsharp",
+                                     "resample"};
+#define KERNEL_COUNT 8
+
+/* Checks every SIMD kernel against the scalar filter on rows of many widths,
+   so the block loops and the scalar tails are both covered. Kernels must be
+   bit-exact, or within 1 where the fixed point rounding differs. Greyscale
+   and sepia must also match their fixed point scalar versions exactly, so
+   the pixels past the last block of 16 come out as they would inside one */
+static int check_kernels(void) {
+    int failed = 0, best = simd_detect();
+    simd_kernels scalar = simd_get_kernels(SIMD_SCALAR);
+    simd_kernels fixed = scalar;
+    fixed.greyscale = greyscale_fixed_row;
+    fixed.sepia = sepia_fixed_row;
+    pixel *expect = malloc(sizeof(pixel) * 1000), *actual = malloc(sizeof(pixel) * 1000), *exact = malloc(sizeof(pixel) * 1000);
+    if (expect == NULL || actual == NULL || exact == NULL) return 1;
+    for (int level = SIMD_SSE41; level <= best; level++) {
+        simd_kernels k = simd_get_kernels(level);
+        for (int which = 0; which < KERNEL_COUNT; which++) {
+            int max_diff = 0, inexact = 0;
+            long int differ = 0;
+            for (int width = 1; width <= 1000; width += (width < 100) ? 1 : 37) {
+                synth_image((unsigned char *)expect, width, 1, width * 3);
+                memcpy(actual, expect, sizeof(pixel) * width);
+                memcpy(exact, expect, sizeof(pixel) * width);
+                run_kernel(&scalar, which, expect, width);
+                run_kernel(&k, which, actual, width);
+                for (int j = 0; j < width * 3; j++) {
+                    int d = abs(((unsigned char *)expect)[j] - ((unsigned char *)actual)[j]);
+                    if (d > max_diff) max_diff = d;
+                    if (d) differ++;
+                }
+                if (which <= 1) {
+                    run_kernel(&fixed, which, exact, width);
+                    if (memcmp(exact, actual, sizeof(pixel) * width) != 0) inexact = 1;
+                }
+            }
+            if (max_diff > 1 || inexact) failed = 1;
+            printf("%-8s %-10s max diff %d (%ld bytes differ) %s\n", simd_name(level), kernel_names[which],
+                   max_diff, differ, (max_diff > 1) ? "FAILED" : inexact ? "FAILED (not exact against fixed point)" : "ok");
+        }
+    }
+    free(expect);
+    free(actual);
+    free(exact);
+    return failed;
+}
+
+/* Checks the library turns down broken BMP files held in memory with the
+   right error, rather than reading past them, and still filters good ones.
+   Each case changes one field of the headers of a 5x3 image */
+static int check_library(void) {
+    static const struct {
+        const char *name;
+        int field;          // 0 none, 1 offset, 2 header size, 3 width, 4 height, 5 cut short
+        long long value;
+        int expect;
+        const char *message;        // part of the error message expected
+    } cases[] = {
+        {"good image", 0, 0, BMPEDIT_OK, ""},
+        {"height of INT_MIN", 4, INT_MIN, BMPEDIT_ERROR_FORMAT, "height"},
+        {"offset past the end", 1, 1000, BMPEDIT_ERROR_FORMAT, "offset"},
+        {"header size past the end", 2, 4000, BMPEDIT_ERROR_FORMAT, "information header"},
+        {"width of 0", 3, 0, BMPEDIT_ERROR_FORMAT, "width"},
+        {"pixels cut short", 5, 20, BMPEDIT_ERROR_FORMAT, "cut short"}
+    };
+    int failed = 0, width = 5, height = 3, stride = 16;
+    unsigned char input[FH_SIZE + IH_SIZE + 48], output[sizeof(input)];
+    bmpedit_context *context = bmpedit_create(1);
+    filter_params params;
+    filter_chain chain;
+    memset(&params, 0, sizeof(params));
+    if (context == NULL || build_chain(&chain, FLAG_INVERSE, &params) != 0) return 1;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        BITMAPFILEHEADER file_header = {0x4d42, sizeof(input), 0, 0, FH_SIZE + IH_SIZE};
+        BITMAPINFOHEADER info_header;
+        memset(&info_header, 0, sizeof(info_header));
+        info_header.header_size = IH_SIZE;
+        info_header.width = width;
+        info_header.height = height;
+        info_header.colors_planes = 1;
+        info_header.bpp = 24;
+        info_header.image_size = stride * height;
+        size_t size = sizeof(input), output_size = sizeof(output);
+        if (cases[c].field == 1) file_header.offset = (unsigned int)cases[c].value;
+        if (cases[c].field == 2) info_header.header_size = (unsigned int)cases[c].value;
+        if (cases[c].field == 3) info_header.width = (int)cases[c].value;
+        if (cases[c].field == 4) info_header.height = (int)cases[c].value;
+        if (cases[c].field == 5) size -= cases[c].value;
+        memset(input, 0, sizeof(input));
+        memcpy(input, &file_header, FH_SIZE);
+        memcpy(input + FH_SIZE, &info_header, IH_SIZE);
+        synth_image(input + FH_SIZE + IH_SIZE, width, height, stride);
+        int result = bmpedit_filter_bmp(context, &chain, input, size, output, &output_size);
+        int ok = result == cases[c].expect && (result != BMPEDIT_OK || (output_size == sizeof(input) &&
+                 output[FH_SIZE + IH_SIZE] == 255 - input[FH_SIZE + IH_SIZE])) &&
+                 strstr(bmpedit_error(context), cases[c].message) != NULL;
+        if (!ok) failed = 1;
+        printf("library  %-26s %d %s\n", cases[c].name, result, ok ? "ok" : "FAILED");
+    }
+    free_chain(&chain);
+    bmpedit_destroy(context);
+    return failed;
+}
+
+/* Times every kernel at every supported SIMD level */
+static void time_kernels(unsigned char *source, unsigned char *work, size_t size, int width, int height, int stride) {
+    double mpixels = (double)width * height / 1e6;
+    int best = simd_detect();
+    printf("\n%-12s", "kernel MP/s");
+    for (int level = SIMD_SCALAR; level <= best; level++) printf(" %10s", simd_name(level));
+    printf("\n");
+    for (int which = 0; which < KERNEL_COUNT; which++) {
+        printf("%-12s", kernel_names[which]);
+        for (int level = SIMD_SCALAR; level <= best; level++) {
+            simd_kernels k = simd_get_kernels(level);
+            memcpy(work, source, size);
+            double t0 = now();
+            for (int i = 0; i < height; i++) run_kernel(&k, which, (pixel *)(work + (size_t)i * stride), width);
+            printf(" %10.1f", mpixels / (now() - t0));
+        }
+        printf("\n");
+    }
+}
+
+/* HSL filter for a row using the float conversion functions, as hsl_row
+   worked before the fixed point engine */
+static void hsl_float_row(double hue, double saturation, double lightness, pixel *data, int width) {
+    hsl_struct hsl;
+    for (int j = 0; j < width; j++) {
+        rgb_to_hsl(&hsl, data[j].red, data[j].green, data[j].blue);
+        hsl_calc(&hsl, hue, saturation, lightness);
+        hsl_to_rgb(&hsl, &data[j]);
+    }
+}
+
+/* Largest difference of any byte between two images */
+static int max_difference(const unsigned char *a, const unsigned char *b, size_t size) {
+    int max_diff = 0;
+    for (size_t i = 0; i < size; i++) {
+        int d = abs(a[i] - b[i]);
+        if (d > max_diff) max_diff = d;
+    }
+    return max_diff;
+}
+
+/* Times the HSL engines on the image and on a copy of it reduced to 64
+   colors, printing the speed of each and its largest error against the
+   float functions */
+static void time_hsl(unsigned char *source, unsigned char *work, unsigned char *expect, size_t size,
+                     int width, int height, int stride) {
+    double mpixels = (double)width * height / 1e6;
+    double hue = 20, saturation = 10, lightness = -5;
+    hsl_shift shift = hsl_fixed_shift(hue, saturation, lightness);
+    unsigned int *cache = malloc(sizeof(unsigned int) << 24);
+    unsigned char *palette = malloc(size);
+    if (cache == NULL || palette == NULL) return;
+    for (size_t i = 0; i < size; i++) palette[i] = source[i] & 0xc0;
+    printf("\n%-22s %10s %10s %10s %10s\n", "hsl engine", "MP/s", "max err", "64c MP/s", "max err");
+
+    for (int engine = -1; engine <= simd_detect() + 1; engine++) {
+        const char *name = (engine < 0) ? "float (before)" : (engine > simd_detect() ? "fixed + cache" : simd_name(engine));
+        simd_kernels k = simd_get_kernels(engine < 0 ? SIMD_SCALAR : engine);
+        printf("%-22s", name);
+        for (int image = 0; image < 2; image++) {
+            unsigned char *in = image ? palette : source;
+            // The float functions give the expected image
+            memcpy(expect, in, size);
+            for (int i = 0; i < height; i++) hsl_float_row(hue, saturation, lightness, (pixel *)(expect + (size_t)i * stride), width);
+            memcpy(work, in, size);
+            memset(cache, 0, sizeof(unsigned int) << 24);
+            double t0 = now();
+            for (int i = 0; i < height; i++) {
+                pixel *row = (pixel *)(work + (size_t)i * stride);
+                if (engine < 0) hsl_float_row(hue, saturation, lightness, row, width);
+                else if (engine > simd_detect()) hsl_cached_row(&shift, cache, row, width);
+                else k.hsl(&shift, row, width);
+            }
+            double t1 = now();
+            printf(" %10.1f %10d", mpixels / (t1 - t0), max_difference(expect, work, size));
+        }
+        printf("\n");
+    }
+    free(cache);
+    free(palette);
+}
+
+/* Times the filter chain once, building it as well */
+static double time_chain(int filter_flag, filter_params *params, image *img) {
+    filter_chain chain;
+    double t0 = now();
+    build_chain(&chain, filter_flag, params);
+    run_chain(&chain, img, NULL);
+    free_chain(&chain);
+    return now() - t0;
+}
+
+/* Times every filter combination baked into cubes of several sizes (the
+   baking included) against the filter chain, on one thread, with the
+   largest error of the 33^3 cube against the chain */
+static void time_cubes(image *source, image *work, image *expect, size_t size) {
+    static const int cube_sizes[] = {17, CUBE_SIZE, 65};
+    double mpixels = (double)(*source).width * (*source).height / 1e6;
+    filter_params params = {20, 10, -5, 40, 2.2, 0.5, 0, 0, NULL, LEVELS_CLIP, LEVELS_CLIP, 2, 4, 1, {2, 1, 0}};
+    printf("\n%-30s %10s", "baked MP/s", "chain");
+    for (int k = 0; k < 3; k++) printf(" %7d^3", cube_sizes[k]);
+    printf(" %10s\n", "max err");
+    for (size_t c = 0; c < sizeof(combos) / sizeof(combos[0]); c++) {
+        memcpy((*expect).data, (*source).data, size);
+        params.bake = 0;
+        printf("%-30s %10.1f", combos[c].name, mpixels / time_chain(combos[c].filter_flag, &params, expect));
+        int max_diff = 0;
+        for (int k = 0; k < 3; k++) {
+            memcpy((*work).data, (*source).data, size);
+            params.bake = cube_sizes[k];
+            printf(" %10.1f", mpixels / time_chain(combos[c].filter_flag, &params, work));
+            if (cube_sizes[k] == CUBE_SIZE) max_diff = max_difference((*expect).data, (*work).data, size);
+        }
+        printf(" %10d\n", max_diff);
+    }
+}
+
+/* Times gathering the statistics of the image on their own, the RGB totals
+   which white balance needs against the histograms, checking the totals
+   worked out from the histograms match */
+static void time_stats(image *img, thread_pool *pool, int repeats) {
+    static const char *levels[] = {"sums", "histograms"};
+    filter_chain empty = {.count = 0};
+    double mpixels = (double)(*img).width * (*img).height / 1e6;
+    unsigned long long sums[3];
+    printf("\n%-30s %10s %s\n", "statistics", "MP/s", "totals");
+    for (int level = STATS_SUMS; level <= STATS_HISTOGRAMS; level++) {
+        double best = 0;
+        static image_stats stats;
+        for (int r = 0; r < repeats; r++) {
+            stats_clear(&stats, level);
+            double t0 = now();
+            run_pass(&empty, 0, 0, NULL, img, pool, &stats);
+            double t = now() - t0;
+            if (r == 0 || t < best) best = t;
+        }
+        if (level == STATS_SUMS) memcpy(sums, stats.sums, sizeof(sums));
+        printf("%-30s %10.1f %s\n", levels[level - 1], mpixels / best,
+               (memcmp(sums, stats.sums, sizeof(sums)) == 0 && stats.pixel_total == (long int)(*img).width * (*img).height) ?
+               "identical" : "DIFFERENT");
+    }
+}
+
+/* Times resizing the whole image with each resize filter, to thumbnails of
+   256 and 1024 pixels and up to twice its size, counting the pixels read.
+   Each is run with the scalar kernels and the best SIMD ones, with the
+   largest difference between them */
+static void time_resize(image *img, thread_pool *pool, int repeats) {
+    static const char *filters[] = {"box", "bilinear", "lanczos"};
+    double mpixels = (double)(*img).width * (*img).height / 1e6;
+    int best = simd_detect(), longest = ((*img).width > (*img).height) ? (*img).width : (*img).height;
+    printf("\n%-30s %10s %10s %10s\n", "resize MP/s", simd_name(SIMD_SCALAR), simd_name(best), "max err");
+    for (int kernel = RESIZE_BOX; kernel <= RESIZE_LANCZOS; kernel++) {
+        for (int target = 0; target < 3; target++) {
+            int fit = (target == 2) ? 2 * longest : 256 << (2 * target);
+            if (fit > MAX_RESIZE) continue;
+            resize_spec spec = {0, 0, fit, kernel};
+            int width, height;
+            resize_size(&spec, (*img).width, (*img).height, &width, &height);
+            image out[2];
+            if (image_create(&out[0], width, height, LAYOUT_BGR) != 0 ||
+                image_create(&out[1], width, height, LAYOUT_BGR) != 0) {
+                fprintf(stderr, "bmpbench: memory allocation failed.\n");
+                exit(EXIT_FAILURE);
+            }
+            // The padding at the end of each row is never written
+            memset(out[0].data, 0, out[0].stride * height);
+            memset(out[1].data, 0, out[1].stride * height);
+            char name[64];
+            snprintf(name, sizeof(name), "%s %dx%d", filters[kernel], width, height);
+            printf("%-30s", name);
+            for (int k = 0; k < 2; k++) {
+                simd_init(k == 0 ? SIMD_SCALAR : best);
+                double time = 1e30;
+                for (int r = 0; r < repeats; r++) {
+                    double t0 = now();
+                    if (resize_image(img, &out[k], kernel, pool) != 0) {
+                        fprintf(stderr, "bmpbench: memory allocation failed.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                    if (now() - t0 < time) time = now() - t0;
+                }
+                printf(" %10.1f", mpixels / time);
+            }
+            printf(" %10d\n", max_difference(out[0].data, out[1].data, out[0].stride * height));
+            image_free(&out[0]);
+            image_free(&out[1]);
+        }
+    }
+    simd_init(best);
+}
+
+/* Returns 1 if two images of packed pixels hold the same pixels, leaving
+   out the padding at the end of each row */
+static int same_pixels(const image *a, const image *b) {
+    for (int i = 0; i < (*a).height; i++) {
+        if (memcmp(IMAGE_ROW(a, i), IMAGE_ROW(b, i), (size_t)(*a).channels * (*a).width) != 0) return 0;
+    }
+    return 1;
+}
+
+/* Times turning the image a quarter: transposing it in one go, and in tiles
+   of TRANSFORM_TILE_ROWS by TRANSFORM_TILE_COLUMNS as rotations do, and
+   mirroring each row as horizontal flips do. Each is run with the scalar
+   kernels and the best SIMD ones, checking they give the same image */
+static void time_transform(image *img, int repeats) {
+    double mpixels = (double)(*img).width * (*img).height / 1e6;
+    int best = simd_detect(), width = (*img).width, height = (*img).height;
+    image out[2], mirrored[2];
+    if (image_create(&out[0], height, width, LAYOUT_BGR) != 0 || image_create(&out[1], height, width, LAYOUT_BGR) != 0 ||
+        image_create(&mirrored[0], width, height, LAYOUT_BGR) != 0 ||
+        image_create(&mirrored[1], width, height, LAYOUT_BGR) != 0) {
+        fprintf(stderr, "bmpbench: memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(out[0].data, 0, out[0].stride * width);
+    memset(out[1].data, 0, out[1].stride * width);
+    // Both copies are mirrored in place the same number of times
+    for (int i = 0; i < height; i++) {
+        memcpy(IMAGE_ROW(&mirrored[0], i), IMAGE_ROW(img, i), (size_t)3 * width);
+        memcpy(IMAGE_ROW(&mirrored[1], i), IMAGE_ROW(img, i), (size_t)3 * width);
+    }
+    printf("\n%-30s %10s %10s %s\n", "transform MP/s", simd_name(SIMD_SCALAR), simd_name(best), "output");
+    for (int test = 0; test < 3; test++) {
+        static const char *names[] = {"transpose untiled", "transpose tiled", "mirror"};
+        printf("%-30s", names[test]);
+        for (int k = 0; k < 2; k++) {
+            simd_kernels kernels = simd_get_kernels(k == 0 ? SIMD_SCALAR : best);
+            double time = 1e30;
+            for (int r = 0; r < repeats; r++) {
+                double t0 = now();
+                if (test == 0) {
+                    kernels.transpose((*img).data, (*img).stride, out[k].data, out[k].stride, height, width, 3);
+                } else if (test == 1) {
+                    for (int i = 0; i < height; i += TRANSFORM_TILE_ROWS) {
+                        int rows = (height - i < TRANSFORM_TILE_ROWS) ? height - i : TRANSFORM_TILE_ROWS;
+                        for (int j = 0; j < width; j += TRANSFORM_TILE_COLUMNS) {
+                            int columns = (width - j < TRANSFORM_TILE_COLUMNS) ? width - j : TRANSFORM_TILE_COLUMNS;
+                            kernels.transpose((*img).data + i * (*img).stride + 3 * j, (*img).stride,
+                                              out[k].data + j * out[k].stride + 3 * i, out[k].stride, rows, columns, 3);
+                        }
+                    }
+                } else {
+                    for (int i = 0; i < height; i++) kernels.mirror((pixel *)(mirrored[k].data + i * mirrored[k].stride), width);
+                }
+                if (now() - t0 < time) time = now() - t0;
+            }
+            printf(" %10.1f", mpixels / time);
+        }
+        int same = (test < 2) ? same_pixels(&out[0], &out[1]) : same_pixels(&mirrored[0], &mirrored[1]);
+        printf(" %s\n", same ? "identical" : "DIFFERENT");
+    }
+    image_free(&out[0]);
+    image_free(&out[1]);
+    image_free(&mirrored[0]);
+    image_free(&mirrored[1]);
+}
+
+/* Sets pixel x of a row of 8 or 4-bit indices */
+static void set_pixel(unsigned char *row, int x, int bpp, int value) {
+    if (bpp == 8) {
+        row[x] = value;
+    } else {
+        row[x >> 1] = (row[x >> 1] & ((x & 1) ? 0xf0 : 0x0f)) | value << ((x & 1) ? 0 : 4);
+    }
+}
+
+/* Fills rows of 8 or 4-bit indices with either rectangles of flat color on
+   a plain background, like a diagram or a mask, or noise. The padding at
+   the end of each row is left as it is */
+static void synth_indices(unsigned char *data, int width, int height, size_t stride, int bpp, int flat) {
+    unsigned int seed = 12345, mask = (1u << bpp) - 1;
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            seed = seed * 1103515245 + 12345;
+            set_pixel(data + (size_t)i * stride, j, bpp, flat ? 0 : (seed >> 24) & mask);
+        }
+    }
+    for (int k = 0; flat && k < 64; k++) {
+        seed = seed * 1103515245 + 12345;
+        int x = (seed >> 8) % width, y = (seed >> 4) % height, color = (seed >> 24) & mask;
+        seed = seed * 1103515245 + 12345;
+        int x_end = x + (seed >> 8) % (width / 4 + 1), y_end = y + (seed >> 4) % (height / 4 + 1);
+        for (int i = y; i < y_end && i < height; i++) {
+            for (int j = x; j < x_end && j < width; j++) set_pixel(data + (size_t)i * stride, j, bpp, color);
+        }
+    }
+}
+
+/* Times run-length encoding and decoding indexed images of flat color and
+   of noise at 8 and 4 bpp, with a round trip through a temporary file both
+   uncompressed and encoded, and counting the colors of each image a pixel
+   at a time and a run at a time. Checks each round trip gives back the
+   same indices, and both counts agree */
+static void time_rle(int width, int height, int repeats) {
+    double mpixels = (double)width * height / 1e6;
+    FILE *fp = tmpfile();
+    printf("\n%-16s %10s %10s %10s %10s %10s %10s %10s %10s %s\n", "rle MP/s", "raw KB", "rle KB", "encode", "decode",
+           "raw trip", "rle trip", "count", "count rle", "output");
+    for (int k = 0; k < 4 && fp != NULL; k++) {
+        int bpp = (k & 1) ? 4 : 8, flat = (k < 2);
+        size_t stride = ((size_t)width * bpp + 31) / 32 * 4, bytes = stride * height, encoded = 0;
+        unsigned char *data = calloc(bytes, 1), *back = malloc(bytes), *rle = malloc(RLE_ROW_BOUND(width) * height);
+        if (data == NULL || back == NULL || rle == NULL) {
+            fprintf(stderr, "bmpbench: memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        synth_indices(data, width, height, stride, bpp, flat);
+        double times[6] = {1e30, 1e30, 1e30, 1e30, 1e30, 1e30};
+        int same = 1;
+        for (int r = 0; r < repeats; r++) {
+            double t[7];
+            unsigned long long counts[2][256] = {{0}};
+            rle_reader reader;
+            t[0] = now();
+            encoded = 0;
+            for (int i = 0; i < height; i++) encoded += rle_encode_row(rle + encoded, data + i * stride, width, bpp, i == height - 1);
+            t[1] = now();
+            rle_open(&reader, NULL, rle, encoded, width, height, bpp);
+            for (int i = 0; i < height; i++) same &= rle_row(&reader, back + i * stride) == 0;
+            rle_close(&reader);
+            t[2] = now();
+            same &= memcmp(data, back, bytes) == 0;
+            // Both round trips write the file and read it straight back, so it is in the page cache
+            t[3] = now();
+            rewind(fp);
+            same &= fwrite(data, 1, bytes, fp) == bytes && fflush(fp) == 0;
+            rewind(fp);
+            same &= fread(back, 1, bytes, fp) == bytes;
+            t[4] = now();
+            rewind(fp);
+            same &= fwrite(rle, 1, encoded, fp) == encoded && fflush(fp) == 0;
+            rewind(fp);
+            rle_open(&reader, fp, NULL, encoded, width, height, bpp);
+            for (int i = 0; i < height; i++) same &= rle_row(&reader, back + i * stride) == 0;
+            rle_close(&reader);
+            t[5] = now();
+            same &= memcmp(data, back, bytes) == 0;
+            palette_count(counts[0], data, width, height, bpp, stride);
+            t[6] = now();
+            same &= rle_count(counts[1], rle, encoded, width, height, bpp) == 0;
+            same &= memcmp(counts[0], counts[1], sizeof(counts[0])) == 0;
+            double spans[6] = {t[1] - t[0], t[2] - t[1], t[4] - t[3], t[5] - t[4] + t[1] - t[0], t[6] - t[5], now() - t[6]};
+            for (int s = 0; s < 6; s++) {
+                if (spans[s] < times[s]) times[s] = spans[s];
+            }
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "%s %d-bit", flat ? "flat" : "noise", bpp);
+        printf("%-16s %10.1f %10.1f", name, bytes / 1024.0, encoded / 1024.0);
+        for (int s = 0; s < 6; s++) printf(" %10.1f", mpixels / times[s]);
+        printf(" %s\n", same ? "identical" : "DIFFERENT");
+        free(data);
+        free(back);
+        free(rle);
+    }
+    if (fp != NULL) fclose(fp);
+}
+
+/* Writes the synthetic image as a BMP file, so it can be used with bmpedit */
+static int write_image(const char *dir, const unsigned char *data, int width, int height, int stride) {
+    char name[4096];
+    snprintf(name, sizeof(name), "%s/synth_%dx%d.bmp", dir, width, height);
+    FILE *fp = fopen(name, "w");
+    if (fp == NULL) return -1;
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    memset(&file_header, 0, sizeof(file_header));
+    memset(&info_header, 0, sizeof(info_header));
+    file_header.type = 0x4d42;
+    file_header.offset = FH_SIZE + IH_SIZE;
+    file_header.size = file_header.offset + (unsigned int)stride * height;
+    info_header.header_size = IH_SIZE;
+    info_header.width = width;
+    info_header.height = height;
+    info_header.colors_planes = 1;
+    info_header.bpp = 24;
+    info_header.image_size = (unsigned int)stride * height;
+    int ok = fwrite(&file_header, sizeof(file_header), 1, fp) == 1 && fwrite(&info_header, IH_SIZE, 1, fp) == 1 &&
+             fwrite(data, stride, height, fp) == (size_t)height;
+    if (fclose(fp) != 0 || !ok) return -1;
+    printf("wrote %s\n", name);
+    return 0;
+}
+
+/* Times the filter chain on a copy of the source image in another layout,
+   not counting the copy, and copies the result to fused for checking */
+static double time_layout(image *copy, image *source, image *fused, int filter_flag, filter_params *params,
+                          thread_pool *pool, int repeats) {
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++) {
+        filter_chain chain;
+        image_copy(copy, source);
+        double t0 = now();
+        build_chain(&chain, filter_flag, params);
+        run_chain(&chain, copy, pool);
+        free_chain(&chain);
+        double t1 = now();
+        if (t1 - t0 < best) best = t1 - t0;
+    }
+    image_copy(fused, copy);
+    return best;
+}
+
+/* Benchmarks every filter combination on one image size, taking the best
+   of repeats runs of the filter chain. Returns 1 if any output differs by more than 1 */
+static int bench_size(int width, int height, int threads, int repeats, FILE *csv, int details) {
+    int padding = (4 - (width * 3) % 4) % 4;
+    int stride = width * 3 + padding;
+    size_t size = (size_t)stride * height;
+    unsigned char *source = malloc(size), *seq = malloc(size), *fused = malloc(size);
+    image source_image, seq_image, fused_image, planar, bgra;
+    if (source == NULL || seq == NULL || fused == NULL || image_create(&planar, width, height, LAYOUT_PLANAR) != 0 ||
+        image_create(&bgra, width, height, LAYOUT_BGRA) != 0) {
+        fprintf(stderr, "bmpbench: memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    synth_image(source, width, height, stride);
+    // The images are laid out as in a BMP file, apart from the planar and BGRA ones
+    image_wrap(&source_image, source, width, height, stride, 3);
+    image_wrap(&seq_image, seq, width, height, stride, 3);
+    image_wrap(&fused_image, fused, width, height, stride, 3);
+    thread_pool *pool = (threads > 1) ? pool_create(threads) : NULL;
+
+    filter_params params = {20, 10, -5, 40, 2.2, 0.5, 0, 0, NULL, LEVELS_CLIP, LEVELS_CLIP, 2, 4, 1, {2, 1, 0}};
+    double mpixels = (double)width * height / 1e6;
+    printf("\nImage: %dx%d (%.1f MP, %d padding bytes), %d thread%s\n", width, height, mpixels, padding,
+           threads, threads == 1 ? "" : "s");
+    printf("%-30s %10s %10s %8s %10s %10s %10s %s\n", "filters", "seq MP/s", "chain MP/s", "speedup", "cycles/px", "planar",
+           "bgra", "output");
+
+    int failed = 0;
+    for (size_t c = 0; c < sizeof(combos) / sizeof(combos[0]); c++) {
+        // The sequential filters are slow and only there for comparison, so they run once
+        double chain_time = 1e30;
+        unsigned long long chain_cycles = ~0ULL;
+        memcpy(seq, source, size);
+        double t0 = now();
+        run_sequential(combos[c].filter_flag, &params, &seq_image);
+        double seq_time = now() - t0;
+        for (int r = 0; r < repeats; r++) {
+            filter_chain chain;
+            memcpy(fused, source, size);
+            unsigned long long c0 = cycles();
+            double t2 = now();
+            build_chain(&chain, combos[c].filter_flag, &params);
+            run_chain(&chain, &fused_image, pool);
+            free_chain(&chain);
+            double t3 = now();
+            unsigned long long c1 = cycles();
+            if (t3 - t2 < chain_time) chain_time = t3 - t2;
+            if (c1 - c0 < chain_cycles) chain_cycles = c1 - c0;
+        }
+        // SIMD kernels may round differently from the scalar filters by 1
+        int max_diff = max_difference(seq, fused, size);
+        // The same chain on the image split into planes, and widened to BGRA
+        double planar_time = time_layout(&planar, &source_image, &fused_image, combos[c].filter_flag, &params, pool, repeats);
+        int layout_diff = max_difference(seq, fused, size);
+        if (layout_diff > max_diff) max_diff = layout_diff;
+        double bgra_time = time_layout(&bgra, &source_image, &fused_image, combos[c].filter_flag, &params, pool, repeats);
+        layout_diff = max_difference(seq, fused, size);
+        if (layout_diff > max_diff) max_diff = layout_diff;
+        if (max_diff > 1) failed = 1;
+        double per_pixel = (double)chain_cycles / ((double)width * height);
+        printf("%-30s %10.1f %10.1f %7.2fx %10.2f %10.1f %10.1f %s\n", combos[c].name, mpixels / seq_time, mpixels / chain_time,
+               seq_time / chain_time, per_pixel, mpixels / planar_time, mpixels / bgra_time,
+               max_diff == 0 ? "identical" : (max_diff == 1 ? "within 1" : "DIFFERENT"));
+        if (csv != NULL) {
+            fprintf(csv, "%d,%d,%d,%s,%d,%.2f,%.2f,%.3f,%.2f,%.2f,%ld,%d\n", width, height, padding, combos[c].name, threads,
+                    mpixels / seq_time, mpixels / chain_time, per_pixel, mpixels / planar_time, mpixels / bgra_time,
+                    peak_rss(), max_diff);
+        }
+    }
+    printf("Peak RSS: %ld KB\n", peak_rss());
+
+    if (details) {
+        time_kernels(source, fused, size, width, height, stride);
+        time_hsl(source, fused, seq, size, width, height, stride);
+        time_cubes(&source_image, &fused_image, &seq_image, size);
+        time_stats(&source_image, pool, repeats);
+        time_resize(&source_image, pool, repeats);
+        time_transform(&source_image, repeats);
+        time_rle(width, height, repeats);
+    }
+    pool_destroy(pool);
+    image_free(&planar);
+    image_free(&bgra);
+    free(source);
+    free(seq);
+    free(fused);
+    return failed;
+}
+
+/* Prints usage text */
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: bmpbench [-j THREADS] [-n REPEATS] [-c FILE] [width height]\n"
+        "       bmpbench -g DIR [width height]\n"
+        "       bmpbench -k\n\n"
+        "   -c FILE       Also write the results to FILE as CSV.\n"
+        "   -g DIR        Write the synthetic images to DIR as BMP files and exit.\n"
+        "   -j THREADS    Run the filter chain on this many threads (default 1).\n"
+        "   -k            Check the SIMD kernels against the scalar filters, and the library\n"
+        "                 against broken BMP files.\n"
+        "   -n REPEATS    Time the filter chain this many times, keeping the best (default 3).\n"
+        "   Without a size the benchmarks run at %dx%d, %dx%d, %dx%d and %dx%d.\n",
+        sizes[0][0], sizes[0][1], sizes[1][0], sizes[1][1], sizes[2][0], sizes[2][1], sizes[3][0], sizes[3][1]);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 1, repeats = 3, c;
+    const char *csv_file = NULL, *image_dir = NULL;
+    while ((c = getopt(argc, argv, "c:g:j:kn:")) != -1) {
+        switch (c) {
+            case 'c':
+                csv_file = optarg;
+                break;
+            case 'g':
+                image_dir = optarg;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                if (threads == 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+                if (threads < 1 || threads > MAX_THREADS) {
+                    usage();
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                return (check_kernels() | check_library()) ? EXIT_FAILURE : EXIT_SUCCESS;
+            case 'n':
+                repeats = atoi(optarg);
+                if (repeats < 1) repeats = 1;
+                break;
+            default:
+                usage();
+                return EXIT_FAILURE;
+        }
+    }
+
+    // An explicit size replaces the default ones
+    int size_list[sizeof(sizes) / sizeof(sizes[0])][2], count = sizeof(sizes) / sizeof(sizes[0]);
+    memcpy(size_list, sizes, sizeof(sizes));
+    if (argc - optind == 2) {
+        size_list[0][0] = atoi(argv[optind]);
+        size_list[0][1] = atoi(argv[optind + 1]);
+        count = 1;
+        if (size_list[0][0] <= 0 || size_list[0][1] <= 0) {
+            usage();
+            return EXIT_FAILURE;
+        }
+    } else if (argc != optind) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (image_dir != NULL) {
+        for (int k = 0; k < count; k++) {
+            int width = size_list[k][0], height = size_list[k][1];
+            int stride = width * 3 + (4 - (width * 3) % 4) % 4;
+            unsigned char *data = malloc((size_t)stride * height);
+            if (data == NULL) return EXIT_FAILURE;
+            synth_image(data, width, height, stride);
+            if (write_image(image_dir, data, width, height, stride) != 0) {
+                fprintf(stderr, "bmpbench: could not write the images to %s.\n", image_dir);
+                return EXIT_FAILURE;
+            }
+            free(data);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    FILE *csv = NULL;
+    if (csv_file != NULL) {
+        csv = fopen(csv_file, "w");
+        if (csv == NULL) {
+            fprintf(stderr, "bmpbench: could not create %s.\n", csv_file);
+            return EXIT_FAILURE;
+        }
+        fprintf(csv, "width,height,padding,filters,threads,seq_mps,chain_mps,cycles_per_pixel,planar_mps,bgra_mps,peak_rss_kb,max_diff\n");
+    }
+    printf("SIMD: %s\n", simd_name(simd_init(SIMD_AVX2)));
+#ifndef HAVE_RDTSC
+    printf("No timestamp counter, cycles/px are not measured\n");
+#endif
+    int failed = 0;
+    for (int k = 0; k < count; k++) {
+        // The kernel and HSL engine timings are only shown for the last size
+        failed |= bench_size(size_list[k][0], size_list[k][1], threads, repeats, csv, k == count - 1);
+    }
+    if (csv != NULL && fclose(csv) != 0) failed = 1;
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,30 +9,47 @@
 /* bmpedit - a simple bmp manipulator
     by William Shen */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <limits.h>
 #include <string.h>
+#include <ctype.h>
 #include <getopt.h>
 #include <math.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif
+#include <dirent.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include "bmpedit.h"
 
-/* Macros for filter_flag */
-#define FLAG_HSL 1
-#define FLAG_CONTRAST 2
-#define FLAG_WB 4
-#define FLAG_GAMMA 8
-#define FLAG_THRESHOLD 16
-#define FLAG_GREYSCALE 32
-#define FLAG_SEPIA 64
-#define FLAG_INVERSE 128
-
 #define ERROR_HEADER "bmpedit - error:"
-#define FH_SIZE 14      // file header size
-#define IH_SIZE 40      // info header size
 #define PI 3.14159265359
 
+/* Point filters held by a lookup table stage */
+#define OP_TABLE 0      // composed tables
+#define OP_CONTRAST 1
+#define OP_INVERSE 2
+
 /* Reads BMP headers into structure, checks and outputs relevant data */
 void read_headers(FILE *fp, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header) {
     /* Reading in header and checking for success */
@@ -40,25 +57,309 @@ void read_headers(FILE *fp, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *inf
         fprintf(stderr, "%s reading the bmp file header failed.\n", ERROR_HEADER);
         exit(EXIT_FAILURE);
     }
-    if (fread(info_header, IH_SIZE, 1, fp) != 1) {
+    if (read_info(fp, info_header) != 0) {
         fprintf(stderr, "%s reading the bmp information header failed.\n", ERROR_HEADER);
         exit(EXIT_FAILURE);
     }
-    /* Checking BMP type is 'BM' and color depth is 24 bpp*/
+    check_headers(file_header, info_header);
+}
+
+/* Reads the info header, and the rest of a longer header or the color masks
+   after it as far as the structure holds them. Returns -1 if the file ends */
+int read_info(FILE *fp, BITMAPINFOHEADER *info_header) {
+    memset(info_header, 0, sizeof(BITMAPINFOHEADER));
+    if (fread(info_header, IH_SIZE, 1, fp) != 1) return -1;
+    size_t rest = info_size(info_header) - IH_SIZE;
+    if (fread((unsigned char *)info_header + IH_SIZE, 1, rest, fp) != rest) return -1;
+    return 0;
+}
+
+/* Returns how many bytes of the info header are held in the structure: all
+   of a BITMAPINFOHEADER along with the color masks following it for bit
+   fields, or as much of a longer header as there is up to a BITMAPV5HEADER */
+size_t info_size(BITMAPINFOHEADER *info_header) {
+    if ((*info_header).header_size > IH_SIZE) {
+        return ((*info_header).header_size < sizeof(BITMAPINFOHEADER)) ? (*info_header).header_size : sizeof(BITMAPINFOHEADER);
+    } else if ((*info_header).compression == BI_BITFIELDS) {
+        return IH_SIZE + 12;
+    } else if ((*info_header).compression == BI_ALPHABITFIELDS) {
+        return IH_SIZE + 16;
+    }
+    return IH_SIZE;
+}
+
+/* Returns the number of bytes between the info header and the pixels, such as
+   a color table */
+size_t header_gap(BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header) {
+    size_t headers = FH_SIZE + info_size(info_header);
+    return ((*file_header).offset > headers) ? (*file_header).offset - headers : 0;
+}
+
+/* Checks BMP type is 'BM' and color depth is 24 or 32 bpp, or 1, 4 or 8 bpp
+   with a color table which fits before the pixels, returning what is wrong
+   or NULL. 32 bpp images with bit fields must hold 8-bit BGRA channels, and
+   only 8 and 4 bpp images may be run-length encoded (as RLE8 and RLE4) */
+const char *header_error(BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header) {
+    int bpp = (*info_header).bpp;
+    unsigned int compression = (*info_header).compression;
+    int rle = (compression == BI_RLE8 && bpp == 8) || (compression == BI_RLE4 && bpp == 4);
     if ((*file_header).type != 0x4d42) {
-        fprintf(stderr, "%s the input file is not in Windows BMP format.\n", ERROR_HEADER);
-        exit(EXIT_FAILURE);
-    } else if ((*info_header).bpp != 24) {
-        fprintf(stderr, "%s the color depth of the input file is not 24 bits per pixel.\n", ERROR_HEADER);
+        return "the input file is not in Windows BMP format.";
+    } else if (bpp != 24 && bpp != 32 && bpp != 8 && bpp != 4 && bpp != 1) {
+        return "the color depth of the input file is not 1, 4, 8, 24 or 32 bits per pixel.";
+    } else if ((*info_header).header_size < IH_SIZE) {
+        return "the information header of the input file is too short.";
+    } else if ((*info_header).height == INT_MIN) {
+        // It has no absolute value as an int
+        return "the height of the input file is out of range.";
+    } else if (bpp == 32 && (compression == BI_BITFIELDS || compression == BI_ALPHABITFIELDS)) {
+        if ((*info_header).red_mask != 0xff0000 || (*info_header).green_mask != 0xff00 || (*info_header).blue_mask != 0xff ||
+            ((*info_header).alpha_mask != 0 && (*info_header).alpha_mask != 0xff000000)) {
+            return "the color masks of the input file are not 8-bit blue, green, red and alpha, the only order supported.";
+        }
+    } else if (compression != BI_RGB && !rle) {
+        return "the input file is compressed in a way which is not supported, only as RLE8 or RLE4.";
+    } else if (rle && (*info_header).height < 0) {
+        return "the input file is run-length encoded from the top row down, which BMP does not allow.";
+    } else if (bpp <= 8) {
+        if ((*info_header).colors > (1u << bpp)) {
+            return "the color table of the input file has more colors than its color depth allows.";
+        } else if ((long long)(*file_header).offset < (long long)FH_SIZE + (*info_header).header_size + 4 * palette_colors(info_header)) {
+            return "the color table of the input file overlaps the pixels.";
+        }
+    }
+    return NULL;
+}
+
+/* Returns the number of colors in the color table of an indexed image */
+int palette_colors(BITMAPINFOHEADER *info_header) {
+    if ((*info_header).bpp > 8) return 0;
+    // A count of 0 means as many as the depth allows
+    return ((*info_header).colors != 0) ? (int)(*info_header).colors : 1 << (*info_header).bpp;
+}
+
+/* Returns the bytes in each row of pixels in the file, padding included */
+size_t bmp_stride(BITMAPINFOHEADER *info_header) {
+    return ((size_t)(*info_header).width * (*info_header).bpp + 31) / 32 * 4;
+}
+
+/* Returns the bytes of pixels in the file: every row along with its padding
+   or, for a run-length encoded image, the size in its header (or if that is
+   0, the rest of the file) */
+size_t pixel_bytes(BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header) {
+    if (!RLE_COMPRESSED(*info_header)) {
+        return bmp_stride(info_header) * abs((*info_header).height);
+    } else if ((*info_header).image_size != 0) {
+        return (*info_header).image_size;
+    }
+    return ((*file_header).size > (*file_header).offset) ? (*file_header).size - (*file_header).offset : 0;
+}
+
+/* Checks the headers, exiting if they are not valid */
+void check_headers(BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header) {
+    const char *error = header_error(file_header, info_header);
+    if (error != NULL) {
+        fprintf(stderr, "%s %s\n", ERROR_HEADER, error);
         exit(EXIT_FAILURE);
     }
 }
 
-/* Writes BMP header and image data */
-void write_bmp(FILE *fp, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header, pixel *pixel_array, long int pixel_total) {
-    fwrite(file_header, FH_SIZE, 1, fp);
-    fwrite(info_header, IH_SIZE, 1, fp);
-    fwrite(pixel_array, sizeof(pixel), pixel_total, fp);
+/* Writes BMP header and image data, along with any bytes which were between
+   the headers and the pixels. Returns -1 if writing fails */
+int write_bmp(FILE *fp, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header, const unsigned char *gap, const image *img) {
+    size_t extra = header_gap(file_header, info_header);
+    if (fwrite(file_header, FH_SIZE, 1, fp) != 1 || fwrite(info_header, info_size(info_header), 1, fp) != 1) return -1;
+    if (fwrite(gap, 1, extra, fp) != extra) return -1;
+    return image_write(fp, img, (*info_header).bpp);
+}
+
+/* Rounds up to a multiple of ROW_ALIGN */
+static size_t align_row(size_t bytes) {
+    return (bytes + ROW_ALIGN - 1) / ROW_ALIGN * ROW_ALIGN;
+}
+
+/* Returns the bytes image_create takes for an image */
+static size_t image_bytes(int width, int height, int layout) {
+    size_t stride = (layout == LAYOUT_PLANAR) ? 3 * align_row(width) : align_row((size_t)((layout == LAYOUT_BGRA) ? 4 : 3) * width);
+    return stride * (height > 0 ? height : 1);
+}
+
+/* Allocates an image with every row aligned to ROW_ALIGN bytes, either of
+   packed BGR or BGRA pixels or of separate B, G and R planes which are each
+   aligned too. Returns -1 if there is not enough memory */
+int image_create(image *img, int width, int height, int layout) {
+    return image_create_in(NULL, img, width, height, layout);
+}
+
+/* Allocates an image like image_create, taking its memory from a block pool
+   if there is one. The image then does not own its memory, which is given
+   back to the pool by image_release */
+int image_create_in(block_pool *blocks, image *img, int width, int height, int layout) {
+    (*img).width = width;
+    (*img).height = height;
+    (*img).channels = (layout == LAYOUT_BGRA) ? 4 : 3;
+    (*img).plane = (layout == LAYOUT_PLANAR) ? align_row(width) : 0;
+    (*img).stride = (layout == LAYOUT_PLANAR) ? 3 * (*img).plane : align_row((size_t)(*img).channels * width);
+    (*img).owned = (blocks == NULL);
+    (*img).data = block_alloc(blocks, image_bytes(width, height, layout));
+    return ((*img).data == NULL) ? -1 : 0;
+}
+
+/* Frees an image made by image_create_in, or gives its memory back to the
+   pool. Memory the image does not own and the pool did not give out is left
+   alone, so this is safe on wrapped images too */
+void image_release(block_pool *blocks, image *img) {
+    if ((*img).owned) {
+        image_free(img);
+    } else {
+        if (blocks != NULL) block_free(blocks, (*img).data);
+        (*img).data = NULL;
+    }
+}
+
+/* Makes an image of packed pixels of channels bytes out of existing memory,
+   such as rows laid out as in a BMP file with stride including the padding */
+void image_wrap(image *img, void *data, int width, int height, size_t stride, int channels) {
+    (*img).width = width;
+    (*img).height = height;
+    (*img).stride = stride;
+    (*img).plane = 0;
+    (*img).channels = channels;
+    (*img).data = data;
+    (*img).owned = 0;
+}
+
+/* Frees an image's memory, if it belongs to the image */
+void image_free(image *img) {
+    if ((*img).owned) free((*img).data);
+    (*img).data = NULL;
+}
+
+/* Splits a row of packed pixels of channels bytes into planes, dropping alpha */
+static void split_row(unsigned char *plane[3], const unsigned char *row, int width, int channels) {
+    for (int j = 0; j < width; j++) {
+        plane[0][j] = row[channels * j];
+        plane[1][j] = row[channels * j + 1];
+        plane[2][j] = row[channels * j + 2];
+    }
+}
+
+/* Packs the planes of a row back into pixels of channels bytes, any alpha opaque */
+static void merge_row(unsigned char *row, unsigned char *plane[3], int width, int channels) {
+    for (int j = 0; j < width; j++) {
+        row[channels * j] = plane[0][j];
+        row[channels * j + 1] = plane[1][j];
+        row[channels * j + 2] = plane[2][j];
+        if (channels == 4) row[4 * j + 3] = 255;
+    }
+}
+
+/* Widens BGR pixels to opaque BGRA. Every pixel but the last is loaded as a
+   32-bit word, taking in the first byte of the next pixel, which is replaced by alpha */
+static void widen_row(quad *restrict to, const pixel *restrict from, int width) {
+    const unsigned char *bytes = (const unsigned char *)from;
+    for (int j = 0; j < width - 1; j++) {
+        unsigned int v;
+        memcpy(&v, bytes + 3 * j, sizeof(v));
+        v |= 0xff000000u;
+        memcpy(&to[j], &v, sizeof(v));
+    }
+    if (width > 0) to[width - 1] = (quad) {from[width - 1].blue, from[width - 1].green, from[width - 1].red, 255};
+}
+
+/* Narrows BGRA pixels to BGR, dropping alpha */
+static void narrow_row(pixel *restrict to, const quad *restrict from, int width) {
+    for (int j = 0; j < width; j++) {
+        to[j].blue = from[j].blue;
+        to[j].green = from[j].green;
+        to[j].red = from[j].red;
+    }
+}
+
+/* Stores a row of packed pixels of channels bytes as a row of the image */
+static void store_row(const image *img, unsigned char *to, const unsigned char *from, int channels) {
+    if ((*img).plane != 0) {
+        unsigned char *plane[3] = {to, to + (*img).plane, to + 2 * (*img).plane};
+        split_row(plane, from, (*img).width, channels);
+    } else if ((*img).channels == channels) {
+        memcpy(to, from, (size_t)channels * (*img).width);
+    } else if (channels == 3) {
+        widen_row((quad *)to, (const pixel *)from, (*img).width);
+    } else {
+        narrow_row((pixel *)to, (const quad *)from, (*img).width);
+    }
+}
+
+/* Loads a row of the image as a row of packed pixels of channels bytes */
+static void load_row(const image *img, unsigned char *to, unsigned char *from, int channels) {
+    if ((*img).plane != 0) {
+        unsigned char *plane[3] = {from, from + (*img).plane, from + 2 * (*img).plane};
+        merge_row(to, plane, (*img).width, channels);
+    } else if ((*img).channels == channels) {
+        memcpy(to, from, (size_t)channels * (*img).width);
+    } else if (channels == 4) {
+        widen_row((quad *)to, (const pixel *)from, (*img).width);
+    } else {
+        narrow_row((pixel *)to, (const quad *)from, (*img).width);
+    }
+}
+
+/* Copies the pixels of one image to another of the same size, converting
+   between layouts where they differ */
+void image_copy(image *dest, const image *source) {
+    for (int i = 0; i < (*dest).height; i++) {
+        unsigned char *to = IMAGE_ROW(dest, i), *from = IMAGE_ROW(source, i);
+        if ((*source).plane == 0) {
+            store_row(dest, to, from, (*source).channels);
+        } else if ((*dest).plane == 0) {
+            load_row(source, to, from, (*dest).channels);
+        } else {
+            for (int c = 0; c < 3; c++) memcpy(to + c * (*dest).plane, from + c * (*source).plane, (*dest).width);
+        }
+    }
+}
+
+/* Reads the rows of an image from a BMP file of bpp bits per pixel, skipping
+   the padding at the end of each row in the file. Rows are read straight into
+   the image if it has the layout of the file. Returns -1 if the file ends too soon */
+int image_read(FILE *fp, image *img, int bpp) {
+    int channels = bpp / 8;
+    size_t bytes = (size_t)channels * (*img).width;
+    int padding = (4 - (bytes % 4)) % 4;
+    int direct = ((*img).plane == 0 && (*img).channels == channels);
+    unsigned char *row = NULL, skip[4];
+    if (!direct && (row = (unsigned char *) malloc (bytes)) == NULL) return -1;
+    for (int i = 0; i < (*img).height; i++) {
+        unsigned char *to = IMAGE_ROW(img, i);
+        if (fread(direct ? to : row, 1, bytes, fp) != bytes || fread(skip, 1, padding, fp) != (size_t)padding) {
+            free(row);
+            return -1;
+        }
+        if (!direct) store_row(img, to, row, channels);
+    }
+    free(row);
+    return 0;
+}
+
+/* Writes the rows of an image to a BMP file of bpp bits per pixel, padding
+   each row to a multiple of 4 bytes. Returns -1 if writing fails */
+int image_write(FILE *fp, const image *img, int bpp) {
+    int channels = bpp / 8;
+    size_t bytes = (size_t)channels * (*img).width;
+    int padding = (4 - (bytes % 4)) % 4;
+    int direct = ((*img).plane == 0 && (*img).channels == channels);
+    unsigned char *row = NULL, zeros[4] = {0, 0, 0, 0};
+    if (!direct && (row = (unsigned char *) malloc (bytes)) == NULL) return -1;
+    for (int i = 0; i < (*img).height; i++) {
+        unsigned char *from = IMAGE_ROW(img, i);
+        if (!direct) load_row(img, row, from, channels);
+        if (fwrite(direct ? from : row, 1, bytes, fp) != bytes || fwrite(zeros, 1, padding, fp) != (size_t)padding) {
+            free(row);
+            return -1;
+        }
+    }
+    free(row);
+    return 0;
 }
 
 /* RGB to HSL algorithm */
@@ -147,419 +448,7837 @@ void hsl_to_rgb(hsl_struct *hsl, pixel *data) {
     (*data) = (pixel) {b, g, r};
 }
 
-/* Hue, Saturation and Lightness filter. Uses HSL color space for extreme accuracy */
-void hsl_filter(double hue, double saturation, double lightness, BITMAPINFOHEADER *header, pixel *data, int padding) {
-    // Declare and initalise hsl_struct
-    hsl_struct *hsl;
-    hsl = (hsl_struct *) malloc (sizeof(hsl_struct));
-    if (hsl == NULL) {
-        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
-        exit(EXIT_FAILURE);
-    }
-    // Loops through the whole pixel array
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            // Converts RGB to HSl
-            rgb_to_hsl(hsl, (*data).red, (*data).green, (*data).blue);
-            // Calculates the HSL values with filters applied
-            hsl_calc(hsl, hue, saturation, lightness);
-            // Converts HSL to RGB and sets pixel array
-            hsl_to_rgb(hsl, data);
-            data++;
-        }
-        data = (pixel*)((size_t)data + padding);    // adding padding
-    }
-    free(hsl);      // free the malloc
+/* The fixed point HSL engine. It gives the same results as rgb_to_hsl,
+   hsl_calc and hsl_to_rgb above (to within 1, from rounding), quirks
+   included: hues with red as the maximum are mirrored rather than wrapped,
+   hue shifts clamp at 0 and 360, and a hue of exactly 360 has no chroma.
+   Hue is kept in sectors of 60 degrees of HSL_SECTOR units, saturation and
+   lightness in Q15. Divisions by the chroma use a table of reciprocals, and
+   the sector selection is done with min, max and abs rather than branches,
+   so the compiler can vectorize whole blocks of pixels */
+#define HSL_SECTOR 16384
+#define HSL_ONE 32768
+#define HSL_BLOCK 64
+#define HSL_INLINE __attribute__((always_inline))      // inlined into the SIMD versions, so they get vectorized too
+
+// 2^24 / d rounded, with 0 for d = 0 so grey pixels get no hue or saturation
+static int hsl_recip[256];
+
+/* Fills in the reciprocal table */
+static void hsl_init(void) {
+    if (hsl_recip[1] != 0) return;
+    for (int d = 1; d < 256; d++) hsl_recip[d] = ((1 << 24) + d / 2) / d;
 }
 
-/* Contrast filter */
-void contrast_filter(double contrast, BITMAPINFOHEADER *header, pixel *data, int padding) {
-    // Calculate contrast coefficient
-    contrast = 2.5 * contrast;
-    double coeff = (259 * (contrast + 255))/(255 * (259 - contrast));
-    // Loops through the whole pixel array
-    double red, green, blue;
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            // Calculating Values and Rounding
-            red = coeff * ((*data).red - 128) + 128;
-            green = coeff * ((*data).green - 128) + 128;
-            blue = coeff * ((*data).blue - 128) + 128;
-            if (red > 255) red = 255;
-            if (red < 0) red = 0;
-            if (green > 255) green = 255;
-            if (green < 0) green = 0;
-            if (blue > 255) blue = 255;
-            if (blue < 0) blue = 0;
-            // Setting pixel value
-            (*data) = (pixel) {(int)(blue + 0.5), (int)(green + 0.5), (int)(red + 0.5)};
-            data++;
-        }
-        data = (pixel*)((size_t)data + padding);    // adding padding
-    }
+/* Converts the HSL shifts from the command line to fixed point */
+hsl_shift hsl_fixed_shift(double hue, double saturation, double lightness) {
+    hsl_init();
+    hsl_shift shift;
+    shift.hue = (int)lround(hue * HSL_SECTOR / 60.0);
+    shift.saturation = (int)lround(saturation * HSL_ONE / 100.0);
+    shift.lightness = (int)lround(lightness * HSL_ONE / 200.0);
+    return shift;
 }
 
-/* Automatic white balance using the Gray World assumption */
-void wb_filter(BITMAPINFOHEADER *header, pixel *data, int padding) {
-    pixel *ptr = data;
-    // Finding average RGB values for whole image
-    float r_avg = 0, g_avg = 0, b_avg = 0;
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            r_avg += (*ptr).red;
-            g_avg += (*ptr).green;
-            b_avg += (*ptr).blue;
-            ptr++;
-        }
-        ptr = (pixel*)((size_t)ptr + padding);    // accounting for padding
-    }
-    long int pixel_total = (*header).height * (*header).width;
-    r_avg /= pixel_total, g_avg /= pixel_total, b_avg /= pixel_total;
-    ptr = data;     // return to beggining of pointer
-    // Applying calculations to pixel_array
-    float r_gain = (g_avg / r_avg), b_gain = (g_avg / b_avg);
-    data -= (pixel_total - (*header).height * padding);     // go back to start of pixel array
-    for (int y = 0; y < (*header).height; y++) {
-        for (int x = 0; x < (*header).width; x++) {
-            float r, g, b;
-            r = r_gain * (*ptr).red;
-            g = (*ptr).green;
-            b = b_gain * (*ptr).blue;
-            if (r > 255) r = 255;
-            if (b > 255) b = 255;
-            (*ptr) = (pixel) {(int)(b + 0.5), (int)(g + 0.5), (int)(r + 0.5)};
-            ptr++;
-        }
-        ptr = (pixel*)((size_t)ptr + padding);    // adding padding
-    }
+/* Channel value from a fixed point chroma weight, for the channel whose
+   hue is at centre. The weight is 1 within a sector of the centre, falling
+   to 0 two sectors away */
+static inline HSL_INLINE int hsl_channel(int h, int centre, int c, int m) {
+    int d = abs(h - centre);
+    d = (d < 6 * HSL_SECTOR - d) ? d : 6 * HSL_SECTOR - d;      // distance around the hue circle
+    int w = 2 * HSL_SECTOR - d;
+    w = (w < 0) ? 0 : ((w > HSL_SECTOR) ? HSL_SECTOR : w);
+    return (255 * (((c * w) >> 14) + m) + HSL_ONE / 2) >> 15;
 }
 
-/* Gamma correction filter */
-void gamma_filter(double gamma, BITMAPINFOHEADER *header, pixel *data, int padding) {
-    // Loops through the whole pixel array
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            // Applying gamme correction formula
-            float red, green, blue;
-            red = powf((*data).red / 255.0, 1 / gamma) * 255;
-            green = powf((*data).green / 255.0, 1 / gamma) * 255;
-            blue = powf((*data).blue / 255.0, 1 / gamma) * 255;
-            if (red > 255) red = 255;
-            if (green > 255) green = 255;
-            if (blue > 255) blue = 255;
-            // Setting pixel data
-            (*data) = (pixel) {(int)(blue + 0.5), (int)(green + 0.5), (int)(red + 0.5)};
-            data++;
-        }
-        data = (pixel*)((size_t)data + padding);    // adding padding
+/* Filters a block of up to HSL_BLOCK pixels, split into channel arrays */
+static inline HSL_INLINE void hsl_block(const hsl_shift *shift, int *r, int *g, int *b, int n) {
+    for (int j = 0; j < n; j++) {
+        int max = (r[j] > g[j]) ? r[j] : g[j];
+        max = (b[j] > max) ? b[j] : max;
+        int min = (r[j] < g[j]) ? r[j] : g[j];
+        min = (b[j] < min) ? b[j] : min;
+        int diff = max - min, sum = max + min;
+        int recip = hsl_recip[diff];
+
+        // Hue, taking the mirrored hue when red is the maximum
+        int red_max = (r[j] > g[j]) & (r[j] > b[j]);
+        int green_max = !red_max & (g[j] > b[j]);
+        int num = red_max ? abs(g[j] - b[j]) : (green_max ? b[j] - r[j] : r[j] - g[j]);
+        int base = red_max ? 0 : (green_max ? 2 : 4);
+        base = diff ? base : 0;
+        int h = ((base << 24) + num * recip + (1 << 9)) >> 10;
+        // Saturation and lightness
+        int s = (diff * hsl_recip[(sum <= 255) ? sum : 510 - sum] + (1 << 8)) >> 9;
+        int l = (sum * HSL_ONE + 255) / 510;
+
+        // Applying the shifts, clamped as in hsl_calc
+        h += (*shift).hue;
+        h = (h < 0) ? 0 : ((h > 6 * HSL_SECTOR) ? 6 * HSL_SECTOR : h);
+        s += (*shift).saturation;
+        s = (s < 0) ? 0 : ((s > HSL_ONE) ? HSL_ONE : s);
+        l += (*shift).lightness;
+        l = (l < 0) ? 0 : ((l > HSL_ONE) ? HSL_ONE : l);
+
+        // Back to RGB. A hue of exactly 360 gives only the grey part m
+        int c = ((HSL_ONE - abs(2 * l - HSL_ONE)) * s) >> 15;
+        int m = l - c / 2;
+        c = (h < 6 * HSL_SECTOR) ? c : 0;
+        r[j] = hsl_channel(h, 0, c, m);
+        g[j] = hsl_channel(h, 2 * HSL_SECTOR, c, m);
+        b[j] = hsl_channel(h, 4 * HSL_SECTOR, c, m);
     }
 }
 
-/* Threshold filter. Blackens or whitens pixels accordingly */
-void threshold_filter(double threshold, BITMAPINFOHEADER *header, pixel *data, int padding) {
-    // Loops through the whole pixel array
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            // Checking pixel intensity against user input threshold
-            if (((*data).red + (*data).green + (*data).blue) / (double)(255*3) < threshold) {
-                (*data) = (pixel) {0, 0, 0};
-            } else {
-                (*data) = (pixel) {255, 255, 255};
-            }
-            data++;
+/* Runs the fixed point engine over a row, a block of pixels at a time */
+static inline HSL_INLINE void hsl_fixed_rows(const hsl_shift *shift, pixel *data, int width) {
+    int r[HSL_BLOCK], g[HSL_BLOCK], b[HSL_BLOCK];
+    for (int j = 0; j < width; j += HSL_BLOCK) {
+        int n = (width - j < HSL_BLOCK) ? width - j : HSL_BLOCK;
+        for (int k = 0; k < n; k++) {
+            r[k] = data[j + k].red;
+            g[k] = data[j + k].green;
+            b[k] = data[j + k].blue;
         }
-        data = (pixel*)((size_t)data + padding);    // adding padding
+        hsl_block(shift, r, g, b, n);
+        for (int k = 0; k < n; k++) data[j + k] = (pixel) {b[k], g[k], r[k]};
     }
 }
 
-/* Greyscale filter. Converts image to black and white using luminance formula */
-void greyscale_filter(BITMAPINFOHEADER *header, pixel *data, int padding) {
-    double grey = 0;
-    // Loops through the whole pixel array
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            grey = (*data).red * 0.2126 + (*data).green * 0.7152 + (*data).blue * 0.0722;
-            (*data) = (pixel) {(int)(grey + 0.5), (int)(grey + 0.5), (int)(grey + 0.5)};       // typecasting and using pixel struct
-            data++;
+/* Runs the fixed point engine over the B, G and R planes of a row, which
+   only need widening to ints rather than splitting out of the pixels */
+static inline HSL_INLINE void hsl_fixed_plane_rows(const hsl_shift *shift, unsigned char *plane[3], int width) {
+    int r[HSL_BLOCK], g[HSL_BLOCK], b[HSL_BLOCK];
+    for (int j = 0; j < width; j += HSL_BLOCK) {
+        int n = (width - j < HSL_BLOCK) ? width - j : HSL_BLOCK;
+        for (int k = 0; k < n; k++) {
+            b[k] = plane[0][j + k];
+            g[k] = plane[1][j + k];
+            r[k] = plane[2][j + k];
+        }
+        hsl_block(shift, r, g, b, n);
+        for (int k = 0; k < n; k++) {
+            plane[0][j + k] = b[k];
+            plane[1][j + k] = g[k];
+            plane[2][j + k] = r[k];
         }
-        data = (pixel*)((size_t)data + padding);    // adding padding
     }
 }
 
-/* Sepia filter. Gives the image a 'warm', yellow tone */
-void sepia_filter(BITMAPINFOHEADER *header, pixel *data, int padding) {
-    double red, green, blue;
-    // Loops through the whole pixel array
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            // Calculations and rounding
-            red = (*data).red * 0.393 + (*data).green * 0.769 + (*data).blue * 0.189;
-            green = (*data).red * 0.349 + (*data).green * 0.686 + (*data).blue * 0.168;
-            blue = (*data).red * 0.272 + (*data).green * 0.534 + (*data).blue * 0.131;
-            if (red > 255) red = 255;
-            if (green > 255) green = 255;
-            if (blue > 255) blue = 255;
-            // Setting rgb for pixel and typecasting
-            (*data) = (pixel) {(int)(blue + 0.5), (int)(green + 0.5), (int)(red + 0.5)};
-            data++;
-        }
-        data = (pixel*)((size_t)data + padding);    // adding padding
-    }
+/* Fixed point HSL filter for a single row of pixels */
+void hsl_fixed_row(const hsl_shift *shift, pixel *data, int width) {
+    hsl_fixed_rows(shift, data, width);
 }
 
-/* Inverse filter. Inverts the color of the pixel */
-void inverse_filter(BITMAPINFOHEADER *header, pixel *data, int padding) {
-    // Loops through the whole pixel array
-    for (int i = 0; i < (*header).height; i++) {
-        for (int j = 0; j < (*header).width; j++) {
-            (*data) = (pixel) {255 - (*data).blue, 255 - (*data).green, 255 - (*data).red};
-            data++;
+/* Fixed point HSL filter for the planes of a single row */
+void hsl_fixed_planes(const hsl_shift *shift, unsigned char *plane[3], int width) {
+    hsl_fixed_plane_rows(shift, plane, width);
+}
+
+/* HSL filter for a row which remembers the result for every color it sees,
+   for images with few colors. The cache has an entry for each of the 2^24
+   colors, holding the filtered color with bit 24 set once it is known. It
+   may be shared between threads, since any thread would store the same value */
+void hsl_cached_row(const hsl_shift *shift, unsigned int *cache, pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        unsigned int key = ((unsigned int)data[j].red << 16) | (data[j].green << 8) | data[j].blue;
+        unsigned int entry = __atomic_load_n(&cache[key], __ATOMIC_RELAXED);
+        if (entry == 0) {
+            pixel p = data[j];
+            hsl_fixed_rows(shift, &p, 1);
+            entry = (1u << 24) | ((unsigned int)p.red << 16) | (p.green << 8) | p.blue;
+            __atomic_store_n(&cache[key], entry, __ATOMIC_RELAXED);
         }
-        data = (pixel*)((size_t)data + padding);    // adding padding
+        data[j] = (pixel) {entry & 0xff, (entry >> 8) & 0xff, (entry >> 16) & 0xff};
     }
 }
 
-/* bmpedit ascii logo */
-static void logo(void) {
-    printf(
-        "***********************************************\n"
-        "*     __                             ___ __   *\n"
-        "*    / /_  ____ ___  ____  ___  ____/ (_) /_  *\n"
-        "*   / __ \\/ __ `__ \\/ __ \\/ _ \\/ __  / / __/  *\n"
-        "*  / /_/ / / / / / / /_/ /  __/ /_/ / / /_    *\n"
-        "* /_.___/_/ /_/ /_/ .___/\\___/\\__,_/_/\\__/    *\n"
-        "*                /_/                          *\n"
-        "*                                             *\n"
-        "***********************************************\n"
-    );
+/* Hue, Saturation and Lightness filter for a single row of pixels */
+void hsl_row(double hue, double saturation, double lightness, pixel *data, int width) {
+    hsl_shift shift = hsl_fixed_shift(hue, saturation, lightness);
+    hsl_fixed_row(&shift, data, width);
 }
 
-/* Prints usage text */
-static void usage(void) {
-    printf(
-        "\nUsage: bmpedit [OPTIONS...] [input.bmp]\n\n"
-        "DESCRIPTION:\n"
-        "   This program does simple edits of BMP image files. When the program runs it\n"
-        "   first prints out the width and the height of the input image within the BMP\n"
-        "   file. Once this is done if there is a filter (or sequence of filters) then\n"
-        "   they are applied to the image. The resulting image is also stored using BMP\n"
-        "   format into an output file. Without any filters only the width and height of\n"
-        "   the image is output.\n\n"
-        "NOTE:\n"
-        "   0.0 will be assumed as the argument for a command if the argument begins\n"
-        "   with a character.\n\n"
-        "OPTIONS:\n"
-        "   -h            Displays this usage message.\n"
-        "   -o FILE       Sets the output file for modified images (default output file\n"
-        "                 is \"out.bmp\").\n"
-        "   -c            Apply a color tint filter to the image - the program will ask\n"
-        "                 you for RGB tint values.\n"
-        "   -g            Apply a greyscale (black and white) filter to the image.\n"
-        "   -i            Apply a filter to invert the pixel colors on the image.\n"
-        "   -s            Apply a sepia filter to the image (gives it a warmer tone).\n"
-        "   -t 0.0-1.0    Apply a threshold filter to the image with the threshold as\n"
-        "                 the value given.\n"
-        "   -y 0.01-7.99  Apply a gamma correction filter to the image.\n"
-        "   -w            Apply an automatic white balance filter to correct the color\n"
-        "                 temperature of the image.\n"
-        "   -H -360-360   Apply a hue (color) shift to the image.\n"
-        "   -S -100-100   Increase or decrease saturation of the image.\n"
-        "   -L -100-100   Increase or decrease the lightness (similar to brightness) of \n"
-        "                 the image.\n\n"
-    );
+/* Hue, Saturation and Lightness filter. Uses HSL color space for extreme accuracy */
+void hsl_filter(double hue, double saturation, double lightness, image *img) {
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        hsl_row(hue, saturation, lightness, (pixel *)IMAGE_ROW(img, i), (*img).width);
+    }
 }
 
-int main(int argc, char *argv[]) {
-    /* Initializing variables */
-    char *ptr, *input_file, *output_file = "out.bmp";
-    double hue = 0, saturation = 0, lightness = 0;
-    double contrast = 0, gamma = 0, threshold = 0;
-    int filter_flag = 0;    // filter flag adds values from macros to consider all possibilties
-    int hsl_flag = 0;   // flag to check if H, S or L filter has already been selected
-    /* Initializing Structs */
-    BITMAPFILEHEADER file_header;
-    BITMAPINFOHEADER info_header;
-    pixel *pixel_array;
+/* Calculates the contrast correction coefficient */
+double contrast_coeff(double contrast) {
+    contrast = 2.5 * contrast;
+    return (259 * (contrast + 255))/(255 * (259 - contrast));
+}
 
-    /* If user passes no options */
-    if (argc == 1) {
-      fprintf(stderr, "%s no valid arguments have been entered.\n"
-                      "Enter ./bmpedit -h to view usage message.\n", ERROR_HEADER);
-      exit(EXIT_FAILURE);
+/* Contrast filter for a single row of pixels */
+void contrast_row(double coeff, pixel *data, int width) {
+    double red, green, blue;
+    for (int j = 0; j < width; j++) {
+        // Calculating Values and Rounding
+        red = coeff * ((*data).red - 128) + 128;
+        green = coeff * ((*data).green - 128) + 128;
+        blue = coeff * ((*data).blue - 128) + 128;
+        if (red > 255) red = 255;
+        if (red < 0) red = 0;
+        if (green > 255) green = 255;
+        if (green < 0) green = 0;
+        if (blue > 255) blue = 255;
+        if (blue < 0) blue = 0;
+        // Setting pixel value
+        (*data) = (pixel) {(int)(blue + 0.5), (int)(green + 0.5), (int)(red + 0.5)};
+        data++;
     }
+}
 
-    /* Checking command line options */
-    int c;
-    while ((c = getopt(argc, argv, "c:ghio:st:wy:H:S:L:")) != -1) {
-        switch (c) {
-            case 'c':
-                contrast = strtod(optarg, &ptr);
-                if (contrast < -100 || contrast > 100) {
-                    fprintf(stderr, "%s the contrast must be between -100 and 100, inclusive.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                } else {
-                    filter_flag += FLAG_CONTRAST;
-                }
-                break;
-            case 'g':
-                filter_flag += FLAG_GREYSCALE;
-                break;
-            case 'h':
-                logo();
-                usage();
-                exit(EXIT_SUCCESS);
-            case 'i':
-                filter_flag += FLAG_INVERSE;
-                break;
-            case 'o':
-                if ((strstr(optarg, ".bmp") != NULL) || (strstr(optarg, ".BMP") != NULL)) {   // simple check for .bmp or .BMP
-                    output_file = optarg;
-                } else {
-                    fprintf(stderr, "%s the output file must be in .bmp or .BMP format.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                }
-                break;
-            case 's':
-                filter_flag += FLAG_SEPIA;
-                break;
-            case 't':
-                threshold = strtod(optarg, &ptr);
-                if (threshold < 0.0 || threshold > 1.0) {
-                    fprintf(stderr, "%s the threshold must be between 0.0 and 1.0, inclusive.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                } else {
-                    filter_flag += FLAG_THRESHOLD;
-                }
-                break;
-            case 'y':
-                gamma = strtod(optarg, &ptr);
-                if (gamma < 0.01 || gamma > 7.99) {
-                    fprintf(stderr, "%s the gamma value must be between 0.01 and 7.99, inclusive.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                } else {
-                    filter_flag += FLAG_GAMMA;
-                }
-                break;
-            case 'w':
-                filter_flag += FLAG_WB;
-                break;
-            case 'H':
-                hue = strtod(optarg, &ptr);
-                if (hue < -360 || hue > 360) {
-                    fprintf(stderr, "%s the hue shift must be between -360 and 360, inclusive.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                } else {
-                    if (hsl_flag == 0) filter_flag += FLAG_HSL;
-                    hsl_flag = 1;
-                }
-                break;
-            case 'S':
-                saturation = strtod(optarg, &ptr);
-                if (saturation < -100 || saturation > 100) {
-                    fprintf(stderr, "%s the saturation must be between -100 and 100, inclusive.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                } else {
-                    if (hsl_flag == 0) filter_flag += FLAG_HSL;
-                    hsl_flag = 1;
-                }
-                break;
-            case 'L':
-                lightness = strtod(optarg, &ptr);
-                if (lightness < -100 || lightness > 100) {
-                    fprintf(stderr, "%s the lightness must be between -100 and 100, inclusive.\n", ERROR_HEADER);
-                    exit(EXIT_FAILURE);
-                } else {
-                    if (hsl_flag == 0) filter_flag += FLAG_HSL;
-                    hsl_flag = 1;
-                }
-                break;
-            default:
-                fprintf(stderr, "%s no valid arguments have been entered.\n"
-                                "Enter ./bmpedit -h to view usage message.\n", ERROR_HEADER);
-                exit(EXIT_FAILURE);
-        }
+/* Contrast filter */
+void contrast_filter(double contrast, image *img) {
+    // Calculate contrast coefficient
+    double coeff = contrast_coeff(contrast);
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        contrast_row(coeff, (pixel *)IMAGE_ROW(img, i), (*img).width);
     }
+}
 
-    /* Check for extra argument (i.e. input file) and performs simple validility test */
-    if (argc - optind == 1) {
-       input_file = *(argv + optind);       // get data from the address containing argument
-       /* Program stops if it is not readable or not in .bmp or .BMP */
-       if (!((strstr(input_file, ".bmp") != NULL) || (strstr(input_file, ".BMP") != NULL))) {   // simple check for NOT .bmp or .BMP
-           fprintf(stderr, "%s input file is not in .bmp or .BMP format.\n", ERROR_HEADER);
-           exit(EXIT_FAILURE);
-       }
-       if (access(input_file, R_OK) != 0) {
-           fprintf(stderr, "%s input file either does not exist or is not readable.\n", ERROR_HEADER);
-           exit(EXIT_FAILURE);
-       }
-    } else {
-        fprintf(stderr, "%s no input file has been set.\n", ERROR_HEADER);
-        exit(EXIT_FAILURE);
+/* Adds the RGB values of a row to the running totals used by the white balance
+   filter. Totals are kept as integers so they are exact however large the
+   image is, and partial totals from separate rows can be added in any order */
+void wb_sum_row(unsigned long long sums[3], pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        sums[0] += (*data).red;
+        sums[1] += (*data).green;
+        sums[2] += (*data).blue;
+        data++;
     }
+}
 
-    /* Open file for reading, read headers into structure */
-    FILE * input = fopen(input_file, "r");
-    read_headers(input, &file_header, &info_header);
-    printf("Image width: %dpx\nImage height: %dpx\n", info_header.width, info_header.height);
-
-    /* Exits program if no filters selected */
-    if (filter_flag == 0) {
-        printf("bmpedit: Success!\n");
-        exit(EXIT_SUCCESS);
-    }
+/* Calculates the red and blue gains from the RGB totals of the image */
+void wb_gains(const unsigned long long sums[3], long int pixel_total, float *r_gain, float *b_gain) {
+    float r_avg = (double)sums[0] / pixel_total, g_avg = (double)sums[1] / pixel_total, b_avg = (double)sums[2] / pixel_total;
+    (*r_gain) = g_avg / r_avg;
+    (*b_gain) = g_avg / b_avg;
+}
 
-    /* Checks for padding */
-    int padding_bytes = 0;
-    if ((info_header.width * 3) % 4 != 0) {
-        padding_bytes = 4 - ((info_header.width * 3) % 4);
-        printf("Padding Bytes: %d\n", padding_bytes);
+/* Applies the white balance gains to a single row of pixels */
+void wb_row(float r_gain, float b_gain, pixel *data, int width) {
+    for (int x = 0; x < width; x++) {
+        float r, g, b;
+        r = r_gain * (*data).red;
+        g = (*data).green;
+        b = b_gain * (*data).blue;
+        if (r > 255) r = 255;
+        if (b > 255) b = 255;
+        (*data) = (pixel) {(int)(b + 0.5), (int)(g + 0.5), (int)(r + 0.5)};
+        data++;
     }
+}
 
-    /* Allocates memory and reads in pixel data */
-    long int pixel_total = info_header.width * info_header.height;
-    pixel_array = (pixel *) malloc (sizeof(pixel) * pixel_total);
-    if (pixel_array == NULL) {
-        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
-        exit(EXIT_FAILURE);
+/* Automatic white balance using the Gray World assumption */
+void wb_filter(image *img) {
+    // Finding average RGB values for whole image
+    unsigned long long sums[3] = {0, 0, 0};
+    for (int i = 0; i < (*img).height; i++) {
+        wb_sum_row(sums, (pixel *)IMAGE_ROW(img, i), (*img).width);
     }
-    if (fread(pixel_array, sizeof(pixel), pixel_total, input) != pixel_total) {
-        fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
-        exit(EXIT_FAILURE);
+    long int pixel_total = (long int)(*img).height * (*img).width;
+    // Applying calculations to every row
+    float r_gain, b_gain;
+    wb_gains(sums, pixel_total, &r_gain, &b_gain);
+    for (int y = 0; y < (*img).height; y++) {
+        wb_row(r_gain, b_gain, (pixel *)IMAGE_ROW(img, y), (*img).width);
     }
-    fclose(input);
+}
 
-    /* Checking and running filters */
-    if (filter_flag & FLAG_HSL) {               // filter_flag & 1
-        hsl_filter(hue, saturation, lightness, &info_header, pixel_array, padding_bytes);
+/* Fills a table per channel (in BGR order) which stretches the values
+   between the darkest and the lightest clip percent of the pixels to the
+   whole range. Auto levels stretches each channel by its own histogram,
+   which also evens out a color cast, while auto contrast stretches all
+   three by the luminance histogram so the colors keep their balance */
+void levels_lut(unsigned char lut[3][256], const image_stats *stats, double clip, int per_channel) {
+    unsigned long long clipped = (unsigned long long)(clip / 100 * (*stats).pixel_total);
+    for (int c = 0; c < 3; c++) {
+        const unsigned long long *hist = (*stats).hist[per_channel ? 2 - c : 3];
+        int low = stats_rank(hist, clipped), high = stats_rank(hist, (*stats).pixel_total - 1 - clipped);
+        for (int v = 0; v < 256; v++) {
+            if (high <= low) {
+                lut[c][v] = v;      // a flat channel is left alone
+            } else if (v <= low || v >= high) {
+                lut[c][v] = (v <= low) ? 0 : 255;
+            } else {
+                lut[c][v] = (int)((v - low) * 255.0 / (high - low) + 0.5);
+            }
+        }
     }
-    if (filter_flag & FLAG_CONTRAST) {          // filter_flag & 2
-        contrast_filter(contrast, &info_header, pixel_array, padding_bytes);
+}
+
+/* Auto levels (or, if not per channel, auto contrast) filter */
+void levels_filter(double clip, int per_channel, image *img) {
+    // Gathering the histograms of the whole image
+    image_stats stats;
+    stats_clear(&stats, STATS_HISTOGRAMS);
+    for (int i = 0; i < (*img).height; i++) {
+        stats_row(&stats, (pixel *)IMAGE_ROW(img, i), (*img).width);
     }
-    if (filter_flag & FLAG_WB) {                // filter_flag & 4
-        wb_filter(&info_header, pixel_array, padding_bytes);
+    unsigned char lut[3][256];
+    levels_lut(lut, &stats, clip, per_channel);
+    for (int y = 0; y < (*img).height; y++) {
+        pixel *data = (pixel *)IMAGE_ROW(img, y);
+        for (int x = 0; x < (*img).width; x++) {
+            data[x] = (pixel) {lut[0][data[x].blue], lut[1][data[x].green], lut[2][data[x].red]};
+        }
+    }
+}
+
+/* Gamma correction filter for a single row of pixels */
+void gamma_row(double gamma, pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        // Applying gamme correction formula
+        float red, green, blue;
+        red = powf((*data).red / 255.0, 1 / gamma) * 255;
+        green = powf((*data).green / 255.0, 1 / gamma) * 255;
+        blue = powf((*data).blue / 255.0, 1 / gamma) * 255;
+        if (red > 255) red = 255;
+        if (green > 255) green = 255;
+        if (blue > 255) blue = 255;
+        // Setting pixel data
+        (*data) = (pixel) {(int)(blue + 0.5), (int)(green + 0.5), (int)(red + 0.5)};
+        data++;
+    }
+}
+
+/* Gamma correction filter */
+void gamma_filter(double gamma, image *img) {
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        gamma_row(gamma, (pixel *)IMAGE_ROW(img, i), (*img).width);
+    }
+}
+
+/* Finds the smallest RGB sum which is not below the threshold, so pixels can be
+   tested with an integer comparison instead of a division */
+int threshold_cutoff(double threshold) {
+    int cutoff = 0;
+    while (cutoff <= 255*3 && cutoff / (double)(255*3) < threshold) cutoff++;
+    return cutoff;
+}
+
+/* Threshold filter for a single row of pixels */
+void threshold_row(int cutoff, pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        // Checking pixel intensity against user input threshold
+        if ((*data).red + (*data).green + (*data).blue < cutoff) {
+            (*data) = (pixel) {0, 0, 0};
+        } else {
+            (*data) = (pixel) {255, 255, 255};
+        }
+        data++;
+    }
+}
+
+/* Threshold filter. Blackens or whitens pixels accordingly */
+void threshold_filter(double threshold, image *img) {
+    int cutoff = threshold_cutoff(threshold);
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        threshold_row(cutoff, (pixel *)IMAGE_ROW(img, i), (*img).width);
+    }
+}
+
+/* Greyscale filter for a single row of pixels */
+void greyscale_row(pixel *data, int width) {
+    double grey = 0;
+    for (int j = 0; j < width; j++) {
+        grey = (*data).red * 0.2126 + (*data).green * 0.7152 + (*data).blue * 0.0722;
+        (*data) = (pixel) {(int)(grey + 0.5), (int)(grey + 0.5), (int)(grey + 0.5)};       // typecasting and using pixel struct
+        data++;
+    }
+}
+
+/* Greyscale filter. Converts image to black and white using luminance formula */
+void greyscale_filter(image *img) {
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        greyscale_row((pixel *)IMAGE_ROW(img, i), (*img).width);
+    }
+}
+
+/* Sepia filter for a single row of pixels */
+void sepia_row(pixel *data, int width) {
+    double red, green, blue;
+    for (int j = 0; j < width; j++) {
+        // Calculations and rounding
+        red = (*data).red * 0.393 + (*data).green * 0.769 + (*data).blue * 0.189;
+        green = (*data).red * 0.349 + (*data).green * 0.686 + (*data).blue * 0.168;
+        blue = (*data).red * 0.272 + (*data).green * 0.534 + (*data).blue * 0.131;
+        if (red > 255) red = 255;
+        if (green > 255) green = 255;
+        if (blue > 255) blue = 255;
+        // Setting rgb for pixel and typecasting
+        (*data) = (pixel) {(int)(blue + 0.5), (int)(green + 0.5), (int)(red + 0.5)};
+        data++;
+    }
+}
+
+/* Sepia filter. Gives the image a 'warm', yellow tone */
+void sepia_filter(image *img) {
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        sepia_row((pixel *)IMAGE_ROW(img, i), (*img).width);
+    }
+}
+
+/* Inverse filter for a single row of pixels */
+void inverse_row(pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        (*data) = (pixel) {255 - (*data).blue, 255 - (*data).green, 255 - (*data).red};
+        data++;
+    }
+}
+
+/* Inverse filter. Inverts the color of the pixel */
+void inverse_filter(image *img) {
+    // Loops through every row of the image
+    for (int i = 0; i < (*img).height; i++) {
+        inverse_row((pixel *)IMAGE_ROW(img, i), (*img).width);
+    }
+}
+
+// Fixed point weights, scaled by 65536 for greyscale and 32768 for sepia
+#define GREY_WR 13933
+#define GREY_WG 46871
+#define GREY_WB 4732
+static const unsigned short sepia_w[3][3] = {       // [output][input], both in RGB order
+    {12878, 25199, 6193},
+    {11436, 22479, 5505},
+    {8913, 17498, 4293}
+};
+
+/* The grey of a color with the fixed point weights, each product rounded
+   down to 8 bits of fraction as the SIMD kernels do */
+static inline unsigned int grey_fixed(unsigned int r, unsigned int g, unsigned int b) {
+    return (((r << 8) * GREY_WR >> 16) + ((g << 8) * GREY_WG >> 16) + ((b << 8) * GREY_WB >> 16) + 128) >> 8;
+}
+
+/* One channel of the sepia of a color, from its row of sepia_w */
+static inline unsigned int sepia_fixed(const unsigned short w[3], unsigned int r, unsigned int g, unsigned int b) {
+    unsigned int v = (((r << 8) * w[0] >> 16) + ((g << 8) * w[1] >> 16) + ((b << 8) * w[2] >> 16) + 64) >> 7;
+    return (v > 255) ? 255 : v;
+}
+
+/* Greyscale and sepia with the fixed point math of the SIMD kernels, which
+   use them for the pixels left over after their blocks of 16, so a pixel
+   gives the same whatever its column */
+void greyscale_fixed_row(pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        unsigned char grey = grey_fixed(data[j].red, data[j].green, data[j].blue);
+        data[j] = (pixel) {grey, grey, grey};
+    }
+}
+
+void sepia_fixed_row(pixel *data, int width) {
+    for (int j = 0; j < width; j++) {
+        pixel p = data[j];
+        data[j].red = sepia_fixed(sepia_w[0], p.red, p.green, p.blue);
+        data[j].green = sepia_fixed(sepia_w[1], p.red, p.green, p.blue);
+        data[j].blue = sepia_fixed(sepia_w[2], p.red, p.green, p.blue);
+    }
+}
+
+/* Row kernels for BGRA pixels, which leave alpha as it is and use the fixed
+   point math of the BGR SIMD kernels below. Each pixel is handled as one
+   32-bit word (blue in the low byte), so there is no deinterleaving to do and
+   the loops are vectorized by the compiler, one pixel to a lane. They are
+   built again for SSE4.1 and AVX2 */
+#define QUAD_INLINE __attribute__((always_inline))
+#define QUAD_ALPHA 0xff000000u
+
+static inline QUAD_INLINE unsigned int quad_load(const quad *q) {
+    unsigned int v;
+    memcpy(&v, q, sizeof(v));
+    return v;
+}
+
+static inline QUAD_INLINE void quad_store(quad *q, unsigned int v) {
+    memcpy(q, &v, sizeof(v));
+}
+
+static inline QUAD_INLINE void greyscale_quad_rows(quad *restrict data, int width) {
+    for (int j = 0; j < width; j++) {
+        unsigned int v = quad_load(&data[j]);
+        unsigned int b = v & 255, g = (v >> 8) & 255, r = (v >> 16) & 255;
+        unsigned int grey = ((((r << 8) * GREY_WR >> 16) + ((g << 8) * GREY_WG >> 16) + ((b << 8) * GREY_WB >> 16)) + 128) >> 8;
+        quad_store(&data[j], (v & QUAD_ALPHA) | grey << 16 | grey << 8 | grey);
+    }
+}
+
+static inline QUAD_INLINE void sepia_quad_rows(quad *restrict data, int width) {
+    for (int j = 0; j < width; j++) {
+        unsigned int v = quad_load(&data[j]);
+        unsigned int b = (v & 255) << 8, g = ((v >> 8) & 255) << 8, r = ((v >> 16) & 255) << 8;
+        unsigned int red = ((r * sepia_w[0][0] >> 16) + (g * sepia_w[0][1] >> 16) + (b * sepia_w[0][2] >> 16) + 64) >> 7;
+        unsigned int green = ((r * sepia_w[1][0] >> 16) + (g * sepia_w[1][1] >> 16) + (b * sepia_w[1][2] >> 16) + 64) >> 7;
+        unsigned int blue = ((r * sepia_w[2][0] >> 16) + (g * sepia_w[2][1] >> 16) + (b * sepia_w[2][2] >> 16) + 64) >> 7;
+        red = (red > 255) ? 255 : red;
+        green = (green > 255) ? 255 : green;
+        blue = (blue > 255) ? 255 : blue;
+        quad_store(&data[j], (v & QUAD_ALPHA) | red << 16 | green << 8 | blue);
+    }
+}
+
+static inline QUAD_INLINE void threshold_quad_rows(int cutoff, quad *restrict data, int width) {
+    for (int j = 0; j < width; j++) {
+        unsigned int v = quad_load(&data[j]);
+        int sum = (v & 255) + ((v >> 8) & 255) + ((v >> 16) & 255);
+        quad_store(&data[j], (v & QUAD_ALPHA) | ((sum < cutoff) ? 0 : 0xffffff));
+    }
+}
+
+static inline QUAD_INLINE unsigned int contrast_channel(int v, int cq) {
+    v = (v - 128) * cq + (128 << 16) + (1 << 15);
+    v = (v < 0) ? 0 : v >> 16;
+    return (v > 255) ? 255 : v;
+}
+
+static inline QUAD_INLINE void contrast_quad_rows(double coeff, quad *restrict data, int width) {
+    int cq = (int)(coeff * 65536 + 0.5);
+    for (int j = 0; j < width; j++) {
+        unsigned int v = quad_load(&data[j]);
+        unsigned int b = contrast_channel(v & 255, cq), g = contrast_channel((v >> 8) & 255, cq), r = contrast_channel((v >> 16) & 255, cq);
+        quad_store(&data[j], (v & QUAD_ALPHA) | r << 16 | g << 8 | b);
+    }
+}
+
+static inline QUAD_INLINE void inverse_quad_rows(quad *restrict data, int width) {
+    for (int j = 0; j < width; j++) quad_store(&data[j], quad_load(&data[j]) ^ ~QUAD_ALPHA);
+}
+
+static inline QUAD_INLINE void hsl_fixed_quad_rows(const hsl_shift *shift, quad *restrict data, int width) {
+    int r[HSL_BLOCK], g[HSL_BLOCK], b[HSL_BLOCK];
+    for (int j = 0; j < width; j += HSL_BLOCK) {
+        int n = (width - j < HSL_BLOCK) ? width - j : HSL_BLOCK;
+        for (int k = 0; k < n; k++) {
+            unsigned int v = quad_load(&data[j + k]);
+            b[k] = v & 255;
+            g[k] = (v >> 8) & 255;
+            r[k] = (v >> 16) & 255;
+        }
+        hsl_block(shift, r, g, b, n);
+        for (int k = 0; k < n; k++) {
+            unsigned int v = quad_load(&data[j + k]);
+            quad_store(&data[j + k], (v & QUAD_ALPHA) | (unsigned int)r[k] << 16 | (unsigned int)g[k] << 8 | (unsigned int)b[k]);
+        }
+    }
+}
+
+void greyscale_quads(quad *data, int width) {
+    greyscale_quad_rows(data, width);
+}
+
+void sepia_quads(quad *data, int width) {
+    sepia_quad_rows(data, width);
+}
+
+void threshold_quads(int cutoff, quad *data, int width) {
+    threshold_quad_rows(cutoff, data, width);
+}
+
+void contrast_quads(double coeff, quad *data, int width) {
+    contrast_quad_rows(coeff, data, width);
+}
+
+void inverse_quads(quad *data, int width) {
+    inverse_quad_rows(data, width);
+}
+
+void hsl_fixed_quads(const hsl_shift *shift, quad *data, int width) {
+    hsl_fixed_quad_rows(shift, data, width);
+}
+
+/* Adds the RGB values of a row of BGRA pixels to the white balance totals */
+void wb_sum_quads(unsigned long long sums[3], quad *data, int width) {
+    for (int j = 0; j < width; j++) {
+        sums[0] += data[j].red;
+        sums[1] += data[j].green;
+        sums[2] += data[j].blue;
+    }
+}
+
+/* The 3D lookup table (cube) engine. Each channel of a color is placed on
+   the grid by a table lookup, giving the grid cell it falls in and how far
+   along the cell it is. The cell is split into six tetrahedra along its
+   diagonal, and the color comes from the four corners of the tetrahedron it
+   is in, weighted by the sorted distances along each axis. The tetrahedron
+   is picked with masks rather than branches, as colors of neighbouring
+   pixels land in different ones, and like the HSL engine the pixels are
+   handled in blocks that the compiler vectorizes. The AVX2 version below
+   does the same 8 pixels at a time with gathers */
+#define CUBE_INLINE __attribute__((always_inline))      // inlined into the SIMD versions
+
+/* Allocates the grid of a cube covering the whole range of colors. The grid
+   is followed by a row, column and plane of zero nodes, which corners past
+   the last grid point read with a weight of 0 */
+int cube_create(color_cube *cube, int size) {
+    memset(cube, 0, sizeof(color_cube));
+    size_t nodes = (size_t)size * size * size + (size_t)size * size + size + 1;
+    (*cube).nodes = (unsigned int *) calloc (nodes, sizeof(unsigned int));
+    if ((*cube).nodes == NULL) return -1;
+    (*cube).size = size;
+    for (int c = 0; c < 3; c++) (*cube).domain[1][c] = 1;
+    cube_domain(cube);
+    return 0;
+}
+
+/* Works out the position of every input value on the grid from the cube's
+   domain. Values outside the domain are clamped to its edges. The table is
+   filled in with the same float math the AVX2 version does on each pixel,
+   so both give the same result */
+void cube_domain(color_cube *cube) {
+    int last = (*cube).size - 1;
+    const unsigned int step[3] = {(*cube).size * (*cube).size, (*cube).size, 1};     // blue changes slowest
+    for (int c = 0; c < 3; c++) {
+        double min = (*cube).domain[0][2 - c], max = (*cube).domain[1][2 - c];     // the domain is in RGB order
+        (*cube).scale[c] = (float)(256.0 * last / (255.0 * (max - min)));
+        (*cube).bias[c] = (float)(-256.0 * last * min / (max - min));
+        for (int v = 0; v < 256; v++) {
+            float pos = (float)v * (*cube).scale[c] + (*cube).bias[c];
+            pos = (pos < 0) ? 0 : ((pos > 256 * last) ? 256 * last : pos);
+            unsigned int fixed = (unsigned int)lrintf(pos);
+            (*cube).axis[c][v] = ((fixed >> 8) * step[c]) << 8 | (fixed & 255);
+        }
+    }
+}
+
+/* Packs a color (0 to 255) into a grid node */
+static unsigned int cube_pack(int red, int green, int blue) {
+    return (unsigned int)red << 22 | (unsigned int)green << 12 | (unsigned int)blue << 2;
+}
+
+/* Frees the grid of a cube */
+void cube_free(color_cube *cube) {
+    free((*cube).nodes);
+    (*cube).nodes = NULL;
+}
+
+/* Looks up a block of up to HSL_BLOCK pixels, split into channel arrays */
+static inline CUBE_INLINE void cube_block(const color_cube *cube, int *r, int *g, int *b, int n) {
+    const unsigned int *nodes = (*cube).nodes;
+    unsigned int sb = (*cube).size * (*cube).size, sg = (*cube).size, sr = 1, far = sb + sg + sr;
+    for (int j = 0; j < n; j++) {
+        unsigned int eb = (*cube).axis[0][b[j]], eg = (*cube).axis[1][g[j]], er = (*cube).axis[2][r[j]];
+        int fb = eb & 255, fg = eg & 255, fr = er & 255;
+        unsigned int base = (eb >> 8) + (eg >> 8) + (er >> 8);
+        int max = (fb > fg) ? fb : fg;
+        max = (fr > max) ? fr : max;
+        int min = (fb < fg) ? fb : fg;
+        min = (fr < min) ? fr : min;
+        int mid = fb + fg + fr - max - min;
+
+        // The tetrahedron runs from the near corner along the axis furthest
+        // along, then the next, to the far corner. Ties give weights of 0
+        unsigned int blue_first = (fb >= fg) & (fb >= fr), green_first = !blue_first & (fg >= fr);
+        unsigned int blue_last = (fb < fg) & (fb < fr), green_last = !blue_last & (fg <= fr);
+        unsigned int first = (-blue_first & sb) | (-green_first & sg) | (-(!blue_first & !green_first) & sr);
+        unsigned int last = (-blue_last & sb) | (-green_last & sg) | (-(!blue_last & !green_last) & sr);
+        unsigned int c0 = nodes[base], c1 = nodes[base + first], c2 = nodes[base + far - last], c3 = nodes[base + far];
+        int w0 = 256 - max, w1 = max - mid, w2 = mid - min, w3 = min;
+
+        b[j] = ((int)(c0 & 1023) * w0 + (int)(c1 & 1023) * w1 + (int)(c2 & 1023) * w2 + (int)(c3 & 1023) * w3 + 512) >> 10;
+        g[j] = ((int)((c0 >> 10) & 1023) * w0 + (int)((c1 >> 10) & 1023) * w1 + (int)((c2 >> 10) & 1023) * w2 +
+                (int)((c3 >> 10) & 1023) * w3 + 512) >> 10;
+        r[j] = ((int)(c0 >> 20) * w0 + (int)(c1 >> 20) * w1 + (int)(c2 >> 20) * w2 + (int)(c3 >> 20) * w3 + 512) >> 10;
+    }
+}
+
+/* Runs the cube over a row, a block of pixels at a time */
+static inline CUBE_INLINE void cube_rows(const color_cube *cube, pixel *data, int width) {
+    int r[HSL_BLOCK], g[HSL_BLOCK], b[HSL_BLOCK];
+    for (int j = 0; j < width; j += HSL_BLOCK) {
+        int n = (width - j < HSL_BLOCK) ? width - j : HSL_BLOCK;
+        for (int k = 0; k < n; k++) {
+            r[k] = data[j + k].red;
+            g[k] = data[j + k].green;
+            b[k] = data[j + k].blue;
+        }
+        cube_block(cube, r, g, b, n);
+        for (int k = 0; k < n; k++) data[j + k] = (pixel) {b[k], g[k], r[k]};
+    }
+}
+
+/* Runs the cube over the B, G and R planes of a row */
+static inline CUBE_INLINE void cube_plane_rows(const color_cube *cube, unsigned char *plane[3], int width) {
+    int r[HSL_BLOCK], g[HSL_BLOCK], b[HSL_BLOCK];
+    for (int j = 0; j < width; j += HSL_BLOCK) {
+        int n = (width - j < HSL_BLOCK) ? width - j : HSL_BLOCK;
+        for (int k = 0; k < n; k++) {
+            b[k] = plane[0][j + k];
+            g[k] = plane[1][j + k];
+            r[k] = plane[2][j + k];
+        }
+        cube_block(cube, r, g, b, n);
+        for (int k = 0; k < n; k++) {
+            plane[0][j + k] = b[k];
+            plane[1][j + k] = g[k];
+            plane[2][j + k] = r[k];
+        }
+    }
+}
+
+/* Runs the cube over a row of BGRA pixels, leaving alpha as it is */
+static inline CUBE_INLINE void cube_quad_rows(const color_cube *cube, quad *restrict data, int width) {
+    int r[HSL_BLOCK], g[HSL_BLOCK], b[HSL_BLOCK];
+    for (int j = 0; j < width; j += HSL_BLOCK) {
+        int n = (width - j < HSL_BLOCK) ? width - j : HSL_BLOCK;
+        for (int k = 0; k < n; k++) {
+            unsigned int v = quad_load(&data[j + k]);
+            b[k] = v & 255;
+            g[k] = (v >> 8) & 255;
+            r[k] = (v >> 16) & 255;
+        }
+        cube_block(cube, r, g, b, n);
+        for (int k = 0; k < n; k++) {
+            unsigned int v = quad_load(&data[j + k]);
+            quad_store(&data[j + k], (v & QUAD_ALPHA) | (unsigned int)r[k] << 16 | (unsigned int)g[k] << 8 | (unsigned int)b[k]);
+        }
+    }
+}
+
+/* 3D lookup table filter for a single row of pixels */
+void cube_row(const color_cube *cube, pixel *data, int width) {
+    cube_rows(cube, data, width);
+}
+
+/* 3D lookup table filter for the planes of a single row */
+void cube_planes(const color_cube *cube, unsigned char *plane[3], int width) {
+    cube_plane_rows(cube, plane, width);
+}
+
+/* 3D lookup table filter for a single row of BGRA pixels */
+void cube_quads(const color_cube *cube, quad *data, int width) {
+    cube_quad_rows(cube, data, width);
+}
+
+/* Packs a color from a .cube file (RGB, 0 to 1) into a grid node */
+static unsigned int cube_node(const double rgb[3]) {
+    unsigned int node = 0;
+    for (int c = 0; c < 3; c++) {
+        double v = (rgb[c] < 0) ? 0 : ((rgb[c] > 1) ? 1 : rgb[c]);
+        node |= (unsigned int)lround(v * 1020) << (20 - 10 * c);
+    }
+    return node;
+}
+
+/* Reads a cube from a .cube file: keywords giving the size of the grid (and
+   optionally its domain), then a line of red, green and blue from 0 to 1 for
+   every grid point, red changing fastest. Returns -1 with a message in error
+   if the file is not valid */
+int cube_read(color_cube *cube, const char *cube_file, char error[ERROR_SIZE]) {
+    FILE *fp = fopen(cube_file, "r");
+    (*cube).nodes = NULL;
+    if (fp == NULL) {
+        snprintf(error, ERROR_SIZE, "the cube file %s could not be read.", cube_file);
+        return -1;
+    }
+    char *line = NULL, keyword[32];
+    size_t capacity = 0;
+    const char *problem = NULL;
+    double domain[2][3] = {{0, 0, 0}, {1, 1, 1}};
+    long int count = 0, total = 0;
+    int number = 0;
+    while (problem == NULL && getline(&line, &capacity, fp) > 0) {
+        number++;
+        char *p = line + strspn(line, " \t\r\n");
+        double rgb[3], range[2];
+        char extra;
+        if (*p == '\0' || *p == '#') continue;
+        if (isalpha((unsigned char)*p)) {
+            sscanf(p, "%31s", keyword);
+            p += strlen(keyword);
+            if (strcmp(keyword, "LUT_3D_SIZE") == 0) {
+                int size;
+                if (total != 0 || sscanf(p, "%d %c", &size, &extra) != 1 || size < 2 || size > MAX_CUBE_SIZE) {
+                    problem = "LUT_3D_SIZE must be given once, between 2 and 256";
+                } else if (cube_create(cube, size) != 0) {
+                    problem = "memory allocation failed";
+                } else {
+                    total = (long int)size * size * size;
+                }
+            } else if (strcmp(keyword, "DOMAIN_MIN") == 0 || strcmp(keyword, "DOMAIN_MAX") == 0) {
+                double *bound = domain[strcmp(keyword, "DOMAIN_MAX") == 0];
+                if (sscanf(p, "%lf %lf %lf %c", &bound[0], &bound[1], &bound[2], &extra) != 3) problem = "the domain must be three numbers";
+            } else if (strcmp(keyword, "LUT_3D_INPUT_RANGE") == 0) {
+                if (sscanf(p, "%lf %lf %c", &range[0], &range[1], &extra) != 2) problem = "the input range must be two numbers";
+                for (int c = 0; c < 3; c++) {
+                    domain[0][c] = range[0];
+                    domain[1][c] = range[1];
+                }
+            } else if (strcmp(keyword, "LUT_1D_SIZE") == 0) {
+                problem = "1D lookup tables are not supported";
+            }
+            // TITLE and other keywords do not change the table
+        } else if (total == 0) {
+            problem = "grid points come before LUT_3D_SIZE";
+        } else if (sscanf(p, "%lf %lf %lf %c", &rgb[0], &rgb[1], &rgb[2], &extra) != 3) {
+            problem = "a grid point must be three numbers";
+        } else if (count == total) {
+            problem = "there are more grid points than LUT_3D_SIZE gives";
+        } else {
+            (*cube).nodes[count++] = cube_node(rgb);
+        }
+    }
+    free(line);
+    fclose(fp);
+    int at = (problem != NULL) ? number : 0;      // the line a problem was found on
+    if (problem == NULL && total == 0) problem = "there is no LUT_3D_SIZE";
+    if (problem == NULL && count < total) problem = "there are fewer grid points than LUT_3D_SIZE gives";
+    for (int c = 0; c < 3; c++) {
+        if (problem == NULL && !(domain[0][c] < domain[1][c])) problem = "the domain minimum must be below its maximum";
+    }
+    if (problem != NULL) {
+        if (at > 0) {
+            snprintf(error, ERROR_SIZE, "the cube file %s is not valid: %s (line %d).", cube_file, problem, at);
+        } else {
+            snprintf(error, ERROR_SIZE, "the cube file %s is not valid: %s.", cube_file, problem);
+        }
+        cube_free(cube);
+        return -1;
+    }
+    memcpy((*cube).domain, domain, sizeof(domain));
+    cube_domain(cube);
+    return 0;
+}
+
+/* Reads a cube from a .cube file, exiting if the file is not valid */
+void cube_load(color_cube *cube, const char *cube_file) {
+    char error[ERROR_SIZE];
+    if (cube_read(cube, cube_file, error) != 0) {
+        fprintf(stderr, "%s %s\n", ERROR_HEADER, error);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Writes a cube in the .cube format, titled if title is not NULL. Returns 0
+   on success */
+int cube_save(FILE *fp, const color_cube *cube, const char *title) {
+    if (title != NULL) fprintf(fp, "TITLE \"%s\"\n", title);
+    fprintf(fp, "LUT_3D_SIZE %d\n", (*cube).size);
+    if ((*cube).domain[0][0] != 0 || (*cube).domain[0][1] != 0 || (*cube).domain[0][2] != 0 ||
+        (*cube).domain[1][0] != 1 || (*cube).domain[1][1] != 1 || (*cube).domain[1][2] != 1) {
+        fprintf(fp, "DOMAIN_MIN %g %g %g\n", (*cube).domain[0][0], (*cube).domain[0][1], (*cube).domain[0][2]);
+        fprintf(fp, "DOMAIN_MAX %g %g %g\n", (*cube).domain[1][0], (*cube).domain[1][1], (*cube).domain[1][2]);
+    }
+    long int total = (long int)(*cube).size * (*cube).size * (*cube).size;
+    for (long int k = 0; k < total; k++) {
+        unsigned int node = (*cube).nodes[k];
+        fprintf(fp, "%.6f %.6f %.6f\n", (node >> 20) / 1020.0, ((node >> 10) & 1023) / 1020.0, (node & 1023) / 1020.0);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/* The spatial filters. The Gaussian and box kernels are separable, so each
+   is applied as a horizontal pass along the rows into 16-bit intermediate
+   values, then a vertical pass down their columns. Gaussian weights are in
+   14-bit fixed point: the horizontal pass keeps 7 bits of fraction, so the
+   values fit signed 16-bit lanes for the SIMD multiply-adds, and the
+   vertical pass rounds back to bytes, or for sharpening compares the
+   blurred value with the original. A line is the values of a row the kernel
+   slides along, each step bytes from the next value of its channel (the
+   width of a packed pixel, or 1 for a plane), so every channel is filtered
+   at once */
+#define SPATIAL_ONE 16384
+#define SPATIAL_BLOCK 64
+#define SPATIAL_INLINE __attribute__((always_inline))      // inlined into the SIMD versions, so they get vectorized too
+
+/* Fills in the weights of a Gaussian blur with standard deviation sigma,
+   taken out to 3 sigma. With an amount the blur is an unsharp mask instead,
+   sharpening by amount times the difference from the blurred image where
+   that is more than threshold levels */
+void spatial_gaussian(spatial_filter *filter, double sigma, double amount, double threshold) {
+    int radius = (int)ceil(3 * sigma);
+    if (radius < 1) radius = 1;
+    if (radius > MAX_RADIUS) radius = MAX_RADIUS;
+    double w[2 * MAX_RADIUS + 1], total = 0;
+    for (int k = -radius; k <= radius; k++) {
+        w[k + radius] = exp(-(double)k * k / (2 * sigma * sigma));
+        total += w[k + radius];
+    }
+    int sum = 0;
+    for (int k = 0; k <= 2 * radius; k++) {
+        (*filter).weights[k] = (short)lround(w[k] * SPATIAL_ONE / total);
+        sum += (*filter).weights[k];
+    }
+    (*filter).weights[radius] += SPATIAL_ONE - sum;     // so they add up to exactly one
+    (*filter).type = SPATIAL_GAUSSIAN;
+    (*filter).radius = radius;
+    (*filter).amount = (int)lround(amount * 256);
+    (*filter).threshold = (int)lround(threshold * 256);
+}
+
+/* Fills in a sharpen filter: an unsharp mask over the 3x3 binomial blur,
+   whose weights are 1 2 1 both ways */
+void spatial_sharpen(spatial_filter *filter, double amount) {
+    static const short binomial[3] = {SPATIAL_ONE / 4, SPATIAL_ONE / 2, SPATIAL_ONE / 4};
+    memcpy((*filter).weights, binomial, sizeof(binomial));
+    (*filter).type = SPATIAL_GAUSSIAN;
+    (*filter).radius = 1;
+    (*filter).amount = (int)lround(amount * 256);
+    (*filter).threshold = 0;
+}
+
+/* Fills in a box blur, the average of the (2 * radius + 1)^2 pixels around each */
+void spatial_box(spatial_filter *filter, int radius) {
+    (*filter).type = SPATIAL_BOX;
+    (*filter).radius = radius;
+    (*filter).amount = 0;
+    (*filter).threshold = 0;
+}
+
+/* Horizontal pass of a Gaussian kernel, convolving n values of a line with
+   the weights a block at a time. The line in holds radius * step bytes of
+   padding before and after the values */
+void convolve_line(const unsigned char *in, unsigned short *out, int n, int step, const short *weights, int radius) {
+    int acc[SPATIAL_BLOCK];
+    for (int j = 0; j < n; j += SPATIAL_BLOCK) {
+        int m = (n - j < SPATIAL_BLOCK) ? n - j : SPATIAL_BLOCK;
+        const unsigned char *p = in + radius * step + j;
+        int w = weights[radius];
+        for (int i = 0; i < m; i++) acc[i] = 64 + w * p[i];
+        // The kernel is symmetric, so each weight is applied to both sides at once
+        for (int k = 1; k <= radius; k++) {
+            const unsigned char *left = p - k * step, *right = p + k * step;
+            w = weights[radius + k];
+            for (int i = 0; i < m; i++) acc[i] += w * (left[i] + right[i]);
+        }
+        for (int i = 0; i < m; i++) out[j + i] = (unsigned short)(acc[i] >> 7);
+    }
+}
+
+/* Sharpens a value by amount 256ths of its difference from the blurred
+   value (in 256ths), if the difference is more than threshold */
+static inline int sharpen_value(int x, int blurred, int amount, int threshold) {
+    int diff = (x << 8) - blurred;
+    if (diff <= threshold && diff >= -threshold) return x;
+    int v = x + ((diff * amount + (1 << 15)) >> 16);
+    return (v < 0) ? 0 : (v > 255) ? 255 : v;
+}
+
+/* Vertical pass of a Gaussian kernel down the columns of 2 * radius + 1
+   lines of horizontal pass values, giving n bytes of a line. Without an
+   original the result is the blurred value, otherwise the original sharpened
+   by amount 256ths of its difference from the blurred value, if more than
+   threshold 256ths of a level */
+void convolve_columns(const unsigned short *const *rows, const short *weights, int radius, const unsigned char *original,
+                      int amount, int threshold, unsigned char *out, int n) {
+    int acc[SPATIAL_BLOCK];
+    for (int j = 0; j < n; j += SPATIAL_BLOCK) {
+        int m = (n - j < SPATIAL_BLOCK) ? n - j : SPATIAL_BLOCK;
+        const unsigned short *centre = rows[radius] + j;
+        int w = weights[radius];
+        for (int i = 0; i < m; i++) acc[i] = w * centre[i];
+        for (int k = 1; k <= radius; k++) {
+            const unsigned short *up = rows[radius - k] + j, *down = rows[radius + k] + j;
+            w = weights[radius + k];
+            for (int i = 0; i < m; i++) acc[i] += w * (up[i] + down[i]);
+        }
+        for (int i = 0; i < m; i++) {
+            out[j + i] = (unsigned char)((original == NULL) ? (acc[i] + (1 << 20)) >> 21 :
+                                         sharpen_value(original[j + i], (acc[i] + (1 << 12)) >> 13, amount, threshold));
+        }
+    }
+}
+
+/* Adds a line of horizontal pass values to the running column sums of a box
+   blur, gives n bytes of the blurred line from them, then takes away the
+   line leaving the box */
+static inline SPATIAL_INLINE void box_column_rows(int *sums, const unsigned short *add, const unsigned short *drop, float scale,
+                                                  unsigned char *out, int n) {
+    for (int i = 0; i < n; i++) {
+        int sum = sums[i] + add[i];
+        out[i] = (unsigned char)(int)(sum * scale + 0.5f);
+        sums[i] = sum - drop[i];
+    }
+}
+
+/* Horizontal pass of a box blur over a padded line, giving the sum of the
+   2 * radius + 1 values of each channel around every value. The sum slides
+   along the line, adding the value coming into the box and taking away the
+   one leaving, so it costs the same whatever the radius */
+void box_line(const unsigned char *in, unsigned short *out, int n, int step, int radius) {
+    int span = (2 * radius + 1) * step;
+    for (int c = 0; c < step && c < n; c++) {
+        int sum = 0;
+        for (int k = c; k < span; k += step) sum += in[k];
+        for (int j = c; j < n; j += step) {
+            out[j] = (unsigned short)sum;
+            if (j + step < n) sum += in[j + span] - in[j];
+        }
+    }
+}
+
+/* Vertical pass of a box blur */
+void box_columns(int *sums, const unsigned short *add, const unsigned short *drop, float scale, unsigned char *out, int n) {
+    box_column_rows(sums, add, drop, scale, out, n);
+}
+
+/* Copies the pixels x0 to x1 - 1 of a line, with radius pixels either side,
+   to padded. Pixels beyond the edges of the line repeat the edge pixel */
+static void pad_line(unsigned char *padded, const unsigned char *line, int width, int x0, int x1, int radius, int step) {
+    int left = x0 - radius, right = x1 + radius;
+    int inside = (left > 0) ? left : 0, end = (right < width) ? right : width;
+    for (int x = left; x < inside; x++, padded += step) memcpy(padded, line, step);
+    memcpy(padded, line + (size_t)inside * step, (size_t)(end - inside) * step);
+    padded += (size_t)(end - inside) * step;
+    for (int x = end; x < right; x++, padded += step) memcpy(padded, line + (size_t)(width - 1) * step, step);
+}
+
+/* Runs a spatial filter over a whole image of packed pixels with the scalar
+   kernels, one pass after the other over every row. This is the simple
+   version of the tiled engine the filter chain uses, kept to check it against */
+void spatial_image(const spatial_filter *filter, image *img) {
+    int width = (*img).width, height = (*img).height, step = (*img).channels, radius = (*filter).radius;
+    size_t n = (size_t)width * step;
+    unsigned short *temp = (unsigned short *) malloc (sizeof(unsigned short) * n * height);
+    unsigned char *padded = (unsigned char *) malloc (n + 2 * radius * step);
+    unsigned char *original = (unsigned char *) malloc (n * height);
+    const unsigned short **window = (const unsigned short **) malloc (sizeof(unsigned short *) * (2 * radius + 1));
+    int *sums = (int *) malloc (sizeof(int) * n);
+    if (temp == NULL || padded == NULL || original == NULL || window == NULL || sums == NULL) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < height; i++) {
+        memcpy(original + n * i, IMAGE_ROW(img, i), n);
+        pad_line(padded, original + n * i, width, 0, width, radius, step);
+        if ((*filter).type == SPATIAL_BOX) {
+            box_line(padded, temp + n * i, n, step, radius);
+        } else {
+            convolve_line(padded, temp + n * i, n, step, (*filter).weights, radius);
+        }
+    }
+    // Rows beyond the top and bottom edges repeat the edge rows
+    memset(sums, 0, sizeof(int) * n);
+    for (int k = -radius; k < radius; k++) {
+        const unsigned short *line = temp + n * ((k < 0) ? 0 : (k >= height) ? height - 1 : k);
+        for (size_t j = 0; j < n; j++) sums[j] += line[j];
+    }
+    for (int i = 0; i < height; i++) {
+        for (int k = 0; k <= 2 * radius; k++) {
+            int y = i - radius + k;
+            window[k] = temp + n * ((y < 0) ? 0 : (y >= height) ? height - 1 : y);
+        }
+        unsigned char *row = IMAGE_ROW(img, i);
+        if ((*filter).type == SPATIAL_BOX) {
+            box_columns(sums, window[2 * radius], window[0], 1.0f / ((2 * radius + 1) * (2 * radius + 1)), row, n);
+        } else {
+            convolve_columns(window, (*filter).weights, radius, (*filter).amount ? original + n * i : NULL,
+                             (*filter).amount, (*filter).threshold, row, n);
+        }
+        // Alpha is left as it was
+        for (size_t j = 3; step == 4 && j < n; j += 4) row[j] = original[n * i + j];
+    }
+    free(temp);
+    free(padded);
+    free(original);
+    free(window);
+    free(sums);
+}
+
+/* Gaussian blur filter */
+void blur_filter(double sigma, image *img) {
+    spatial_filter filter;
+    spatial_gaussian(&filter, sigma, 0, 0);
+    spatial_image(&filter, img);
+}
+
+/* Box blur filter */
+void box_blur_filter(int radius, image *img) {
+    spatial_filter filter;
+    spatial_box(&filter, radius);
+    spatial_image(&filter, img);
+}
+
+/* Sharpen filter */
+void sharpen_filter(double amount, image *img) {
+    spatial_filter filter;
+    spatial_sharpen(&filter, amount);
+    spatial_image(&filter, img);
+}
+
+/* Unsharp mask filter */
+void unsharp_filter(double sigma, double amount, double threshold, image *img) {
+    spatial_filter filter;
+    spatial_gaussian(&filter, sigma, amount, threshold);
+    spatial_image(&filter, img);
+}
+
+/* The resize engine. Resizing is separable like the spatial filters: the
+   vertical pass takes the input rows each output row needs and weights
+   them into a line of 16-bit values with 7 bits of fraction, and the
+   horizontal pass weights the values of that line into the output pixels.
+   Downscaling widens the kernel by the scale, so every input pixel counts
+   towards the output. The weights of each output position are worked out
+   once for the image and kept in a table for each axis */
+#define RESIZE_BLOCK 64
+#define RESIZE_ONE 16384
+#define RESIZE_INLINE __attribute__((always_inline))      // inlined into the SSE4.1 and AVX2 versions
+
+/* Value of a resampling kernel at x input pixels from the centre */
+static double resize_kernel(int kernel, double x) {
+    x = fabs(x);
+    if (kernel == RESIZE_BOX) return (x < 0.5) ? 1 : 0;
+    if (kernel == RESIZE_BILINEAR) return (x < 1) ? 1 - x : 0;
+    if (x == 0) return 1;
+    if (x >= 3) return 0;
+    // Lanczos-3: sinc windowed by a sinc three times as wide
+    return 3 * sin(PI * x) * sin(PI * x / 3) / (PI * PI * x * x);
+}
+
+/* Works out the weights for resampling in positions along an axis to out,
+   with the kernel stretched over as many input positions as each output
+   position covers when downscaling. Returns -1 if there is not enough memory */
+int resize_axis_create(resize_axis *axis, int in, int out, int kernel) {
+    static const double support[] = {0.5, 1, 3};
+    double scale = (double)in / out, stretch = (scale > 1) ? scale : 1, reach = support[kernel] * stretch;
+    int taps = 2 * (int)ceil(reach) + 1;
+    if (taps > in) taps = in;
+    (*axis).in = in;
+    (*axis).out = out;
+    (*axis).taps = taps;
+    (*axis).start = (int *) malloc (sizeof(int) * out);
+    (*axis).weights = (short *) calloc ((size_t)out * taps, sizeof(short));
+    double *w = (double *) malloc (sizeof(double) * taps);
+    if ((*axis).start == NULL || (*axis).weights == NULL || w == NULL) {
+        free(w);
+        resize_axis_free(axis);
+        return -1;
+    }
+    for (int i = 0; i < out; i++) {
+        // Pixel centres are half a pixel in, so the edges of both line up
+        double centre = (i + 0.5) * scale;
+        int low = (int)floor(centre - reach + 0.5), high = (int)floor(centre + reach + 0.5);
+        if (low < 0) low = 0;
+        if (high > in) high = in;
+        if (high - low > taps) high = low + taps;
+        int start = (low + taps > in) ? in - taps : low;
+        double total = 0;
+        for (int k = 0; k < taps; k++) {
+            int x = start + k;
+            w[k] = (x >= low && x < high) ? resize_kernel(kernel, (x + 0.5 - centre) / stretch) : 0;
+            total += w[k];
+        }
+        // Fixed point weights adding up to exactly one, the rounding left over going to the largest
+        short *weights = (*axis).weights + (size_t)i * taps;
+        int sum = 0, largest = 0;
+        for (int k = 0; k < taps; k++) {
+            weights[k] = (total != 0) ? (short)lround(w[k] / total * RESIZE_ONE) : 0;
+            sum += weights[k];
+            if (weights[k] > weights[largest]) largest = k;
+        }
+        weights[largest] += RESIZE_ONE - sum;
+        (*axis).start[i] = start;
+    }
+    free(w);
+    return 0;
+}
+
+/* Frees the weights of an axis */
+void resize_axis_free(resize_axis *axis) {
+    free((*axis).start);
+    free((*axis).weights);
+    (*axis).start = NULL;
+    (*axis).weights = NULL;
+}
+
+/* Works out the size an image of width by height pixels is resized to */
+void resize_size(const resize_spec *spec, int width, int height, int *out_width, int *out_height) {
+    double w = (*spec).width, h = (*spec).height;
+    if ((*spec).fit) {
+        w = (width >= height) ? (*spec).fit : (double)(*spec).fit * width / height;
+        h = (width >= height) ? (double)(*spec).fit * height / width : (*spec).fit;
+    } else if (w == 0) {
+        w = h * width / height;
+    } else if (h == 0) {
+        h = w * height / width;
+    }
+    *out_width = (w < 1) ? 1 : (int)lround(w);
+    *out_height = (h < 1) ? 1 : (int)lround(h);
+}
+
+/* Works out the weights for resizing an image of width by height pixels of
+   channels bytes as the spec says, and sets aside what each of up to threads
+   threads resizes in, so resizing itself allocates nothing. Returns -1 if
+   there is not enough memory */
+int resizer_create(resizer *r, int width, int height, int channels, const resize_spec *spec, int threads) {
+    int out_width, out_height;
+    resize_size(spec, width, height, &out_width, &out_height);
+    (*r).channels = channels;
+    (*r).threads = (threads > 1) ? threads : 1;
+    (*r).y.start = NULL;
+    (*r).y.weights = NULL;
+    (*r).lines = NULL;
+    (*r).rows = NULL;
+    if (resize_axis_create(&(*r).x, width, out_width, (*spec).kernel) != 0) return -1;
+    if (resize_axis_create(&(*r).y, height, out_height, (*spec).kernel) != 0) {
+        resizer_free(r);
+        return -1;
+    }
+    // Zeroed, as with 3 channels the horizontal pass reads a value past the end of the line
+    (*r).lines = (unsigned short *) calloc (((size_t)width * channels + 4) * (*r).threads, sizeof(unsigned short));
+    (*r).rows = (const unsigned char **) malloc (sizeof(unsigned char *) * (*r).y.taps * (*r).threads);
+    if ((*r).lines == NULL || (*r).rows == NULL) {
+        resizer_free(r);
+        return -1;
+    }
+    return 0;
+}
+
+/* Frees the weights of a resizer and what its threads resize in */
+void resizer_free(resizer *r) {
+    resize_axis_free(&(*r).x);
+    resize_axis_free(&(*r).y);
+    free((*r).lines);
+    free((void *)(*r).rows);
+    (*r).lines = NULL;
+    (*r).rows = NULL;
+}
+
+/* Sets the size of the image in the headers to width by height, keeping the
+   direction of the rows. Anything after the pixels is not kept */
+void resize_headers(BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header, int width, int height) {
+    (*info_header).width = width;
+    (*info_header).height = ((*info_header).height < 0) ? -height : height;
+    (*info_header).image_size = (unsigned int)(bmp_stride(info_header) * height);
+    (*file_header).size = (*file_header).offset + (*info_header).image_size;
+}
+
+/* Returns the TRANSFORM_ bits of turning an image by first and then by then.
+   Moving then's transpose before first's flips swaps which way they flip */
+int transform_compose(int first, int then) {
+    int flips = first & (TRANSFORM_FLIP_X | TRANSFORM_FLIP_Y);
+    if ((then & TRANSFORM_TRANSPOSE) && flips != 0 && flips != (TRANSFORM_FLIP_X | TRANSFORM_FLIP_Y)) {
+        flips ^= TRANSFORM_FLIP_X | TRANSFORM_FLIP_Y;
+    }
+    return ((first ^ then) & TRANSFORM_TRANSPOSE) | (flips ^ (then & (TRANSFORM_FLIP_X | TRANSFORM_FLIP_Y)));
+}
+
+/* Readies the chain's rotations and flips for an image stored as the headers
+   say, and changes the headers to those of the turned image. The turn is
+   seen from the top left corner, so for rows stored from the bottom up a
+   transpose flips both ways as well. The rows are never flipped top to
+   bottom in memory: the headers store them the other way up instead, which
+   costs nothing, leaving transposing stages to mirror them at most */
+void transform_headers(filter_chain *chain, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header) {
+    int stored = (*chain).transform;
+    if ((stored & TRANSFORM_TRANSPOSE) && (*info_header).height > 0) stored ^= TRANSFORM_FLIP_X | TRANSFORM_FLIP_Y;
+    for (int k = 0; k < (*chain).count; k++) {
+        if ((*chain).stages[k].transform != 0) (*chain).stages[k].transform = stored & ~TRANSFORM_FLIP_Y;
+    }
+    if (stored & TRANSFORM_TRANSPOSE) {
+        resize_headers(file_header, info_header, abs((*info_header).height), (*info_header).width);
+    }
+    if (stored & TRANSFORM_FLIP_Y) (*info_header).height = -(*info_header).height;
+}
+
+/* One value of the vertical pass of a resize, for the ends of lines the
+   SIMD versions leave over */
+static inline int resample_value(const unsigned char *const *rows, const short *weights, int taps, int j) {
+    int acc = 64;
+    for (int k = 0; k < taps; k++) acc += weights[k] * rows[k][j];
+    acc >>= 7;
+    return (acc < 0) ? 0 : (acc > 255 << 7) ? 255 << 7 : acc;
+}
+
+/* Vertical pass of a resize, weighting n bytes of taps rows into a line of
+   values with 7 bits of fraction. Lanczos weights are negative in places,
+   so the values are clamped to the range of a byte */
+void resample_columns(const unsigned char *const *rows, const short *weights, int taps, unsigned short *out, int n) {
+    int acc[RESIZE_BLOCK];
+    for (int j = 0; j < n; j += RESIZE_BLOCK) {
+        int m = (n - j < RESIZE_BLOCK) ? n - j : RESIZE_BLOCK;
+        for (int i = 0; i < m; i++) acc[i] = 64;
+        for (int k = 0; k < taps; k++) {
+            const unsigned char *p = rows[k] + j;
+            int w = weights[k];
+            for (int i = 0; i < m; i++) acc[i] += w * p[i];
+        }
+        for (int i = 0; i < m; i++) {
+            int v = acc[i] >> 7;
+            out[j + i] = (unsigned short)((v < 0) ? 0 : (v > 255 << 7) ? 255 << 7 : v);
+        }
+    }
+}
+
+/* Horizontal pass of a resize, weighting the values of a line from the
+   vertical pass into output pixels first to last - 1 of a row */
+void resample_line(const unsigned short *in, unsigned char *out, const resize_axis *x, int first, int last, int channels) {
+    int taps = (*x).taps;
+    for (int j = first; j < last; j++) {
+        const unsigned short *p = in + (size_t)(*x).start[j] * channels;
+        const short *weights = (*x).weights + (size_t)j * taps;
+        for (int c = 0; c < channels; c++) {
+            int acc = 1 << 20;
+            for (int k = 0; k < taps; k++) acc += weights[k] * p[k * channels + c];
+            acc >>= 21;
+            out[j * channels + c] = (unsigned char)((acc < 0) ? 0 : (acc > 255) ? 255 : acc);
+        }
+    }
+}
+
+/* Mirrors a row of pixels left to right */
+void mirror_row(pixel *data, int width) {
+    for (int i = 0, j = width - 1; i < j; i++, j--) {
+        pixel p = data[i];
+        data[i] = data[j];
+        data[j] = p;
+    }
+}
+
+void mirror_quads(quad *data, int width) {
+    for (int i = 0, j = width - 1; i < j; i++, j--) {
+        quad q = data[i];
+        data[i] = data[j];
+        data[j] = q;
+    }
+}
+
+/* Transposes a block of pixels of channels bytes, rows rows of columns
+   pixels from source into columns rows of rows pixels in dest, so pixel j
+   of row i becomes pixel i of row j. A negative stride takes (or puts) the
+   rows in reverse order, which mirrors the transposed block */
+void transpose_block(const unsigned char *source, ptrdiff_t source_stride, unsigned char *dest, ptrdiff_t dest_stride,
+                     int rows, int columns, int channels) {
+    for (int j = 0; j < columns; j++) {
+        const unsigned char *in = source + (size_t)j * channels;
+        unsigned char *out = dest + j * dest_stride;
+        if (channels == 4) {
+            for (int i = 0; i < rows; i++) memcpy(out + 4 * i, in + i * source_stride, 4);
+        } else if (channels == 3) {
+            for (int i = 0; i < rows; i++) memcpy(out + 3 * i, in + i * source_stride, 3);
+        } else {
+            for (int i = 0; i < rows; i++) out[i] = in[i * source_stride];
+        }
+    }
+}
+
+/* SIMD kernels for x86. Each one handles 16 pixels at a time, splitting the
+   packed BGR bytes into one vector per channel, doing the math in 16-bit
+   fixed point and packing the result back. Remaining pixels at the end of a
+   row go through the scalar filter. simd_init picks the best kernels the CPU
+   supports at runtime, otherwise the scalar filters are used */
+#ifdef HAVE_X86_SIMD
+
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// Shuffle masks taking channel c (BGR order) out of vector v of 3 packed vectors
+static const signed char split_mask[3][3][16] = {
+    {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+    {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+    {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}}
+};
+
+// Shuffle masks putting channel c back into packed vector v
+static const signed char merge_mask[3][3][16] = {
+    {{0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5},
+     {-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1},
+     {-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1}},
+    {{-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1},
+     {5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10},
+     {-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1}},
+    {{-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1},
+     {-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1},
+     {10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15}}
+};
+
+/* Splits 16 packed BGR pixels into one vector per channel */
+TARGET_SSE41 static inline void split_bgr(const unsigned char *p, __m128i ch[3]) {
+    __m128i v[3];
+    for (int k = 0; k < 3; k++) v[k] = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+    for (int c = 0; c < 3; c++) {
+        ch[c] = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(v[0], _mm_loadu_si128((const __m128i *)split_mask[c][0])),
+            _mm_shuffle_epi8(v[1], _mm_loadu_si128((const __m128i *)split_mask[c][1]))),
+            _mm_shuffle_epi8(v[2], _mm_loadu_si128((const __m128i *)split_mask[c][2])));
+    }
+}
+
+/* Packs one vector per channel back into 16 BGR pixels */
+TARGET_SSE41 static inline void merge_bgr(unsigned char *p, const __m128i ch[3]) {
+    for (int k = 0; k < 3; k++) {
+        __m128i v = _mm_or_si128(_mm_or_si128(
+            _mm_shuffle_epi8(ch[0], _mm_loadu_si128((const __m128i *)merge_mask[0][k])),
+            _mm_shuffle_epi8(ch[1], _mm_loadu_si128((const __m128i *)merge_mask[1][k]))),
+            _mm_shuffle_epi8(ch[2], _mm_loadu_si128((const __m128i *)merge_mask[2][k])));
+        _mm_storeu_si128((__m128i *)(p + 16 * k), v);
+    }
+}
+
+/* Weighted sum of 8 RGB values in 16-bit lanes, each product is v * w / 256 */
+TARGET_SSE41 static inline __m128i weigh_sse41(__m128i r, __m128i g, __m128i b, int wr, int wg, int wb) {
+    __m128i sum = _mm_mulhi_epu16(_mm_slli_epi16(r, 8), _mm_set1_epi16((short)wr));
+    sum = _mm_add_epi16(sum, _mm_mulhi_epu16(_mm_slli_epi16(g, 8), _mm_set1_epi16((short)wg)));
+    return _mm_add_epi16(sum, _mm_mulhi_epu16(_mm_slli_epi16(b, 8), _mm_set1_epi16((short)wb)));
+}
+
+TARGET_SSE41 static void greyscale_sse41(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(128);
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3], grey[2];
+        split_bgr(p, ch);
+        grey[0] = weigh_sse41(_mm_cvtepu8_epi16(ch[2]), _mm_cvtepu8_epi16(ch[1]), _mm_cvtepu8_epi16(ch[0]), GREY_WR, GREY_WG, GREY_WB);
+        grey[1] = weigh_sse41(_mm_unpackhi_epi8(ch[2], zero), _mm_unpackhi_epi8(ch[1], zero), _mm_unpackhi_epi8(ch[0], zero), GREY_WR, GREY_WG, GREY_WB);
+        grey[0] = _mm_srli_epi16(_mm_add_epi16(grey[0], half), 8);
+        grey[1] = _mm_srli_epi16(_mm_add_epi16(grey[1], half), 8);
+        ch[0] = ch[1] = ch[2] = _mm_packus_epi16(grey[0], grey[1]);
+        merge_bgr(p, ch);
+    }
+    greyscale_fixed_row((pixel *)p, width - j);
+}
+
+TARGET_SSE41 static void sepia_sse41(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m128i zero = _mm_setzero_si128(), half = _mm_set1_epi16(64);
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3], lo[3], hi[3], out[3];
+        split_bgr(p, ch);
+        for (int c = 0; c < 3; c++) {
+            lo[c] = _mm_cvtepu8_epi16(ch[c]);
+            hi[c] = _mm_unpackhi_epi8(ch[c], zero);
+        }
+        for (int c = 0; c < 3; c++) {
+            const unsigned short *w = sepia_w[2 - c];
+            __m128i l = weigh_sse41(lo[2], lo[1], lo[0], w[0], w[1], w[2]);
+            __m128i h = weigh_sse41(hi[2], hi[1], hi[0], w[0], w[1], w[2]);
+            l = _mm_srli_epi16(_mm_add_epi16(l, half), 7);
+            h = _mm_srli_epi16(_mm_add_epi16(h, half), 7);
+            out[c] = _mm_packus_epi16(l, h);        // saturates at 255
+        }
+        merge_bgr(p, out);
+    }
+    sepia_fixed_row((pixel *)p, width - j);
+}
+
+TARGET_SSE41 static void threshold_sse41(int cutoff, pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m128i zero = _mm_setzero_si128(), white = _mm_set1_epi16(255), limit = _mm_set1_epi16((short)cutoff);
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3];
+        split_bgr(p, ch);
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_cvtepu8_epi16(ch[0]), _mm_cvtepu8_epi16(ch[1])), _mm_cvtepu8_epi16(ch[2]));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(ch[0], zero), _mm_unpackhi_epi8(ch[1], zero)), _mm_unpackhi_epi8(ch[2], zero));
+        lo = _mm_andnot_si128(_mm_cmplt_epi16(lo, limit), white);
+        hi = _mm_andnot_si128(_mm_cmplt_epi16(hi, limit), white);
+        ch[0] = ch[1] = ch[2] = _mm_packus_epi16(lo, hi);
+        merge_bgr(p, ch);
+    }
+    threshold_row(cutoff, (pixel *)p, width - j);
+}
+
+/* Contrast and inverse treat every channel the same, so they work on the raw bytes */
+TARGET_SSE41 static inline __m128i contrast4_sse41(__m128i d, __m128i coeff) {
+    d = _mm_mullo_epi32(d, coeff);
+    d = _mm_add_epi32(d, _mm_set1_epi32((128 << 16) + (1 << 15)));
+    return _mm_srai_epi32(d, 16);
+}
+
+TARGET_SSE41 static void contrast_sse41(double coeff, pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m128i cq = _mm_set1_epi32((int)(coeff * 65536 + 0.5)), bias = _mm_set1_epi16(128);
+    int n = (width / 16) * 48;     // whole blocks of 16 pixels
+    for (int j = 0; j < n; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + j));
+        __m128i lo = _mm_sub_epi16(_mm_cvtepu8_epi16(v), bias);
+        __m128i hi = _mm_sub_epi16(_mm_cvtepu8_epi16(_mm_srli_si128(v, 8)), bias);
+        lo = _mm_packs_epi32(contrast4_sse41(_mm_cvtepi16_epi32(lo), cq), contrast4_sse41(_mm_cvtepi16_epi32(_mm_srli_si128(lo, 8)), cq));
+        hi = _mm_packs_epi32(contrast4_sse41(_mm_cvtepi16_epi32(hi), cq), contrast4_sse41(_mm_cvtepi16_epi32(_mm_srli_si128(hi, 8)), cq));
+        _mm_storeu_si128((__m128i *)(p + j), _mm_packus_epi16(lo, hi));
+    }
+    contrast_row(coeff, (pixel *)(p + n), width % 16);
+}
+
+TARGET_SSE41 static void inverse_sse41(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m128i ones = _mm_set1_epi8(-1);
+    int n = (width / 16) * 48;
+    for (int j = 0; j < n; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + j));
+        _mm_storeu_si128((__m128i *)(p + j), _mm_xor_si128(v, ones));
+    }
+    inverse_row((pixel *)(p + n), width % 16);
+}
+
+/* The AVX2 kernels split the pixels the same way, then do the math on all 16
+   pixels at once in 256-bit registers */
+TARGET_AVX2 static inline __m256i weigh_avx2(__m256i r, __m256i g, __m256i b, int wr, int wg, int wb) {
+    __m256i sum = _mm256_mulhi_epu16(_mm256_slli_epi16(r, 8), _mm256_set1_epi16((short)wr));
+    sum = _mm256_add_epi16(sum, _mm256_mulhi_epu16(_mm256_slli_epi16(g, 8), _mm256_set1_epi16((short)wg)));
+    return _mm256_add_epi16(sum, _mm256_mulhi_epu16(_mm256_slli_epi16(b, 8), _mm256_set1_epi16((short)wb)));
+}
+
+/* Packs 16 unsigned 16-bit lanes into 16 bytes with saturation */
+TARGET_AVX2 static inline __m128i narrow_avx2(__m256i v) {
+    return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+TARGET_AVX2 static void greyscale_avx2(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m256i half = _mm256_set1_epi16(128);
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3];
+        split_bgr(p, ch);
+        __m256i grey = weigh_avx2(_mm256_cvtepu8_epi16(ch[2]), _mm256_cvtepu8_epi16(ch[1]), _mm256_cvtepu8_epi16(ch[0]), GREY_WR, GREY_WG, GREY_WB);
+        ch[0] = ch[1] = ch[2] = narrow_avx2(_mm256_srli_epi16(_mm256_add_epi16(grey, half), 8));
+        merge_bgr(p, ch);
+    }
+    greyscale_fixed_row((pixel *)p, width - j);
+}
+
+TARGET_AVX2 static void sepia_avx2(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m256i half = _mm256_set1_epi16(64);
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3], out[3];
+        __m256i wide[3];
+        split_bgr(p, ch);
+        for (int c = 0; c < 3; c++) wide[c] = _mm256_cvtepu8_epi16(ch[c]);
+        for (int c = 0; c < 3; c++) {
+            const unsigned short *w = sepia_w[2 - c];
+            __m256i v = weigh_avx2(wide[2], wide[1], wide[0], w[0], w[1], w[2]);
+            out[c] = narrow_avx2(_mm256_srli_epi16(_mm256_add_epi16(v, half), 7));
+        }
+        merge_bgr(p, out);
+    }
+    sepia_fixed_row((pixel *)p, width - j);
+}
+
+TARGET_AVX2 static void threshold_avx2(int cutoff, pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m256i white = _mm256_set1_epi16(255), limit = _mm256_set1_epi16((short)cutoff);
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3];
+        split_bgr(p, ch);
+        __m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_cvtepu8_epi16(ch[0]), _mm256_cvtepu8_epi16(ch[1])), _mm256_cvtepu8_epi16(ch[2]));
+        sum = _mm256_andnot_si256(_mm256_cmpgt_epi16(limit, sum), white);
+        ch[0] = ch[1] = ch[2] = narrow_avx2(sum);
+        merge_bgr(p, ch);
+    }
+    threshold_row(cutoff, (pixel *)p, width - j);
+}
+
+TARGET_AVX2 static inline __m256i contrast8_avx2(__m128i v, __m256i coeff) {
+    __m256i d = _mm256_sub_epi32(_mm256_cvtepu8_epi32(v), _mm256_set1_epi32(128));
+    d = _mm256_add_epi32(_mm256_mullo_epi32(d, coeff), _mm256_set1_epi32((128 << 16) + (1 << 15)));
+    return _mm256_srai_epi32(d, 16);
+}
+
+TARGET_AVX2 static void contrast_avx2(double coeff, pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m256i cq = _mm256_set1_epi32((int)(coeff * 65536 + 0.5));
+    int n = (width / 16) * 48;
+    for (int j = 0; j < n; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + j));
+        __m256i lo = contrast8_avx2(v, cq), hi = contrast8_avx2(_mm_srli_si128(v, 8), cq);
+        // packs works within 128-bit lanes, so the 32-bit results are reordered first
+        __m256i w = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xd8);
+        _mm_storeu_si128((__m128i *)(p + j), narrow_avx2(w));
+    }
+    contrast_row(coeff, (pixel *)(p + n), width % 16);
+}
+
+TARGET_AVX2 static void inverse_avx2(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    const __m256i ones = _mm256_set1_epi8(-1);
+    int n = (width / 32) * 96;
+    for (int j = 0; j < n; j += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + j));
+        _mm256_storeu_si256((__m256i *)(p + j), _mm256_xor_si256(v, ones));
+    }
+    inverse_row((pixel *)(p + n), width % 32);
+}
+
+/* The fixed point HSL engine compiled for SSE4.1 and AVX2, which the
+   compiler vectorizes 4 or 8 pixels at a time */
+TARGET_SSE41 static void hsl_sse41(const hsl_shift *shift, pixel *data, int width) {
+    hsl_fixed_rows(shift, data, width);
+}
+
+TARGET_AVX2 static void hsl_avx2(const hsl_shift *shift, pixel *data, int width) {
+    hsl_fixed_rows(shift, data, width);
+}
+
+TARGET_SSE41 static void hsl_planes_sse41(const hsl_shift *shift, unsigned char *plane[3], int width) {
+    hsl_fixed_plane_rows(shift, plane, width);
+}
+
+TARGET_AVX2 static void hsl_planes_avx2(const hsl_shift *shift, unsigned char *plane[3], int width) {
+    hsl_fixed_plane_rows(shift, plane, width);
+}
+
+/* The BGRA kernels built for a target, named with its suffix */
+#define QUAD_KERNELS(target, suffix) \
+    target static void greyscale_quads_##suffix(quad *data, int width) { greyscale_quad_rows(data, width); } \
+    target static void sepia_quads_##suffix(quad *data, int width) { sepia_quad_rows(data, width); } \
+    target static void threshold_quads_##suffix(int cutoff, quad *data, int width) { threshold_quad_rows(cutoff, data, width); } \
+    target static void contrast_quads_##suffix(double coeff, quad *data, int width) { contrast_quad_rows(coeff, data, width); } \
+    target static void inverse_quads_##suffix(quad *data, int width) { inverse_quad_rows(data, width); } \
+    target static void hsl_quads_##suffix(const hsl_shift *shift, quad *data, int width) { hsl_fixed_quad_rows(shift, data, width); }
+
+QUAD_KERNELS(TARGET_SSE41, sse41)
+QUAD_KERNELS(TARGET_AVX2, avx2)
+
+/* The cube engine built for SSE4.1, which the compiler vectorizes 4 pixels
+   at a time. Without gathers the corners are fetched one by one */
+TARGET_SSE41 static void cube_sse41(const color_cube *cube, pixel *data, int width) {
+    cube_rows(cube, data, width);
+}
+
+TARGET_SSE41 static void cube_planes_sse41(const color_cube *cube, unsigned char *plane[3], int width) {
+    cube_plane_rows(cube, plane, width);
+}
+
+TARGET_SSE41 static void cube_quads_sse41(const color_cube *cube, quad *data, int width) {
+    cube_quad_rows(cube, data, width);
+}
+
+/* The Gaussian passes on 8 values at a time with SSE4.1, or 16 with AVX2.
+   Each weight is applied to the values on both sides of the centre with one
+   16-bit multiply-add, the values interleaved with each other. The box blur
+   column sums are left to the compiler to vectorize */
+TARGET_SSE41 static void convolve_line_sse41(const unsigned char *in, unsigned short *out, int n, int step,
+                                             const short *weights, int radius) {
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(64);
+    const unsigned char *centre = in + radius * step;
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m128i c = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(centre + j)));
+        __m128i w = _mm_set1_epi32(weights[radius]);
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(c, zero), w), hi = _mm_madd_epi16(_mm_unpackhi_epi16(c, zero), w);
+        for (int k = 1; k <= radius; k++) {
+            __m128i left = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(centre + j - k * step)));
+            __m128i right = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(centre + j + k * step)));
+            w = _mm_set1_epi16(weights[radius + k]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(left, right), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(left, right), w));
+        }
+        lo = _mm_srli_epi32(_mm_add_epi32(lo, round), 7);
+        hi = _mm_srli_epi32(_mm_add_epi32(hi, round), 7);
+        _mm_storeu_si128((__m128i *)(out + j), _mm_packus_epi32(lo, hi));
+    }
+    convolve_line(in + j, out + j, n - j, step, weights, radius);
+}
+
+/* Finishes 4 values of the vertical pass from their sums, blurred or sharpened */
+TARGET_SSE41 static inline __m128i column_finish_sse41(__m128i acc, __m128i x, int amount, int threshold, int sharpen) {
+    if (!sharpen) return _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << 20)), 21);
+    __m128i blurred = _mm_srai_epi32(_mm_add_epi32(acc, _mm_set1_epi32(1 << 12)), 13);
+    __m128i diff = _mm_sub_epi32(_mm_slli_epi32(x, 8), blurred);
+    __m128i v = _mm_add_epi32(x, _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(diff, _mm_set1_epi32(amount)),
+                                                              _mm_set1_epi32(1 << 15)), 16));
+    __m128i keep = _mm_cmpgt_epi32(_mm_set1_epi32(threshold + 1), _mm_abs_epi32(diff));
+    return _mm_blendv_epi8(v, x, keep);
+}
+
+TARGET_SSE41 static void convolve_columns_sse41(const unsigned short *const *rows, const short *weights, int radius,
+                                                const unsigned char *original, int amount, int threshold,
+                                                unsigned char *out, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(rows[radius] + j));
+        __m128i w = _mm_set1_epi32(weights[radius]);
+        __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(c, zero), w), hi = _mm_madd_epi16(_mm_unpackhi_epi16(c, zero), w);
+        for (int k = 1; k <= radius; k++) {
+            __m128i up = _mm_loadu_si128((const __m128i *)(rows[radius - k] + j));
+            __m128i down = _mm_loadu_si128((const __m128i *)(rows[radius + k] + j));
+            w = _mm_set1_epi16(weights[radius + k]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(up, down), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(up, down), w));
+        }
+        __m128i x = zero;
+        if (original != NULL) x = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(original + j)));
+        lo = column_finish_sse41(lo, _mm_unpacklo_epi16(x, zero), amount, threshold, original != NULL);
+        hi = column_finish_sse41(hi, _mm_unpackhi_epi16(x, zero), amount, threshold, original != NULL);
+        __m128i v = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(out + j), _mm_packus_epi16(v, v));
+    }
+    const unsigned short *rest[2 * MAX_RADIUS + 1];
+    for (int k = 0; k <= 2 * radius; k++) rest[k] = rows[k] + j;
+    convolve_columns(rest, weights, radius, (original != NULL) ? original + j : NULL, amount, threshold, out + j, n - j);
+}
+
+/* The AVX2 versions interleave within each 128-bit half, so the low sums
+   hold values 0-3 and 8-11 and the high ones 4-7 and 12-15, which packing
+   puts back in order */
+TARGET_AVX2 static void convolve_line_avx2(const unsigned char *in, unsigned short *out, int n, int step,
+                                           const short *weights, int radius) {
+    const __m256i zero = _mm256_setzero_si256(), round = _mm256_set1_epi32(64);
+    const unsigned char *centre = in + radius * step;
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m256i c = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(centre + j)));
+        __m256i w = _mm256_set1_epi32(weights[radius]);
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(c, zero), w);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(c, zero), w);
+        for (int k = 1; k <= radius; k++) {
+            __m256i left = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(centre + j - k * step)));
+            __m256i right = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(centre + j + k * step)));
+            w = _mm256_set1_epi16(weights[radius + k]);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(left, right), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(left, right), w));
+        }
+        lo = _mm256_srli_epi32(_mm256_add_epi32(lo, round), 7);
+        hi = _mm256_srli_epi32(_mm256_add_epi32(hi, round), 7);
+        _mm256_storeu_si256((__m256i *)(out + j), _mm256_packus_epi32(lo, hi));
+    }
+    convolve_line(in + j, out + j, n - j, step, weights, radius);
+}
+
+TARGET_AVX2 static inline __m256i column_finish_avx2(__m256i acc, __m256i x, int amount, int threshold, int sharpen) {
+    if (!sharpen) return _mm256_srai_epi32(_mm256_add_epi32(acc, _mm256_set1_epi32(1 << 20)), 21);
+    __m256i blurred = _mm256_srai_epi32(_mm256_add_epi32(acc, _mm256_set1_epi32(1 << 12)), 13);
+    __m256i diff = _mm256_sub_epi32(_mm256_slli_epi32(x, 8), blurred);
+    __m256i v = _mm256_add_epi32(x, _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(diff, _mm256_set1_epi32(amount)),
+                                                                       _mm256_set1_epi32(1 << 15)), 16));
+    __m256i keep = _mm256_cmpgt_epi32(_mm256_set1_epi32(threshold + 1), _mm256_abs_epi32(diff));
+    return _mm256_blendv_epi8(v, x, keep);
+}
+
+TARGET_AVX2 static void convolve_columns_avx2(const unsigned short *const *rows, const short *weights, int radius,
+                                              const unsigned char *original, int amount, int threshold,
+                                              unsigned char *out, int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(rows[radius] + j));
+        __m256i w = _mm256_set1_epi32(weights[radius]);
+        __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(c, zero), w);
+        __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(c, zero), w);
+        for (int k = 1; k <= radius; k++) {
+            __m256i up = _mm256_loadu_si256((const __m256i *)(rows[radius - k] + j));
+            __m256i down = _mm256_loadu_si256((const __m256i *)(rows[radius + k] + j));
+            w = _mm256_set1_epi16(weights[radius + k]);
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(up, down), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(up, down), w));
+        }
+        __m256i x = zero;
+        if (original != NULL) x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(original + j)));
+        lo = column_finish_avx2(lo, _mm256_unpacklo_epi16(x, zero), amount, threshold, original != NULL);
+        hi = column_finish_avx2(hi, _mm256_unpackhi_epi16(x, zero), amount, threshold, original != NULL);
+        __m256i v = _mm256_packs_epi32(lo, hi);
+        v = _mm256_permute4x64_epi64(_mm256_packus_epi16(v, v), 0x08);
+        _mm_storeu_si128((__m128i *)(out + j), _mm256_castsi256_si128(v));
+    }
+    const unsigned short *rest[2 * MAX_RADIUS + 1];
+    for (int k = 0; k <= 2 * radius; k++) rest[k] = rows[k] + j;
+    convolve_columns(rest, weights, radius, (original != NULL) ? original + j : NULL, amount, threshold, out + j, n - j);
+}
+
+TARGET_SSE41 static void box_columns_sse41(int *sums, const unsigned short *add, const unsigned short *drop, float scale,
+                                           unsigned char *out, int n) {
+    box_column_rows(sums, add, drop, scale, out, n);
+}
+
+TARGET_AVX2 static void box_columns_avx2(int *sums, const unsigned short *add, const unsigned short *drop, float scale,
+                                         unsigned char *out, int n) {
+    box_column_rows(sums, add, drop, scale, out, n);
+}
+
+/* The vertical pass of a resize on 8 values at a time with SSE4.1, or 16
+   with AVX2, taking the rows in pairs so each pair of weights is one 16-bit
+   multiply-add */
+TARGET_SSE41 static void resample_columns_sse41(const unsigned char *const *rows, const short *weights, int taps,
+                                                unsigned short *out, int n) {
+    const __m128i round = _mm_set1_epi32(64), zero = _mm_setzero_si128(), top = _mm_set1_epi16(255 << 7);
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m128i lo = round, hi = round;
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(rows[k] + j)));
+            __m128i b = (k + 1 < taps) ? _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *)(rows[k + 1] + j))) : zero;
+            __m128i w = _mm_unpacklo_epi16(_mm_set1_epi16(weights[k]), _mm_set1_epi16((k + 1 < taps) ? weights[k + 1] : 0));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        __m128i v = _mm_packus_epi32(_mm_srai_epi32(lo, 7), _mm_srai_epi32(hi, 7));
+        _mm_storeu_si128((__m128i *)(out + j), _mm_min_epu16(v, top));
+    }
+    for (; j < n; j++) out[j] = (unsigned short)resample_value(rows, weights, taps, j);
+}
+
+TARGET_AVX2 static void resample_columns_avx2(const unsigned char *const *rows, const short *weights, int taps,
+                                              unsigned short *out, int n) {
+    const __m256i round = _mm256_set1_epi32(64), zero = _mm256_setzero_si256(), top = _mm256_set1_epi16(255 << 7);
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m256i lo = round, hi = round;
+        for (int k = 0; k < taps; k += 2) {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k] + j)));
+            __m256i b = (k + 1 < taps) ? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[k + 1] + j))) : zero;
+            __m256i w = _mm256_unpacklo_epi16(_mm256_set1_epi16(weights[k]), _mm256_set1_epi16((k + 1 < taps) ? weights[k + 1] : 0));
+            lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+            hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+        }
+        // Both the interleaving and the packing work within 128-bit halves, so the values end up in order
+        __m256i v = _mm256_packus_epi32(_mm256_srai_epi32(lo, 7), _mm256_srai_epi32(hi, 7));
+        _mm256_storeu_si256((__m256i *)(out + j), _mm256_min_epu16(v, top));
+    }
+    for (; j < n; j++) out[j] = (unsigned short)resample_value(rows, weights, taps, j);
+}
+
+/* The horizontal pass of a resize with SSE4.1, one output pixel at a time
+   with a channel to each 32-bit lane, and pairs of input pixels interleaved
+   for the multiply-adds. Every pixel is loaded as 4 values, so with 3
+   channels the line needs a value after its end. The output pixels are too
+   few when downscaling for more lanes to pay, so AVX2 uses the same code */
+TARGET_SSE41 static inline RESIZE_INLINE void resample_pixels(const unsigned short *in, unsigned char *out, const resize_axis *x,
+                                                              int first, int last, int channels) {
+    const __m128i round = _mm_set1_epi32(1 << 20), zero = _mm_setzero_si128();
+    int taps = (*x).taps;
+    for (int j = first; j < last; j++) {
+        const unsigned short *p = in + (size_t)(*x).start[j] * channels;
+        const short *weights = (*x).weights + (size_t)j * taps;
+        __m128i acc = round;
+        for (int k = 0; k < taps; k += 2) {
+            __m128i a = _mm_loadl_epi64((const __m128i *)(p + k * channels));
+            __m128i b = (k + 1 < taps) ? _mm_loadl_epi64((const __m128i *)(p + (k + 1) * channels)) : zero;
+            __m128i w = _mm_unpacklo_epi16(_mm_set1_epi16(weights[k]), _mm_set1_epi16((k + 1 < taps) ? weights[k + 1] : 0));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+        }
+        __m128i v = _mm_packs_epi32(_mm_srai_epi32(acc, 21), zero);
+        int bytes = _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+        memcpy(out + (size_t)j * channels, &bytes, channels);
+    }
+}
+
+TARGET_SSE41 static void resample_line_sse41(const unsigned short *in, unsigned char *out, const resize_axis *x, int first,
+                                             int last, int channels) {
+    resample_pixels(in, out, x, first, last, channels);
+}
+
+TARGET_AVX2 static void resample_line_avx2(const unsigned short *in, unsigned char *out, const resize_axis *x, int first,
+                                           int last, int channels) {
+    resample_pixels(in, out, x, first, last, channels);
+}
+
+/* The cube engine on 8 pixels at a time, one to each 32-bit lane. The grid
+   positions are worked out with float math rather than the table, and the
+   four corners are fetched with gathers */
+TARGET_AVX2 static inline void cube8_avx2(const color_cube *cube, __m256i v[3]) {
+    const __m256i one = _mm256_set1_epi32(1), low = _mm256_set1_epi32(255), channel = _mm256_set1_epi32(1023);
+    const __m256 top = _mm256_set1_ps(256.0f * ((*cube).size - 1));
+    const int *nodes = (const int *)(*cube).nodes;
+    __m256i f[3], base = _mm256_setzero_si256();
+    __m256i step[3] = {_mm256_set1_epi32((*cube).size * (*cube).size), _mm256_set1_epi32((*cube).size), one};
+    for (int c = 0; c < 3; c++) {
+        __m256 pos = _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v[c]), _mm256_set1_ps((*cube).scale[c])),
+                                   _mm256_set1_ps((*cube).bias[c]));
+        __m256i fixed = _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(pos, _mm256_setzero_ps()), top));
+        f[c] = _mm256_and_si256(fixed, low);
+        base = _mm256_add_epi32(base, _mm256_mullo_epi32(_mm256_srli_epi32(fixed, 8), step[c]));
+    }
+    __m256i max = _mm256_max_epi32(_mm256_max_epi32(f[0], f[1]), f[2]);
+    __m256i min = _mm256_min_epi32(_mm256_min_epi32(f[0], f[1]), f[2]);
+    __m256i mid = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(f[0], f[1]), f[2]), _mm256_add_epi32(max, min));
+
+    // The same choice of tetrahedron as cube_block, as lane masks
+    __m256i green_over_blue = _mm256_cmpgt_epi32(f[1], f[0]), red_over_blue = _mm256_cmpgt_epi32(f[2], f[0]);
+    __m256i blue_first = _mm256_andnot_si256(_mm256_or_si256(green_over_blue, red_over_blue), _mm256_set1_epi32(-1));
+    __m256i green_first = _mm256_andnot_si256(_mm256_or_si256(blue_first, _mm256_cmpgt_epi32(f[2], f[1])), _mm256_set1_epi32(-1));
+    __m256i first = _mm256_blendv_epi8(_mm256_blendv_epi8(step[2], step[1], green_first), step[0], blue_first);
+    __m256i blue_last = _mm256_and_si256(green_over_blue, red_over_blue);
+    __m256i green_last = _mm256_andnot_si256(_mm256_or_si256(blue_last, _mm256_cmpgt_epi32(f[1], f[2])), _mm256_set1_epi32(-1));
+    __m256i last = _mm256_blendv_epi8(_mm256_blendv_epi8(step[2], step[1], green_last), step[0], blue_last);
+    __m256i far = _mm256_add_epi32(_mm256_add_epi32(step[0], step[1]), step[2]);
+
+    __m256i corner[4] = {
+        _mm256_i32gather_epi32(nodes, base, 4),
+        _mm256_i32gather_epi32(nodes, _mm256_add_epi32(base, first), 4),
+        _mm256_i32gather_epi32(nodes, _mm256_add_epi32(base, _mm256_sub_epi32(far, last)), 4),
+        _mm256_i32gather_epi32(nodes, _mm256_add_epi32(base, far), 4)
+    };
+    // Corners are weighted in pairs with 16-bit multiply-adds, each lane
+    // holding a channel of one corner in its low half and of the other in its high half
+    __m256i pair_weight[2] = {
+        _mm256_or_si256(_mm256_sub_epi32(_mm256_set1_epi32(256), max), _mm256_slli_epi32(_mm256_sub_epi32(max, mid), 16)),
+        _mm256_or_si256(_mm256_sub_epi32(mid, min), _mm256_slli_epi32(min, 16))
+    };
+    const __m256i high = _mm256_slli_epi32(channel, 16);
+    for (int c = 0; c < 3; c++) {
+        __m256i sum = _mm256_set1_epi32(512);
+        for (int k = 0; k < 2; k++) {
+            __m256i near = _mm256_and_si256(_mm256_srli_epi32(corner[2 * k], 10 * c), channel);
+            __m256i far = _mm256_and_si256((c < 2) ? _mm256_slli_epi32(corner[2 * k + 1], 16 - 10 * c) :
+                                           _mm256_srli_epi32(corner[2 * k + 1], 4), high);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_or_si256(near, far), pair_weight[k]));
+        }
+        v[c] = _mm256_srli_epi32(sum, 10);
+    }
+}
+
+/* Packs 8 32-bit lanes of 0 to 255 into the low 8 bytes */
+TARGET_AVX2 static inline __m128i cube_narrow_avx2(__m256i v) {
+    __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    return _mm_packus_epi16(words, words);
+}
+
+TARGET_AVX2 static void cube_avx2(const color_cube *cube, pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    int j = 0;
+    for (; j + 16 <= width; j += 16, p += 48) {
+        __m128i ch[3];
+        __m256i v[2][3];
+        split_bgr(p, ch);
+        for (int c = 0; c < 3; c++) {
+            v[0][c] = _mm256_cvtepu8_epi32(ch[c]);
+            v[1][c] = _mm256_cvtepu8_epi32(_mm_srli_si128(ch[c], 8));
+        }
+        cube8_avx2(cube, v[0]);
+        cube8_avx2(cube, v[1]);
+        for (int c = 0; c < 3; c++) ch[c] = _mm_unpacklo_epi64(cube_narrow_avx2(v[0][c]), cube_narrow_avx2(v[1][c]));
+        merge_bgr(p, ch);
+    }
+    cube_row(cube, (pixel *)p, width - j);
+}
+
+TARGET_AVX2 static void cube_planes_avx2(const color_cube *cube, unsigned char *plane[3], int width) {
+    int j = 0;
+    for (; j + 8 <= width; j += 8) {
+        __m256i v[3];
+        for (int c = 0; c < 3; c++) v[c] = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(plane[c] + j)));
+        cube8_avx2(cube, v);
+        for (int c = 0; c < 3; c++) _mm_storel_epi64((__m128i *)(plane[c] + j), cube_narrow_avx2(v[c]));
+    }
+    unsigned char *rest[3] = {plane[0] + j, plane[1] + j, plane[2] + j};
+    cube_planes(cube, rest, width - j);
+}
+
+TARGET_AVX2 static void cube_quads_avx2(const color_cube *cube, quad *data, int width) {
+    const __m256i low = _mm256_set1_epi32(255), alpha = _mm256_set1_epi32((int)QUAD_ALPHA);
+    int j = 0;
+    for (; j + 8 <= width; j += 8) {
+        __m256i q = _mm256_loadu_si256((const __m256i *)(data + j));
+        __m256i v[3] = {_mm256_and_si256(q, low), _mm256_and_si256(_mm256_srli_epi32(q, 8), low),
+                        _mm256_and_si256(_mm256_srli_epi32(q, 16), low)};
+        cube8_avx2(cube, v);
+        q = _mm256_or_si256(_mm256_and_si256(q, alpha), _mm256_or_si256(v[0], _mm256_or_si256(_mm256_slli_epi32(v[1], 8),
+                                                                                                _mm256_slli_epi32(v[2], 16))));
+        _mm256_storeu_si256((__m256i *)(data + j), q);
+    }
+    cube_quads(cube, data + j, width - j);
+}
+
+// Shuffle masks mirroring 16 packed BGR pixels: vector k of the result takes
+// the bytes of vector mirror_from[m] of the pixels through mirror_mask[m]
+static const int mirror_to[7] = {0, 0, 1, 1, 1, 2, 2}, mirror_from[7] = {1, 2, 0, 1, 2, 0, 1};
+static const signed char mirror_mask[7][16] = {
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 14},
+    {13, 14, 15, 10, 11, 12, 7, 8, 9, 4, 5, 6, 1, 2, 3, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 15, -1},
+    {15, -1, 11, 12, 13, 8, 9, 10, 5, 6, 7, 2, 3, 4, -1, 0},
+    {-1, 0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, 12, 13, 14, 9, 10, 11, 6, 7, 8, 3, 4, 5, 0, 1, 2},
+    {1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}
+};
+
+// Shuffle masks widening 4 BGR pixels to 32-bit lanes and narrowing them back
+static const signed char widen_mask[16] = {0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1};
+static const signed char narrow_mask[16] = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1};
+
+/* Mirrors the 16 BGR pixels at p into 3 vectors */
+TARGET_SSE41 static inline void mirror16_sse41(const unsigned char *p, __m128i out[3]) {
+    __m128i v[3];
+    for (int k = 0; k < 3; k++) {
+        v[k] = _mm_loadu_si128((const __m128i *)(p + 16 * k));
+        out[k] = _mm_setzero_si128();
+    }
+    for (int m = 0; m < 7; m++) {
+        out[mirror_to[m]] = _mm_or_si128(out[mirror_to[m]], _mm_shuffle_epi8(v[mirror_from[m]],
+                                                                             _mm_loadu_si128((const __m128i *)mirror_mask[m])));
+    }
+}
+
+/* Mirrors 16 pixels from each end of the row at a time, swapping them over,
+   until the ends meet */
+TARGET_SSE41 static void mirror_sse41(pixel *data, int width) {
+    unsigned char *p = (unsigned char *)data;
+    int i = 0, j = width - 16;
+    for (; i + 16 <= j; i += 16, j -= 16) {
+        __m128i left[3], right[3];
+        mirror16_sse41(p + 3 * i, left);
+        mirror16_sse41(p + 3 * j, right);
+        for (int k = 0; k < 3; k++) {
+            _mm_storeu_si128((__m128i *)(p + 3 * i + 16 * k), right[k]);
+            _mm_storeu_si128((__m128i *)(p + 3 * j + 16 * k), left[k]);
+        }
+    }
+    mirror_row(data + i, j + 16 - i);
+}
+
+TARGET_SSE41 static void mirror_quads_sse41(quad *data, int width) {
+    int i = 0, j = width - 4;
+    for (; i + 4 <= j; i += 4, j -= 4) {
+        __m128i left = _mm_loadu_si128((const __m128i *)(data + i)), right = _mm_loadu_si128((const __m128i *)(data + j));
+        _mm_storeu_si128((__m128i *)(data + i), _mm_shuffle_epi32(right, 0x1b));
+        _mm_storeu_si128((__m128i *)(data + j), _mm_shuffle_epi32(left, 0x1b));
+    }
+    mirror_quads(data + i, j + 4 - i);
+}
+
+TARGET_AVX2 static void mirror_quads_avx2(quad *data, int width) {
+    const __m256i reverse = _mm256_set_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    int i = 0, j = width - 8;
+    for (; i + 8 <= j; i += 8, j -= 8) {
+        __m256i left = _mm256_loadu_si256((const __m256i *)(data + i)), right = _mm256_loadu_si256((const __m256i *)(data + j));
+        _mm256_storeu_si256((__m256i *)(data + i), _mm256_permutevar8x32_epi32(right, reverse));
+        _mm256_storeu_si256((__m256i *)(data + j), _mm256_permutevar8x32_epi32(left, reverse));
+    }
+    mirror_quads_sse41(data + i, j + 8 - i);
+}
+
+/* Loads 4 BGR pixels without reading past them */
+TARGET_SSE41 static inline __m128i load12_sse41(const unsigned char *p) {
+    int last;
+    memcpy(&last, p + 8, 4);
+    return _mm_insert_epi32(_mm_loadl_epi64((const __m128i *)p), last, 2);
+}
+
+/* Stores the 4 BGR pixels in the low 12 bytes of v */
+TARGET_SSE41 static inline void store12_sse41(unsigned char *p, __m128i v) {
+    int last = _mm_extract_epi32(v, 2);
+    _mm_storel_epi64((__m128i *)p, v);
+    memcpy(p + 8, &last, 4);
+}
+
+/* Transposes 4x4 blocks of pixels with 32-bit lanes, BGR pixels widened to
+   BGRx as they are loaded and narrowed back as they are stored. The blocks
+   go down each 4 columns of source in turn, filling 4 rows of dest. BGR
+   pixels are moved 16 bytes at a time wherever 2 more pixels follow, as the
+   4 bytes too many written are written again by the next block (or by the
+   scalar version, for the pixels left over) */
+TARGET_SSE41 static void transpose_sse41(const unsigned char *source, ptrdiff_t source_stride, unsigned char *dest,
+                                         ptrdiff_t dest_stride, int rows, int columns, int channels) {
+    if (channels != 3 && channels != 4) {
+        transpose_block(source, source_stride, dest, dest_stride, rows, columns, channels);
+        return;
+    }
+    const __m128i widen = _mm_loadu_si128((const __m128i *)widen_mask), narrow = _mm_loadu_si128((const __m128i *)narrow_mask);
+    int full_rows = rows & ~3, full_columns = columns & ~3;
+    for (int j = 0; j < full_columns; j += 4) {
+        for (int i = 0; i < full_rows; i += 4) {
+            __m128i r[4];
+            for (int k = 0; k < 4; k++) {
+                const unsigned char *in = source + (i + k) * source_stride + (size_t)j * channels;
+                if (channels == 4 || j + 6 <= columns) {
+                    r[k] = _mm_loadu_si128((const __m128i *)in);
+                } else {
+                    r[k] = load12_sse41(in);
+                }
+                if (channels == 3) r[k] = _mm_shuffle_epi8(r[k], widen);
+            }
+            __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]), t1 = _mm_unpacklo_epi32(r[2], r[3]);
+            __m128i t2 = _mm_unpackhi_epi32(r[0], r[1]), t3 = _mm_unpackhi_epi32(r[2], r[3]);
+            r[0] = _mm_unpacklo_epi64(t0, t1);
+            r[1] = _mm_unpackhi_epi64(t0, t1);
+            r[2] = _mm_unpacklo_epi64(t2, t3);
+            r[3] = _mm_unpackhi_epi64(t2, t3);
+            for (int k = 0; k < 4; k++) {
+                unsigned char *out = dest + (j + k) * dest_stride + (size_t)i * channels;
+                if (channels == 4) {
+                    _mm_storeu_si128((__m128i *)out, r[k]);
+                } else if (i + 6 <= rows) {
+                    _mm_storeu_si128((__m128i *)out, _mm_shuffle_epi8(r[k], narrow));
+                } else {
+                    store12_sse41(out, _mm_shuffle_epi8(r[k], narrow));
+                }
+            }
+        }
+    }
+    // The columns and then the rows left over
+    transpose_block(source + (size_t)full_columns * channels, source_stride, dest + full_columns * dest_stride, dest_stride,
+                    rows, columns - full_columns, channels);
+    transpose_block(source + full_rows * source_stride, source_stride, dest + (size_t)full_rows * channels, dest_stride,
+                    rows - full_rows, full_columns, channels);
+}
+
+/* The same with 8x8 blocks, each lane of a row holding 4 of its pixels */
+TARGET_AVX2 static void transpose_avx2(const unsigned char *source, ptrdiff_t source_stride, unsigned char *dest,
+                                       ptrdiff_t dest_stride, int rows, int columns, int channels) {
+    if (channels != 3 && channels != 4) {
+        transpose_block(source, source_stride, dest, dest_stride, rows, columns, channels);
+        return;
+    }
+    const __m256i widen = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)widen_mask));
+    const __m256i narrow = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)narrow_mask));
+    int full_rows = rows & ~7, full_columns = columns & ~7;
+    for (int j = 0; j < full_columns; j += 8) {
+        for (int i = 0; i < full_rows; i += 8) {
+            __m256i r[8], t[8];
+            for (int k = 0; k < 8; k++) {
+                const unsigned char *in = source + (i + k) * source_stride + (size_t)j * channels;
+                if (channels == 4) {
+                    r[k] = _mm256_loadu_si256((const __m256i *)in);
+                } else if (j + 10 <= columns) {
+                    r[k] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(
+                        _mm_loadu_si128((const __m128i *)in)), _mm_loadu_si128((const __m128i *)(in + 12)), 1), widen);
+                } else {
+                    r[k] = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(load12_sse41(in)),
+                                                                       load12_sse41(in + 12), 1), widen);
+                }
+            }
+            for (int k = 0; k < 8; k += 2) {
+                t[k] = _mm256_unpacklo_epi32(r[k], r[k + 1]);
+                t[k + 1] = _mm256_unpackhi_epi32(r[k], r[k + 1]);
+            }
+            for (int k = 0; k < 8; k += 4) {
+                r[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+                r[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+                r[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+                r[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+            }
+            // Rows 0-3 hold columns 0-3 in their low lanes and 4-7 in their high lanes, with rows 4-7 for the rest
+            for (int k = 0; k < 4; k++) {
+                t[k] = _mm256_permute2x128_si256(r[k], r[k + 4], 0x20);
+                t[k + 4] = _mm256_permute2x128_si256(r[k], r[k + 4], 0x31);
+            }
+            for (int k = 0; k < 8; k++) {
+                unsigned char *out = dest + (j + k) * dest_stride + (size_t)i * channels;
+                if (channels == 4) {
+                    _mm256_storeu_si256((__m256i *)out, t[k]);
+                } else if (i + 10 <= rows) {
+                    __m256i v = _mm256_shuffle_epi8(t[k], narrow);
+                    _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+                    _mm_storeu_si128((__m128i *)(out + 12), _mm256_extracti128_si256(v, 1));
+                } else {
+                    __m256i v = _mm256_shuffle_epi8(t[k], narrow);
+                    store12_sse41(out, _mm256_castsi256_si128(v));
+                    store12_sse41(out + 12, _mm256_extracti128_si256(v, 1));
+                }
+            }
+        }
+    }
+    transpose_sse41(source + (size_t)full_columns * channels, source_stride, dest + full_columns * dest_stride, dest_stride,
+                    rows, columns - full_columns, channels);
+    transpose_sse41(source + full_rows * source_stride, source_stride, dest + (size_t)full_rows * channels, dest_stride,
+                    rows - full_rows, full_columns, channels);
+}
+
+#endif
+
+/* Row kernels used by the filter chain, scalar until simd_init picks faster ones */
+static simd_kernels kernels = {greyscale_row, sepia_row, threshold_row, contrast_row, inverse_row, hsl_fixed_row, hsl_fixed_planes,
+                               greyscale_quads, sepia_quads, threshold_quads, contrast_quads, inverse_quads, hsl_fixed_quads,
+                               cube_row, cube_planes, cube_quads, convolve_line, convolve_columns, box_columns,
+                               resample_columns, resample_line, mirror_row, mirror_quads, transpose_block};
+
+/* Returns the kernels for a SIMD level, falling back to scalar ones */
+simd_kernels simd_get_kernels(int level) {
+    simd_kernels k = {greyscale_row, sepia_row, threshold_row, contrast_row, inverse_row, hsl_fixed_row, hsl_fixed_planes,
+                      greyscale_quads, sepia_quads, threshold_quads, contrast_quads, inverse_quads, hsl_fixed_quads,
+                      cube_row, cube_planes, cube_quads, convolve_line, convolve_columns, box_columns, resample_columns,
+                      resample_line, mirror_row, mirror_quads, transpose_block};
+#ifdef HAVE_X86_SIMD
+    if (level == SIMD_SSE41) {
+        k = (simd_kernels) {greyscale_sse41, sepia_sse41, threshold_sse41, contrast_sse41, inverse_sse41, hsl_sse41, hsl_planes_sse41,
+                            greyscale_quads_sse41, sepia_quads_sse41, threshold_quads_sse41, contrast_quads_sse41,
+                            inverse_quads_sse41, hsl_quads_sse41, cube_sse41, cube_planes_sse41, cube_quads_sse41,
+                            convolve_line_sse41, convolve_columns_sse41, box_columns_sse41, resample_columns_sse41,
+                            resample_line_sse41, mirror_sse41, mirror_quads_sse41, transpose_sse41};
+    } else if (level == SIMD_AVX2) {
+        k = (simd_kernels) {greyscale_avx2, sepia_avx2, threshold_avx2, contrast_avx2, inverse_avx2, hsl_avx2, hsl_planes_avx2,
+                            greyscale_quads_avx2, sepia_quads_avx2, threshold_quads_avx2, contrast_quads_avx2,
+                            inverse_quads_avx2, hsl_quads_avx2, cube_avx2, cube_planes_avx2, cube_quads_avx2,
+                            convolve_line_avx2, convolve_columns_avx2, box_columns_avx2, resample_columns_avx2,
+                            resample_line_avx2, mirror_sse41, mirror_quads_avx2, transpose_avx2};
+    }
+#endif
+    return k;
+}
+
+/* Returns the best SIMD level supported by this CPU */
+int simd_detect(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+#endif
+    return SIMD_SCALAR;
+}
+
+/* Selects the kernels used by the filter chain, up to the given SIMD level */
+int simd_init(int max_level) {
+    int level = simd_detect();
+    if (level > max_level) level = max_level;
+    kernels = simd_get_kernels(level);
+    return level;
+}
+
+/* Names of the SIMD levels */
+const char *simd_name(int level) {
+    static const char *names[] = {"scalar", "sse4.1", "avx2"};
+    return names[level];
+}
+
+/* Fills a row with the grey ramp 0 to 255. Running a per-channel filter over
+   the ramp gives the filter's lookup table for each channel */
+static void ramp_row(pixel row[256]) {
+    for (int v = 0; v < 256; v++) {
+        row[v] = (pixel) {v, v, v};
+    }
+}
+
+/* Copies a filtered ramp into the stage's lookup tables */
+static void lut_from_row(stage *s, pixel row[256]) {
+    for (int v = 0; v < 256; v++) {
+        (*s).lut[0][v] = row[v].blue;
+        (*s).lut[1][v] = row[v].green;
+        (*s).lut[2][v] = row[v].red;
+    }
+}
+
+/* Lookup table builders for the per-channel (point) filters. The tables are
+   built with the filters themselves, so the output is identical */
+static void identity_lut(stage *s) {
+    pixel row[256];
+    ramp_row(row);
+    lut_from_row(s, row);
+}
+
+static void contrast_lut(stage *s, double coeff) {
+    pixel row[256];
+    ramp_row(row);
+    contrast_row(coeff, row, 256);
+    lut_from_row(s, row);
+}
+
+static void gamma_lut(stage *s, double gamma) {
+    pixel row[256];
+    ramp_row(row);
+    gamma_row(gamma, row, 256);
+    lut_from_row(s, row);
+}
+
+static void inverse_lut(stage *s) {
+    pixel row[256];
+    ramp_row(row);
+    inverse_row(row, 256);
+    lut_from_row(s, row);
+}
+
+/* Applies a stage's lookup tables to a row, one lookup per byte */
+static void run_lut(stage *s, pixel *row, int width) {
+    unsigned char *data = (unsigned char *)row;
+    for (int j = 0; j < width; j++) {
+        data[0] = (*s).lut[0][data[0]];
+        data[1] = (*s).lut[1][data[1]];
+        data[2] = (*s).lut[2][data[2]];
+        data += 3;
+    }
+}
+
+/* Stage wrappers, adapting each row filter to the pipeline */
+static void run_hsl(stage *s, pixel *row, int width) {
+    kernels.hsl(&(*s).shift, row, width);
+}
+
+static void run_hsl_cached(stage *s, pixel *row, int width) {
+    hsl_cached_row(&(*s).shift, (*s).cache, row, width);
+}
+
+static void run_threshold(stage *s, pixel *row, int width) {
+    kernels.threshold((int)(*s).param[0], row, width);
+}
+
+static void run_greyscale(stage *s, pixel *row, int width) {
+    kernels.greyscale(row, width);
+}
+
+static void run_sepia(stage *s, pixel *row, int width) {
+    kernels.sepia(row, width);
+}
+
+/* A lone contrast or inverse filter runs faster as arithmetic on whole vectors
+   than as table lookups, when there are SIMD kernels for it */
+static void run_contrast(stage *s, pixel *row, int width) {
+    kernels.contrast((*s).param[0], row, width);
+}
+
+static void run_inverse(stage *s, pixel *row, int width) {
+    kernels.inverse(row, width);
+}
+
+/* Planar versions of the stages, each running over the B, G and R planes of
+   a row. Written as plain loops over the planes, which the compiler vectorizes */
+static void lut_planes(stage *s, unsigned char *plane[3], int width) {
+    unsigned char *restrict b = plane[0], *restrict g = plane[1], *restrict r = plane[2];
+    const unsigned char *restrict lut = &(*s).lut[0][0];
+    for (int j = 0; j < width; j++) {
+        b[j] = lut[b[j]];
+        g[j] = lut[256 + g[j]];
+        r[j] = lut[512 + r[j]];
+    }
+}
+
+/* A lone contrast or inverse filter, with the arithmetic of the SIMD kernels */
+static void contrast_planes(stage *s, unsigned char *plane[3], int width) {
+    int cq = (int)((*s).param[0] * 65536 + 0.5);
+    for (int c = 0; c < 3; c++) {
+        unsigned char *restrict p = plane[c];
+        for (int j = 0; j < width; j++) {
+            int v = (p[j] - 128) * cq + (128 << 16) + (1 << 15);
+            v = (v < 0) ? 0 : v >> 16;
+            p[j] = (v > 255) ? 255 : v;
+        }
+    }
+}
+
+static void inverse_planes(stage *s, unsigned char *plane[3], int width) {
+    for (int c = 0; c < 3; c++) {
+        unsigned char *restrict p = plane[c];
+        for (int j = 0; j < width; j++) p[j] = 255 - p[j];
+    }
+}
+
+static void hsl_planes(stage *s, unsigned char *plane[3], int width) {
+    kernels.hsl_planar(&(*s).shift, plane, width);
+}
+
+static void hsl_cached_planes(stage *s, unsigned char *plane[3], int width) {
+    for (int j = 0; j < width; j++) {
+        pixel p = {plane[0][j], plane[1][j], plane[2][j]};
+        hsl_cached_row(&(*s).shift, (*s).cache, &p, 1);
+        plane[0][j] = p.blue;
+        plane[1][j] = p.green;
+        plane[2][j] = p.red;
+    }
+}
+
+static void threshold_planes(stage *s, unsigned char *plane[3], int width) {
+    int cutoff = (int)(*s).param[0];
+    unsigned char *restrict b = plane[0], *restrict g = plane[1], *restrict r = plane[2];
+    for (int j = 0; j < width; j++) {
+        unsigned char v = (r[j] + g[j] + b[j] < cutoff) ? 0 : 255;
+        b[j] = g[j] = r[j] = v;
+    }
+}
+
+/* Greyscale and sepia use the fixed point math of the SIMD kernels, so they
+   give what those kernels give */
+static void greyscale_planes(stage *s, unsigned char *plane[3], int width) {
+    unsigned char *restrict b = plane[0], *restrict g = plane[1], *restrict r = plane[2];
+    for (int j = 0; j < width; j++) b[j] = g[j] = r[j] = grey_fixed(r[j], g[j], b[j]);
+}
+
+static void sepia_planes(stage *s, unsigned char *plane[3], int width) {
+    unsigned char *restrict b = plane[0], *restrict g = plane[1], *restrict r = plane[2];
+    for (int j = 0; j < width; j++) {
+        unsigned int red = sepia_fixed(sepia_w[0], r[j], g[j], b[j]), green = sepia_fixed(sepia_w[1], r[j], g[j], b[j]);
+        b[j] = sepia_fixed(sepia_w[2], r[j], g[j], b[j]);
+        g[j] = green;
+        r[j] = red;
+    }
+}
+
+/* BGRA versions of the stages, leaving alpha as it is */
+static void run_lut_quads(stage *s, quad *row, int width) {
+    for (int j = 0; j < width; j++) {
+        row[j].blue = (*s).lut[0][row[j].blue];
+        row[j].green = (*s).lut[1][row[j].green];
+        row[j].red = (*s).lut[2][row[j].red];
+    }
+}
+
+static void run_hsl_quads(stage *s, quad *row, int width) {
+    kernels.hsl_quad(&(*s).shift, row, width);
+}
+
+static void run_hsl_cached_quads(stage *s, quad *row, int width) {
+    for (int j = 0; j < width; j++) {
+        pixel p = {row[j].blue, row[j].green, row[j].red};
+        hsl_cached_row(&(*s).shift, (*s).cache, &p, 1);
+        row[j].blue = p.blue;
+        row[j].green = p.green;
+        row[j].red = p.red;
+    }
+}
+
+static void run_threshold_quads(stage *s, quad *row, int width) {
+    kernels.threshold_quad((int)(*s).param[0], row, width);
+}
+
+static void run_greyscale_quads(stage *s, quad *row, int width) {
+    kernels.greyscale_quad(row, width);
+}
+
+static void run_sepia_quads(stage *s, quad *row, int width) {
+    kernels.sepia_quad(row, width);
+}
+
+static void run_contrast_quads(stage *s, quad *row, int width) {
+    kernels.contrast_quad((*s).param[0], row, width);
+}
+
+static void run_inverse_quads(stage *s, quad *row, int width) {
+    kernels.inverse_quad(row, width);
+}
+
+/* A 3D lookup table stage, in each layout */
+static void run_cube(stage *s, pixel *row, int width) {
+    kernels.cube((*s).cube, row, width);
+}
+
+static void run_cube_planes(stage *s, unsigned char *plane[3], int width) {
+    kernels.cube_planar((*s).cube, plane, width);
+}
+
+static void run_cube_quads(stage *s, quad *row, int width) {
+    kernels.cube_quad((*s).cube, row, width);
+}
+
+/* Mirrors each row left to right, the one flip which moves pixels along a
+   row rather than between rows */
+static void run_mirror(stage *s, pixel *row, int width) {
+    kernels.mirror(row, width);
+}
+
+static void run_mirror_quads(stage *s, quad *row, int width) {
+    kernels.mirror_quad(row, width);
+}
+
+static void mirror_planes(stage *s, unsigned char *plane[3], int width) {
+    for (int c = 0; c < 3; c++) {
+        unsigned char *p = plane[c];
+        for (int i = 0, j = width - 1; i < j; i++, j--) {
+            unsigned char v = p[i];
+            p[i] = p[j];
+            p[j] = v;
+        }
+    }
+}
+
+/* Adds the RGB values of the planes of a row to the white balance totals */
+static void wb_sum_planes(unsigned long long sums[3], unsigned char *plane[3], int width) {
+    for (int j = 0; j < width; j++) {
+        sums[0] += plane[2][j];
+        sums[1] += plane[1][j];
+        sums[2] += plane[0][j];
+    }
+}
+
+/* Builds the white balance table once the averages of the stage input are known.
+   The stage's table already holds the point filters fused after it, so the
+   gains are composed in front of them */
+static void prepare_wb(stage *s, const image_stats *stats) {
+    wb_gains((*stats).sums, (*stats).pixel_total, &(*s).gain[0], &(*s).gain[2]);
+    (*s).gain[1] = 1;
+    unsigned char post[3][256];
+    memcpy(post, (*s).lut, sizeof(post));
+    pixel row[256];
+    ramp_row(row);
+    wb_row((*s).gain[0], (*s).gain[2], row, 256);
+    for (int v = 0; v < 256; v++) {
+        (*s).lut[0][v] = post[0][row[v].blue];
+        (*s).lut[1][v] = post[1][row[v].green];
+        (*s).lut[2][v] = post[2][row[v].red];
+    }
+}
+
+/* Builds the auto levels or auto contrast table once the histograms of the
+   stage input are known, in front of the point filters fused after it */
+static void prepare_levels(stage *s, const image_stats *stats) {
+    unsigned char levels[3][256];
+    levels_lut(levels, stats, (*s).param[0], (*s).param[1] != 0);
+    for (int c = 0; c < 3; c++) {
+        for (int v = 0; v < 256; v++) levels[c][v] = (*s).lut[c][levels[c][v]];
+    }
+    memcpy((*s).lut, levels, sizeof(levels));
+}
+
+/* Appends a stage to the end of the chain */
+static stage *add_stage(filter_chain *chain, void (*run)(stage *, pixel *, int), const char *name) {
+    stage *s = &(*chain).stages[(*chain).count++];
+    memset(s, 0, sizeof(stage));
+    (*s).run = run;
+    strncpy((*s).name, name, sizeof((*s).name) - 1);
+    return s;
+}
+
+/* Composes consecutive lookup table stages into one table per channel, so any
+   run of point filters costs a single lookup per byte */
+static void fuse_luts(filter_chain *chain) {
+    int count = 0;
+    for (int k = 0; k < (*chain).count; k++) {
+        stage *s = &(*chain).stages[k];
+        stage *prev = (count > 0) ? &(*chain).stages[count - 1] : NULL;
+        if (prev != NULL && (*prev).run == run_lut && (*s).run == run_lut && (*s).prepare == NULL) {
+            (*prev).op = OP_TABLE;
+            // Named after all the filters it holds
+            size_t used = strlen((*prev).name);
+            snprintf((*prev).name + used, sizeof((*prev).name) - used, "+%s", (*s).name);
+            for (int c = 0; c < 3; c++) {
+                for (int v = 0; v < 256; v++) {
+                    (*prev).lut[c][v] = (*s).lut[c][(*prev).lut[c][v]];
+                }
+            }
+        } else {
+            if (count != k) (*chain).stages[count] = *s;
+            count++;
+        }
+    }
+    (*chain).count = count;
+    // Stages still holding a single filter can use its SIMD kernel instead
+    for (int k = 0; k < count; k++) {
+        stage *s = &(*chain).stages[k];
+        if ((*s).run == run_lut && (*s).op == OP_CONTRAST && kernels.contrast != contrast_row) (*s).run = run_contrast;
+        if ((*s).run == run_lut && (*s).op == OP_INVERSE && kernels.inverse != inverse_row) (*s).run = run_inverse;
+    }
+}
+
+/* Gives every stage its planar and BGRA versions */
+static void add_layout_runs(filter_chain *chain) {
+    static const struct {
+        void (*run)(stage *, pixel *, int);
+        void (*run_planar)(stage *, unsigned char *[3], int);
+        void (*run_quad)(stage *, quad *, int);
+    } layouts[] = {
+        {run_lut, lut_planes, run_lut_quads}, {run_contrast, contrast_planes, run_contrast_quads},
+        {run_inverse, inverse_planes, run_inverse_quads}, {run_hsl, hsl_planes, run_hsl_quads},
+        {run_hsl_cached, hsl_cached_planes, run_hsl_cached_quads}, {run_threshold, threshold_planes, run_threshold_quads},
+        {run_greyscale, greyscale_planes, run_greyscale_quads}, {run_sepia, sepia_planes, run_sepia_quads},
+        {run_cube, run_cube_planes, run_cube_quads}, {run_mirror, mirror_planes, run_mirror_quads}
+    };
+    for (int k = 0; k < (*chain).count; k++) {
+        stage *s = &(*chain).stages[k];
+        for (size_t p = 0; p < sizeof(layouts) / sizeof(layouts[0]); p++) {
+            if ((*s).run == layouts[p].run) {
+                (*s).run_planar = layouts[p].run_planar;
+                (*s).run_quad = layouts[p].run_quad;
+            }
+        }
+    }
+}
+
+/* Appends a spatial stage to the end of the chain, returning its filter to
+   fill in, or NULL if there is not enough memory */
+static spatial_filter *add_spatial(filter_chain *chain, const char *name) {
+    stage *s = add_stage(chain, NULL, name);
+    (*s).spatial = (spatial_filter *) malloc (sizeof(spatial_filter));
+    return (*s).spatial;
+}
+
+/* Frees what has been built of a chain when memory runs out, returning -1 */
+static int chain_failed(filter_chain *chain) {
+    free_chain(chain);
+    (*chain).count = 0;
+    return -1;
+}
+
+/* Compiles the selected filters into a chain, in the order of precedence.
+   Returns -1, with nothing left to free, if there is not enough memory */
+int build_chain(filter_chain *chain, int filter_flag, filter_params *params) {
+    stage *s;
+    spatial_filter *spatial;
+    (*chain).count = 0;
+    (*chain).timed = 0;
+    (*chain).transform = 0;
+    (*chain).blocks = NULL;
+    if (filter_flag & FLAG_BLUR) {              // filter_flag & 2048
+        if ((spatial = add_spatial(chain, "blur")) == NULL) return chain_failed(chain);
+        spatial_gaussian(spatial, (*params).blur, 0, 0);
+    }
+    if (filter_flag & FLAG_BOX_BLUR) {          // filter_flag & 4096
+        if ((spatial = add_spatial(chain, "boxblur")) == NULL) return chain_failed(chain);
+        spatial_box(spatial, (*params).box_radius);
+    }
+    if (filter_flag & FLAG_HSL) {               // filter_flag & 1
+        s = add_stage(chain, run_hsl, "hsl");
+        (*s).param[0] = (*params).hue;
+        (*s).param[1] = (*params).saturation;
+        (*s).param[2] = (*params).lightness;
+        (*s).shift = hsl_fixed_shift((*params).hue, (*params).saturation, (*params).lightness);
+        if ((*params).hsl_cache) {
+            // Zeroed pages are only mapped in once a color in them is seen
+            (*s).cache = (unsigned int *) calloc (1 << 24, sizeof(unsigned int));
+            if ((*s).cache == NULL) return chain_failed(chain);
+            (*s).run = run_hsl_cached;
+        }
+    }
+    if (filter_flag & FLAG_CONTRAST) {          // filter_flag & 2
+        s = add_stage(chain, run_lut, "contrast");
+        (*s).op = OP_CONTRAST;
+        (*s).param[0] = contrast_coeff((*params).contrast);
+        contrast_lut(s, (*s).param[0]);
+    }
+    if (filter_flag & FLAG_WB) {                // filter_flag & 4
+        s = add_stage(chain, run_lut, "wb");
+        (*s).prepare = prepare_wb;      // needs the averages of the whole image
+        (*s).stats = STATS_SUMS;
+        identity_lut(s);        // filled in once the gains are known
+    }
+    if (filter_flag & FLAG_LEVELS) {            // filter_flag & 512
+        s = add_stage(chain, run_lut, "levels");
+        (*s).prepare = prepare_levels;      // needs the histograms of the whole image
+        (*s).stats = STATS_HISTOGRAMS;
+        (*s).param[0] = (*params).levels_clip;
+        (*s).param[1] = 1;      // each channel by itself
+        identity_lut(s);
+    }
+    if (filter_flag & FLAG_AUTO_CONTRAST) {     // filter_flag & 1024
+        s = add_stage(chain, run_lut, "autocontrast");
+        (*s).prepare = prepare_levels;
+        (*s).stats = STATS_HISTOGRAMS;
+        (*s).param[0] = (*params).contrast_clip;
+        identity_lut(s);
     }
     if (filter_flag & FLAG_GAMMA) {             // filter_flag & 8
-        gamma_filter(gamma, &info_header, pixel_array, padding_bytes);
+        s = add_stage(chain, run_lut, "gamma");
+        gamma_lut(s, (*params).gamma);
+    }
+    if (filter_flag & FLAG_THRESHOLD) {         // filter_flag & 16
+        s = add_stage(chain, run_threshold, "threshold");
+        (*s).param[0] = threshold_cutoff((*params).threshold);
+    }
+    if (filter_flag & FLAG_GREYSCALE) {         // filter_flag & 32
+        add_stage(chain, run_greyscale, "greyscale");
+    }
+    if (filter_flag & FLAG_SEPIA) {             // filter_flag & 64
+        add_stage(chain, run_sepia, "sepia");
+    }
+    if (filter_flag & FLAG_INVERSE) {           // filter_flag & 128
+        s = add_stage(chain, run_lut, "inverse");
+        (*s).op = OP_INVERSE;
+        inverse_lut(s);
+    }
+    if (filter_flag & FLAG_CUBE) {              // filter_flag & 256
+        s = add_stage(chain, run_cube, "cube");
+        // The stage keeps its own copy, freed with the chain
+        int size = (*(*params).cube).size;
+        (*s).cube = (color_cube *) malloc (sizeof(color_cube));
+        if ((*s).cube == NULL || cube_create((*s).cube, size) != 0) return chain_failed(chain);
+        unsigned int *nodes = (*(*s).cube).nodes;
+        memcpy(nodes, (*(*params).cube).nodes, sizeof(unsigned int) * size * size * size);
+        *(*s).cube = *(*params).cube;
+        (*(*s).cube).nodes = nodes;
+    }
+    if (filter_flag & FLAG_SHARPEN) {           // filter_flag & 8192
+        if ((spatial = add_spatial(chain, "sharpen")) == NULL) return chain_failed(chain);
+        spatial_sharpen(spatial, (*params).sharpen);
+    }
+    if (filter_flag & FLAG_UNSHARP) {           // filter_flag & 16384
+        if ((spatial = add_spatial(chain, "unsharp")) == NULL) return chain_failed(chain);
+        spatial_gaussian(spatial, (*params).unsharp[0], (*params).unsharp[1], (*params).unsharp[2]);
+    }
+    if (filter_flag & FLAG_TRANSFORM) {         // filter_flag & 32768
+        // Last, so it shares the pass of the stages before it. A flip top to
+        // bottom is left to the headers, and one left to right is a row stage
+        (*chain).transform = (*params).transform;
+        if ((*params).transform & TRANSFORM_TRANSPOSE) {
+            s = add_stage(chain, NULL, "transpose");
+            (*s).transform = (*params).transform;
+        } else if ((*params).transform & TRANSFORM_FLIP_X) {
+            add_stage(chain, run_mirror, "mirror");
+        }
+    }
+    fuse_luts(chain);
+    if ((*params).bake > 0 && bake_chain(chain, (*params).bake) != 0) return chain_failed(chain);
+    add_layout_runs(chain);
+    return 0;
+}
+
+/* Picks the layout a 24-bit image is filtered in. Widening the pixels to
+   BGRA as they are read, on a larger buffer, and narrowing them as they are
+   written adds about 2 ns a pixel (timed with --profile on a 12 MP image), so
+   the image is only widened if the stages which run faster on BGRA save more
+   than that. The savings are the differences between the chain and bgra
+   columns of bmpbench for each stage on its own */
+#define WIDEN_COST 200      // hundredths of a ns per pixel
+
+int chain_layout(filter_chain *chain) {
+    static const struct {
+        void (*run)(stage *, pixel *, int);
+        int saving;         // hundredths of a ns per pixel
+    } savings[] = {
+        {run_hsl, 80}, {run_threshold, 16}, {run_greyscale, 6}, {run_sepia, -25}, {run_inverse, -2}
+    };
+    int saving = 0;
+    for (int k = 0; k < (*chain).count; k++) {
+        stage *s = &(*chain).stages[k];
+        if ((*s).prepare != NULL) saving += 30;     // gathering the statistics for it
+        if ((*s).spatial != NULL) saving -= 200;    // a third more values to filter, 2 ns even for the narrowest kernels
+        for (size_t p = 0; p < sizeof(savings) / sizeof(savings[0]); p++) {
+            if ((*s).run == savings[p].run) saving += savings[p].saving;
+        }
+    }
+    return (saving > WIDEN_COST) ? LAYOUT_BGRA : LAYOUT_BGR;
+}
+
+/* Fills in the grid of a cube by running stages first to last - 1 of the
+   chain over the color at every grid point, a plane of the grid at a time.
+   None of the stages may need image statistics. Returns -1 if there is not
+   enough memory */
+int cube_from_chain(color_cube *cube, filter_chain *chain, int first, int last) {
+    int size = (*cube).size, area = size * size;
+    pixel *plane = (pixel *) malloc (sizeof(pixel) * area);
+    if (plane == NULL) return -1;
+    for (int b = 0; b < size; b++) {
+        for (int g = 0; g < size; g++) {
+            for (int r = 0; r < size; r++) {
+                plane[g * size + r] = (pixel) {lround(b * 255.0 / (size - 1)), lround(g * 255.0 / (size - 1)),
+                                               lround(r * 255.0 / (size - 1))};
+            }
+        }
+        for (int k = first; k < last; k++) (*chain).stages[k].run(&(*chain).stages[k], plane, area);
+        unsigned int *nodes = (*cube).nodes + (size_t)b * area;
+        for (int j = 0; j < area; j++) nodes[j] = cube_pack(plane[j].red, plane[j].green, plane[j].blue);
+    }
+    free(plane);
+    return 0;
+}
+
+/* Frees anything a stage allocated */
+static void free_stage(stage *s) {
+    free((*s).cache);
+    (*s).cache = NULL;
+    if ((*s).cube != NULL) cube_free((*s).cube);
+    free((*s).cube);
+    (*s).cube = NULL;
+    free((*s).spatial);
+    (*s).spatial = NULL;
+}
+
+/* Whether a stage can go into a cube. The stages needing image statistics
+   can't, nor can spatial stages or rotations and flips, which are not a
+   mapping of colors, and neither can the threshold, whose step the
+   interpolation would smear over a whole cell */
+static int bakeable(const stage *s) {
+    return (*s).prepare == NULL && (*s).spatial == NULL && (*s).transform == 0 && (*s).run != run_mirror &&
+           (*s).run != run_threshold;
+}
+
+/* Bakes every run of bakeable stages into a cube of size^3 grid points, so
+   each run costs one lookup per pixel however many filters it holds. A run
+   of just one lookup table or cube stage is left as it is, since the cube
+   would cost more. Returns -1 if there is not enough memory, leaving the
+   stages not yet baked as they were */
+int bake_chain(filter_chain *chain, int size) {
+    int count = 0;
+    for (int k = 0; k < (*chain).count; ) {
+        stage *s = &(*chain).stages[k];
+        int end = k;
+        while (end < (*chain).count && bakeable(&(*chain).stages[end])) end++;
+        if (end == k || (end == k + 1 && ((*s).run == run_lut || (*s).run == run_contrast || (*s).run == run_inverse ||
+                                          (*s).run == run_cube))) {
+            if (count != k) (*chain).stages[count] = *s;
+            count++;
+            k++;
+            continue;
+        }
+        stage baked;
+        memset(&baked, 0, sizeof(stage));
+        baked.run = run_cube;
+        // Named after all the filters it holds
+        strcpy(baked.name, "cube:");
+        for (int j = k; j < end; j++) {
+            size_t used = strlen(baked.name);
+            snprintf(baked.name + used, sizeof(baked.name) - used, (j > k) ? "+%s" : "%s", (*chain).stages[j].name);
+        }
+        baked.cube = (color_cube *) malloc (sizeof(color_cube));
+        if (baked.cube == NULL || cube_create(baked.cube, size) != 0 || cube_from_chain(baked.cube, chain, k, end) != 0) {
+            if (baked.cube != NULL) cube_free(baked.cube);
+            free(baked.cube);
+            // The stages moved down are kept, and the rest left where they were
+            for (int j = k; j < (*chain).count; j++) (*chain).stages[count++] = (*chain).stages[j];
+            (*chain).count = count;
+            return -1;
+        }
+        for (int j = k; j < end; j++) free_stage(&(*chain).stages[j]);
+        (*chain).stages[count++] = baked;
+        k = end;
+    }
+    (*chain).count = count;
+    return 0;
+}
+
+/* Frees anything the stages of a chain allocated */
+void free_chain(filter_chain *chain) {
+    for (int k = 0; k < (*chain).count; k++) free_stage(&(*chain).stages[k]);
+}
+
+/* Worker thread of the pool. Waits for a new job, then takes bands from it
+   until none are left */
+static void *pool_worker(void *arg) {
+    thread_pool *pool = arg;
+    unsigned long int generation = 0;
+    pthread_mutex_lock(&(*pool).lock);
+    for (;;) {
+        while ((*pool).generation == generation && !(*pool).quit) pthread_cond_wait(&(*pool).wake, &(*pool).lock);
+        if ((*pool).quit) break;
+        generation = (*pool).generation;
+        while ((*pool).next < (*pool).bands) {
+            int band = (*pool).next++;
+            pthread_mutex_unlock(&(*pool).lock);
+            (*pool).job((*pool).arg, band);
+            pthread_mutex_lock(&(*pool).lock);
+            if (++(*pool).finished == (*pool).bands) pthread_cond_signal(&(*pool).done);
+        }
+    }
+    pthread_mutex_unlock(&(*pool).lock);
+    return NULL;
+}
+
+/* Creates a pool for running jobs on the given number of threads. The calling
+   thread takes part in every job, so one fewer worker is started */
+thread_pool *pool_create(int threads) {
+    thread_pool *pool = (thread_pool *) calloc (1, sizeof(thread_pool));
+    if (pool == NULL) return NULL;
+    (*pool).workers = (pthread_t *) malloc (sizeof(pthread_t) * threads);
+    if ((*pool).workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&(*pool).lock, NULL);
+    pthread_cond_init(&(*pool).wake, NULL);
+    pthread_cond_init(&(*pool).done, NULL);
+    (*pool).threads = 1;
+    while ((*pool).threads < threads) {
+        if (pthread_create(&(*pool).workers[(*pool).threads - 1], NULL, pool_worker, pool) != 0) break;
+        (*pool).threads++;
+    }
+    return pool;
+}
+
+/* Runs job(arg, band) for every band from 0 to bands - 1 across the pool,
+   returning once all of them have finished */
+void pool_run(thread_pool *pool, void (*job)(void *, int), void *arg, int bands) {
+    if (pool == NULL || (*pool).threads == 1) {
+        for (int band = 0; band < bands; band++) job(arg, band);
+        return;
+    }
+    pthread_mutex_lock(&(*pool).lock);
+    (*pool).job = job;
+    (*pool).arg = arg;
+    (*pool).bands = bands;
+    (*pool).next = 0;
+    (*pool).finished = 0;
+    (*pool).generation++;
+    pthread_cond_broadcast(&(*pool).wake);
+    // Working alongside the pool
+    while ((*pool).next < bands) {
+        int band = (*pool).next++;
+        pthread_mutex_unlock(&(*pool).lock);
+        job(arg, band);
+        pthread_mutex_lock(&(*pool).lock);
+        (*pool).finished++;
+    }
+    while ((*pool).finished < bands) pthread_cond_wait(&(*pool).done, &(*pool).lock);
+    pthread_mutex_unlock(&(*pool).lock);
+}
+
+/* Stops the worker threads and frees the pool */
+void pool_destroy(thread_pool *pool) {
+    if (pool == NULL) return;
+    pthread_mutex_lock(&(*pool).lock);
+    (*pool).quit = 1;
+    pthread_cond_broadcast(&(*pool).wake);
+    pthread_mutex_unlock(&(*pool).lock);
+    for (int t = 0; t < (*pool).threads - 1; t++) pthread_join((*pool).workers[t], NULL);
+    pthread_mutex_destroy(&(*pool).lock);
+    pthread_cond_destroy(&(*pool).wake);
+    pthread_cond_destroy(&(*pool).done);
+    free((*pool).workers);
+    free(pool);
+}
+
+/* Number of threads in a pool, 1 without one */
+int pool_threads(thread_pool *pool) {
+    return (pool == NULL) ? 1 : (*pool).threads;
+}
+
+/* Sets up an empty block pool */
+void block_pool_init(block_pool *blocks) {
+    memset(blocks, 0, sizeof(block_pool));
+    pthread_mutex_init(&(*blocks).lock, NULL);
+}
+
+/* Frees every block of a pool, which must all have been given back */
+void block_pool_free(block_pool *blocks) {
+    for (int b = 0; b < (*blocks).count; b++) free((*blocks).blocks[b].data);
+    free((*blocks).blocks);
+    pthread_mutex_destroy(&(*blocks).lock);
+    memset(blocks, 0, sizeof(block_pool));
+}
+
+/* Adds a new free block of bytes to the pool, whose lock is held. Returns
+   its slot, or -1 if there is not enough memory */
+static int block_add(block_pool *blocks, size_t bytes) {
+    void *data;
+    if ((*blocks).count == (*blocks).capacity) {
+        int capacity = (*blocks).capacity ? 2 * (*blocks).capacity : 64;
+        pool_block *grown = (pool_block *) realloc ((*blocks).blocks, sizeof(pool_block) * capacity);
+        if (grown == NULL) return -1;
+        (*blocks).blocks = grown;
+        (*blocks).capacity = capacity;
+    }
+    if (posix_memalign(&data, ROW_ALIGN, bytes > 0 ? bytes : 1) != 0) return -1;
+    (*blocks).blocks[(*blocks).count] = (pool_block) {data, bytes, 0};
+    (*blocks).allocations++;
+    return (*blocks).count++;
+}
+
+/* Hands out bytes aligned to ROW_ALIGN: the smallest free block of the pool
+   big enough for them, or a new block which joins the pool. Without a pool
+   the memory is allocated for this request alone. Returns NULL if there is
+   not enough memory */
+void *block_alloc(block_pool *blocks, size_t bytes) {
+    void *data;
+    if (blocks == NULL) return (posix_memalign(&data, ROW_ALIGN, bytes > 0 ? bytes : 1) == 0) ? data : NULL;
+    pthread_mutex_lock(&(*blocks).lock);
+    int best = -1;
+    for (int b = 0; b < (*blocks).count; b++) {
+        pool_block *block = &(*blocks).blocks[b];
+        if (!(*block).used && (*block).size >= bytes && (best < 0 || (*block).size < (*blocks).blocks[best].size)) best = b;
+    }
+    if (best < 0) best = block_add(blocks, bytes);
+    data = (best >= 0) ? (*blocks).blocks[best].data : NULL;
+    if (best >= 0) (*blocks).blocks[best].used = 1;
+    pthread_mutex_unlock(&(*blocks).lock);
+    return data;
+}
+
+/* Makes sure the pool has count free blocks of at least bytes, before work
+   shared out across threads asks for them, so how many it needs at once
+   does not depend on how the threads happen to run. Does nothing without a
+   pool. Returns -1 if there is not enough memory */
+int block_reserve(block_pool *blocks, size_t bytes, int count) {
+    if (blocks == NULL) return 0;
+    pthread_mutex_lock(&(*blocks).lock);
+    for (int b = 0; b < (*blocks).count; b++) {
+        if (!(*blocks).blocks[b].used && (*blocks).blocks[b].size >= bytes) count--;
+    }
+    while (count > 0 && block_add(blocks, bytes) >= 0) count--;
+    pthread_mutex_unlock(&(*blocks).lock);
+    return (count > 0) ? -1 : 0;
+}
+
+/* Gives a block back to its pool, or frees it without one */
+void block_free(block_pool *blocks, void *data) {
+    if (blocks == NULL || data == NULL) {
+        free(data);
+        return;
+    }
+    pthread_mutex_lock(&(*blocks).lock);
+    for (int b = 0; b < (*blocks).count; b++) {
+        if ((*blocks).blocks[b].data == data) (*blocks).blocks[b].used = 0;
+    }
+    pthread_mutex_unlock(&(*blocks).lock);
+}
+
+/* The statistics engine. Histograms are counted with integers for each
+   band of rows and added together once the pass is done, and everything
+   else (the totals, the extremes, the mean and the spread) is worked out
+   from them, so they are exact for any image and any number of threads.
+   The luminance uses the weights of the greyscale filter */
+#define LUMA(r, g, b) ((54 * (r) + 183 * (g) + 19 * (b) + 128) >> 8)
+
+/* Clears the statistics, to be gathered at the given level */
+void stats_clear(image_stats *stats, int level) {
+    memset(stats, 0, sizeof(image_stats));
+    (*stats).level = level;
+}
+
+/* Adds a row of pixels to the histograms */
+void stats_row(image_stats *stats, const pixel *data, int width) {
+    unsigned long long (*hist)[256] = (*stats).hist;
+    for (int j = 0; j < width; j++) {
+        int r = data[j].red, g = data[j].green, b = data[j].blue;
+        hist[0][r]++;
+        hist[1][g]++;
+        hist[2][b]++;
+        hist[3][LUMA(r, g, b)]++;
+    }
+    (*stats).pixel_total += width;
+}
+
+/* Adds a row of BGRA pixels to the histograms, leaving out alpha */
+void stats_quads(image_stats *stats, const quad *data, int width) {
+    unsigned long long (*hist)[256] = (*stats).hist;
+    for (int j = 0; j < width; j++) {
+        int r = data[j].red, g = data[j].green, b = data[j].blue;
+        hist[0][r]++;
+        hist[1][g]++;
+        hist[2][b]++;
+        hist[3][LUMA(r, g, b)]++;
+    }
+    (*stats).pixel_total += width;
+}
+
+/* Adds the B, G and R planes of a row to the histograms */
+void stats_planes(image_stats *stats, unsigned char *plane[3], int width) {
+    unsigned long long (*hist)[256] = (*stats).hist;
+    for (int j = 0; j < width; j++) {
+        int r = plane[2][j], g = plane[1][j], b = plane[0][j];
+        hist[0][r]++;
+        hist[1][g]++;
+        hist[2][b]++;
+        hist[3][LUMA(r, g, b)]++;
+    }
+    (*stats).pixel_total += width;
+}
+
+/* Adds the colors of an indexed image, each counted as many times as the
+   pixels using it. The totals are added as well */
+void stats_palette(image_stats *stats, const pixel *entries, int colors, const unsigned long long counts[256]) {
+    for (int v = 0; v < colors; v++) {
+        int r = entries[v].red, g = entries[v].green, b = entries[v].blue;
+        (*stats).sums[0] += counts[v] * r;
+        (*stats).sums[1] += counts[v] * g;
+        (*stats).sums[2] += counts[v] * b;
+        (*stats).hist[0][r] += counts[v];
+        (*stats).hist[1][g] += counts[v];
+        (*stats).hist[2][b] += counts[v];
+        (*stats).hist[3][LUMA(r, g, b)] += counts[v];
+        (*stats).pixel_total += counts[v];
+    }
+}
+
+/* Works out the RGB totals from the histograms, once they are gathered */
+void stats_finish(image_stats *stats) {
+    if ((*stats).level < STATS_HISTOGRAMS) return;
+    for (int c = 0; c < 3; c++) {
+        (*stats).sums[c] = 0;
+        for (int v = 0; v < 256; v++) (*stats).sums[c] += (*stats).hist[c][v] * v;
+    }
+}
+
+/* Adds statistics gathered separately, such as those of another band */
+void stats_add(image_stats *total, const image_stats *stats) {
+    (*total).pixel_total += (*stats).pixel_total;
+    for (int c = 0; c < 3; c++) (*total).sums[c] += (*stats).sums[c];
+    if ((*total).level < STATS_HISTOGRAMS) return;
+    for (int c = 0; c < 4; c++) {
+        for (int v = 0; v < 256; v++) (*total).hist[c][v] += (*stats).hist[c][v];
+    }
+}
+
+/* Returns the value of the pixel at the given rank (from 0) if the pixels
+   were sorted by the value in the histogram, or 255 past the last pixel */
+int stats_rank(const unsigned long long hist[256], unsigned long long rank) {
+    unsigned long long count = 0;
+    for (int v = 0; v < 255; v++) {
+        count += hist[v];
+        if (count > rank) return v;
+    }
+    return 255;
+}
+
+/* Prints a string as a quoted JSON string */
+void json_string(FILE *fp, const char *text) {
+    fputc('"', fp);
+    for (const char *ch = text; *ch != '\0'; ch++) {
+        if (*ch == '"' || *ch == '\\') fputc('\\', fp);
+        if ((unsigned char)*ch < 0x20) fprintf(fp, "\\u%04x", *ch);
+        else fputc(*ch, fp);
+    }
+    fputc('"', fp);
+}
+
+/* Prints the statistics of an image: for each channel and the luminance the
+   darkest and lightest values, the mean, median and standard deviation and
+   the share of pixels clipped to 0 or 255. As JSON, the image is one object
+   on a single line with the histograms, for log pipelines */
+void stats_print(FILE *fp, const image_stats *stats, const char *name, int json) {
+    static const char *channels[] = {"red", "green", "blue", "luminance"};
+    unsigned long long pixels = (*stats).pixel_total;
+    if (json) {
+        fputs("{\"file\": ", fp);
+        json_string(fp, name);
+        fprintf(fp, ", \"pixels\": %llu", pixels);
+    } else {
+        fprintf(fp, "Statistics of %s (%llu pixels):\n", name, pixels);
+        fprintf(fp, "%-10s %5s %5s %9s %7s %9s %9s\n", "channel", "min", "max", "mean", "median", "stddev", "clipped");
+    }
+    for (int c = 0; c < 4; c++) {
+        const unsigned long long *hist = (*stats).hist[c];
+        double sum = 0, squares = 0;
+        for (int v = 0; v < 256; v++) {
+            sum += (double)hist[v] * v;
+            squares += (double)hist[v] * v * v;
+        }
+        double mean = pixels ? sum / pixels : 0;
+        double variance = pixels ? squares / pixels - mean * mean : 0;
+        double clipped = pixels ? 100.0 * (hist[0] + hist[255]) / pixels : 0;
+        int low = stats_rank(hist, 0), high = 0, median = stats_rank(hist, pixels ? (pixels - 1) / 2 : 0);
+        for (int v = 255; v >= 0 && high == 0; v--) {
+            if (hist[v] != 0) high = v;
+        }
+        if (pixels == 0) low = 0;
+        double stddev = (variance > 0) ? sqrt(variance) : 0;
+        if (json) {
+            fprintf(fp, ", \"%s\": {\"min\": %d, \"max\": %d, \"mean\": %.3f, \"median\": %d, \"stddev\": %.3f, "
+                    "\"clipped\": %.3f, \"histogram\": [", channels[c], low, high, mean, median, stddev, clipped);
+            for (int v = 0; v < 256; v++) fprintf(fp, (v == 0) ? "%llu" : ", %llu", hist[v]);
+            fputs("]}", fp);
+        } else {
+            fprintf(fp, "%-10s %5d %5d %9.2f %7d %9.2f %8.2f%%\n", channels[c], low, high, mean, median, stddev, clipped);
+        }
+    }
+    if (json) fputs("}\n", fp);
+}
+
+/* One pass of the chain over the image, split into bands of rows */
+typedef struct {
+    filter_chain *chain;
+    int first, last;        // stages run in this pass
+    int gather;             // the statistics to gather for the next stage, as a STATS_ level, or 0
+    const image *source;        // rows are copied from here to data first, if set
+    image *data;
+    int bands;
+    image_stats *stats;         // statistics of each band
+    double (*seconds)[MAX_STAGES];      // time each band spent in each stage, if the chain is timed
+} chain_pass;
+
+/* Runs a stage over a row of the image, in the version for its layout */
+static inline void run_stage(stage *s, unsigned char *row, const image *img) {
+    if ((*img).plane != 0) {
+        unsigned char *planes[3] = {row, row + (*img).plane, row + 2 * (*img).plane};
+        (*s).run_planar(s, planes, (*img).width);
+    } else if ((*img).channels == 4) {
+        (*s).run_quad(s, (quad *)row, (*img).width);
+    } else {
+        (*s).run(s, (pixel *)row, (*img).width);
+    }
+}
+
+/* Adds a row of the image to the statistics, only totalling the RGB values
+   if that is all the stage needs, as they take far less work */
+static inline void gather_row(image_stats *stats, unsigned char *row, const image *img) {
+    unsigned char *planes[3] = {row, row + (*img).plane, row + 2 * (*img).plane};
+    if ((*stats).level >= STATS_HISTOGRAMS) {
+        if ((*img).plane != 0) {
+            stats_planes(stats, planes, (*img).width);
+        } else if ((*img).channels == 4) {
+            stats_quads(stats, (quad *)row, (*img).width);
+        } else {
+            stats_row(stats, (pixel *)row, (*img).width);
+        }
+        return;
+    }
+    if ((*img).plane != 0) {
+        wb_sum_planes((*stats).sums, planes, (*img).width);
+    } else if ((*img).channels == 4) {
+        wb_sum_quads((*stats).sums, (quad *)row, (*img).width);
+    } else {
+        wb_sum_row((*stats).sums, (pixel *)row, (*img).width);
+    }
+    (*stats).pixel_total += (*img).width;
+}
+
+/* Returns row i of the pass's image, copying it from the source first if set */
+static inline unsigned char *pass_row(chain_pass *pass, int i) {
+    unsigned char *row = IMAGE_ROW((*pass).data, i);
+    if ((*pass).source != NULL) memcpy(row, IMAGE_ROW((*pass).source, i), (*(*pass).data).stride);
+    return row;
+}
+
+/* Runs a band like run_band, timing every stage on every row. Gathering the
+   statistics counts towards the stage which needs them */
+static void timed_band(chain_pass *pass, int band, int start, int end) {
+    const image *img = (*pass).data;
+    double *seconds = (*pass).seconds[band];
+    for (int k = 0; k < MAX_STAGES; k++) seconds[k] = 0;
+    for (int i = start; i < end; i++) {
+        unsigned char *row = pass_row(pass, i);
+        double t = profile_clock();
+        for (int k = (*pass).first; k < (*pass).last; k++) {
+            run_stage(&(*(*pass).chain).stages[k], row, img);
+            double after = profile_clock();
+            seconds[k] += after - t;
+            t = after;
+        }
+        if ((*pass).gather) {
+            gather_row(&(*pass).stats[band], row, img);
+            seconds[(*pass).last] += profile_clock() - t;
+        }
+    }
+}
+
+/* Runs the stages of a pass over one band of rows */
+static void run_band(void *arg, int band) {
+    chain_pass *pass = arg;
+    const image *img = (*pass).data;
+    int height = (*img).height;
+    int start = (int)((long long)height * band / (*pass).bands), end = (int)((long long)height * (band + 1) / (*pass).bands);
+    image_stats *stats = ((*pass).gather) ? &(*pass).stats[band] : NULL;
+    if (stats != NULL) stats_clear(stats, (*pass).gather);
+    if ((*pass).seconds != NULL) {
+        timed_band(pass, band, start, end);
+    } else {
+        for (int i = start; i < end; i++) {
+            unsigned char *row = pass_row(pass, i);
+            for (int k = (*pass).first; k < (*pass).last; k++) run_stage(&(*(*pass).chain).stages[k], row, img);
+            if (stats != NULL) gather_row(stats, row, img);
+        }
+    }
+    if (stats != NULL) stats_finish(stats);
+}
+
+/* Runs stages first to last - 1 of the chain over every row of the image in
+   one pass, split into bands of rows across the thread pool. Rows are first
+   copied from source (which has the same layout), if set. If stats is set,
+   the filtered rows are added to it at its level, for a stage needing them;
+   each band keeps its own integer counts, which are added together
+   afterwards. Returns -1 if there is not enough memory */
+int run_pass(filter_chain *chain, int first, int last, const image *source, image *data, thread_pool *pool,
+             image_stats *stats) {
+    chain_pass pass = {chain, first, last, (stats != NULL) ? (*stats).level : 0, source, data, 1, NULL, NULL};
+    // Several bands per thread, so threads finishing early can take more
+    if (pool_threads(pool) > 1) pass.bands = pool_threads(pool) * 4;
+    if (pass.bands > (*data).height) pass.bands = ((*data).height > 0) ? (*data).height : 1;
+    if (stats != NULL) pass.stats = block_alloc((*chain).blocks, sizeof(image_stats) * pass.bands);
+    if ((*chain).timed) pass.seconds = block_alloc((*chain).blocks, sizeof(*pass.seconds) * pass.bands);
+    if ((stats != NULL && pass.stats == NULL) || ((*chain).timed && pass.seconds == NULL)) {
+        block_free((*chain).blocks, pass.stats);
+        block_free((*chain).blocks, pass.seconds);
+        return -1;
+    }
+    pool_run(pool, run_band, &pass, pass.bands);
+    if (stats != NULL) {
+        for (int band = 0; band < pass.bands; band++) stats_add(stats, &pass.stats[band]);
+    }
+    // Adding up the time of every band, so with several threads this is CPU time
+    if (pass.seconds != NULL) {
+        for (int band = 0; band < pass.bands; band++) {
+            for (int k = first; k <= last && k < (*chain).count; k++) (*chain).stages[k].seconds += pass.seconds[band][k];
+        }
+        long long bytes = (long long)(*data).channels * (*data).width * (*data).height;
+        for (int k = first; k < last; k++) (*chain).stages[k].bytes += bytes;
+    }
+    block_free((*chain).blocks, pass.stats);
+    block_free((*chain).blocks, pass.seconds);
+    return 0;
+}
+
+/* Finds the first stage from the given one which needs whole-image statistics
+   that are not ready yet, or which is a spatial or transposing stage, or the
+   end of the chain */
+int next_barrier(filter_chain *chain, int first, int prepared) {
+    int last = first;
+    while (last < (*chain).count && (((*chain).stages[last].prepare == NULL && (*chain).stages[last].spatial == NULL &&
+                                      (*chain).stages[last].transform == 0) || last == prepared)) last++;
+    return last;
+}
+
+/* Whether any stage of the chain is a spatial stage */
+static int has_spatial(filter_chain *chain) {
+    for (int k = 0; k < (*chain).count; k++) {
+        if ((*chain).stages[k].spatial != NULL) return 1;
+    }
+    return 0;
+}
+
+/* One spatial stage over a range of rows, split into tiles */
+typedef struct {
+    const spatial_filter *filter;
+    const image *source;
+    int source_first;       // row of the stage input the source starts at
+    int height;             // rows in the whole stage input
+    image *dest;
+    int first;              // row of the output dest starts at
+    int tile_width, tile_height, columns;
+    int lines, step;        // lines in each row (one, or one per plane), and bytes between values of a channel
+    block_pool *blocks;     // where the buffers of each tile come from
+    int failed;             // set if a tile could not get its buffers
+} spatial_pass;
+
+/* Bytes of the buffers of a tile of the pass, laid out one after another in
+   a single block: the intermediate values, the window of lines, the column
+   sums and a padded line. Every tile takes a block of the same size, that of
+   a whole tile, so the blocks of a pool suit any tile */
+static size_t spatial_tile_bytes(const spatial_pass *pass, size_t at[3]) {
+    int radius = (*(*pass).filter).radius, n = (*pass).tile_width * (*pass).step;
+    at[0] = align_row(sizeof(unsigned short) * n * (*pass).lines * ((*pass).tile_height + 2 * radius));
+    at[1] = at[0] + align_row(sizeof(unsigned short *) * (2 * radius + 1));
+    at[2] = at[1] + align_row(sizeof(int) * n);
+    return at[2] + n + 2 * radius * (*pass).step;
+}
+
+/* Filters one tile: the horizontal pass over the rows of the tile and the
+   radius rows above and below it into the tile's intermediate values, then
+   the vertical pass down them into dest */
+static void spatial_tile(void *arg, int tile) {
+    spatial_pass *pass = arg;
+    const spatial_filter *filter = (*pass).filter;
+    const image *source = (*pass).source;
+    image *dest = (*pass).dest;
+    int radius = (*filter).radius, step = (*pass).step, lines = (*pass).lines, width = (*dest).width;
+    int x0 = (tile % (*pass).columns) * (*pass).tile_width, x1 = x0 + (*pass).tile_width;
+    int y0 = (*pass).first + (tile / (*pass).columns) * (*pass).tile_height, y1 = y0 + (*pass).tile_height;
+    if (x1 > width) x1 = width;
+    if (y1 > (*pass).first + (*dest).height) y1 = (*pass).first + (*dest).height;
+    int n = (x1 - x0) * step, rows = y1 - y0 + 2 * radius;
+    size_t at[3];
+    unsigned char *block = (unsigned char *) block_alloc ((*pass).blocks, spatial_tile_bytes(pass, at));
+    if (block == NULL) {
+        (*pass).failed = 1;
+        return;
+    }
+    unsigned short *temp = (unsigned short *)block;
+    const unsigned short **window = (const unsigned short **)(block + at[0]);
+    int *sums = (int *)(block + at[1]);
+    unsigned char *padded = block + at[2];
+
+    /* Horizontal pass, rows beyond the top and bottom edges repeating the edge rows */
+    for (int i = 0; i < rows; i++) {
+        int y = y0 - radius + i;
+        y = (y < 0) ? 0 : (y >= (*pass).height) ? (*pass).height - 1 : y;
+        const unsigned char *row = IMAGE_ROW(source, y - (*pass).source_first);
+        for (int l = 0; l < lines; l++) {
+            pad_line(padded, row + l * (*source).plane, width, x0, x1, radius, step);
+            unsigned short *h = temp + ((size_t)i * lines + l) * n;
+            if ((*filter).type == SPATIAL_BOX) {
+                box_line(padded, h, n, step, radius);
+            } else {
+                kernels.convolve_line(padded, h, n, step, (*filter).weights, radius);
+            }
+        }
+    }
+
+    /* Vertical pass, one line at a time so a box blur keeps its column sums */
+    float scale = 1.0f / ((2 * radius + 1) * (2 * radius + 1));
+    for (int l = 0; l < lines; l++) {
+        if ((*filter).type == SPATIAL_BOX) {
+            memset(sums, 0, sizeof(int) * n);
+            for (int k = 0; k < 2 * radius; k++) {
+                const unsigned short *h = temp + ((size_t)k * lines + l) * n;
+                for (int j = 0; j < n; j++) sums[j] += h[j];
+            }
+        }
+        for (int y = y0; y < y1; y++) {
+            for (int k = 0; k <= 2 * radius; k++) window[k] = temp + ((size_t)(y - y0 + k) * lines + l) * n;
+            unsigned char *out = IMAGE_ROW(dest, y - (*pass).first) + l * (*dest).plane + (size_t)x0 * step;
+            const unsigned char *original = IMAGE_ROW(source, y - (*pass).source_first) + l * (*source).plane + (size_t)x0 * step;
+            if ((*filter).type == SPATIAL_BOX) {
+                kernels.box_columns(sums, window[2 * radius], window[0], scale, out, n);
+            } else {
+                kernels.convolve_columns(window, (*filter).weights, radius, (*filter).amount ? original : NULL,
+                                         (*filter).amount, (*filter).threshold, out, n);
+            }
+            // Alpha is left as it was
+            for (int j = 3; step == 4 && j < n; j += 4) out[j] = original[j];
+        }
+    }
+    block_free((*pass).blocks, block);
+}
+
+/* Runs spatial stage k of the chain over the rows of its input from source,
+   which holds rows source_first onwards of an input height rows tall, giving
+   the filtered rows first to first + (*dest).height - 1 in dest. The source
+   must hold the rows radius above and below those, as far as the image goes.
+   The image is filtered in tiles, as wide as fit the intermediate values of
+   enough rows in SPATIAL_TILE_BYTES (going down to 64 pixels), so both
+   passes over a tile work in L2. Tiles are shared out across the thread
+   pool, each filtering the rows around it from the source to dest. Returns
+   -1 if there is not enough memory for the buffers of the tiles */
+int run_spatial(filter_chain *chain, int k, const image *source, int source_first, int height, image *dest, int first,
+                thread_pool *pool) {
+    stage *s = &(*chain).stages[k];
+    double t = profile_clock();
+    int radius = (*(*s).spatial).radius, width = (*dest).width;
+    spatial_pass pass = {(*s).spatial, source, source_first, height, dest, first, width, 0, 1, 1, (*dest).channels,
+                         (*chain).blocks, 0};
+    if ((*dest).plane != 0) {
+        pass.lines = 3;
+        pass.step = 1;
+    }
+    // Rows each tile should hold, its own and the ones around it: for wide
+    // kernels at least as many of its own as around it, so the horizontal
+    // pass is not repeated over too many rows
+    size_t pixel_bytes = sizeof(unsigned short) * pass.lines * pass.step;
+    int rows = 2 * radius + ((radius > 8) ? 2 * radius : 16);
+    while (pass.tile_width > 64 && pass.tile_width * pixel_bytes * rows > SPATIAL_TILE_BYTES) {
+        pass.tile_width = (pass.tile_width + 1) / 2;
+    }
+    pass.tile_height = (int)(SPATIAL_TILE_BYTES / (pass.tile_width * pixel_bytes)) - 2 * radius;
+    if (pass.tile_height < rows - 2 * radius) pass.tile_height = rows - 2 * radius;
+    pass.columns = (width + pass.tile_width - 1) / pass.tile_width;
+    // Several tiles per thread, so threads finishing early can take more
+    int threads = pool_threads(pool);
+    while (threads > 1 && pass.tile_height > 16 &&
+           pass.columns * (((*dest).height + pass.tile_height - 1) / pass.tile_height) < threads * 4) {
+        pass.tile_height /= 2;
+    }
+    size_t at[3];
+    if (block_reserve(pass.blocks, spatial_tile_bytes(&pass, at), threads) != 0) return -1;
+    pool_run(pool, spatial_tile, &pass, pass.columns * (((*dest).height + pass.tile_height - 1) / pass.tile_height));
+    if ((*chain).timed) {
+        (*s).seconds += profile_clock() - t;
+        (*s).bytes += (long long)(*dest).channels * width * (*dest).height;
+    }
+    return pass.failed ? -1 : 0;
+}
+
+// A transposing stage over the whole image, shared out across the thread
+// pool in strips of TRANSFORM_TILE_ROWS rows
+typedef struct {
+    filter_chain *chain;
+    int first, last;        // stages run over each tile before it is turned, the last being the transposing one
+    int gather;             // STATS_ level to gather from the filtered tiles, 0 for none
+    const image *source;
+    image *dest;
+    image_stats *stats;     // statistics of each strip
+    double (*seconds)[MAX_STAGES];      // time each strip spent in each stage, if the chain is timed
+    int failed;             // set if a strip could not get its tile
+} transform_pass;
+
+/* Turns one strip of rows into columns of dest, a tile at a time. If there
+   are stages to run first, the rows of each tile are copied into a buffer
+   the size of a tile and filtered there, so they are turned while still in
+   cache; otherwise they are turned straight from the source */
+static void transform_strip(void *arg, int strip) {
+    transform_pass *pass = arg;
+    const image *source = (*pass).source;
+    image *dest = (*pass).dest;
+    stage *turn = &(*(*pass).chain).stages[(*pass).last];
+    int mirror = (*turn).transform & TRANSFORM_FLIP_X, height = (*source).height;
+    int y0 = strip * TRANSFORM_TILE_ROWS, rows = (height - y0 < TRANSFORM_TILE_ROWS) ? height - y0 : TRANSFORM_TILE_ROWS;
+    int lines = ((*source).plane != 0) ? 3 : 1, step = ((*source).plane != 0) ? 1 : (*source).channels;
+    image_stats *stats = ((*pass).gather) ? &(*pass).stats[strip] : NULL;
+    double *seconds = ((*pass).seconds != NULL) ? (*pass).seconds[strip] : NULL;
+    int staged = (*pass).first < (*pass).last || stats != NULL;
+    block_pool *blocks = (*(*pass).chain).blocks;
+    image tile = {0, 0, 0, 0, 0, NULL, 0};
+    // A whole tile even for the last strip, so the blocks of a pool suit every strip
+    if (staged && image_create_in(blocks, &tile, TRANSFORM_TILE_COLUMNS, TRANSFORM_TILE_ROWS, ((*source).plane != 0) ?
+                                  LAYOUT_PLANAR : ((*source).channels == 4) ? LAYOUT_BGRA : LAYOUT_BGR) != 0) {
+        (*pass).failed = 1;
+        return;
+    }
+    if (stats != NULL) stats_clear(stats, (*pass).gather);
+    if (seconds != NULL) {
+        for (int k = 0; k < MAX_STAGES; k++) seconds[k] = 0;
+    }
+    for (int x0 = 0; x0 < (*source).width; x0 += TRANSFORM_TILE_COLUMNS) {
+        int columns = ((*source).width - x0 < TRANSFORM_TILE_COLUMNS) ? (*source).width - x0 : TRANSFORM_TILE_COLUMNS;
+        const unsigned char *from = IMAGE_ROW(source, y0) + (size_t)x0 * step;
+        size_t from_stride = (*source).stride, from_plane = (*source).plane;
+        if (staged) {
+            tile.width = columns;
+            for (int i = 0; i < rows; i++) {
+                unsigned char *row = IMAGE_ROW(&tile, i);
+                for (int l = 0; l < lines; l++) {
+                    memcpy(row + l * tile.plane, from + i * from_stride + l * from_plane, (size_t)columns * step);
+                }
+                double t = (seconds != NULL) ? profile_clock() : 0;
+                for (int k = (*pass).first; k < (*pass).last; k++) {
+                    run_stage(&(*(*pass).chain).stages[k], row, &tile);
+                    if (seconds != NULL) {
+                        double after = profile_clock();
+                        seconds[k] += after - t;
+                        t = after;
+                    }
+                }
+                if (stats != NULL) gather_row(stats, row, &tile);
+            }
+            from = tile.data;
+            from_stride = tile.stride;
+            from_plane = tile.plane;
+        }
+        // Source row y becomes column y of dest, or column height - 1 - y when mirrored
+        double t = (seconds != NULL) ? profile_clock() : 0;
+        ptrdiff_t stride = mirror ? -(ptrdiff_t)from_stride : (ptrdiff_t)from_stride;
+        unsigned char *to = IMAGE_ROW(dest, x0) + (size_t)(mirror ? height - y0 - rows : y0) * step;
+        for (int l = 0; l < lines; l++) {
+            kernels.transpose(from + (mirror ? (rows - 1) * from_stride : 0) + l * from_plane, stride, to + l * (*dest).plane,
+                              (ptrdiff_t)(*dest).stride, rows, columns, step);
+        }
+        if (seconds != NULL) seconds[(*pass).last] += profile_clock() - t;
+    }
+    if (stats != NULL) stats_finish(stats);
+    image_release(blocks, &tile);
+}
+
+/* Runs transposing stage k of the chain over the image from source, turning
+   it into a new image which replaces data (whose memory is freed if it owns
+   it, or given back if it came from the chain's block pool). The new image
+   owns its memory, unless the chain has a block pool to take it from. Stages first to k - 1 run
+   over each tile of the image just before it is turned, so they and the
+   turn take one pass over the image, and if stats is set the filtered tiles
+   are added to it at its level. Tiles of TRANSFORM_TILE_ROWS rows are turned
+   into as many columns of the output, filling a cache line or more of each
+   row it touches, and strips of tiles are shared out across the thread pool.
+   Returns -1, leaving data as it was, if there is not enough memory */
+int run_transform(filter_chain *chain, int first, int k, const image *source, image *data, thread_pool *pool,
+                  image_stats *stats) {
+    image turned;
+    block_pool *blocks = (*chain).blocks;
+    int strips = ((*source).height + TRANSFORM_TILE_ROWS - 1) / TRANSFORM_TILE_ROWS;
+    int layout = ((*source).plane != 0) ? LAYOUT_PLANAR : ((*source).channels == 4) ? LAYOUT_BGRA : LAYOUT_BGR;
+    transform_pass pass = {chain, first, k, (stats != NULL) ? (*stats).level : 0, source, &turned, NULL, NULL, 0};
+    if (image_create_in(blocks, &turned, (*source).height, (*source).width, layout) != 0) return -1;
+    if (stats != NULL) pass.stats = (image_stats *) block_alloc (blocks, sizeof(image_stats) * (strips > 0 ? strips : 1));
+    if ((*chain).timed) pass.seconds = block_alloc(blocks, sizeof(*pass.seconds) * (strips > 0 ? strips : 1));
+    if ((stats != NULL && pass.stats == NULL) || ((*chain).timed && pass.seconds == NULL) ||
+        ((first < k || stats != NULL) &&
+         block_reserve(blocks, image_bytes(TRANSFORM_TILE_COLUMNS, TRANSFORM_TILE_ROWS, layout), pool_threads(pool)) != 0)) {
+        pass.failed = 1;
+    } else {
+        pool_run(pool, transform_strip, &pass, strips);
+    }
+    if (pass.failed) {
+        block_free(blocks, pass.stats);
+        block_free(blocks, pass.seconds);
+        image_release(blocks, &turned);
+        return -1;
+    }
+    if (stats != NULL) {
+        for (int strip = 0; strip < strips; strip++) stats_add(stats, &pass.stats[strip]);
+    }
+    if (pass.seconds != NULL) {
+        for (int strip = 0; strip < strips; strip++) {
+            for (int j = first; j <= k; j++) (*chain).stages[j].seconds += pass.seconds[strip][j];
+        }
+        long long bytes = (long long)(*source).channels * (*source).width * (*source).height;
+        for (int j = first; j <= k; j++) (*chain).stages[j].bytes += bytes;
+    }
+    block_free(blocks, pass.stats);
+    block_free(blocks, pass.seconds);
+    image_release(blocks, data);
+    *data = turned;
+    return 0;
+}
+
+// A resize shared out across the thread pool, in bands of output rows which
+// are split into parts along the row when there are too few rows to go round.
+// Each thread takes the next part until there are none left
+typedef struct {
+    const resizer *r;
+    const image *source;
+    int source_first;
+    image *dest;
+    int first;
+    int bands, parts;
+    pthread_mutex_t lock;
+    int next;
+} resize_pass;
+
+/* Resizes one part of one band of rows in the line and rows of the thread
+   in slot: the vertical pass over the input columns the part's output pixels
+   take in, then the horizontal pass */
+static void resize_part(resize_pass *pass, int job, int slot) {
+    const resizer *r = (*pass).r;
+    const image *source = (*pass).source;
+    image *dest = (*pass).dest;
+    int channels = (*r).channels, taps = (*r).y.taps, band = job / (*pass).parts, part = job % (*pass).parts;
+    int start = (int)((long long)(*dest).height * band / (*pass).bands);
+    int end = (int)((long long)(*dest).height * (band + 1) / (*pass).bands);
+    int x0 = (int)((long long)(*r).x.out * part / (*pass).parts), x1 = (int)((long long)(*r).x.out * (part + 1) / (*pass).parts);
+    if (start == end || x0 == x1) return;
+    int in0 = (*r).x.start[x0], in1 = (*r).x.start[x1 - 1] + (*r).x.taps;
+    unsigned short *line = (*r).lines + ((size_t)(*r).x.in * channels + 4) * slot;
+    const unsigned char **rows = (*r).rows + (size_t)taps * slot;
+    for (int i = start; i < end; i++) {
+        int y = (*pass).first + i;
+        for (int k = 0; k < taps; k++) {
+            rows[k] = IMAGE_ROW(source, (*r).y.start[y] + k - (*pass).source_first) + (size_t)in0 * channels;
+        }
+        kernels.resample_columns(rows, (*r).y.weights + (size_t)y * taps, taps, line + (size_t)in0 * channels,
+                                 (in1 - in0) * channels);
+        kernels.resample_line(line, IMAGE_ROW(dest, i), &(*r).x, x0, x1, channels);
+    }
+}
+
+/* Resizes parts for as long as there are any left, as the thread in slot */
+static void resize_parts(void *arg, int slot) {
+    resize_pass *pass = arg;
+    for (;;) {
+        pthread_mutex_lock(&(*pass).lock);
+        int job = (*pass).next++;
+        pthread_mutex_unlock(&(*pass).lock);
+        if (job >= (*pass).bands * (*pass).parts) break;
+        resize_part(pass, job, slot);
+    }
+}
+
+/* Resizes the rows of an image of packed pixels from source, which holds
+   input rows source_first onwards, giving output rows first to first +
+   (*dest).height - 1 in dest. The source must hold every input row those
+   take in. Bands of rows are shared out across the thread pool, and when
+   only a few rows are made at a time (as when downscaling while reading)
+   each row is split into parts as well so every thread has work. No more
+   threads are used than the resizer was made for */
+void run_resize(const resizer *r, const image *source, int source_first, image *dest, int first, thread_pool *pool) {
+    resize_pass pass;
+    pass.r = r;
+    pass.source = source;
+    pass.source_first = source_first;
+    pass.dest = dest;
+    pass.first = first;
+    pass.bands = pass.parts = 1;
+    pass.next = 0;
+    int threads = pool_threads(pool);
+    if (threads > (*r).threads) threads = (*r).threads;
+    if (threads > 1) {
+        // Several jobs per thread, so threads finishing early can take more
+        pass.bands = threads * 4;
+        if (pass.bands > (*dest).height) {
+            pass.bands = ((*dest).height > 0) ? (*dest).height : 1;
+            pass.parts = (threads * 4 + pass.bands - 1) / pass.bands;
+            if (pass.parts > (*r).x.out / 64) pass.parts = ((*r).x.out >= 128) ? (*r).x.out / 64 : 1;
+        }
+    }
+    if (threads == 1) {
+        for (int job = 0; job < pass.bands * pass.parts; job++) resize_part(&pass, job, 0);
+        return;
+    }
+    pthread_mutex_init(&pass.lock, NULL);
+    pool_run(pool, resize_parts, &pass, threads);
+    pthread_mutex_destroy(&pass.lock);
+}
+
+/* Resizes a whole image of packed pixels to the size of dest, which has the
+   same pixels. Returns -1 if there is not enough memory */
+int resize_image(const image *source, image *dest, int kernel, thread_pool *pool) {
+    resize_spec spec = {(*dest).width, (*dest).height, 0, kernel};
+    resizer r;
+    if (resizer_create(&r, (*source).width, (*source).height, (*source).channels, &spec, pool_threads(pool)) != 0) return -1;
+    run_resize(&r, source, 0, dest, 0, pool);
+    resizer_free(&r);
+    return 0;
+}
+
+/* Runs the filter chain over the image. All stages up to the next stage that
+   needs whole-image statistics are fused into one pass, so each row goes
+   through all of them while it is still in cache. The statistics for that
+   stage are gathered in the same pass (or in a reduction-only pass if it is
+   the first stage), giving one sweep of the image per statistics stage
+   rather than one per filter. A spatial stage needs the rows around each
+   row, so it runs by itself between passes. Returns -1 if there is not
+   enough memory for a pass */
+int run_chain(filter_chain *chain, image *data, thread_pool *pool) {
+    return run_chain_copy(chain, NULL, data, pool, NULL);
+}
+
+/* Runs the filter chain like run_chain, but reads the image from source and
+   writes the result to data, copying each row over in the first pass. Both
+   images must have the same layout. If stats is set, the filtered image is
+   added to it in the last pass, so it costs no extra sweep of the image.
+   Spatial stages filter into a second image, which is swapped with data if
+   data owns its memory and is otherwise copied back in the next pass. A
+   transposing stage turns the image into a new one of its own, which
+   replaces data as run_transform does, so the caller frees data afterwards
+   with image_release if it owns the memory then or the chain has a block
+   pool. Any memory a pass needs comes from that pool if there is one.
+   Returns -1 if there is not enough memory, data being left part filtered */
+int run_chain_copy(filter_chain *chain, const image *source, image *data, thread_pool *pool, image_stats *stats) {
+    int first = 0, prepared = -1, spatial_last = 0, failed = 0;
+    block_pool *blocks = (*chain).blocks;
+    image scratch = {0, 0, 0, 0, 0, NULL, 0};
+    do {
+        int last = next_barrier(chain, first, prepared);
+        stage *next = (last < (*chain).count) ? &(*chain).stages[last] : NULL;
+        if (next != NULL && (*next).transform != 0) {
+            // The stages before it run in the same pass, gathering the statistics if it is the last stage
+            if (run_transform(chain, first, last, (source != NULL) ? source : data, data, pool,
+                              (last + 1 == (*chain).count) ? stats : NULL) != 0) {
+                failed = 1;
+                break;
+            }
+            image_release(blocks, &scratch);        // the wrong size now
+            source = NULL;
+            first = last + 1;
+            spatial_last = 0;
+            continue;
+        }
+        image_stats gathered, *gather = stats;
+        if (next != NULL) gather = ((*next).prepare != NULL) ? &gathered : NULL;
+        if (gather == &gathered) stats_clear(&gathered, (*next).stats);
+        if ((first < last || source != NULL || gather != NULL) && run_pass(chain, first, last, source, data, pool, gather) != 0) {
+            failed = 1;
+            break;
+        }
+        source = NULL;      // later passes work on the copied rows
+        first = last;
+        spatial_last = (next != NULL && (*next).spatial != NULL);
+        if (spatial_last) {
+            if (scratch.data == NULL) {
+                void *memory = block_alloc(blocks, (*data).stride * ((*data).height > 0 ? (*data).height : 1));
+                if (memory == NULL) {
+                    failed = 1;
+                    break;
+                }
+                memset(memory, 0, (*data).stride * (*data).height);        // so any row padding copied back is zeroed
+                scratch = *data;
+                scratch.data = memory;
+                scratch.owned = (blocks == NULL);
+            }
+            if (run_spatial(chain, last, data, 0, (*data).height, &scratch, 0, pool) != 0) {
+                failed = 1;
+                break;
+            }
+            // Swapped only when both are the same kind of memory
+            if ((*data).owned && scratch.owned) {
+                unsigned char *filtered = scratch.data;
+                scratch.data = (*data).data;
+                (*data).data = filtered;
+            } else {
+                source = &scratch;
+            }
+            first = last + 1;
+        } else if (next != NULL) {
+            // Statistics are ready for the next stage
+            (*next).prepare(next, &gathered);
+            prepared = last;
+        }
+    } while (first < (*chain).count || (spatial_last && (source != NULL || stats != NULL)));
+    image_release(blocks, &scratch);
+    return failed ? -1 : 0;
+}
+
+/* Adds up how many pixels of an indexed image use each color, from rows of
+   stride bytes holding bpp bits per pixel, most significant bits first */
+void palette_count(unsigned long long counts[256], const unsigned char *rows, int width, int height, int bpp, size_t stride) {
+    int mask = (1 << bpp) - 1;
+    for (int i = 0; i < height; i++) {
+        const unsigned char *row = rows + (size_t)i * stride;
+        if (bpp == 8) {
+            for (int j = 0; j < width; j++) counts[row[j]]++;
+            continue;
+        }
+        for (int j = 0; j < width; j++) {
+            int bit = j * bpp;
+            counts[(row[bit >> 3] >> (8 - bpp - (bit & 7))) & mask]++;
+        }
+    }
+}
+
+/* Runs the filter chain over the color table of an indexed image instead of
+   its pixels, as every filter works on each color by itself. A stage needing
+   the statistics of the image gets them by weighting each color with counts,
+   the number of pixels using it, which may be NULL if no stage needs them */
+void palette_filter(filter_chain *chain, unsigned char *table, int colors, const unsigned long long counts[256]) {
+    pixel entries[256];
+    // Table entries are blue, green, red and a reserved byte
+    for (int v = 0; v < colors; v++) memcpy(&entries[v], table + 4 * v, sizeof(pixel));
+    for (int k = 0; k < (*chain).count; k++) {
+        stage *s = &(*chain).stages[k];
+        double t = profile_clock();
+        if ((*s).prepare != NULL) {
+            image_stats stats;
+            stats_clear(&stats, (*s).stats);
+            stats_palette(&stats, entries, colors, counts);
+            (*s).prepare(s, &stats);
+        }
+        (*s).run(s, entries, colors);
+        if ((*chain).timed) {
+            (*s).seconds += profile_clock() - t;
+            (*s).bytes += sizeof(pixel) * colors;
+        }
+    }
+    for (int v = 0; v < colors; v++) memcpy(table + 4 * v, &entries[v], sizeof(pixel));
+}
+
+/* Adds the colors of an indexed image to the statistics from its color table */
+static void table_stats(image_stats *stats, const unsigned char *table, int colors, const unsigned long long counts[256]) {
+    pixel entries[256];
+    for (int v = 0; v < colors; v++) memcpy(&entries[v], table + 4 * v, sizeof(pixel));
+    stats_palette(stats, entries, colors, counts);
+}
+
+/* Returns the index of pixel x in a row of 4 or 8-bit indices */
+static inline int row_index(const unsigned char *row, int x, int bpp) {
+    return (bpp == 8) ? row[x] : (row[x >> 1] >> ((x & 1) ? 0 : 4)) & 15;
+}
+
+/* Sets the index of pixel x in a row of 4 or 8-bit indices */
+static inline void set_index(unsigned char *row, int x, int bpp, int value) {
+    if (bpp == 8) {
+        row[x] = value;
+        return;
+    }
+    int shift = (x & 1) ? 0 : 4;
+    row[x >> 1] = (row[x >> 1] & ~(15 << shift)) | value << shift;
+}
+
+/* Starts decoding bytes of run-length encoded pixels of an image with 4 or
+   8 bpp, either held in data or, if data is NULL, read from fp a block at a
+   time. Returns -1 if allocation fails */
+int rle_open(rle_reader *r, FILE *fp, const unsigned char *data, size_t bytes, int width, int height, int bpp) {
+    memset(r, 0, sizeof(*r));
+    (*r).fp = fp;
+    (*r).width = width;
+    (*r).height = height;
+    (*r).bpp = bpp;
+    if (data != NULL) {
+        (*r).data = data;
+        (*r).end = bytes;
+        return 0;
+    }
+    (*r).remaining = bytes;
+    (*r).buffer = (unsigned char *) malloc (RLE_BLOCK);
+    (*r).data = (*r).buffer;
+    return ((*r).buffer == NULL) ? -1 : 0;
+}
+
+/* Makes sure need bytes of encoded pixels are held from start, reading more
+   of the file if they are not. Returns how many are, up to need */
+static size_t rle_fill(rle_reader *r, size_t need) {
+    size_t held = (*r).end - (*r).start;
+    if (held < need && (*r).remaining > 0) {
+        memmove((*r).buffer, (*r).buffer + (*r).start, held);
+        size_t n = RLE_BLOCK - held;
+        if ((long long)n > (*r).remaining) n = (*r).remaining;
+        n = fread((*r).buffer + held, 1, n, (*r).fp);
+        (*r).remaining = (n == 0) ? -1 : (*r).remaining - n;
+        (*r).start = 0;
+        (*r).end = held + n;
+        held += n;
+    }
+    return (held < need) ? held : need;
+}
+
+/* Decodes the next run, moving past the ends of lines and the jumps (deltas)
+   before it. Returns 1 with the run, 0 at the end of the bitmap, or -1 if
+   the pixels are corrupt or end part way through a code. Literal indices
+   are only kept until the next call */
+int rle_next(rle_reader *r, rle_run *run) {
+    while (!(*r).done) {
+        size_t held = rle_fill(r, 2);
+        if (held == 0 && (*r).remaining == 0) break;    // a missing end of bitmap is allowed
+        if (held < 2) return -1;
+        const unsigned char *code = (*r).data + (*r).start;
+        int count = code[0];
+        if (count > 0) {
+            // Encoded mode: a count and the index (or two for RLE4) to repeat
+            if ((*r).y >= (*r).height || (*r).x + count > (*r).width) return -1;
+            (*run).x = (*r).x;
+            (*run).y = (*r).y;
+            (*run).length = count;
+            (*run).value = code[1];
+            (*run).literal = NULL;
+            (*r).x += count;
+            (*r).start += 2;
+            return 1;
+        } else if (code[1] == 0) {
+            (*r).x = 0;
+            (*r).y++;
+            (*r).start += 2;
+        } else if (code[1] == 1) {
+            (*r).start += 2;
+            break;
+        } else if (code[1] == 2) {
+            if (rle_fill(r, 4) < 4) return -1;
+            code = (*r).data + (*r).start;
+            (*r).x += code[2];
+            (*r).y += code[3];
+            (*r).start += 4;
+            if ((*r).x > (*r).width || (*r).y > (*r).height) return -1;
+        } else {
+            // Absolute mode: 3 or more literal indices, padded to a 16-bit boundary
+            count = code[1];
+            size_t bytes = ((size_t)count * (*r).bpp + 7) / 8;
+            bytes += bytes & 1;
+            if (rle_fill(r, 2 + bytes) < 2 + bytes) return -1;
+            if ((*r).y >= (*r).height || (*r).x + count > (*r).width) return -1;
+            (*run).x = (*r).x;
+            (*run).y = (*r).y;
+            (*run).length = count;
+            (*run).value = 0;
+            (*run).literal = (*r).data + (*r).start + 2;
+            (*r).x += count;
+            (*r).start += 2 + bytes;
+            return 1;
+        }
+    }
+    (*r).done = 1;
+    return 0;
+}
+
+/* Decodes the next row into row, packed as in an uncompressed image with its
+   padding. Pixels the encoding skips over are left as index 0. Returns -1
+   if the pixels are corrupt */
+int rle_row(rle_reader *r, unsigned char *row) {
+    int bpp = (*r).bpp;
+    memset(row, 0, ((size_t)(*r).width * bpp + 31) / 32 * 4);
+    for (;;) {
+        if (!(*r).pending) {
+            int found = rle_next(r, &(*r).run);
+            if (found <= 0) {
+                if (found < 0) return -1;
+                break;
+            }
+            (*r).pending = 1;
+        }
+        const rle_run *run = &(*r).run;
+        if ((*run).y > (*r).row) break;
+        if ((*run).literal != NULL && bpp == 8) {
+            memcpy(row + (*run).x, (*run).literal, (*run).length);
+        } else if ((*run).literal != NULL && !((*run).x & 1)) {
+            memcpy(row + (*run).x / 2, (*run).literal, (*run).length / 2);
+            if ((*run).length & 1) set_index(row, (*run).x + (*run).length - 1, 4, (*run).literal[(*run).length / 2] >> 4);
+        } else if ((*run).literal != NULL) {
+            for (int k = 0; k < (*run).length; k++) set_index(row, (*run).x + k, bpp, row_index((*run).literal, k, bpp));
+        } else if (bpp == 8) {
+            memset(row + (*run).x, (*run).value, (*run).length);
+        } else {
+            // From an even pixel on, the two indices fill whole bytes
+            int x = (*run).x, n = (*run).length, value = (*run).value;
+            if (x & 1) {
+                set_index(row, x++, 4, value >> 4);
+                n--;
+                value = (value << 4 | value >> 4) & 0xff;
+            }
+            memset(row + x / 2, value, n / 2);
+            if (n & 1) set_index(row, x + n - 1, 4, value >> 4);
+        }
+        (*r).pending = 0;
+    }
+    (*r).row++;
+    return 0;
+}
+
+void rle_close(rle_reader *r) {
+    free((*r).buffer);
+    (*r).buffer = NULL;
+}
+
+/* Adds up how many pixels of a run-length encoded image use each color, a
+   run at a time rather than a pixel at a time. Pixels the encoding skips
+   over are index 0. Returns -1 if the pixels are corrupt */
+int rle_count(unsigned long long counts[256], const unsigned char *data, size_t bytes, int width, int height, int bpp) {
+    rle_reader r;
+    rle_run run;
+    unsigned long long counted = 0;
+    int found;
+    rle_open(&r, NULL, data, bytes, width, height, bpp);
+    while ((found = rle_next(&r, &run)) > 0) {
+        counted += run.length;
+        if (run.literal != NULL) {
+            for (int k = 0; k < run.length; k++) counts[row_index(run.literal, k, bpp)]++;
+        } else if (bpp == 8) {
+            counts[run.value] += run.length;
+        } else {
+            counts[run.value >> 4] += (run.length + 1) / 2;
+            counts[run.value & 15] += run.length / 2;
+        }
+    }
+    counts[0] += (unsigned long long)width * height - counted;
+    return found;
+}
+
+/* Returns how many pixels from x on repeat the index at x, or for 4 bpp the
+   two indices from x taking turns, up to the 255 a run can hold */
+static int rle_span(const unsigned char *row, int x, int width, int bpp) {
+    int limit = (width - x < 255) ? width - x : 255, n = 1;
+    if (bpp == 8) {
+        while (n < limit && row[x + n] == row[x]) n++;
+        return n;
+    }
+    // Whole bytes the same as the first hold the same two indices
+    if (!(x & 1) && limit > 1) {
+        int bytes = 1;
+        while (2 * (bytes + 1) <= limit && row[(x >> 1) + bytes] == row[x >> 1]) bytes++;
+        n = 2 * bytes;
+    }
+    while (n < limit && row_index(row, x + n, 4) == row_index(row, x + (n & 1), 4)) n++;
+    return n;
+}
+
+/* Run-length encodes a row of 8 or 4-bit indices as RLE8 or RLE4 into out,
+   which holds RLE_ROW_BOUND(width) bytes, ending it with the end of the line
+   or, for the last row, of the bitmap. Returns the bytes written. Runs shorter
+   than a literal would take are put in literals, and literals too short for
+   absolute mode are written as runs of their own */
+size_t rle_encode_row(unsigned char *out, const unsigned char *row, int width, int bpp, int last) {
+    int shortest = (bpp == 8) ? 3 : 5;
+    size_t n = 0;
+    int x = 0;
+    while (x < width) {
+        int span = rle_span(row, x, width, bpp);
+        if (span >= shortest) {
+            out[n++] = span;
+            out[n++] = (bpp == 8) ? row[x] : row_index(row, x, 4) << 4 | row_index(row, x + 1, 4);
+            x += span;
+            continue;
+        }
+        int end = x + 1;
+        while (end < width && end - x < 255 && rle_span(row, end, width, bpp) < shortest) end++;
+        int count = end - x;
+        if (count < 3) {
+            // 1 and 2 after a zero byte mean the end of the bitmap and a jump, so these are runs
+            for (; x < end; x++) {
+                out[n++] = 1;
+                out[n++] = (bpp == 8) ? row[x] : row_index(row, x, 4) << 4;
+            }
+            continue;
+        }
+        out[n++] = 0;
+        out[n++] = count;
+        size_t bytes = ((size_t)count * bpp + 7) / 8;
+        if (bpp == 8) {
+            memcpy(out + n, row + x, count);
+        } else {
+            memset(out + n, 0, bytes);
+            for (int k = 0; k < count; k++) set_index(out + n, k, 4, row_index(row, x + k, 4));
+        }
+        n += bytes;
+        if (bytes & 1) out[n++] = 0;
+        x = end;
+    }
+    out[n++] = 0;
+    out[n++] = last ? 1 : 0;
+    return n;
+}
+
+/* Returns the monotonic clock in seconds */
+double profile_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Starts profiling a run */
+void profile_start(profile *prof) {
+    if (prof == NULL) return;
+    (*prof).count = 0;
+    (*prof).start = profile_clock();
+}
+
+/* Adds the time since start to a step of the profile, along with the bytes
+   it moved. Steps done several times (like reading each window of rows) add
+   up under one name. Does nothing without a profile */
+void profile_add(profile *prof, const char *name, double start, long long bytes) {
+    if (prof == NULL) return;
+    double seconds = profile_clock() - start;
+    int k = 0;
+    while (k < (*prof).count && strcmp((*prof).steps[k].name, name) != 0) k++;
+    if (k == (*prof).count) {
+        if (k == MAX_STEPS) return;
+        (*prof).steps[k].name = name;
+        (*prof).steps[k].seconds = 0;
+        (*prof).steps[k].bytes = 0;
+        (*prof).count++;
+    }
+    (*prof).steps[k].seconds += seconds;
+    (*prof).steps[k].bytes += bytes;
+}
+
+/* Adds the time spent in each stage of a timed chain to the profile */
+void profile_chain(profile *prof, filter_chain *chain) {
+    if (prof == NULL) return;
+    for (int k = 0; k < (*chain).count && (*prof).count < MAX_STEPS; k++) {
+        stage *s = &(*chain).stages[k];
+        (*prof).steps[(*prof).count].name = (*s).name;
+        (*prof).steps[(*prof).count].seconds = (*s).seconds;
+        (*prof).steps[(*prof).count].bytes = (*s).bytes;
+        (*prof).count++;
+    }
+}
+
+/* Prints the profile as a table, or as one JSON object per line, followed by
+   the total time and the peak memory use */
+void profile_print(FILE *fp, profile *prof, int json) {
+    double total = profile_clock() - (*prof).start;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    if (!json) fprintf(fp, "%-36s %12s %12s %10s\n", "step", "seconds", "MB", "MB/s");
+    for (int k = 0; k < (*prof).count; k++) {
+        double seconds = (*prof).steps[k].seconds, mb = (*prof).steps[k].bytes / 1e6;
+        double rate = (seconds > 0) ? mb / seconds : 0;
+        if (json) {
+            fprintf(fp, "{\"step\": \"%s\", \"seconds\": %.6f, \"bytes\": %lld, \"mb_per_s\": %.1f}\n",
+                    (*prof).steps[k].name, seconds, (*prof).steps[k].bytes, rate);
+        } else {
+            fprintf(fp, "%-36s %12.6f %12.2f %10.1f\n", (*prof).steps[k].name, seconds, mb, rate);
+        }
+    }
+    if (json) {
+        fprintf(fp, "{\"step\": \"total\", \"seconds\": %.6f, \"peak_rss_kb\": %ld}\n", total, usage.ru_maxrss);
+    } else {
+        fprintf(fp, "%-36s %12.6f\nPeak memory: %ld KB\n", "total", total, usage.ru_maxrss);
+    }
+}
+
+/* Reports a failed read or write of a streamed file and exits */
+static void io_fail(int failed) {
+    if (failed == 1) fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+    if (failed == 2) fprintf(stderr, "%s writing the temporary copy of the input failed.\n", ERROR_HEADER);
+    if (failed == 3) fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+    exit(EXIT_FAILURE);
+}
+
+/* Reads or writes one chunk of a streamed file, copying what is read to the
+   spool file as well if one is set. Returns 0, or what failed for io_fail */
+static int io_move(io_stream *s, unsigned char *data, size_t bytes) {
+    if ((*s).writing) return (fwrite(data, 1, bytes, (*s).fp) == bytes) ? 0 : 3;
+    if (fread(data, 1, bytes, (*s).fp) != bytes) return 1;
+    if ((*s).spool != NULL && fwrite(data, 1, bytes, (*s).spool) != bytes) return 2;
+    return 0;
+}
+
+/* Reads the chunks of a streamed file into the ring, as long as there is
+   room for them, until every byte has been read or the stream is closed */
+static void *io_reader(void *arg) {
+    io_stream *s = arg;
+    pthread_mutex_lock(&(*s).lock);
+    while ((*s).remaining > 0 && !(*s).failed) {
+        while ((*s).count == (*s).depth && !(*s).done) pthread_cond_wait(&(*s).changed, &(*s).lock);
+        if ((*s).done) break;
+        // The filters only take chunks from the head, so the one after the last is free while it is read
+        int slot = ((*s).head + (*s).count) % (*s).depth;
+        size_t bytes = ((long long)(*s).chunk < (*s).remaining) ? (*s).chunk : (size_t)(*s).remaining;
+        pthread_mutex_unlock(&(*s).lock);
+        double t = profile_clock();
+        int failed = io_move(s, (*s).data + slot * (*s).chunk, bytes);
+        (*s).io_seconds += profile_clock() - t;
+        pthread_mutex_lock(&(*s).lock);
+        if (failed) {
+            (*s).failed = failed;
+        } else {
+            (*s).length[slot] = bytes;
+            (*s).count++;
+            (*s).remaining -= bytes;
+        }
+        pthread_cond_broadcast(&(*s).changed);
+    }
+    pthread_mutex_unlock(&(*s).lock);
+    return NULL;
+}
+
+/* Writes the chunks the filters hand over, in order, until the stream is
+   closed and they have all been written. After a failed write the rest
+   are dropped */
+static void *io_writer(void *arg) {
+    io_stream *s = arg;
+    pthread_mutex_lock(&(*s).lock);
+    for (;;) {
+        while ((*s).count == 0 && !(*s).done) pthread_cond_wait(&(*s).changed, &(*s).lock);
+        if ((*s).count == 0) break;
+        int slot = (*s).head;
+        pthread_mutex_unlock(&(*s).lock);
+        double t = profile_clock();
+        int failed = (*s).failed ? (*s).failed : io_move(s, (*s).data + slot * (*s).chunk, (*s).length[slot]);
+        (*s).io_seconds += profile_clock() - t;
+        pthread_mutex_lock(&(*s).lock);
+        (*s).failed = failed;
+        (*s).head = ((*s).head + 1) % (*s).depth;
+        (*s).count--;
+        pthread_cond_broadcast(&(*s).changed);
+    }
+    pthread_mutex_unlock(&(*s).lock);
+    return NULL;
+}
+
+/* Opens a stream reading bytes from fp (copying them to spool as well if
+   set), or writing to fp, as io asks. A thread is started to read ahead of
+   or write behind the filters, unless the depth is 0 or there is no memory
+   for the chunks, when the filtering thread reads and writes itself */
+void io_open(io_stream *s, FILE *fp, FILE *spool, long long bytes, int writing, const io_spec *io) {
+    memset(s, 0, sizeof(io_stream));
+    (*s).fp = fp;
+    (*s).spool = spool;
+    (*s).writing = writing;
+    (*s).remaining = bytes;
+    (*s).chunk = (*io).chunk;
+    (*s).depth = (*io).depth;
+    if ((*s).depth == 0) return;
+    (*s).data = (unsigned char *) malloc ((*s).chunk * (*s).depth);
+    (*s).length = (size_t *) malloc (sizeof(size_t) * (*s).depth);
+    pthread_mutex_init(&(*s).lock, NULL);
+    pthread_cond_init(&(*s).changed, NULL);
+    if ((*s).data == NULL || (*s).length == NULL ||
+        pthread_create(&(*s).thread, NULL, writing ? io_writer : io_reader, s) != 0) {
+        free((*s).data);
+        free((*s).length);
+        pthread_mutex_destroy(&(*s).lock);
+        pthread_cond_destroy(&(*s).changed);
+        (*s).depth = 0;
+    }
+}
+
+/* Reads the next bytes of a stream into data, waiting for the chunks
+   holding them if they have not been read yet. Returns 0, or what failed
+   for io_fail */
+static int io_take(io_stream *s, unsigned char *data, size_t bytes) {
+    if ((*s).depth == 0) return io_move(s, data, bytes);
+    while (bytes > 0) {
+        pthread_mutex_lock(&(*s).lock);
+        double t = profile_clock();
+        while ((*s).count == 0 && !(*s).failed) pthread_cond_wait(&(*s).changed, &(*s).lock);
+        (*s).wait_seconds += profile_clock() - t;
+        if ((*s).count == 0) {
+            pthread_mutex_unlock(&(*s).lock);
+            return (*s).failed;
+        }
+        int slot = (*s).head;
+        size_t n = (*s).length[slot] - (*s).offset;
+        pthread_mutex_unlock(&(*s).lock);
+        if (n > bytes) n = bytes;
+        memcpy(data, (*s).data + slot * (*s).chunk + (*s).offset, n);
+        data += n;
+        bytes -= n;
+        (*s).offset += n;
+        if ((*s).offset == (*s).length[slot]) {
+            // Giving the chunk back to the reader
+            pthread_mutex_lock(&(*s).lock);
+            (*s).head = ((*s).head + 1) % (*s).depth;
+            (*s).count--;
+            (*s).offset = 0;
+            pthread_cond_broadcast(&(*s).changed);
+            pthread_mutex_unlock(&(*s).lock);
+        }
+    }
+    return 0;
+}
+
+/* Reads the next bytes of a stream into data as io_take does, exiting if
+   they cannot be read */
+void io_read(io_stream *s, unsigned char *data, size_t bytes) {
+    int failed = io_take(s, data, bytes);
+    if (failed) io_fail(failed);
+}
+
+/* Hands the chunk being filled over to the writer */
+static void io_hand(io_stream *s) {
+    pthread_mutex_lock(&(*s).lock);
+    (*s).length[((*s).head + (*s).count) % (*s).depth] = (*s).offset;
+    (*s).count++;
+    (*s).offset = 0;
+    pthread_cond_broadcast(&(*s).changed);
+    pthread_mutex_unlock(&(*s).lock);
+}
+
+/* Writes bytes from data to a stream, waiting for a free chunk to put them
+   in if the writer is behind */
+void io_write(io_stream *s, const unsigned char *data, size_t bytes) {
+    if ((*s).depth == 0) {
+        int failed = io_move(s, (unsigned char *)data, bytes);
+        if (failed) io_fail(failed);
+        return;
+    }
+    while (bytes > 0) {
+        pthread_mutex_lock(&(*s).lock);
+        double t = profile_clock();
+        while ((*s).count == (*s).depth && !(*s).failed) pthread_cond_wait(&(*s).changed, &(*s).lock);
+        (*s).wait_seconds += profile_clock() - t;
+        if ((*s).failed) io_fail((*s).failed);
+        int slot = ((*s).head + (*s).count) % (*s).depth;
+        pthread_mutex_unlock(&(*s).lock);
+        size_t n = (*s).chunk - (*s).offset;
+        if (n > bytes) n = bytes;
+        memcpy((*s).data + slot * (*s).chunk + (*s).offset, data, n);
+        data += n;
+        bytes -= n;
+        (*s).offset += n;
+        if ((*s).offset == (*s).chunk) io_hand(s);
+    }
+}
+
+/* Closes a stream, waiting for the writes still behind the filters, and
+   adds the time spent reading or writing while the filters ran to the
+   profile. The file itself is left open */
+void io_close(io_stream *s, profile *prof) {
+    if ((*s).depth == 0) return;
+    if ((*s).writing && (*s).offset > 0) io_hand(s);
+    pthread_mutex_lock(&(*s).lock);
+    (*s).done = 1;
+    pthread_cond_broadcast(&(*s).changed);
+    pthread_mutex_unlock(&(*s).lock);
+    pthread_join((*s).thread, NULL);
+    free((*s).data);
+    free((*s).length);
+    pthread_mutex_destroy(&(*s).lock);
+    pthread_cond_destroy(&(*s).changed);
+    if ((*s).writing && (*s).failed) io_fail((*s).failed);
+    double hidden = (*s).io_seconds - (*s).wait_seconds;
+    if (hidden > 0) profile_add(prof, (*s).writing ? "write (overlapped)" : "read (overlapped)", profile_clock() - hidden, 0);
+}
+
+/* Reads the height rows of stride bytes of a BMP from in, resizing them as
+   they are read. The rows are read
+   rows at a time into a window which only holds on to the rows that output
+   rows still to be made take in, so the whole image is never in memory,
+   and every window of up to rows output rows is passed to emit as soon as
+   the input rows it needs are in. Output windows are zeroed, padding and all.
+   Returns 0, -1 if there is not enough memory, or what failed for io_fail
+   if the rows cannot be read */
+static int resize_read(io_stream *in, const resizer *r, int height, size_t stride, int rows, thread_pool *pool,
+                       profile *prof, const char *step, void (*emit)(void *, image *), void *arg) {
+    int channels = (*r).channels, taps = (*r).y.taps, out_height = (*r).y.out, failed = 0;
+    size_t out_stride = ((size_t)(*r).x.out * channels + 3) / 4 * 4;
+    unsigned char *held_data = (unsigned char *) malloc (stride * (taps + rows));
+    unsigned char *out_data = (unsigned char *) calloc (rows, out_stride);
+    if (held_data == NULL || out_data == NULL) {
+        free(held_data);
+        free(out_data);
+        return -1;
+    }
+    image held, out;
+    image_wrap(&held, held_data, (*r).x.in, 0, stride, channels);
+    int read = 0, first = 0, done = 0;
+    // Rows after the last one any output row takes in are still read, so the input is left at its end
+    while (done < out_height || read < height) {
+        if (read < height) {
+            int n = (height - read < rows) ? height - read : rows;
+            double t = profile_clock();
+            if ((failed = io_take(in, IMAGE_ROW(&held, held.height), stride * n)) != 0) break;
+            profile_add(prof, step, t, stride * n);
+            held.height += n;
+            read += n;
+        }
+        int ready = done;
+        while (ready < out_height && (*r).y.start[ready] + taps <= read) ready++;
+        while (done < ready) {
+            image_wrap(&out, out_data, (*r).x.out, (ready - done < rows) ? ready - done : rows, out_stride, channels);
+            double t = profile_clock();
+            run_resize(r, &held, first, &out, done, pool);
+            profile_add(prof, "resize", t, (long long)channels * out.width * out.height);
+            done += out.height;
+            emit(arg, &out);
+        }
+        // Dropping the rows no later output row takes in
+        int keep = (done < out_height) ? (*r).y.start[done] : read;
+        if (keep > first) {
+            memmove(held.data, IMAGE_ROW(&held, keep - first), stride * (held.height - (keep - first)));
+            held.height -= keep - first;
+            first = keep;
+        }
+    }
+    free(held_data);
+    free(out_data);
+    return failed;
+}
+
+/* Exits with the message for what resize_read returned, if it failed */
+static void resize_check(int failed) {
+    if (failed < 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (failed) io_fail(failed);
+}
+
+// Where resize_read puts the rows of an image resized as it is read
+typedef struct {
+    image *dest;
+    int done;
+} resize_target;
+
+/* Copies a window of resized rows into the image, in its layout */
+static void resize_store(void *arg, image *part) {
+    resize_target *target = arg;
+    image rows = *(*target).dest;
+    rows.data = IMAGE_ROW((*target).dest, (*target).done);
+    rows.height = (*part).height;
+    image_copy(&rows, part);
+    (*target).done += (*part).height;
+}
+
+/* Rows of a streamed image on their way through stages 0 to last - 1 of
+   the chain, a window at a time. A spatial stage needs radius rows either
+   side of each row it filters, so it holds on to the rows coming into it
+   until the next window of its output has all the rows around it, keeping
+   the last 2 * radius for the window after. Finished rows are added to
+   stats and written to out, if set */
+typedef struct {
+    filter_chain *chain;
+    int last;
+    int height;         // rows in the whole image
+    int rows;           // rows in a window
+    thread_pool *pool;
+    struct {
+        image held;         // rows of the stage input from first on, up to a window and 2 * radius of them
+        int first;
+        int done;           // output rows filtered so far
+        image out;          // window of filtered rows
+    } spatial[MAX_STAGES];
+    image_stats *stats;
+    io_stream *out;
+    profile *prof;
+} row_stream;
+
+/* Sets up a stream through stages 0 to last - 1, with room for the rows
+   each spatial stage holds */
+static void stream_start(row_stream *rs, filter_chain *chain, int last, int width, int height, int rows, size_t stride,
+                         int channels, thread_pool *pool) {
+    memset(rs, 0, sizeof(row_stream));
+    (*rs).chain = chain;
+    (*rs).last = last;
+    (*rs).height = height;
+    (*rs).rows = rows;
+    (*rs).pool = pool;
+    for (int k = 0; k < last; k++) {
+        if ((*chain).stages[k].spatial == NULL) continue;
+        int held = rows + 2 * (*(*chain).stages[k].spatial).radius;
+        // Zeroed, as the filtered rows are written out padding and all
+        unsigned char *data = (unsigned char *) malloc (stride * held), *out = (unsigned char *) calloc (rows, stride);
+        if (data == NULL || out == NULL) {
+            fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        image_wrap(&(*rs).spatial[k].held, data, width, 0, stride, channels);
+        image_wrap(&(*rs).spatial[k].out, out, width, rows, stride, channels);
+    }
+}
+
+/* Frees the rows held by a stream */
+static void stream_end(row_stream *rs) {
+    for (int k = 0; k < (*rs).last; k++) {
+        free((*rs).spatial[k].held.data);
+        free((*rs).spatial[k].out.data);
+    }
+}
+
+/* Stops the program when a pass of the stream runs out of memory */
+static void stream_check(int result) {
+    if (result != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Runs a window of rows coming into stage first through the stream, up to
+   the next spatial stage or to the end. Windows come in the order of their rows */
+static void stream_rows(row_stream *rs, int first, image *part) {
+    filter_chain *chain = (*rs).chain;
+    int last = first;
+    while (last < (*rs).last && (*chain).stages[last].spatial == NULL) last++;
+    if (last == (*rs).last) {
+        if (first < last || (*rs).stats != NULL) stream_check(run_pass(chain, first, last, NULL, part, (*rs).pool, (*rs).stats));
+        if ((*rs).out == NULL) return;
+        double t = profile_clock();
+        size_t bytes = (*part).stride * (*part).height;
+        io_write((*rs).out, (*part).data, bytes);
+        profile_add((*rs).prof, "write", t, bytes);
+        return;
+    }
+    if (first < last) stream_check(run_pass(chain, first, last, NULL, part, (*rs).pool, NULL));
+
+    /* Holding the rows for the spatial stage, and filtering every window
+       which has all the rows around it */
+    image *held = &(*rs).spatial[last].held;
+    int radius = (*(*chain).stages[last].spatial).radius;
+    memcpy(IMAGE_ROW(held, (*held).height), (*part).data, (*part).stride * (*part).height);
+    (*held).height += (*part).height;
+    int in = (*rs).spatial[last].first + (*held).height;
+    int ready = (in == (*rs).height) ? in : in - radius;
+    while ((*rs).spatial[last].done < ready) {
+        image out = (*rs).spatial[last].out;
+        int done = (*rs).spatial[last].done;
+        if (out.height > ready - done) out.height = ready - done;
+        stream_check(run_spatial(chain, last, held, (*rs).spatial[last].first, (*rs).height, &out, done, (*rs).pool));
+        (*rs).spatial[last].done += out.height;
+        stream_rows(rs, last + 1, &out);
+    }
+    // Dropping the rows no later window needs
+    int drop = (*rs).spatial[last].done - radius - (*rs).spatial[last].first;
+    if (drop > 0) {
+        memmove((*held).data, IMAGE_ROW(held, drop), (*held).stride * ((*held).height - drop));
+        (*held).height -= drop;
+        (*rs).spatial[last].first += drop;
+    }
+}
+
+/* Runs a window of resized rows through a stream */
+static void stream_window(void *arg, image *part) {
+    stream_rows(arg, 0, part);
+}
+
+/* Filters a BMP a window of rows at a time, so memory use stays the same
+   whatever the image size. As io asks, the input is read ahead of the
+   filters and the output written behind them a chunk at a time by threads
+   of their own, so the disk is kept busy while the filters run. The headers have already been read from the input. A stage needing whole-
+   image statistics gets a first pass over the input which only runs the
+   stages before it and gathers the statistics, then the input is read again
+   for the next pass. Input which cannot be rewound, like a pipe, is copied to
+   a temporary file during the first pass and read back from there. Spatial
+   stages each hold up to a window and twice their radius of rows. With a
+   resize, the image is resized as it is read and the resized rows go
+   through the chain. If stats is set, the filtered image is added to it, and
+   without out is not written */
+void stream_filter(FILE *in, FILE *out, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header,
+                   filter_chain *chain, int rows, const io_spec *io, const resize_spec *resize, thread_pool *pool,
+                   profile *prof, image_stats *stats) {
+    size_t stride = bmp_stride(info_header);
+    int channels = (*info_header).bpp / 8, height = abs((*info_header).height);
+    if (rows > height) rows = height;
+    if (rows < 1) rows = 1;
+    BITMAPFILEHEADER out_file_header = *file_header;
+    BITMAPINFOHEADER out_info_header = *info_header;
+    resizer r;
+    if (resize != NULL) {
+        if (resizer_create(&r, (*info_header).width, height, channels, resize, pool_threads(pool)) != 0) {
+            fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        resize_headers(&out_file_header, &out_info_header, r.x.out, r.y.out);
+    }
+    transform_headers(chain, &out_file_header, &out_info_header);     // flips only, as rows cannot be turned into columns here
+    int out_height = abs(out_info_header.height);
+
+    /* Anything between the headers and the pixels is passed through */
+    size_t extra = header_gap(file_header, info_header);
+    unsigned char *gap = (unsigned char *) malloc (extra + 1);
+    unsigned char *window = (unsigned char *) malloc (stride * rows);
+    if (gap == NULL || window == NULL) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(gap, 1, extra, in) != extra) {
+        fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    long int start = ftell(in);
+    FILE *source = in, *spool = NULL;
+    io_stream reader, writer;
+    row_stream rs;
+
+    /* Statistics passes, one for each stage needing them */
+    for (int last = 0; last < (*chain).count; last++) {
+        if ((*chain).stages[last].prepare == NULL) continue;
+        FILE *copy = NULL;
+        if (source == in && (start < 0 || fseek(in, start, SEEK_SET) != 0)) {
+            copy = spool = tmpfile();       // the input is a pipe
+            if (spool == NULL) {
+                fprintf(stderr, "%s creating a temporary copy of the input failed.\n", ERROR_HEADER);
+                exit(EXIT_FAILURE);
+            }
+        }
+        image_stats gathered;
+        stats_clear(&gathered, (*chain).stages[last].stats);
+        stream_start(&rs, chain, last, out_info_header.width, out_height, rows, bmp_stride(&out_info_header), channels, pool);
+        rs.stats = &gathered;
+        image part;
+        io_open(&reader, source, copy, (long long)stride * height, 0, io);
+        if (resize != NULL) {
+            resize_check(resize_read(&reader, &r, height, stride, rows, pool, prof, "read (statistics)", stream_window, &rs));
+        }
+        for (int i = 0; resize == NULL && i < height; i += part.height) {
+            image_wrap(&part, window, (*info_header).width, (height - i < rows) ? height - i : rows, stride, channels);
+            double t = profile_clock();
+            io_read(&reader, window, stride * part.height);
+            profile_add(prof, "read (statistics)", t, stride * part.height);
+            stream_rows(&rs, 0, &part);
+        }
+        io_close(&reader, prof);
+        stream_end(&rs);
+        stage *next = &(*chain).stages[last];
+        (*next).prepare(next, &gathered);
+        // Going back to the first row for the next pass
+        if (spool != NULL) {
+            source = spool;
+            rewind(spool);
+        } else if (fseek(in, start, SEEK_SET) != 0) {
+            fprintf(stderr, "%s rewinding the input file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Filtering and writing the image a window at a time */
+    if (out != NULL) {
+        fwrite(&out_file_header, FH_SIZE, 1, out);
+        fwrite(&out_info_header, info_size(&out_info_header), 1, out);
+        fwrite(gap, 1, extra, out);
+    }
+    stream_start(&rs, chain, (*chain).count, out_info_header.width, out_height, rows, bmp_stride(&out_info_header), channels,
+                 pool);
+    rs.stats = stats;
+    rs.prof = prof;
+    if (out != NULL) {
+        io_open(&writer, out, NULL, 0, 1, io);
+        rs.out = &writer;
+    }
+    image part;
+    io_open(&reader, source, NULL, (long long)stride * height, 0, io);
+    if (resize != NULL) {
+        resize_check(resize_read(&reader, &r, height, stride, rows, pool, prof, "read", stream_window, &rs));
+        resizer_free(&r);
+    }
+    for (int i = 0; resize == NULL && i < height; i += part.height) {
+        image_wrap(&part, window, (*info_header).width, (height - i < rows) ? height - i : rows, stride, channels);
+        double t = profile_clock();
+        io_read(&reader, window, stride * part.height);
+        profile_add(prof, "read", t, stride * part.height);
+        stream_rows(&rs, 0, &part);
+    }
+    io_close(&reader, prof);
+    if (out != NULL) io_close(&writer, prof);
+    stream_end(&rs);
+    if (spool != NULL) fclose(spool);
+    free(window);
+    free(gap);
+}
+
+/* Sets the headers of an indexed image for its pixels being written as bytes
+   of run-length encoded indices if rle is set, or otherwise uncompressed */
+static void rle_headers(BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header, int rle, size_t bytes) {
+    if (rle) {
+        (*info_header).compression = ((*info_header).bpp == 8) ? BI_RLE8 : BI_RLE4;
+    } else {
+        (*info_header).compression = BI_RGB;
+    }
+    // Run-length encoded rows are always stored from the bottom up
+    (*info_header).height = abs((*info_header).height);
+    (*info_header).image_size = bytes;
+    (*file_header).size = (*file_header).offset + bytes;
+}
+
+/* Run-length encodes the rows of an indexed image into encoded, which is
+   grown as needed, taking them from data or, if it is NULL, reading them from
+   in a row at a time. Rows stored from the top down, which must be in data,
+   are taken from the bottom up. Sets bytes to the size of the encoded
+   pixels, and returns what went wrong if reading or allocation fails, or NULL */
+static const char *encode_rows(BITMAPINFOHEADER *info_header, const unsigned char *data, FILE *in, work_buffer *encoded,
+                               size_t *bytes) {
+    int width = (*info_header).width, height = abs((*info_header).height), bpp = (*info_header).bpp;
+    size_t stride = bmp_stride(info_header), used = 0;
+    unsigned char *row = (data == NULL) ? (unsigned char *) malloc (stride) : NULL;
+    if (data == NULL && row == NULL) return "memory allocation failed.";
+    for (int i = 0; i < height; i++) {
+        if ((*encoded).capacity < used + RLE_ROW_BOUND(width)) {
+            size_t capacity = 2 * (*encoded).capacity + RLE_ROW_BOUND(width);
+            unsigned char *grown = (unsigned char *) realloc ((*encoded).data, capacity);
+            if (grown == NULL) {
+                free(row);
+                return "memory allocation failed.";
+            }
+            (*encoded).data = grown;
+            (*encoded).capacity = capacity;
+        }
+        const unsigned char *from = row;
+        if (data != NULL) {
+            from = data + stride * (((*info_header).height < 0) ? height - 1 - i : i);
+        } else if (fread(row, 1, stride, in) != stride) {
+            free(row);
+            return "reading the image data failed.";
+        }
+        used += rle_encode_row((*encoded).data + used, from, width, bpp, i == height - 1);
+    }
+    free(row);
+    *bytes = used;
+    return NULL;
+}
+
+/* Decodes the rows of a run-length encoded image from bytes of encoded
+   pixels, held in data or, if it is NULL, read from in, and writes them to
+   out uncompressed. Returns what went wrong if the pixels are corrupt or
+   writing fails, or NULL */
+static const char *decode_rows(BITMAPINFOHEADER *info_header, const unsigned char *data, FILE *in, size_t bytes, FILE *out) {
+    size_t stride = bmp_stride(info_header);
+    unsigned char *row = (unsigned char *) malloc (stride);
+    rle_reader r;
+    if (row == NULL || rle_open(&r, in, data, bytes, (*info_header).width, (*info_header).height, (*info_header).bpp) != 0) {
+        free(row);
+        return "memory allocation failed.";
+    }
+    const char *problem = NULL;
+    for (int i = 0; i < (*info_header).height && problem == NULL; i++) {
+        if (rle_row(&r, row) != 0) {
+            problem = "the run-length encoded pixels of the input file are corrupt.";
+        } else if (fwrite(row, 1, stride, out) != stride) {
+            problem = "writing the output file failed.";
+        }
+    }
+    rle_close(&r);
+    free(row);
+    return problem;
+}
+
+/* Filters an indexed BMP through its color table, copying the pixel indices
+   across untouched. The headers have already been read from the input. The
+   indices are only held in memory if a stage needs the statistics of the
+   image, and are otherwise copied a block at a time. Run-length encoded
+   indices are counted a run at a time, and stay encoded unless compress
+   asks for them uncompressed, when they are decoded a row at a time as they
+   are written; uncompressed ones are encoded a row at a time if compress
+   asks for that, and written once they all are, as the headers give their
+   size. If stats is set, the filtered image is added to it, and without out
+   is not written */
+void palette_stream(FILE *in, FILE *out, BITMAPFILEHEADER *file_header, BITMAPINFOHEADER *info_header,
+                    filter_chain *chain, int compress, profile *prof, image_stats *stats) {
+    int width = (*info_header).width, height = abs((*info_header).height), bpp = (*info_header).bpp;
+    size_t stride = bmp_stride(info_header), bytes = pixel_bytes(file_header, info_header);
+    size_t extra = header_gap(file_header, info_header);
+    int rle_in = RLE_COMPRESSED(*info_header), rle_out = (compress == COMPRESS_KEEP) ? rle_in : (compress == COMPRESS_RLE);
+    // Rows stored from the top down are encoded from the bottom up, so they are all read first
+    int gather = next_barrier(chain, 0, -1) < (*chain).count || stats != NULL || (rle_out && !rle_in && (*info_header).height < 0);
+    size_t block = gather ? bytes : 65536;
+    const char *problem;
+    if (out != NULL && rle_out && bpp != 8 && bpp != 4) {
+        fprintf(stderr, "%s only 8 and 4-bit images can be run-length encoded.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    unsigned char *gap = (unsigned char *) malloc (extra + 1);
+    unsigned char *data = (unsigned char *) malloc (block + 1);
+    if (gap == NULL || data == NULL) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    /* The color table is in the gap, after the rest of a longer info header */
+    double t = profile_clock();
+    unsigned long long counts[256] = {0};
+    if (fread(gap, 1, extra, in) != extra || (gather && fread(data, 1, bytes, in) != bytes)) {
+        fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "read", t, extra + (gather ? bytes : 0));
+    if (gather && rle_in) {
+        t = profile_clock();
+        if (rle_count(counts, data, bytes, width, height, bpp) != 0) {
+            fprintf(stderr, "%s the run-length encoded pixels of the input file are corrupt.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, "count runs", t, bytes);
+    } else if (gather) {
+        palette_count(counts, data, width, height, bpp, stride);
+    }
+    t = profile_clock();
+    unsigned char *table = gap + (*info_header).header_size - info_size(info_header);
+    palette_filter(chain, table, palette_colors(info_header), counts);
+    profile_add(prof, "filter (color table)", t, 4 * palette_colors(info_header));
+    if (stats != NULL) table_stats(stats, table, palette_colors(info_header), counts);
+    if (out == NULL) {
+        free(data);
+        free(gap);
+        return;
+    }
+
+    /* Encoding the indices before the headers, which give their size */
+    BITMAPFILEHEADER out_file_header = *file_header;
+    BITMAPINFOHEADER out_info_header = *info_header;
+    work_buffer encoded = {NULL, 0};
+    size_t encoded_bytes = 0;
+    if (rle_out && !rle_in) {
+        t = profile_clock();
+        if ((problem = encode_rows(info_header, gather ? data : NULL, in, &encoded, &encoded_bytes)) != NULL) {
+            fprintf(stderr, "%s %s\n", ERROR_HEADER, problem);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, gather ? "encode" : "read and encode", t, stride * height);
+        rle_headers(&out_file_header, &out_info_header, 1, encoded_bytes);
+    } else if (rle_in && !rle_out) {
+        rle_headers(&out_file_header, &out_info_header, 0, stride * height);
+    }
+
+    t = profile_clock();
+    int copy = (rle_in == rle_out);
+    if (fwrite(&out_file_header, FH_SIZE, 1, out) != 1 || fwrite(&out_info_header, info_size(info_header), 1, out) != 1 ||
+        fwrite(gap, 1, extra, out) != extra || (gather && copy && fwrite(data, 1, bytes, out) != bytes) ||
+        (encoded_bytes > 0 && fwrite(encoded.data, 1, encoded_bytes, out) != encoded_bytes)) {
+        fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "write", t, FH_SIZE + info_size(info_header) + extra + (gather && copy ? bytes : 0) + encoded_bytes);
+    if (rle_in && !rle_out) {
+        t = profile_clock();
+        if ((problem = decode_rows(&out_info_header, gather ? data : NULL, in, bytes, out)) != NULL) {
+            fprintf(stderr, "%s %s\n", ERROR_HEADER, problem);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, gather ? "decode and write" : "read, decode and write", t, stride * height);
+    }
+    for (size_t done = 0; !gather && copy && done < bytes; done += block) {
+        size_t n = (bytes - done < block) ? bytes - done : block;
+        t = profile_clock();
+        if (fread(data, 1, n, in) != n) {
+            fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        if (fwrite(data, 1, n, out) != n) {
+            fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, "copy indices", t, n);
+    }
+    free(encoded.data);
+    free(data);
+    free(gap);
+}
+
+/* Resizes and filters a BMP for filter_file, once its headers have been
+   read from input, which is closed. The bytes between the headers and the
+   pixels go in the buffer */
+static long long resize_file(FILE *input, const char *input_file, const char *output_file, BITMAPFILEHEADER *file_header,
+                             BITMAPINFOHEADER *info_header, filter_chain *chain, const resize_spec *resize, thread_pool *pool,
+                             work_buffer *buffer, image_stats *stats, char error[ERROR_SIZE]) {
+    int height = abs((*info_header).height), channels = (*info_header).bpp / 8;
+    size_t stride = bmp_stride(info_header), gap = header_gap(file_header, info_header);
+    if ((*info_header).bpp <= 8) {
+        snprintf(error, ERROR_SIZE, "%s: indexed color images cannot be resized.", input_file);
+        fclose(input);
+        return -1;
+    }
+    if ((*info_header).width <= 0) {
+        snprintf(error, ERROR_SIZE, "%s: reading the image data failed.", input_file);
+        fclose(input);
+        return -1;
+    }
+    if ((*buffer).capacity < gap + 1) {
+        unsigned char *data = (unsigned char *) realloc ((*buffer).data, gap + 1);
+        if (data == NULL) {
+            snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+            fclose(input);
+            return -1;
+        }
+        (*buffer).data = data;
+        (*buffer).capacity = gap + 1;
+    }
+    resizer r;
+    image img;
+    if (fread((*buffer).data, 1, gap, input) != gap) {
+        snprintf(error, ERROR_SIZE, "%s: reading the image data failed.", input_file);
+        fclose(input);
+        return -1;
+    }
+    if (resizer_create(&r, (*info_header).width, height, channels, resize, pool_threads(pool)) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+        fclose(input);
+        return -1;
+    }
+    if (image_create(&img, r.x.out, r.y.out, (channels == 4) ? LAYOUT_BGRA : LAYOUT_BGR) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+        resizer_free(&r);
+        fclose(input);
+        return -1;
+    }
+    // Batch and server workers each read their own files already, so they read without a thread of their own
+    io_spec direct = {0, 0};
+    io_stream reader;
+    resize_target target = {&img, 0};
+    io_open(&reader, input, NULL, (long long)stride * height, 0, &direct);
+    int failed = resize_read(&reader, &r, height, stride, RESIZE_ROWS, pool, NULL, "read", resize_store, &target);
+    fclose(input);
+    resizer_free(&r);
+    if (failed) {
+        snprintf(error, ERROR_SIZE, "%s: %s", input_file, (failed < 0) ? "memory allocation failed." : "reading the image data failed.");
+        image_free(&img);
+        return -1;
+    }
+    long long bytes = FH_SIZE + info_size(info_header) + gap + stride * height;
+
+    /* Filtering with a copy of the chain, as statistics stages keep their results */
+    filter_chain local = *chain;
+    BITMAPFILEHEADER out_file_header = *file_header;
+    BITMAPINFOHEADER out_info_header = *info_header;
+    resize_headers(&out_file_header, &out_info_header, img.width, img.height);
+    transform_headers(&local, &out_file_header, &out_info_header);
+    if (run_chain_copy(&local, NULL, &img, pool, stats) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+        image_release(local.blocks, &img);
+        return -1;
+    }
+    if (output_file == NULL) {
+        image_free(&img);
+        return bytes;
+    }
+    FILE *output = fopen(output_file, "w");
+    if (output == NULL) {
+        snprintf(error, ERROR_SIZE, "%s: the output file could not be created.", output_file);
+        image_free(&img);
+        return -1;
+    }
+    int written = write_bmp(output, &out_file_header, &out_info_header, (*buffer).data, &img) == 0;
+    image_free(&img);
+    if (fclose(output) != 0 || !written) {
+        snprintf(error, ERROR_SIZE, "%s: writing the output file failed.", output_file);
+        return -1;
+    }
+    return bytes;
+}
+
+/* Filters one BMP file into another, reading the whole image into a buffer
+   which is kept and grown between calls. Unlike the other functions this
+   does not exit on errors, but writes the message into error and returns -1,
+   so one bad file does not stop a batch. Returns the number of bytes read.
+   With a resize, the image is resized as it is read instead, and only the
+   resized image is held. Indexed images are written with the compression
+   of the input unless compress changes it. If stats is set, the filtered
+   image is added to it, and without an output file it is not written */
+long long filter_file(const char *input_file, const char *output_file, filter_chain *chain, const resize_spec *resize,
+                      int compress, thread_pool *pool, work_buffer *buffer, image_stats *stats, char error[ERROR_SIZE]) {
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    const char *problem;
+    FILE *input = fopen(input_file, "r");
+    if (input == NULL) {
+        snprintf(error, ERROR_SIZE, "%s: input file either does not exist or is not readable.", input_file);
+        return -1;
+    }
+    if (fread(&file_header, FH_SIZE, 1, input) != 1 || read_info(input, &info_header) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: reading the bmp headers failed.", input_file);
+        fclose(input);
+        return -1;
+    }
+    if ((problem = header_error(&file_header, &info_header)) != NULL) {
+        snprintf(error, ERROR_SIZE, "%s: %s", input_file, problem);
+        fclose(input);
+        return -1;
+    }
+
+    /* Reading everything after the headers, padding included */
+    BITMAPINFOHEADER rows = info_header;
+    rows.height = abs(info_header.height);       // point filters do not mind which way up the rows are
+    size_t stride = bmp_stride(&rows);
+    size_t gap = header_gap(&file_header, &info_header);
+    size_t size = gap + pixel_bytes(&file_header, &info_header);
+    int rle_in = RLE_COMPRESSED(info_header), rle_out = (compress == COMPRESS_KEEP) ? rle_in : (compress == COMPRESS_RLE);
+    if (output_file != NULL && rle_out && rows.bpp != 8 && rows.bpp != 4) {
+        snprintf(error, ERROR_SIZE, "%s: only 8 and 4-bit images can be run-length encoded.", input_file);
+        fclose(input);
+        return -1;
+    }
+    if (resize != NULL) return resize_file(input, input_file, output_file, &file_header, &info_header, chain, resize, pool,
+                                           buffer, stats, error);
+    if ((*buffer).capacity < size) {
+        unsigned char *data = (unsigned char *) realloc ((*buffer).data, size);
+        if (data == NULL) {
+            snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+            fclose(input);
+            return -1;
+        }
+        (*buffer).data = data;
+        (*buffer).capacity = size;
+    }
+    if (rows.width <= 0 || fread((*buffer).data, 1, size, input) != size) {
+        snprintf(error, ERROR_SIZE, "%s: reading the image data failed.", input_file);
+        fclose(input);
+        return -1;
+    }
+    fclose(input);
+
+    /* Filtering with a copy of the chain, as statistics stages keep their results */
+    filter_chain local = *chain;
+    BITMAPFILEHEADER out_file_header = file_header;
+    BITMAPINFOHEADER out_info_header = info_header;
+    if (rows.bpp <= 8 && has_spatial(&local)) {
+        snprintf(error, ERROR_SIZE, "%s: blurring and sharpening cannot be used on indexed color images.", input_file);
+        return -1;
+    } else if (rows.bpp <= 8 && local.transform != 0) {
+        snprintf(error, ERROR_SIZE, "%s: indexed color images cannot be rotated or flipped.", input_file);
+        return -1;
+    } else if (rows.bpp <= 8) {
+        unsigned long long counts[256] = {0};
+        unsigned char *table = (*buffer).data + rows.header_size - info_size(&rows);
+        if ((next_barrier(&local, 0, -1) < local.count || stats != NULL) && rle_in) {
+            if (rle_count(counts, (*buffer).data + gap, size - gap, rows.width, rows.height, rows.bpp) != 0) {
+                snprintf(error, ERROR_SIZE, "%s: the run-length encoded pixels of the input file are corrupt.", input_file);
+                return -1;
+            }
+        } else if (next_barrier(&local, 0, -1) < local.count || stats != NULL) {
+            palette_count(counts, (*buffer).data + gap, rows.width, rows.height, rows.bpp, stride);
+        }
+        palette_filter(&local, table, palette_colors(&rows), counts);
+        if (stats != NULL) table_stats(stats, table, palette_colors(&rows), counts);
+    } else {
+        image img;
+        image_wrap(&img, (*buffer).data + gap, rows.width, rows.height, stride, rows.bpp / 8);
+        transform_headers(&local, &out_file_header, &out_info_header);
+        if (run_chain_copy(&local, NULL, &img, pool, stats) != 0) {
+            snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+            image_release(local.blocks, &img);
+            return -1;
+        }
+        if (img.data != (*buffer).data + gap) {
+            // Turned into an image of its own, rather than filtered in the buffer
+            FILE *output = (output_file != NULL) ? fopen(output_file, "w") : NULL;
+            int written = output != NULL && write_bmp(output, &out_file_header, &out_info_header, (*buffer).data, &img) == 0;
+            image_release(local.blocks, &img);
+            if (output_file != NULL && (output == NULL || fclose(output) != 0 || !written)) {
+                snprintf(error, ERROR_SIZE, "%s: %s", output_file, (output == NULL) ? "the output file could not be created." :
+                         "writing the output file failed.");
+                return -1;
+            }
+            return FH_SIZE + info_size(&info_header) + size;
+        }
+    }
+    if (output_file == NULL) return FH_SIZE + info_size(&info_header) + size;
+
+    /* Indices changing compression are encoded before the headers, which give their size, or decoded after them */
+    work_buffer encoded = {NULL, 0};
+    size_t encoded_bytes = 0;
+    if (rle_out && !rle_in) {
+        if ((problem = encode_rows(&info_header, (*buffer).data + gap, NULL, &encoded, &encoded_bytes)) != NULL) {
+            snprintf(error, ERROR_SIZE, "%s: %s", input_file, problem);
+            free(encoded.data);
+            return -1;
+        }
+        rle_headers(&out_file_header, &out_info_header, 1, encoded_bytes);
+    } else if (rle_in && !rle_out) {
+        rle_headers(&out_file_header, &out_info_header, 0, stride * rows.height);
+    }
+    FILE *output = fopen(output_file, "w");
+    if (output == NULL) {
+        snprintf(error, ERROR_SIZE, "%s: the output file could not be created.", output_file);
+        free(encoded.data);
+        return -1;
+    }
+    size_t kept = (rle_in == rle_out) ? size : gap;
+    int written = fwrite(&out_file_header, FH_SIZE, 1, output) == 1 &&
+                  fwrite(&out_info_header, info_size(&info_header), 1, output) == 1 && fwrite((*buffer).data, 1, kept, output) == kept &&
+                  (encoded_bytes == 0 || fwrite(encoded.data, 1, encoded_bytes, output) == encoded_bytes);
+    free(encoded.data);
+    if (written && rle_in && !rle_out &&
+        (problem = decode_rows(&out_info_header, (*buffer).data + gap, NULL, size - gap, output)) != NULL) {
+        snprintf(error, ERROR_SIZE, "%s: %s", input_file, problem);
+        fclose(output);
+        return -1;
+    }
+    if (fclose(output) != 0 || !written) {
+        snprintf(error, ERROR_SIZE, "%s: writing the output file failed.", output_file);
+        return -1;
+    }
+    return FH_SIZE + info_size(&info_header) + size;
+}
+
+/* Makes the output file name for an input from the batch template. %n is the
+   input file name without its extension, %d the directory it is in and %i
+   its position in the batch. Returns -1 if the name does not fit */
+int batch_output_name(char *name, size_t size, const char *template, const char *input_file, int index) {
+    const char *base = strrchr(input_file, '/');
+    base = (base == NULL) ? input_file : base + 1;
+    size_t base_length = strlen(base);
+    const char *dot = strrchr(base, '.');
+    if (dot != NULL && dot != base) base_length = dot - base;
+    size_t used = 0;
+    for (const char *t = template; *t != '\0'; t++) {
+        char part[32];
+        const char *text = t;
+        size_t length = 1;
+        if (*t == '%' && t[1] == 'n') {
+            text = base;
+            length = base_length;
+            t++;
+        } else if (*t == '%' && t[1] == 'd') {
+            text = input_file;
+            length = base - input_file;
+            if (length == 0) {
+                text = ".";
+                length = 1;
+            } else {
+                length--;       // leaving off the last '/'
+            }
+            t++;
+        } else if (*t == '%' && t[1] == 'i') {
+            snprintf(part, sizeof(part), "%d", index);
+            text = part;
+            length = strlen(part);
+            t++;
+        } else if (*t == '%' && t[1] == '%') {
+            t++;
+        }
+        if (used + length >= size) return -1;
+        memcpy(name + used, text, length);
+        used += length;
+    }
+    name[used] = '\0';
+    return 0;
+}
+
+/* A worker's share of the batch. The worker takes files from the front, and
+   workers which have run out steal files from the back */
+typedef struct {
+    pthread_mutex_t lock;
+    int head, tail;
+} batch_queue;
+
+typedef struct {
+    char **files;
+    int count;
+    const char *template;
+    filter_chain *chain;
+    const resize_spec *resize;      // size to resize every image to, if set
+    int compress;           // compression of the indexed images written
+    int stats_flag;         // 1 or 2 to print the statistics of each image as a table or JSON instead of writing it
+    const result_cache *cache;      // cache to look each image up in before filtering it, if set
+    int workers;
+    batch_queue *queues;
+    long long *bytes;       // bytes read and written by each worker
+    int *failed;            // files each worker could not filter
+    int *hits;              // files each worker found in the cache
+} batch_job;
+
+/* Takes the next file for a worker, stealing one if its own queue is empty.
+   Returns -1 once every queue is empty */
+static int batch_next(batch_job *job, int worker) {
+    for (int k = 0; k < (*job).workers; k++) {
+        batch_queue *queue = &(*job).queues[(worker + k) % (*job).workers];
+        int index = -1;
+        pthread_mutex_lock(&(*queue).lock);
+        if ((*queue).head < (*queue).tail) {
+            index = (k == 0) ? (*queue).head++ : --(*queue).tail;
+        }
+        pthread_mutex_unlock(&(*queue).lock);
+        if (index >= 0) return index;
+    }
+    return -1;
+}
+
+/* Filters files until there are none left, reusing one buffer for all of them.
+   When printing statistics, each report is printed whole before the next.
+   With a cache, an image filtered the same way before is copied from it,
+   and every other image is added to it */
+static void batch_worker(void *arg, int worker) {
+    batch_job *job = arg;
+    work_buffer buffer = {NULL, 0};
+    char output_file[4096], error[ERROR_SIZE];
+    image_stats stats;
+    int index;
+    while ((index = batch_next(job, worker)) >= 0) {
+        const char *input_file = (*job).files[index];
+        long long bytes = -1;
+        if ((*job).stats_flag) {
+            stats_clear(&stats, STATS_HISTOGRAMS);
+            bytes = filter_file(input_file, NULL, (*job).chain, (*job).resize, COMPRESS_KEEP, NULL, &buffer, &stats, error);
+        } else if (batch_output_name(output_file, sizeof(output_file), (*job).template, input_file, index) != 0) {
+            snprintf(error, ERROR_SIZE, "%s: the output file name is too long.", input_file);
+        } else {
+            unsigned long long input_hash;
+            int hashed = ((*job).cache != NULL && hash_file(input_file, &input_hash) == 0);
+            long long cached = hashed ? cache_fetch((*job).cache, input_hash, output_file) : 0;
+            if (cached > 0) {
+                bytes = cached;
+                (*job).hits[worker]++;
+            } else {
+                bytes = filter_file(input_file, output_file, (*job).chain, (*job).resize, (*job).compress, NULL, &buffer, NULL, error);
+                if (bytes >= 0 && hashed) cache_store((*job).cache, input_hash, output_file);
+            }
+        }
+        if (bytes < 0) {
+            fprintf(stderr, "%s %s\n", ERROR_HEADER, error);
+            (*job).failed[worker]++;
+        } else if ((*job).stats_flag) {
+            flockfile(stdout);
+            stats_print(stdout, &stats, input_file, (*job).stats_flag == 2);
+            funlockfile(stdout);
+            (*job).bytes[worker] += bytes;
+        } else {
+            (*job).bytes[worker] += 2 * bytes;
+        }
+    }
+    free(buffer.data);
+}
+
+/* Filters every file in the list with the same compiled chain, spread over
+   the thread pool with one work-stealing queue per thread. Each file is
+   filtered by a single thread, so the threads work on separate files. With
+   stats_flag set the images are not written, and the statistics of each are
+   printed instead. Prints a summary of the throughput (to stderr when
+   printing statistics) and returns the number of failed files. If resize is
+   set, every image is resized as it is read, and indexed images are written
+   compressed as compress asks. If cache is set, images are looked up in it
+   first, unless printing statistics */
+int run_batch(char **files, int count, const char *template, filter_chain *chain, const resize_spec *resize, int compress,
+              thread_pool *pool, int stats_flag, const result_cache *cache) {
+    batch_job job = {files, count, template, chain, resize, compress, stats_flag, stats_flag ? NULL : cache, pool_threads(pool), NULL,
+                     NULL, NULL, NULL};
+    job.queues = (batch_queue *) malloc (sizeof(batch_queue) * job.workers);
+    job.bytes = (long long *) calloc (job.workers, sizeof(long long));
+    job.failed = (int *) calloc (job.workers, sizeof(int));
+    job.hits = (int *) calloc (job.workers, sizeof(int));
+    if (job.queues == NULL || job.bytes == NULL || job.failed == NULL || job.hits == NULL) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    // Each worker starts with an even share of the files
+    for (int w = 0; w < job.workers; w++) {
+        pthread_mutex_init(&job.queues[w].lock, NULL);
+        job.queues[w].head = (int)((long long)count * w / job.workers);
+        job.queues[w].tail = (int)((long long)count * (w + 1) / job.workers);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pool_run(pool, batch_worker, &job, job.workers);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    int failed = 0, hits = 0;
+    long long bytes = 0;
+    for (int w = 0; w < job.workers; w++) {
+        failed += job.failed[w];
+        hits += job.hits[w];
+        bytes += job.bytes[w];
+        pthread_mutex_destroy(&job.queues[w].lock);
+    }
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (seconds <= 0) seconds = 1e-9;
+    fprintf(stats_flag ? stderr : stdout, "bmpedit: %d images (%d failed) in %.3f s, %.1f images/s, %.1f MB/s\n",
+            count - failed, failed, seconds, (count - failed) / seconds, bytes / seconds / 1e6);
+    long long totals[3];
+    if (job.cache != NULL && cache_count(job.cache, hits, count - failed - hits, totals) == 0) {
+        printf("Cache: %d of %d images found (%lld hits and %lld misses in all, %.1f MB cached)\n", hits, count,
+               totals[0], totals[1], totals[2] / 1e6);
+    }
+    free(job.queues);
+    free(job.bytes);
+    free(job.failed);
+    free(job.hits);
+    return failed;
+}
+
+/* Appends a file name to the list, growing it as needed */
+static void batch_append(batch_list *list, char *file) {
+    if ((*list).count == (*list).capacity) {
+        (*list).capacity = ((*list).capacity == 0) ? 64 : (*list).capacity * 2;
+        (*list).files = (char **) realloc ((*list).files, sizeof(char *) * (*list).capacity);
+        if ((*list).files == NULL) {
+            fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*list).files[(*list).count++] = file;
+}
+
+/* Orders file names for qsort */
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Adds a batch input to the list. A directory adds every .bmp or .BMP file in it */
+void batch_add(batch_list *list, const char *path) {
+    struct stat info;
+    if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+        DIR *dir = opendir(path);
+        if (dir == NULL) {
+            fprintf(stderr, "%s the directory %s could not be read.\n", ERROR_HEADER, path);
+            exit(EXIT_FAILURE);
+        }
+        int first = (*list).count;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t length = strlen((*entry).d_name);
+            if (length > 4 && (strcmp((*entry).d_name + length - 4, ".bmp") == 0 || strcmp((*entry).d_name + length - 4, ".BMP") == 0)) {
+                char *file = (char *) malloc (strlen(path) + length + 2);
+                if (file == NULL) {
+                    fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+                    exit(EXIT_FAILURE);
+                }
+                sprintf(file, "%s/%s", path, (*entry).d_name);
+                batch_append(list, file);
+            }
+        }
+        closedir(dir);
+        // Directory order is arbitrary, so the files are sorted
+        qsort((*list).files + first, (*list).count - first, sizeof(char *), compare_names);
+        return;
+    }
+    char *file = (char *) malloc (strlen(path) + 1);
+    if (file == NULL) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(file, path);
+    batch_append(list, file);
+}
+
+/* Adds every file named in a list file, one per line ('-' reads the list from stdin) */
+void batch_add_list(batch_list *list, const char *list_file) {
+    FILE *fp = (strcmp(list_file, "-") == 0) ? stdin : fopen(list_file, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s the list file %s could not be read.\n", ERROR_HEADER, list_file);
+        exit(EXIT_FAILURE);
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, fp)) > 0) {
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) line[--length] = '\0';
+        if (length > 0) batch_add(list, line);
+    }
+    free(line);
+    if (fp != stdin) fclose(fp);
+}
+
+/* Frees the file names in the list */
+void batch_free(batch_list *list) {
+    for (int k = 0; k < (*list).count; k++) free((*list).files[k]);
+    free((*list).files);
+    (*list).files = NULL;
+    (*list).count = (*list).capacity = 0;
+}
+
+/* Hashes bytes with XXH64, which reads 32 bytes at a time in four lanes and
+   runs at about the speed memory can be read */
+unsigned long long hash_bytes(const void *data, size_t size, unsigned long long seed) {
+    static const unsigned long long p1 = 0x9e3779b185ebca87ULL, p2 = 0xc2b2ae3d27d4eb4fULL, p3 = 0x165667b19e3779f9ULL,
+                                    p4 = 0x85ebca77c2b2ae63ULL, p5 = 0x27d4eb2f165667c5ULL;
+    const unsigned char *p = data, *end = p + size;
+    unsigned long long h, word;
+    unsigned int half;
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define HASH_ROUND(acc, x) HASH_ROTL((acc) + (x) * p2, 31) * p1
+    if (size >= 32) {
+        unsigned long long v[4] = {seed + p1 + p2, seed + p2, seed, seed - p1};
+        for (; end - p >= 32; p += 32) {
+            for (int k = 0; k < 4; k++) {
+                memcpy(&word, p + 8 * k, 8);
+                v[k] = HASH_ROUND(v[k], word);
+            }
+        }
+        h = HASH_ROTL(v[0], 1) + HASH_ROTL(v[1], 7) + HASH_ROTL(v[2], 12) + HASH_ROTL(v[3], 18);
+        for (int k = 0; k < 4; k++) h = (h ^ HASH_ROUND(0, v[k])) * p1 + p4;
+    } else {
+        h = seed + p5;
+    }
+    h += size;
+    for (; end - p >= 8; p += 8) {
+        memcpy(&word, p, 8);
+        h ^= HASH_ROUND(0, word);
+        h = HASH_ROTL(h, 27) * p1 + p4;
+    }
+    if (end - p >= 4) {
+        memcpy(&half, p, 4);
+        h ^= half * p1;
+        h = HASH_ROTL(h, 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * p5;
+        h = HASH_ROTL(h, 11) * p1;
+    }
+#undef HASH_ROUND
+#undef HASH_ROTL
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    return h ^ (h >> 32);
+}
+
+/* Hashes the whole of a file, headers and pixels, through a memory map.
+   Returns -1 if it cannot be read */
+int hash_file(const char *file, unsigned long long *hash) {
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *data = (st.st_size > 0) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    *hash = hash_bytes(data, st.st_size, 0);
+    if (data != NULL) munmap(data, st.st_size);
+    return 0;
+}
+
+/* Copies a file of size bytes into an empty one: as a reflink sharing the
+   blocks of the file where the file system can, otherwise inside the
+   kernel, or failing that through a buffer. Returns -1 if it fails */
+static int file_copy(int in_fd, int out_fd, long long size) {
+    long long done = 0;
+#ifdef FICLONE
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) return 0;
+#endif
+#ifdef __linux__
+    while (done < size) {
+        ssize_t n = sendfile(out_fd, in_fd, NULL, (size - done < (1 << 30)) ? size - done : (1 << 30));
+        if (n <= 0) break;
+        done += n;
+    }
+#endif
+    unsigned char *buffer = (done < size) ? (unsigned char *) malloc (COPY_BLOCK) : NULL;
+    while (done < size && buffer != NULL) {
+        ssize_t n = read(in_fd, buffer, COPY_BLOCK), written = 0;
+        while (n > 0 && written < n) {
+            ssize_t w = write(out_fd, buffer + written, n - written);
+            if (w <= 0) break;
+            written += w;
+        }
+        if (n <= 0 || written < n) break;
+        done += n;
+    }
+    free(buffer);
+    return (done == size) ? 0 : -1;
+}
+
+/* Writes the path of a cached image into name. Returns -1 if it is too long */
+static int cache_name(char *name, size_t size, const result_cache *cache, unsigned long long input_hash) {
+    int length = snprintf(name, size, "%s/%016llx%016llx.bmp", (*cache).dir, input_hash, (*cache).filters);
+    return (length < 0 || (size_t)length >= size) ? -1 : 0;
+}
+
+/* Copies the cached result for an input file to the output file (stdout if
+   NULL), marking it as just used. Returns the bytes copied, 0 if there is no
+   result for the file, or -1 if the output could not be written */
+long long cache_fetch(const result_cache *cache, unsigned long long input_hash, const char *output_file) {
+    char name[4096];
+    struct stat st;
+    int in_fd = (cache_name(name, sizeof(name), cache, input_hash) == 0) ? open(name, O_RDONLY) : -1;
+    if (in_fd < 0) return 0;
+    if (fstat(in_fd, &st) != 0 || st.st_size == 0) {
+        close(in_fd);
+        return 0;
+    }
+    futimens(in_fd, NULL);      // the time it was last used, for eviction
+    int out_fd = (output_file == NULL) ? STDOUT_FILENO : open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = (out_fd < 0 || file_copy(in_fd, out_fd, st.st_size) != 0);
+    if (out_fd >= 0 && out_fd != STDOUT_FILENO && close(out_fd) != 0) failed = 1;
+    close(in_fd);
+    return failed ? -1 : st.st_size;
+}
+
+// A cached image, while deciding which to remove
+typedef struct {
+    char name[40];
+    double used;
+    long long size;
+} cache_entry;
+
+/* Orders cached images from the least recently used */
+static int cache_older(const void *a, const void *b) {
+    double x = (*(const cache_entry *)a).used, y = (*(const cache_entry *)b).used;
+    return (x > y) - (x < y);
+}
+
+/* Removes the least recently used images until the cache is back under 90%
+   of its limit, so it is not emptied again on the next image. Only files
+   named the way the cache names them are counted or removed. Returns the
+   bytes the cache takes up afterwards */
+static long long cache_evict(const result_cache *cache) {
+    DIR *dir = opendir((*cache).dir);
+    if (dir == NULL) return 0;
+    cache_entry *entries = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent *d;
+    char path[4096];
+    while ((d = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strlen((*d).d_name) != 36 || strspn((*d).d_name, "0123456789abcdef") != 32 ||
+            strcmp((*d).d_name + 32, ".bmp") != 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", (*cache).dir, (*d).d_name);
+        if (stat(path, &st) != 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 256;
+            cache_entry *grown = (cache_entry *) realloc (entries, sizeof(cache_entry) * capacity);
+            if (grown == NULL) break;
+            entries = grown;
+        }
+        strcpy(entries[count].name, (*d).d_name);
+        entries[count].used = st.st_mtim.tv_sec + st.st_mtim.tv_nsec / 1e9;
+        entries[count].size = st.st_size;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+    if (count > 0) qsort(entries, count, sizeof(cache_entry), cache_older);
+    for (int k = 0; k < count && total > (*cache).limit / 10 * 9; k++) {
+        snprintf(path, sizeof(path), "%s/%s", (*cache).dir, entries[k].name);
+        if (unlink(path) == 0) total -= entries[k].size;
+    }
+    free(entries);
+    return total;
+}
+
+/* Adds hits, misses and bytes stored to the counts kept in the cache
+   directory, removing the least recently used images if the cache has
+   outgrown its limit, and fills in totals (hits, misses and bytes in the
+   cache) if set. The counts are locked against other bmpedit processes, and
+   against the other threads of this one with a mutex, as the lock is only
+   held per process. Returns -1 if the counts cannot be kept */
+static int cache_update(const result_cache *cache, long long hits, long long misses, long long stored,
+                        long long totals[3]) {
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    char path[4096], text[128];
+    long long counts[3] = {0, 0, 0};
+    snprintf(path, sizeof(path), "%s/counts", (*cache).dir);
+    pthread_mutex_lock(&lock);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct flock whole;
+    memset(&whole, 0, sizeof(whole));
+    whole.l_type = F_WRLCK;
+    whole.l_whence = SEEK_SET;
+    if (fd < 0 || fcntl(fd, F_SETLKW, &whole) != 0) {
+        if (fd >= 0) close(fd);
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    ssize_t length = pread(fd, text, sizeof(text) - 1, 0);
+    text[(length > 0) ? length : 0] = '\0';
+    sscanf(text, "hits %lld\nmisses %lld\nbytes %lld", &counts[0], &counts[1], &counts[2]);
+    counts[0] += hits;
+    counts[1] += misses;
+    counts[2] += stored;
+    if (counts[2] > (*cache).limit) counts[2] = cache_evict(cache);
+    length = snprintf(text, sizeof(text), "hits %lld\nmisses %lld\nbytes %lld\n", counts[0], counts[1], counts[2]);
+    int failed = (pwrite(fd, text, length, 0) != length || ftruncate(fd, length) != 0);
+    close(fd);      // which releases the lock
+    pthread_mutex_unlock(&lock);
+    if (totals != NULL) memcpy(totals, counts, sizeof(counts));
+    return failed ? -1 : 0;
+}
+
+/* Adds an output file to the cache as the result for an input file. It is
+   copied under a temporary name and renamed, so other processes never see
+   part of an image. Returns -1 if it cannot be stored */
+int cache_store(const result_cache *cache, unsigned long long input_hash, const char *output_file) {
+    char name[4096], temp[4096];
+    struct stat st;
+    mkdir((*cache).dir, 0755);
+    if (cache_name(name, sizeof(name), cache, input_hash) != 0 ||
+        snprintf(temp, sizeof(temp), "%s/.store.XXXXXX", (*cache).dir) >= (int)sizeof(temp)) return -1;
+    int in_fd = open(output_file, O_RDONLY);
+    if (in_fd < 0) return -1;
+    int out_fd = mkstemp(temp);
+    int failed = (out_fd < 0 || fchmod(out_fd, 0644) != 0 || fstat(in_fd, &st) != 0 ||
+                  file_copy(in_fd, out_fd, st.st_size) != 0);
+    if (out_fd >= 0 && close(out_fd) != 0) failed = 1;
+    close(in_fd);
+    if (!failed && rename(temp, name) != 0) failed = 1;
+    if (failed) {
+        if (out_fd >= 0) unlink(temp);
+        return -1;
+    }
+    return cache_update(cache, 0, 0, st.st_size, NULL);
+}
+
+/* Adds hits and misses to the counts of the cache, and fills in totals (hits,
+   misses and bytes in the cache) if set. Returns -1 if the counts cannot be kept */
+int cache_count(const result_cache *cache, long long hits, long long misses, long long totals[3]) {
+    mkdir((*cache).dir, 0755);
+    return cache_update(cache, hits, misses, 0, totals);
+}
+
+/* Filters a BMP through memory maps instead of reading it into a buffer. The
+   input is mapped read-only and the output file is preallocated with ftruncate
+   and mapped read-write, then the filter chain copies each row across and
+   filters it in place in the output map, leaving the kernel to page the data
+   in and write it back. When the output is the input file, it is mapped
+   read-write and filtered in place */
+void map_filter(const char *input_file, const char *output_file, filter_chain *chain, thread_pool *pool, profile *prof) {
+    double t = profile_clock();
+    int in_fd = open(input_file, O_RDONLY);
+    struct stat in_stat, out_stat;
+    if (in_fd < 0 || fstat(in_fd, &in_stat) != 0) {
+        fprintf(stderr, "%s input file either does not exist or is not readable.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    size_t size = in_stat.st_size;
+    if (size < FH_SIZE + IH_SIZE) {
+        fprintf(stderr, "%s reading the bmp file header failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    // Same file for input and output means filtering in place
+    int in_place = (stat(output_file, &out_stat) == 0 && out_stat.st_dev == in_stat.st_dev && out_stat.st_ino == in_stat.st_ino);
+    unsigned char *in_map = NULL, *out_map;
+    int out_fd;
+    if (in_place) {
+        close(in_fd);
+        out_fd = open(output_file, O_RDWR);
+    } else {
+        in_map = mmap(NULL, size, PROT_READ, MAP_SHARED, in_fd, 0);
+        close(in_fd);
+        if (in_map == MAP_FAILED) {
+            fprintf(stderr, "%s mapping the input file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        posix_madvise(in_map, size, POSIX_MADV_SEQUENTIAL);
+        out_fd = open(output_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    }
+    if (out_fd < 0 || ftruncate(out_fd, size) != 0) {
+        fprintf(stderr, "%s the output file could not be created.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    out_map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0);
+    close(out_fd);
+    if (out_map == MAP_FAILED) {
+        fprintf(stderr, "%s mapping the output file failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Checking the headers in the map, and that all the pixel rows are there */
+    unsigned char *headers = in_place ? out_map : in_map;
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    memcpy(&file_header, headers, FH_SIZE);
+    memset(&info_header, 0, sizeof(info_header));
+    memcpy(&info_header, headers + FH_SIZE, IH_SIZE);
+    if (size < FH_SIZE + info_size(&info_header)) {
+        fprintf(stderr, "%s reading the bmp information header failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&info_header, headers + FH_SIZE, info_size(&info_header));
+    check_headers(&file_header, &info_header);
+    size_t stride = bmp_stride(&info_header);
+    int height = abs(info_header.height);
+    int rle = RLE_COMPRESSED(info_header);
+    if (file_header.offset > size || (rle && size - file_header.offset < pixel_bytes(&file_header, &info_header)) ||
+        (!rle && (size - file_header.offset) / stride < (size_t)height)) {
+        fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    profile_add(prof, "map", t, FH_SIZE + info_size(&info_header));
+
+    /* Indexed images only have their color table written, the indices are
+       copied as they are or, in place, not touched at all */
+    if (info_header.bpp <= 8) {
+        t = profile_clock();
+        if (!in_place) memcpy(out_map, in_map, size);
+        profile_add(prof, "copy", t, in_place ? 0 : size);
+        t = profile_clock();
+        unsigned long long counts[256] = {0};
+        if (next_barrier(chain, 0, -1) < (*chain).count && rle) {
+            if (rle_count(counts, out_map + file_header.offset, pixel_bytes(&file_header, &info_header), info_header.width, height,
+                          info_header.bpp) != 0) {
+                fprintf(stderr, "%s the run-length encoded pixels of the input file are corrupt.\n", ERROR_HEADER);
+                exit(EXIT_FAILURE);
+            }
+        } else if (next_barrier(chain, 0, -1) < (*chain).count) {
+            palette_count(counts, out_map + file_header.offset, info_header.width, height, info_header.bpp, stride);
+        }
+        palette_filter(chain, out_map + FH_SIZE + info_header.header_size, palette_colors(&info_header), counts);
+        profile_add(prof, "filter (color table)", t, 4 * palette_colors(&info_header));
+        t = profile_clock();
+        munmap(out_map, size);
+        if (in_map != NULL) munmap(in_map, size);
+        profile_add(prof, "unmap", t, 0);
+        return;
+    }
+
+    /* Everything before the pixels is copied as is, then the rows are filtered across */
+    if (!in_place) memcpy(out_map, in_map, file_header.offset);
+    t = profile_clock();
+    image source, dest;
+    image_wrap(&dest, out_map + file_header.offset, info_header.width, height, stride, info_header.bpp / 8);
+    if (!in_place) image_wrap(&source, in_map + file_header.offset, info_header.width, height, stride, info_header.bpp / 8);
+    if (run_chain_copy(chain, in_place ? NULL : &source, &dest, pool, NULL) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "filter (including page faults)", t, 2 * stride * height);
+    // Copying anything stored after the pixels
+    size_t end = file_header.offset + stride * height;
+    if (!in_place && end < size) memcpy(out_map + end, in_map + end, size - end);
+
+    t = profile_clock();
+    munmap(out_map, size);
+    if (in_map != NULL) munmap(in_map, size);
+    profile_add(prof, "unmap", t, 0);
+}
+
+/* Reads (or with writing set, writes) count bytes at offset in a file,
+   carrying on after short reads and writes. Returns -1 if it fails */
+static int region_io(int fd, unsigned char *data, size_t count, off_t offset, int writing) {
+    while (count > 0) {
+        ssize_t done = writing ? pwrite(fd, data, count, offset) : pread(fd, data, count, offset);
+        if (done <= 0) return -1;
+        data += done;
+        count -= done;
+        offset += done;
+    }
+    return 0;
+}
+
+/* Copies the first size bytes of one file to another. Returns -1 if it fails */
+static int region_copy(int in_fd, int out_fd, size_t size) {
+    unsigned char *buffer = (unsigned char *) malloc (COPY_BLOCK);
+    int failed = (buffer == NULL);
+    for (size_t done = 0; !failed && done < size; done += COPY_BLOCK) {
+        size_t count = (size - done < COPY_BLOCK) ? size - done : COPY_BLOCK;
+        failed = region_io(in_fd, buffer, count, done, 0) != 0 || region_io(out_fd, buffer, count, done, 1) != 0;
+    }
+    free(buffer);
+    return failed ? -1 : 0;
+}
+
+/* Filters only a rectangle of a BMP. Just the bytes of each row inside it
+   are read with pread, filtered as an image of their own (so the statistics
+   and the edges of the blur and sharpen filters only see the rectangle),
+   and written back with pwrite. When the output is the input file only the
+   rectangle is written, so the cost grows with the rectangle rather than
+   the image; otherwise the input file is copied to the output first. If
+   stats is set, the statistics of the filtered rectangle are gathered and
+   nothing is written */
+void region_filter(const char *input_file, const char *output_file, filter_chain *chain, const region *roi,
+                   thread_pool *pool, profile *prof, image_stats *stats) {
+    double t = profile_clock();
+    struct stat in_stat, out_stat;
+    // Same file for input and output means filtering in place
+    int in_place = (stats == NULL && stat(input_file, &in_stat) == 0 && stat(output_file, &out_stat) == 0 &&
+                    out_stat.st_dev == in_stat.st_dev && out_stat.st_ino == in_stat.st_ino);
+    int in_fd = open(input_file, in_place ? O_RDWR : O_RDONLY);
+    if (in_fd < 0 || fstat(in_fd, &in_stat) != 0) {
+        fprintf(stderr, "%s input file either does not exist or is not readable.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    size_t size = in_stat.st_size;
+
+    /* Reading and checking the headers, and that all the pixel rows are there */
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    memset(&info_header, 0, sizeof(info_header));
+    if (region_io(in_fd, (unsigned char *)&file_header, FH_SIZE, 0, 0) != 0) {
+        fprintf(stderr, "%s reading the bmp file header failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (region_io(in_fd, (unsigned char *)&info_header, IH_SIZE, FH_SIZE, 0) != 0 ||
+        region_io(in_fd, (unsigned char *)&info_header, info_size(&info_header), FH_SIZE, 0) != 0) {
+        fprintf(stderr, "%s reading the bmp information header failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    check_headers(&file_header, &info_header);
+    if (info_header.bpp <= 8) {
+        fprintf(stderr, "%s the colors of an indexed image are shared by all its pixels, so a region of it cannot be "
+                "filtered.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    size_t stride = bmp_stride(&info_header);
+    int height = abs(info_header.height);
+    if (file_header.offset > size || (size - file_header.offset) / stride < (size_t)height) {
+        fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    // Compared without adding, which could overflow for large regions
+    if ((*roi).x < 0 || (*roi).width <= 0 || (*roi).x > info_header.width - (*roi).width ||
+        (*roi).y < 0 || (*roi).height <= 0 || (*roi).y > height - (*roi).height) {
+        fprintf(stderr, "%s the region %d,%d,%d,%d is not inside the %dx%d image.\n", ERROR_HEADER, (*roi).x, (*roi).y,
+                (*roi).width, (*roi).height, info_header.width, height);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "headers", t, FH_SIZE + info_size(&info_header));
+
+    /* Reading the part of each row inside the region. Rows are stored from
+       the bottom up unless the height is negative */
+    t = profile_clock();
+    int channels = info_header.bpp / 8;
+    image img;
+    if (image_create(&img, (*roi).width, (*roi).height, (channels == 4) ? LAYOUT_BGRA : LAYOUT_BGR) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    int first = (info_header.height > 0) ? height - (*roi).y - (*roi).height : (*roi).y;
+    off_t start = file_header.offset + (off_t)stride * first + (off_t)channels * (*roi).x;
+    size_t bytes = (size_t)channels * (*roi).width;
+    for (int i = 0; i < (*roi).height; i++) {
+        if (region_io(in_fd, img.data + img.stride * i, bytes, start + (off_t)stride * i, 0) != 0) {
+            fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+    }
+    profile_add(prof, "read (region)", t, (long long)bytes * (*roi).height);
+
+    t = profile_clock();
+    if (run_chain_copy(chain, NULL, &img, pool, stats) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "filter (all stages)", t, (long long)bytes * (*roi).height);
+    if (stats != NULL) {
+        image_free(&img);
+        close(in_fd);
+        return;
+    }
+
+    /* Writing the region back, into a copy of the input file unless in place */
+    int out_fd = in_fd;
+    if (!in_place) {
+        t = profile_clock();
+        out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0 || region_copy(in_fd, out_fd, size) != 0) {
+            fprintf(stderr, "%s the output file could not be created.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, "copy", t, size);
+    }
+    t = profile_clock();
+    for (int i = 0; i < (*roi).height; i++) {
+        if (region_io(out_fd, img.data + img.stride * i, bytes, start + (off_t)stride * i, 1) != 0) {
+            fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (out_fd != in_fd && close(out_fd) != 0) {
+        fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    close(in_fd);
+    profile_add(prof, "write (region)", t, (long long)bytes * (*roi).height);
+    image_free(&img);
+}
+
+/* Reads a proxy of a 24 or 32-bit BMP for previews, keeping every step-th
+   pixel of every step-th row counted from the top left corner. Only the
+   kept rows are read, with pread, and when they are far enough apart the
+   kernel is told not to read ahead, so the rows skipped are never read
+   from the disk. Like filter_file this writes the message into error and
+   returns -1 if it fails, otherwise the bytes read */
+long long proxy_read(const char *input_file, int step, proxy_image *proxy, char error[ERROR_SIZE]) {
+    BITMAPFILEHEADER *file_header = &(*proxy).file_header;
+    BITMAPINFOHEADER *info_header = &(*proxy).info_header;
+    const char *problem;
+    struct stat st;
+    memset(proxy, 0, sizeof(*proxy));
+    int fd = open(input_file, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        snprintf(error, ERROR_SIZE, "%s: input file either does not exist or is not readable.", input_file);
+        return -1;
+    }
+    if (region_io(fd, (unsigned char *)file_header, FH_SIZE, 0, 0) != 0 ||
+        region_io(fd, (unsigned char *)info_header, IH_SIZE, FH_SIZE, 0) != 0 ||
+        region_io(fd, (unsigned char *)info_header, info_size(info_header), FH_SIZE, 0) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: reading the bmp headers failed.", input_file);
+        close(fd);
+        return -1;
+    }
+    if ((problem = header_error(file_header, info_header)) != NULL || (*info_header).bpp <= 8) {
+        snprintf(error, ERROR_SIZE, "%s: %s", input_file, (problem != NULL) ? problem : "indexed color images are only "
+                 "filtered through their color tables, which is as fast as a preview, so they cannot be previewed.");
+        close(fd);
+        return -1;
+    }
+
+    /* The gap before the pixels is kept, and all the rows must be there */
+    size_t stride = bmp_stride(info_header), gap = header_gap(file_header, info_header);
+    int width = (*info_header).width, height = abs((*info_header).height), channels = (*info_header).bpp / 8;
+    int proxy_width = (width + step - 1) / step, proxy_height = (height + step - 1) / step;
+    size_t span = (size_t)channels * ((size_t)(proxy_width - 1) * step + 1);
+    unsigned char *row = (unsigned char *) malloc (span);
+    (*proxy).gap = (unsigned char *) malloc (gap + 1);
+    if (width <= 0 || (*file_header).offset > (unsigned long long)st.st_size ||
+        (st.st_size - (*file_header).offset) / stride < (size_t)height) {
+        snprintf(error, ERROR_SIZE, "%s: reading the image data failed.", input_file);
+    } else if (row == NULL || (*proxy).gap == NULL ||
+               image_create(&(*proxy).img, proxy_width, proxy_height, (channels == 4) ? LAYOUT_BGRA : LAYOUT_BGR) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: memory allocation failed.", input_file);
+    } else if (region_io(fd, (*proxy).gap, gap, FH_SIZE + info_size(info_header), 0) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: reading the image data failed.", input_file);
+    } else {
+#ifdef POSIX_FADV_RANDOM
+        if ((size_t)(step - 1) * stride >= (size_t)sysconf(_SC_PAGESIZE)) posix_fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+#endif
+        /* Rows of the proxy are kept in the order of the file, so for rows
+           stored from the bottom up its first row is the last one kept */
+        int i;
+        for (i = 0; i < proxy_height; i++) {
+            int y = ((*info_header).height > 0) ? height - 1 - (proxy_height - 1 - i) * step : i * step;
+            if (region_io(fd, row, span, (*file_header).offset + (off_t)stride * y, 0) != 0) break;
+            unsigned char *to = IMAGE_ROW(&(*proxy).img, i);
+            for (int x = 0; x < proxy_width; x++) memcpy(to + channels * x, row + (size_t)channels * x * step, channels);
+        }
+        if (i < proxy_height) snprintf(error, ERROR_SIZE, "%s: reading the image data failed.", input_file);
+        free(row);
+        close(fd);
+        if (i < proxy_height) {
+            proxy_free(proxy);
+            return -1;
+        }
+        resize_headers(file_header, info_header, proxy_width, proxy_height);
+        return FH_SIZE + info_size(info_header) + gap + (long long)span * proxy_height;
+    }
+    free(row);
+    close(fd);
+    proxy_free(proxy);
+    return -1;
+}
+
+/* Works out the name a proxy is cached under from the identity, size and
+   modification time of the input file and the step, rather than from its
+   contents, so looking a proxy up never reads the image. Returns -1 if the
+   file cannot be found */
+int proxy_key(const char *input_file, int step, unsigned long long *key) {
+    struct stat st;
+    if (stat(input_file, &st) != 0) return -1;
+    long long identity[7] = {(long long)st.st_dev, (long long)st.st_ino, (long long)st.st_size, (long long)st.st_mtim.tv_sec,
+                             (long long)st.st_mtim.tv_nsec, step, CACHE_VERSION};
+    *key = hash_bytes(identity, sizeof(identity), 0);
+    return 0;
+}
+
+/* The result cache with the name it keeps proxies under, in place of the
+   hash of the filters */
+static result_cache proxy_cache(const result_cache *cache) {
+    result_cache proxies = *cache;
+    proxies.filters = hash_bytes("proxy", 5, 0);
+    return proxies;
+}
+
+/* Reads the proxy cached under key, marking it as just used. Returns 1 if
+   it was found, or 0 if there is none (or it cannot be read) */
+int proxy_load(const result_cache *cache, unsigned long long key, proxy_image *proxy) {
+    char name[4096];
+    result_cache proxies = proxy_cache(cache);
+    memset(proxy, 0, sizeof(*proxy));
+    FILE *fp = (cache_name(name, sizeof(name), &proxies, key) == 0) ? fopen(name, "r") : NULL;
+    if (fp == NULL) return 0;
+    futimens(fileno(fp), NULL);     // the time it was last used, for eviction
+    BITMAPFILEHEADER *file_header = &(*proxy).file_header;
+    BITMAPINFOHEADER *info_header = &(*proxy).info_header;
+    size_t gap = 0;
+    int found = fread(file_header, FH_SIZE, 1, fp) == 1 && read_info(fp, info_header) == 0 &&
+                header_error(file_header, info_header) == NULL && (*info_header).bpp > 8;
+    if (found) {
+        gap = header_gap(file_header, info_header);
+        found = ((*proxy).gap = (unsigned char *) malloc (gap + 1)) != NULL && fread((*proxy).gap, 1, gap, fp) == gap &&
+                image_create(&(*proxy).img, (*info_header).width, abs((*info_header).height),
+                             ((*info_header).bpp == 32) ? LAYOUT_BGRA : LAYOUT_BGR) == 0 &&
+                image_read(fp, &(*proxy).img, (*info_header).bpp) == 0;
+    }
+    fclose(fp);
+    if (!found) proxy_free(proxy);
+    return found;
+}
+
+/* Adds a proxy to the cache under key, written under a temporary name and
+   renamed like cache_store. Returns -1 if it cannot be stored */
+int proxy_store(const result_cache *cache, unsigned long long key, const proxy_image *proxy) {
+    char name[4096], temp[4096];
+    result_cache proxies = proxy_cache(cache);
+    BITMAPFILEHEADER file_header = (*proxy).file_header;
+    BITMAPINFOHEADER info_header = (*proxy).info_header;
+    mkdir((*cache).dir, 0755);
+    if (cache_name(name, sizeof(name), &proxies, key) != 0 ||
+        snprintf(temp, sizeof(temp), "%s/.store.XXXXXX", (*cache).dir) >= (int)sizeof(temp)) return -1;
+    int fd = mkstemp(temp);
+    FILE *fp = (fd >= 0 && fchmod(fd, 0644) == 0) ? fdopen(fd, "w") : NULL;
+    int failed = (fp == NULL || write_bmp(fp, &file_header, &info_header, (*proxy).gap, &(*proxy).img) != 0);
+    if (fp != NULL && fclose(fp) != 0) failed = 1;
+    if (fp == NULL && fd >= 0) close(fd);
+    if (!failed && rename(temp, name) != 0) failed = 1;
+    if (failed) {
+        if (fd >= 0) unlink(temp);
+        return -1;
+    }
+    return cache_update(cache, 0, 0, file_header.size, NULL);
+}
+
+/* Runs the filter chain over a copy of the proxy, so it can be filtered
+   again with other settings, and writes the result to output unless it is
+   NULL. If stats is set, the filtered proxy is added to it. Returns -1 if
+   memory runs out or writing fails */
+int proxy_filter(const proxy_image *proxy, FILE *output, filter_chain *chain, thread_pool *pool, image_stats *stats) {
+    BITMAPFILEHEADER file_header = (*proxy).file_header;
+    BITMAPINFOHEADER info_header = (*proxy).info_header;
+    image img;
+    int layout = ((*proxy).img.channels == 4) ? LAYOUT_BGRA : LAYOUT_BGR;
+    if (image_create(&img, (*proxy).img.width, (*proxy).img.height, layout) != 0) return -1;
+    transform_headers(chain, &file_header, &info_header);
+    int failed = run_chain_copy(chain, &(*proxy).img, &img, pool, stats) != 0 ||
+                 (output != NULL && write_bmp(output, &file_header, &info_header, (*proxy).gap, &img) != 0);
+    image_free(&img);
+    return failed ? -1 : 0;
+}
+
+/* Frees the memory of a proxy */
+void proxy_free(proxy_image *proxy) {
+    free((*proxy).gap);
+    image_free(&(*proxy).img);
+    (*proxy).gap = NULL;
+}
+
+/* The library interface. Each function runs a copy of the chain taking its
+   buffers from the context's block pool, so a chain can be shared */
+
+struct bmpedit_context {
+    thread_pool *pool;
+    block_pool blocks;
+    work_buffer buffer;         // for reading whole files
+    char error[ERROR_SIZE];
+};
+
+/* Makes a context filtering with threads threads, and picks the fastest
+   kernels this CPU has. Returns NULL if there is not enough memory */
+bmpedit_context *bmpedit_create(int threads) {
+    bmpedit_context *context = (bmpedit_context *) calloc (1, sizeof(bmpedit_context));
+    if (context == NULL) return NULL;
+    if (threads > 1 && ((*context).pool = pool_create(threads)) == NULL) {
+        free(context);
+        return NULL;
+    }
+    block_pool_init(&(*context).blocks);
+    simd_init(SIMD_AVX2);
+    return context;
+}
+
+/* Stops the threads of a context and frees everything it holds */
+void bmpedit_destroy(bmpedit_context *context) {
+    if (context == NULL) return;
+    pool_destroy((*context).pool);
+    block_pool_free(&(*context).blocks);
+    free((*context).buffer.data);
+    free(context);
+}
+
+/* Returns the message of the last error of a context */
+const char *bmpedit_error(const bmpedit_context *context) {
+    return (*context).error;
+}
+
+/* Returns how many blocks the context has allocated so far, which stops
+   growing once it has filtered an image of each size it is given */
+long long bmpedit_allocations(const bmpedit_context *context) {
+    return (*context).blocks.allocations;
+}
+
+/* Keeps the message of an error, returning its code */
+static int library_error(bmpedit_context *context, int code, const char *message) {
+    snprintf((*context).error, ERROR_SIZE, "%s", message);
+    return code;
+}
+
+/* Filters rows of packed BGR or BGRA pixels in place, stride bytes apart.
+   Chains which rotate or flip the image cannot be used, as they would
+   change its size */
+int bmpedit_filter_pixels(bmpedit_context *context, const filter_chain *chain, unsigned char *pixels, int width, int height,
+                          size_t stride, int channels) {
+    if (channels != 3 && channels != 4) {
+        return library_error(context, BMPEDIT_ERROR_ARGUMENT, "the pixels must have 3 or 4 channels.");
+    } else if (width <= 0 || height <= 0 || stride < (size_t)width * channels) {
+        return library_error(context, BMPEDIT_ERROR_ARGUMENT, "the rows are empty or longer than their stride.");
+    } else if ((*chain).transform != 0) {
+        return library_error(context, BMPEDIT_ERROR_ARGUMENT, "pixels cannot be rotated or flipped in place.");
+    }
+    filter_chain local = *chain;
+    local.blocks = &(*context).blocks;
+    image img;
+    image_wrap(&img, pixels, width, height, stride, channels);
+    if (run_chain_copy(&local, NULL, &img, (*context).pool, NULL) != 0) {
+        return library_error(context, BMPEDIT_ERROR_MEMORY, "memory allocation failed.");
+    }
+    return BMPEDIT_OK;
+}
+
+/* Filters a BMP file held in memory into output, which has room for
+   *output_size bytes. *output_size is set to the size of the filtered
+   file, and if that does not fit nothing is written, so the call can be
+   repeated with a buffer big enough. Indexed images keep their encoding */
+int bmpedit_filter_bmp(bmpedit_context *context, const filter_chain *chain, const unsigned char *input, size_t size,
+                       unsigned char *output, size_t *output_size) {
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    const char *problem;
+    memset(&info_header, 0, sizeof(BITMAPINFOHEADER));
+    if (size < FH_SIZE + IH_SIZE) return library_error(context, BMPEDIT_ERROR_FORMAT, "the bmp headers are cut short.");
+    memcpy(&file_header, input, FH_SIZE);
+    memcpy(&info_header, input + FH_SIZE, IH_SIZE);
+    size_t headers = FH_SIZE + info_size(&info_header);
+    if (size < headers || info_header.header_size > size - FH_SIZE) {
+        return library_error(context, BMPEDIT_ERROR_FORMAT, "the information header is longer than the data.");
+    }
+    memcpy((unsigned char *)&info_header + IH_SIZE, input + FH_SIZE + IH_SIZE, headers - FH_SIZE - IH_SIZE);
+    if ((problem = header_error(&file_header, &info_header)) != NULL) {
+        return library_error(context, BMPEDIT_ERROR_FORMAT, problem);
+    }
+    BITMAPINFOHEADER rows = info_header;
+    rows.height = abs(info_header.height);
+    size_t stride = bmp_stride(&rows), gap = header_gap(&file_header, &info_header);
+    size_t bytes = headers + gap + pixel_bytes(&file_header, &info_header);
+    if (file_header.offset > size) {
+        return library_error(context, BMPEDIT_ERROR_FORMAT, "the offset of the pixels is past the end of the data.");
+    } else if (rows.width <= 0) {
+        return library_error(context, BMPEDIT_ERROR_FORMAT, "the width of the image is not positive.");
+    } else if (size < bytes) {
+        return library_error(context, BMPEDIT_ERROR_FORMAT, "the image data is cut short.");
+    }
+
+    /* Filtering with a copy of the chain, as statistics stages keep their results */
+    filter_chain local = *chain;
+    local.blocks = &(*context).blocks;
+    if (rows.bpp <= 8) {
+        if (has_spatial(&local) || local.transform != 0) {
+            return library_error(context, BMPEDIT_ERROR_ARGUMENT, "indexed color images can only have their colors filtered.");
+        }
+        if (*output_size < bytes) {
+            *output_size = bytes;
+            return library_error(context, BMPEDIT_ERROR_SPACE, "the output buffer is too small.");
+        }
+        *output_size = bytes;
+        memcpy(output, input, bytes);
+        unsigned long long counts[256] = {0};
+        if (next_barrier(&local, 0, -1) < local.count && RLE_COMPRESSED(info_header)) {
+            if (rle_count(counts, output + headers + gap, bytes - headers - gap, rows.width, rows.height, rows.bpp) != 0) {
+                return library_error(context, BMPEDIT_ERROR_FORMAT, "the run-length encoded pixels are corrupt.");
+            }
+        } else if (next_barrier(&local, 0, -1) < local.count) {
+            palette_count(counts, output + headers + gap, rows.width, rows.height, rows.bpp, stride);
+        }
+        palette_filter(&local, output + FH_SIZE + rows.header_size, palette_colors(&rows), counts);
+        return BMPEDIT_OK;
+    }
+
+    /* Packed pixels, filtered from the input straight into the output unless they are turned */
+    BITMAPFILEHEADER out_file_header = file_header;
+    BITMAPINFOHEADER out_info_header = info_header;
+    transform_headers(&local, &out_file_header, &out_info_header);
+    BITMAPINFOHEADER out_rows = out_info_header;
+    out_rows.height = abs(out_info_header.height);
+    size_t out_stride = bmp_stride(&out_rows), out_headers = FH_SIZE + info_size(&out_info_header);
+    size_t out_bytes = out_headers + gap + out_stride * out_rows.height;
+    if (*output_size < out_bytes) {
+        *output_size = out_bytes;
+        return library_error(context, BMPEDIT_ERROR_SPACE, "the output buffer is too small.");
+    }
+    *output_size = out_bytes;
+    memcpy(output, &out_file_header, FH_SIZE);
+    memcpy(output + FH_SIZE, &out_info_header, out_headers - FH_SIZE);
+    memcpy(output + out_headers, input + headers, gap);
+    unsigned char *pixels = output + out_headers + gap;
+    int channels = rows.bpp / 8, failed = 0;
+    image source, dest;
+    image_wrap(&source, (unsigned char *)input + headers + gap, rows.width, rows.height, stride, channels);
+    if (local.transform == 0) {
+        image_wrap(&dest, pixels, rows.width, rows.height, stride, channels);
+        failed = run_chain_copy(&local, &source, &dest, (*context).pool, NULL) != 0;
+    } else {
+        // Turned into an image from the pool, then copied into place. The
+        // rows are copied from the input into a block with the same stride
+        unsigned char *rows_block = (unsigned char *) block_alloc (local.blocks, stride * rows.height);
+        image_wrap(&dest, rows_block, rows.width, rows.height, stride, channels);
+        failed = rows_block == NULL || run_chain_copy(&local, &source, &dest, (*context).pool, NULL) != 0;
+        for (int i = 0; !failed && i < dest.height; i++) {
+            memcpy(pixels + out_stride * i, IMAGE_ROW(&dest, i), (size_t)channels * dest.width);
+        }
+        image_release(local.blocks, &dest);
+        block_free(local.blocks, rows_block);
+    }
+    if (failed) return library_error(context, BMPEDIT_ERROR_MEMORY, "memory allocation failed.");
+    // Zeroing the padding of each row
+    size_t used = (size_t)channels * out_rows.width;
+    for (int i = 0; used < out_stride && i < out_rows.height; i++) memset(pixels + out_stride * i + used, 0, out_stride - used);
+    return BMPEDIT_OK;
+}
+
+/* Filters a BMP file into another, as the command-line program does, with
+   the buffer the file is read into kept for the next one */
+int bmpedit_filter_file(bmpedit_context *context, const filter_chain *chain, const char *input_file, const char *output_file) {
+    filter_chain local = *chain;
+    local.blocks = &(*context).blocks;
+    if (filter_file(input_file, output_file, &local, NULL, COMPRESS_KEEP, (*context).pool, &(*context).buffer, NULL,
+                    (*context).error) < 0) {
+        return BMPEDIT_ERROR_FILE;
+    }
+    return BMPEDIT_OK;
+}
+
+/* The command-line program, left out when the filters are linked into other programs */
+#ifndef BMPEDIT_NO_MAIN
+
+/* bmpedit ascii logo */
+static void logo(void) {
+    printf(
+        "***********************************************\n"
+        "*     __                             ___ __   *\n"
+        "*    / /_  ____ ___  ____  ___  ____/ (_) /_  *\n"
+        "*   / __ \\/ __ `__ \\/ __ \\/ _ \\/ __  / / __/  *\n"
+        "*  / /_/ / / / / / / /_/ /  __/ /_/ / / /_    *\n"
+        "* /_.___/_/ /_/ /_/ .___/\\___/\\__,_/_/\\__/    *\n"
+        "*                /_/                          *\n"
+        "*                                             *\n"
+        "***********************************************\n"
+    );
+}
+
+/* Prints usage text */
+static void usage(void) {
+    printf(
+        "\nUsage: bmpedit [OPTIONS...] [input.bmp]\n"
+        "       bmpedit [OPTIONS...] -o TEMPLATE [-l LIST] [input.bmp | directory]...\n\n"
+        "DESCRIPTION:\n"
+        "   This program does simple edits of BMP image files. When the program runs it\n"
+        "   first prints out the width and the height of the input image within the BMP\n"
+        "   file. Once this is done if there is a filter (or sequence of filters) then\n"
+        "   they are applied to the image. The resulting image is also stored using BMP\n"
+        "   format into an output file. Without any filters only the width and height of\n"
+        "   the image is output.\n\n"
+        "NOTE:\n"
+        "   0.0 will be assumed as the argument for a command if the argument begins\n"
+        "   with a character. An input file of - reads the image from stdin.\n\n"
+        "BATCH MODE:\n"
+        "   Given more than one input, a directory (all of its .bmp files) or a list\n"
+        "   of files with -l, the same filters are applied to every image. The output\n"
+        "   file is then a template, in which %%n is replaced by the input file name\n"
+        "   without its extension, %%d by the directory it is in, %%i by its position\n"
+        "   and %%%% by %%, e.g. -o \"out/%%n.bmp\". With --stats the statistics of\n"
+        "   every image are printed instead, and no template is needed.\n\n"
+    );
+    printf(
+        "OPTIONS:\n"
+        "   -h            Displays this usage message.\n"
+        "   --profile[=table|json]\n"
+        "                 Print the time taken by each step (reading, each filter and\n"
+        "                 writing) with the bytes it moved and the peak memory use to\n"
+        "                 stderr, as a table or as JSON lines.\n"
+        "   --stats[=table|json]\n"
+        "                 Print the smallest, largest, mean and median value, standard\n"
+        "                 deviation and clipped pixels of each channel and the\n"
+        "                 luminance of the image after any filters, instead of writing\n"
+        "                 it. As JSON the histograms are included.\n"
+        "   -m            Filter through memory maps of the input and output files\n"
+        "                 rather than reading the image into memory. If the output\n"
+        "                 file is the input file, it is filtered in place.\n"
+        "   -o FILE       Sets the output file for modified images (default output file\n"
+        "                 is \"out.bmp\"). Use - to write the image to stdout.\n"
+        "   --in-place    Write the output over the input file, with -m or --roi.\n"
+        "   -c            Apply a color tint filter to the image - the program will ask\n"
+        "                 you for RGB tint values.\n"
+        "   -g            Apply a greyscale (black and white) filter to the image.\n"
+        "   -i            Apply a filter to invert the pixel colors on the image.\n"
+        "   -j 0-256      Run the filters on this many threads, each working on a band\n"
+        "                 of rows (0 uses one thread per CPU, default is 1). In batch\n"
+        "                 mode each thread filters whole images instead.\n"
+        "   -l LIST       Filter every file named in LIST, one per line (- reads the\n"
+        "                 list from stdin).\n"
+        "   -p            Keep the image in memory as separate blue, green and red\n"
+        "                 planes rather than as pixels, which can be faster for chains\n"
+        "                 of compute-heavy filters like -H, -S, -L and -s.\n"
+        "   -r ROWS       Stream the image through the filters ROWS rows at a time, so\n"
+        "                 memory use does not grow with the image size.\n"
+        "   --io-depth 0-64\n"
+        "                 With -r, read up to this many chunks ahead of the filters\n"
+        "                 and write as many behind them on threads of their own\n"
+        "                 (default 2, 0 reads and writes between the filters).\n"
+        "   --io-chunk 4-65536\n"
+        "                 Read and write chunks of this many KB (default 1024).\n"
+        "   -s            Apply a sepia filter to the image (gives it a warmer tone).\n"
+        "   -t 0.0-1.0    Apply a threshold filter to the image with the threshold as\n"
+        "                 the value given.\n"
+        "   -u FILE       Apply the 3D lookup table in the .cube file FILE to the image.\n"
+        "   --bake[=2-256]\n"
+        "                 Bake the filters into 3D lookup tables with this many points\n"
+        "                 along each side (default 33), which is faster for long\n"
+        "                 chains but only exact at the grid points.\n"
+        "   --save-cube=FILE\n"
+        "                 Write the filters as a 3D lookup table to the .cube file FILE,\n"
+        "                 with the size given by --bake. Without an input file no image\n"
+        "                 is filtered.\n"
+        "   -y 0.01-7.99  Apply a gamma correction filter to the image.\n"
+        "   -w            Apply an automatic white balance filter to correct the color\n"
+        "                 temperature of the image.\n"
+        "   --auto-levels[=0-50]\n"
+        "                 Stretch each channel so the darkest and lightest percent of\n"
+        "                 the pixels given (default 0.5) become black and white, which\n"
+        "                 also removes a color cast.\n"
+        "   --auto-contrast[=0-50]\n"
+        "                 Stretch all channels the same way by the luminance, keeping\n"
+        "                 the balance of the colors.\n"
+    );
+    printf(
+        "   --blur 0.1-50 Apply a Gaussian blur with this standard deviation in pixels.\n"
+        "   --box-blur 1-128\n"
+        "                 Apply a box blur, averaging the square this many pixels\n"
+        "                 around each pixel.\n"
+        "   --sharpen[=0-10]\n"
+        "                 Sharpen the image by this amount (default 1).\n"
+        "   --unsharp SIGMA[,AMOUNT[,THRESHOLD]]\n"
+        "                 Apply an unsharp mask: add the difference from a Gaussian\n"
+        "                 blur of SIGMA (0.1-50) times AMOUNT (0-10, default 1) where it\n"
+        "                 is more than THRESHOLD (0-255, default 0). The blur and\n"
+        "                 sharpen filters cannot be used on indexed images.\n"
+        "   --roi X,Y,WIDTH,HEIGHT\n"
+        "                 Filter only the rectangle with its top left corner X pixels\n"
+        "                 from the left and Y from the top, reading and writing just\n"
+        "                 its rows. The rest of the file is copied unless the output\n"
+        "                 is the input file. The rectangle is filtered as an image of\n"
+        "                 its own, and cannot be used on indexed images.\n"
+        "   --resize WIDTH[xHEIGHT] | --resize xHEIGHT\n"
+        "                 Resize the image as it is read, before any filters. With\n"
+        "                 only one side given the other keeps the aspect ratio.\n"
+        "   --thumbnail 1-65535\n"
+        "                 Resize the image so its longer side is this many pixels.\n"
+        "   --resize-filter box|bilinear|lanczos\n"
+        "                 Resample with this filter (default lanczos). Resizing cannot\n"
+        "                 be used with -m or on indexed images.\n"
+        "   --serve SOCKET\n"
+        "                 Serve requests on the Unix domain socket SOCKET with -j\n"
+        "                 workers until stopped. A request is a line of the options\n"
+        "                 for one image, or a JSON array of them, and is answered with\n"
+        "                 a line of JSON.\n"
+        "   --client SOCKET\n"
+        "                 Send the options to the server on SOCKET and print its\n"
+        "                 answer, rather than filtering the image here.\n"
+        "   --cache DIR   Keep the filtered images in the directory DIR, and copy the\n"
+        "                 result from there when the same file is filtered the same\n"
+        "                 way again.\n"
+        "   --cache-size MB\n"
+        "                 Remove the least recently used results once the cache takes\n"
+        "                 up more than this (default 1024).\n"
+        "   --compress rle|none\n"
+        "                 Write 8 and 4-bit indexed images run-length encoded (as RLE8\n"
+        "                 or RLE4), or uncompressed, rather than as the input was.\n"
+        "   --rotate 90|180|270\n"
+        "                 Rotate the image clockwise by this many degrees.\n"
+        "   --flip h|v    Flip the image left to right (h) or top to bottom (v).\n"
+        "   --transpose   Swap the rows and columns of the image. Rotations and flips\n"
+        "                 add up in the order given and are made after the filters, in\n"
+        "                 the same pass. They cannot be used with -m or --roi, or on\n"
+        "                 indexed images, and with -r only flips can.\n"
+        "   --preview[=STEP]\n"
+        "                 Filter a proxy of every STEP-th pixel of every STEP-th row\n"
+        "                 (2-256, default 8) rather than the whole image, reading only\n"
+        "                 the rows kept. With --cache the proxy is kept in DIR, so\n"
+        "                 previews of the same file with other settings do not read\n"
+        "                 the image again. Blur and unsharp radii are scaled down to\n"
+        "                 match. It cannot be used with -m, -r, -p, --roi, --in-place\n"
+        "                 or --resize, or on indexed images.\n"
+        "   -C            Cache the result of the hue, saturation and lightness filters\n"
+        "                 for each color, which is faster on images with few colors.\n"
+        "   -H -360-360   Apply a hue (color) shift to the image.\n"
+        "   -S -100-100   Increase or decrease saturation of the image.\n"
+        "   -L -100-100   Increase or decrease the lightness (similar to brightness) of \n"
+        "                 the image.\n\n"
+    );
+}
+
+/* Prints the profile to stderr after anything already printed, if profiling */
+static void report_profile(profile *prof, int profile_flag) {
+    if (prof == NULL) return;
+    fflush(stdout);
+    profile_print(stderr, prof, profile_flag == 2);
+}
+
+// Settings from the command-line options, or from a request to the server
+typedef struct {
+    char *output_file, *list_file, *cube_file, *save_file;
+    char *serve_socket, *client_socket;     // socket to serve requests on, or to send the request to
+    filter_params params;
+    int filter_flag;    // filter flag adds values from macros to consider all possibilties
+    int hsl_flag;   // flag to check if H, S or L filter has already been selected
+    int threads;
+    int map_flag;   // flag to filter through memory maps
+    int stream_rows;    // rows per window when streaming, 0 to read the whole image
+    int profile_flag;   // 1 to print a table of timings, 2 for JSON lines
+    int planar_flag;    // keep the image as separate B, G and R planes
+    int stats_flag;     // 1 to print the statistics of the filtered image as a table, 2 as JSON, instead of writing it
+    resize_spec resize_size_set, *resize;      // resize is set to resize the image
+    region roi_set, *roi;   // roi is set to filter only a rectangle of the image
+    int in_place_flag;  // write the output over the input file
+    io_spec io;         // how streamed files are read and written
+    char *cache_dir;    // directory of the result cache, if set
+    long long cache_limit;      // bytes the result cache may take up
+    int compress;       // COMPRESS_RLE or COMPRESS_NONE to change the compression of indexed images
+    int preview;        // pixels between those kept in the preview proxy, 0 to filter the whole image
+} options;
+
+/* Reads the command-line options into opts, leaving optind at the first
+   input file. Returns 1 if the usage message was asked for, or -1 with a
+   message in error if an option is not valid */
+static int parse_options(int argc, char *argv[], options *opts, char error[ERROR_SIZE]) {
+    static const filter_params no_params = {0, 0, 0, 0, 0, 0, 0, 0, NULL, LEVELS_CLIP, LEVELS_CLIP, 0, 0, 0, {0, 0, 0}, 0};
+    char *ptr;
+    memset(opts, 0, sizeof(*opts));
+    (*opts).output_file = "out.bmp";
+    (*opts).params = no_params;
+    (*opts).threads = 1;
+    (*opts).resize_size_set.kernel = RESIZE_LANCZOS;
+    (*opts).io.chunk = IO_CHUNK;
+    (*opts).io.depth = IO_DEPTH;
+    (*opts).cache_limit = (long long)CACHE_LIMIT << 20;
+
+    /* Checking command line options, from the start as the server parses
+       every request */
+    static struct option long_options[] = {
+        {"profile", optional_argument, NULL, 'P'},
+        {"bake", optional_argument, NULL, 'B'},
+        {"save-cube", required_argument, NULL, 'K'},
+        {"stats", optional_argument, NULL, 'T'},
+        {"auto-levels", optional_argument, NULL, 'A'},
+        {"auto-contrast", optional_argument, NULL, 'X'},
+        {"blur", required_argument, NULL, 'G'},
+        {"box-blur", required_argument, NULL, 'O'},
+        {"sharpen", optional_argument, NULL, 'E'},
+        {"unsharp", required_argument, NULL, 'U'},
+        {"resize", required_argument, NULL, 'Z'},
+        {"thumbnail", required_argument, NULL, 'N'},
+        {"resize-filter", required_argument, NULL, 'F'},
+        {"roi", required_argument, NULL, 'R'},
+        {"in-place", no_argument, NULL, 'I'},
+        {"serve", required_argument, NULL, 'V'},
+        {"client", required_argument, NULL, 'Q'},
+        {"io-depth", required_argument, NULL, 'D'},
+        {"io-chunk", required_argument, NULL, 'W'},
+        {"cache", required_argument, NULL, 'M'},
+        {"cache-size", required_argument, NULL, 'Y'},
+        {"compress", required_argument, NULL, 'J'},
+        {"rotate", required_argument, NULL, 'a'},
+        {"flip", required_argument, NULL, 'f'},
+        {"transpose", no_argument, NULL, 'x'},
+        {"preview", optional_argument, NULL, 'v'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    optind = 0;     // 0 rather than 1 makes getopt start over
+    while ((c = getopt_long(argc, argv, "c:ghij:l:mo:pr:st:u:wy:CH:S:L:", long_options, NULL)) != -1) {
+        switch (c) {
+            case 'P':
+                if (optarg == NULL || strcmp(optarg, "table") == 0) {
+                    (*opts).profile_flag = 1;
+                } else if (strcmp(optarg, "json") == 0) {
+                    (*opts).profile_flag = 2;
+                } else {
+                    snprintf(error, ERROR_SIZE, "the profile format must be table or json.");
+                    return -1;
+                }
+                break;
+            case 'B':
+                (*opts).params.bake = (optarg == NULL) ? CUBE_SIZE : strtol(optarg, &ptr, 10);
+                if ((*opts).params.bake < 2 || (*opts).params.bake > MAX_CUBE_SIZE) {
+                    snprintf(error, ERROR_SIZE, "the cube size must be between 2 and %d, inclusive.", MAX_CUBE_SIZE);
+                    return -1;
+                }
+                break;
+            case 'K':
+                (*opts).save_file = optarg;
+                break;
+            case 'T':
+                if (optarg == NULL || strcmp(optarg, "table") == 0) {
+                    (*opts).stats_flag = 1;
+                } else if (strcmp(optarg, "json") == 0) {
+                    (*opts).stats_flag = 2;
+                } else {
+                    snprintf(error, ERROR_SIZE, "the statistics format must be table or json.");
+                    return -1;
+                }
+                break;
+            case 'A':
+            case 'X': {
+                double clip = (optarg == NULL) ? LEVELS_CLIP : strtod(optarg, &ptr);
+                if (clip < 0 || clip >= 50) {
+                    snprintf(error, ERROR_SIZE, "the percent of pixels to clip must be at least 0 and less than 50.");
+                    return -1;
+                }
+                if (c == 'A') {
+                    (*opts).params.levels_clip = clip;
+                    (*opts).filter_flag |= FLAG_LEVELS;
+                } else {
+                    (*opts).params.contrast_clip = clip;
+                    (*opts).filter_flag |= FLAG_AUTO_CONTRAST;
+                }
+                break;
+            }
+            case 'G':
+                (*opts).params.blur = strtod(optarg, &ptr);
+                if ((*opts).params.blur < 0.1 || (*opts).params.blur > MAX_SIGMA) {
+                    snprintf(error, ERROR_SIZE, "the blur sigma must be between 0.1 and %g, inclusive.", MAX_SIGMA);
+                    return -1;
+                }
+                (*opts).filter_flag |= FLAG_BLUR;
+                break;
+            case 'O':
+                (*opts).params.box_radius = strtol(optarg, &ptr, 10);
+                if ((*opts).params.box_radius < 1 || (*opts).params.box_radius > MAX_BOX_RADIUS) {
+                    snprintf(error, ERROR_SIZE, "the box blur radius must be between 1 and %d, inclusive.",
+                             MAX_BOX_RADIUS);
+                    return -1;
+                }
+                (*opts).filter_flag |= FLAG_BOX_BLUR;
+                break;
+            case 'E':
+                (*opts).params.sharpen = (optarg == NULL) ? 1 : strtod(optarg, &ptr);
+                if ((*opts).params.sharpen < 0 || (*opts).params.sharpen > 10) {
+                    snprintf(error, ERROR_SIZE, "the sharpen amount must be between 0 and 10, inclusive.");
+                    return -1;
+                }
+                (*opts).filter_flag |= FLAG_SHARPEN;
+                break;
+            case 'U':
+                // SIGMA[,AMOUNT[,THRESHOLD]]
+                (*opts).params.unsharp[0] = strtod(optarg, &ptr);
+                (*opts).params.unsharp[1] = (*ptr == ',') ? strtod(ptr + 1, &ptr) : 1;
+                (*opts).params.unsharp[2] = (*ptr == ',') ? strtod(ptr + 1, &ptr) : 0;
+                if ((*opts).params.unsharp[0] < 0.1 || (*opts).params.unsharp[0] > MAX_SIGMA ||
+                    (*opts).params.unsharp[1] < 0 || (*opts).params.unsharp[1] > 10 ||
+                    (*opts).params.unsharp[2] < 0 || (*opts).params.unsharp[2] > 255) {
+                    snprintf(error, ERROR_SIZE, "the unsharp mask sigma must be between 0.1 and %g, the amount between 0 "
+                             "and 10 and the threshold between 0 and 255, inclusive.", MAX_SIGMA);
+                    return -1;
+                }
+                (*opts).filter_flag |= FLAG_UNSHARP;
+                break;
+            case 'Z':
+                // WIDTH, WIDTHxHEIGHT or xHEIGHT
+                (*opts).resize_size_set.width = (int)strtol(optarg, &ptr, 10);
+                (*opts).resize_size_set.height = 0;
+                if (*ptr == 'x') {
+                    (*opts).resize_size_set.height = (int)strtol(ptr + 1, &ptr, 10);
+                    if ((*opts).resize_size_set.height == 0) ptr = optarg;
+                }
+                if (*ptr != '\0' || (*opts).resize_size_set.width < 0 || (*opts).resize_size_set.width > MAX_RESIZE ||
+                    (*opts).resize_size_set.height < 0 || (*opts).resize_size_set.height > MAX_RESIZE ||
+                    ((*opts).resize_size_set.width == 0 && (*opts).resize_size_set.height == 0)) {
+                    snprintf(error, ERROR_SIZE, "the size to resize to must be WIDTH, WIDTHxHEIGHT or xHEIGHT, each between "
+                             "1 and %d.", MAX_RESIZE);
+                    return -1;
+                }
+                (*opts).resize_size_set.fit = 0;
+                (*opts).resize = &(*opts).resize_size_set;
+                break;
+            case 'R':
+                // X,Y,WIDTH,HEIGHT from the top left corner
+                (*opts).roi_set.x = (int)strtol(optarg, &ptr, 10);
+                (*opts).roi_set.y = (*ptr == ',') ? (int)strtol(ptr + 1, &ptr, 10) : -1;
+                (*opts).roi_set.width = (*ptr == ',') ? (int)strtol(ptr + 1, &ptr, 10) : 0;
+                (*opts).roi_set.height = (*ptr == ',') ? (int)strtol(ptr + 1, &ptr, 10) : 0;
+                if (*ptr != '\0' || ptr == optarg || (*opts).roi_set.x < 0 || (*opts).roi_set.y < 0 ||
+                    (*opts).roi_set.width < 1 || (*opts).roi_set.height < 1) {
+                    snprintf(error, ERROR_SIZE, "the region must be X,Y,WIDTH,HEIGHT, with X and Y at least 0 and the width "
+                             "and height at least 1.");
+                    return -1;
+                }
+                (*opts).roi = &(*opts).roi_set;
+                break;
+            case 'I':
+                (*opts).in_place_flag = 1;
+                break;
+            case 'V':
+                (*opts).serve_socket = optarg;
+                break;
+            case 'Q':
+                (*opts).client_socket = optarg;
+                break;
+            case 'N':
+                (*opts).resize_size_set.fit = (int)strtol(optarg, &ptr, 10);
+                if ((*opts).resize_size_set.fit < 1 || (*opts).resize_size_set.fit > MAX_RESIZE) {
+                    snprintf(error, ERROR_SIZE, "the thumbnail size must be between 1 and %d, inclusive.", MAX_RESIZE);
+                    return -1;
+                }
+                (*opts).resize = &(*opts).resize_size_set;
+                break;
+            case 'F':
+                if (strcmp(optarg, "box") == 0) {
+                    (*opts).resize_size_set.kernel = RESIZE_BOX;
+                } else if (strcmp(optarg, "bilinear") == 0) {
+                    (*opts).resize_size_set.kernel = RESIZE_BILINEAR;
+                } else if (strcmp(optarg, "lanczos") == 0) {
+                    (*opts).resize_size_set.kernel = RESIZE_LANCZOS;
+                } else {
+                    snprintf(error, ERROR_SIZE, "the resize filter must be box, bilinear or lanczos.");
+                    return -1;
+                }
+                break;
+            case 'c':
+                (*opts).params.contrast = strtod(optarg, &ptr);
+                if ((*opts).params.contrast < -100 || (*opts).params.contrast > 100) {
+                    snprintf(error, ERROR_SIZE, "the contrast must be between -100 and 100, inclusive.");
+                    return -1;
+                } else {
+                    (*opts).filter_flag += FLAG_CONTRAST;
+                }
+                break;
+            case 'g':
+                (*opts).filter_flag += FLAG_GREYSCALE;
+                break;
+            case 'h':
+                return 1;
+            case 'i':
+                (*opts).filter_flag += FLAG_INVERSE;
+                break;
+            case 'j':
+                (*opts).threads = strtol(optarg, &ptr, 10);
+                if ((*opts).threads < 0 || (*opts).threads > MAX_THREADS) {
+                    snprintf(error, ERROR_SIZE, "the number of threads must be between 0 and %d, inclusive.",
+                             MAX_THREADS);
+                    return -1;
+                }
+                if ((*opts).threads == 0) (*opts).threads = sysconf(_SC_NPROCESSORS_ONLN);     // one per CPU
+                if ((*opts).threads < 1) (*opts).threads = 1;
+                break;
+            case 'l':
+                (*opts).list_file = optarg;
+                break;
+            case 'm':
+                (*opts).map_flag = 1;
+                break;
+            case 'o':
+                if ((strstr(optarg, ".bmp") != NULL) || (strstr(optarg, ".BMP") != NULL) || strcmp(optarg, "-") == 0) {   // simple check for .bmp or .BMP, or stdout
+                    (*opts).output_file = optarg;
+                } else {
+                    snprintf(error, ERROR_SIZE, "the output file must be in .bmp or .BMP format.");
+                    return -1;
+                }
+                break;
+            case 'p':
+                (*opts).planar_flag = 1;
+                break;
+            case 'D':
+                (*opts).io.depth = (int)strtol(optarg, &ptr, 10);
+                if (*ptr != '\0' || (*opts).io.depth < 0 || (*opts).io.depth > MAX_IO_DEPTH) {
+                    snprintf(error, ERROR_SIZE, "the I/O depth must be between 0 and %d, inclusive.", MAX_IO_DEPTH);
+                    return -1;
+                }
+                break;
+            case 'W': {
+                long int kb = strtol(optarg, &ptr, 10);
+                if (*ptr != '\0' || kb < 4 || kb > MAX_IO_CHUNK / 1024) {
+                    snprintf(error, ERROR_SIZE, "the I/O chunk size must be between 4 and %d KB, inclusive.",
+                             MAX_IO_CHUNK / 1024);
+                    return -1;
+                }
+                (*opts).io.chunk = (size_t)kb * 1024;
+                break;
+            }
+            case 'M':
+                (*opts).cache_dir = optarg;
+                break;
+            case 'Y':
+                (*opts).cache_limit = strtoll(optarg, &ptr, 10);
+                if (*ptr != '\0' || (*opts).cache_limit < 1 || (*opts).cache_limit > (1LL << 40)) {
+                    snprintf(error, ERROR_SIZE, "the cache size must be between 1 and %lld MB, inclusive.", 1LL << 40);
+                    return -1;
+                }
+                (*opts).cache_limit <<= 20;
+                break;
+            case 'J':
+                if (strcmp(optarg, "rle") == 0) {
+                    (*opts).compress = COMPRESS_RLE;
+                } else if (strcmp(optarg, "none") == 0) {
+                    (*opts).compress = COMPRESS_NONE;
+                } else {
+                    snprintf(error, ERROR_SIZE, "the compression must be rle or none.");
+                    return -1;
+                }
+                break;
+            case 'a': {
+                // Turns add up in the order given, with the flips
+                long int degrees = strtol(optarg, &ptr, 10);
+                if (*ptr != '\0' || (degrees != 90 && degrees != 180 && degrees != 270)) {
+                    snprintf(error, ERROR_SIZE, "the rotation must be 90, 180 or 270 degrees.");
+                    return -1;
+                }
+                (*opts).params.transform = transform_compose((*opts).params.transform, (degrees == 90) ? TRANSFORM_ROTATE_90 :
+                                                             (degrees == 180) ? TRANSFORM_ROTATE_180 : TRANSFORM_ROTATE_270);
+                (*opts).filter_flag |= FLAG_TRANSFORM;
+                break;
+            }
+            case 'f':
+                if (strcmp(optarg, "h") == 0) {
+                    (*opts).params.transform = transform_compose((*opts).params.transform, TRANSFORM_FLIP_X);
+                } else if (strcmp(optarg, "v") == 0) {
+                    (*opts).params.transform = transform_compose((*opts).params.transform, TRANSFORM_FLIP_Y);
+                } else {
+                    snprintf(error, ERROR_SIZE, "the flip must be h (left to right) or v (top to bottom).");
+                    return -1;
+                }
+                (*opts).filter_flag |= FLAG_TRANSFORM;
+                break;
+            case 'x':
+                (*opts).params.transform = transform_compose((*opts).params.transform, TRANSFORM_TRANSPOSE);
+                (*opts).filter_flag |= FLAG_TRANSFORM;
+                break;
+            case 'v':
+                (*opts).preview = (optarg == NULL) ? PREVIEW_STEP : (int)strtol(optarg, &ptr, 10);
+                if ((optarg != NULL && *ptr != '\0') || (*opts).preview < 2 || (*opts).preview > MAX_PREVIEW_STEP) {
+                    snprintf(error, ERROR_SIZE, "the preview step must be between 2 and %d, inclusive.", MAX_PREVIEW_STEP);
+                    return -1;
+                }
+                break;
+            case 'r':
+                (*opts).stream_rows = strtol(optarg, &ptr, 10);
+                if ((*opts).stream_rows < 1) {
+                    snprintf(error, ERROR_SIZE, "the number of rows to stream must be at least 1.");
+                    return -1;
+                }
+                break;
+            case 's':
+                (*opts).filter_flag += FLAG_SEPIA;
+                break;
+            case 't':
+                (*opts).params.threshold = strtod(optarg, &ptr);
+                if ((*opts).params.threshold < 0.0 || (*opts).params.threshold > 1.0) {
+                    snprintf(error, ERROR_SIZE, "the threshold must be between 0.0 and 1.0, inclusive.");
+                    return -1;
+                } else {
+                    (*opts).filter_flag += FLAG_THRESHOLD;
+                }
+                break;
+            case 'u':
+                (*opts).cube_file = optarg;
+                break;
+            case 'y':
+                (*opts).params.gamma = strtod(optarg, &ptr);
+                if ((*opts).params.gamma < 0.01 || (*opts).params.gamma > 7.99) {
+                    snprintf(error, ERROR_SIZE, "the gamma value must be between 0.01 and 7.99, inclusive.");
+                    return -1;
+                } else {
+                    (*opts).filter_flag += FLAG_GAMMA;
+                }
+                break;
+            case 'w':
+                (*opts).filter_flag += FLAG_WB;
+                break;
+            case 'C':
+                (*opts).params.hsl_cache = 1;
+                break;
+            case 'H':
+                (*opts).params.hue = strtod(optarg, &ptr);
+                if ((*opts).params.hue < -360 || (*opts).params.hue > 360) {
+                    snprintf(error, ERROR_SIZE, "the hue shift must be between -360 and 360, inclusive.");
+                    return -1;
+                } else {
+                    if ((*opts).hsl_flag == 0) (*opts).filter_flag += FLAG_HSL;
+                    (*opts).hsl_flag = 1;
+                }
+                break;
+            case 'S':
+                (*opts).params.saturation = strtod(optarg, &ptr);
+                if ((*opts).params.saturation < -100 || (*opts).params.saturation > 100) {
+                    snprintf(error, ERROR_SIZE, "the saturation must be between -100 and 100, inclusive.");
+                    return -1;
+                } else {
+                    if ((*opts).hsl_flag == 0) (*opts).filter_flag += FLAG_HSL;
+                    (*opts).hsl_flag = 1;
+                }
+                break;
+            case 'L':
+                (*opts).params.lightness = strtod(optarg, &ptr);
+                if ((*opts).params.lightness < -100 || (*opts).params.lightness > 100) {
+                    snprintf(error, ERROR_SIZE, "the lightness must be between -100 and 100, inclusive.");
+                    return -1;
+                } else {
+                    if ((*opts).hsl_flag == 0) (*opts).filter_flag += FLAG_HSL;
+                    (*opts).hsl_flag = 1;
+                }
+                break;
+            default:
+                snprintf(error, ERROR_SIZE, "no valid arguments have been entered.\n"
+                                            "Enter ./bmpedit -h to view usage message.");
+                return -1;
+        }
+    }
+
+    /* A server takes its files from the requests, and cannot also be a client */
+    if ((*opts).serve_socket != NULL) {
+        if ((*opts).client_socket != NULL) {
+            snprintf(error, ERROR_SIZE, "--serve cannot be used with --client.\n"
+                                        "Enter ./bmpedit -h to view usage message.");
+            return -1;
+        }
+        if (optind < argc || strcmp((*opts).output_file, "out.bmp") != 0 || (*opts).in_place_flag) {
+            snprintf(error, ERROR_SIZE, "--serve takes its files from the requests, so it cannot be given input or output files.\n"
+                                        "Enter ./bmpedit -h to view usage message.");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Describes the selected filters and their settings as text, which is the
+   same however the settings were typed, with cube standing for the .cube
+   file if there is one */
+static void filters_key(char *key, size_t size, const options *opts, const char *cube) {
+    const filter_params *params = &(*opts).params;
+    snprintf(key, size, "%d %d %d %.17g %.17g %.17g %.17g %.17g %.17g %d %d %.17g %.17g %.17g %d %.17g %.17g %.17g %.17g %s",
+             (*opts).filter_flag, (*params).transform, (*opts).compress, (*params).hue, (*params).saturation, (*params).lightness, (*params).contrast,
+             (*params).gamma, (*params).threshold, (*params).hsl_cache, (*params).bake, (*params).levels_clip,
+             (*params).contrast_clip, (*params).blur, (*params).box_radius, (*params).sharpen, (*params).unsharp[0],
+             (*params).unsharp[1], (*params).unsharp[2], cube);
+}
+
+/* Sets up the result cache for the options: images are looked up by the
+   hash of the filters, the contents of the .cube file and the size to
+   resize to, along with the version of the filters */
+static void cache_setup(result_cache *cache, const options *opts) {
+    char key[1024], cube[32] = "";
+    unsigned long long cube_hash;
+    if ((*opts).cube_file != NULL && hash_file((*opts).cube_file, &cube_hash) == 0) {
+        snprintf(cube, sizeof(cube), "%016llx", cube_hash);
+    }
+    filters_key(key, sizeof(key), opts, cube);
+    size_t length = strlen(key);
+    const resize_spec *resize = (*opts).resize;
+    if (resize != NULL) {
+        snprintf(key + length, sizeof(key) - length, " %d %d %d %d v%d", (*resize).width, (*resize).height, (*resize).fit,
+                 (*resize).kernel, CACHE_VERSION);
+    } else {
+        snprintf(key + length, sizeof(key) - length, " - v%d", CACHE_VERSION);
+    }
+    (*cache).dir = (*opts).cache_dir;
+    (*cache).filters = hash_bytes(key, strlen(key), 0);
+    (*cache).limit = (*opts).cache_limit;
+}
+
+/* Counts a hit or a miss of the result cache, and prints the totals */
+static void cache_report(const result_cache *cache, int hit, FILE *info) {
+    long long totals[3];
+    if (cache_count(cache, hit, !hit, totals) != 0) return;
+    fprintf(info, "Cache: %s (%lld hits and %lld misses in all, %.1f MB cached)\n", hit ? "hit" : "miss", totals[0],
+            totals[1], totals[2] / 1e6);
+}
+
+/* Adds the output file to the result cache after a miss, unless it went to
+   stdout, and counts the miss */
+static void cache_miss(const result_cache *cache, unsigned long long input_hash, const char *output_file, FILE *info) {
+    if (cache == NULL) return;
+    if (output_file != NULL && cache_store(cache, input_hash, output_file) != 0) {
+        fprintf(stderr, "%s the result could not be added to the cache.\n", ERROR_HEADER);
+    }
+    cache_report(cache, 0, info);
+}
+
+/* Scales the blur and unsharp mask radii down by the preview step, so the
+   proxy looks as the whole image would shrunk to its size. Blurs which
+   become too small to see on the proxy are left out */
+static void preview_params(options *opts) {
+    filter_params *params = &(*opts).params;
+    int step = (*opts).preview;
+    if ((*opts).filter_flag & FLAG_BLUR) {
+        (*params).blur /= step;
+        if ((*params).blur < 0.1) (*opts).filter_flag &= ~FLAG_BLUR;
+    }
+    if ((*opts).filter_flag & FLAG_BOX_BLUR) {
+        (*params).box_radius = ((*params).box_radius + step / 2) / step;
+        if ((*params).box_radius < 1) (*opts).filter_flag &= ~FLAG_BOX_BLUR;
+    }
+    if ((*opts).filter_flag & FLAG_UNSHARP) {
+        (*params).unsharp[0] /= step;
+        if ((*params).unsharp[0] < 0.1) (*opts).filter_flag &= ~FLAG_UNSHARP;
+    }
+}
+
+/* Builds the filter chain, stopping the program if there is not enough memory */
+static void compile_chain(filter_chain *chain, int filter_flag, filter_params *params) {
+    if (build_chain(chain, filter_flag, params) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
     }
-    if (filter_flag & FLAG_THRESHOLD) {         // filter_flag & 16
-        threshold_filter(threshold, &info_header, pixel_array, padding_bytes);
+}
+
+/* Filters a proxy of the input file rather than the whole image, taking the
+   proxy from the cache if it has been read before, and writes the filtered
+   proxy or prints its statistics. Returns the exit status */
+static int run_preview(const char *input_file, options *opts, int to_stdout, FILE *info) {
+    profile timings, *prof = NULL;
+    proxy_image proxy;
+    result_cache cache;
+    filter_chain chain;
+    image_stats stats;
+    char error[ERROR_SIZE];
+    unsigned long long key = 0;
+    int cached = 0;
+    if ((*opts).profile_flag) {
+        prof = &timings;
+        profile_start(prof);
     }
-    if (filter_flag & FLAG_GREYSCALE) {         // filter_flag & 32
-        greyscale_filter(&info_header, pixel_array, padding_bytes);
+
+    /* Reading the proxy, unless it is in the cache */
+    double t = profile_clock();
+    if ((*opts).cache_dir != NULL) {
+        cache_setup(&cache, opts);
+        if (proxy_key(input_file, (*opts).preview, &key) != 0) {
+            fprintf(stderr, "%s input file either does not exist or is not readable.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        cached = proxy_load(&cache, key, &proxy);
     }
-    if (filter_flag & FLAG_SEPIA) {             // filter_flag & 64
-        sepia_filter(&info_header, pixel_array, padding_bytes);
+    if (cached) {
+        profile_add(prof, "read (cached proxy)", t, (long long)proxy.file_header.size);
+    } else {
+        long long bytes = proxy_read(input_file, (*opts).preview, &proxy, error);
+        if (bytes < 0) {
+            fprintf(stderr, "%s %s\n", ERROR_HEADER, error);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, "read (proxy)", t, bytes);
+        if ((*opts).cache_dir != NULL && proxy_store(&cache, key, &proxy) != 0) {
+            fprintf(stderr, "%s the proxy could not be added to the cache.\n", ERROR_HEADER);
+        }
     }
-    if (filter_flag & FLAG_INVERSE) {           // filter_flag & 128
-        inverse_filter(&info_header, pixel_array, padding_bytes);
+    fprintf(info, "Preview: %dx%dpx, every %d pixels%s\n", proxy.img.width, proxy.img.height, (*opts).preview,
+            cached ? " (cached proxy)" : "");
+
+    /* Filtering a copy of the proxy */
+    simd_init(SIMD_AVX2);
+    thread_pool *pool = ((*opts).threads > 1) ? pool_create((*opts).threads) : NULL;
+    preview_params(opts);
+    compile_chain(&chain, (*opts).filter_flag, &(*opts).params);
+    chain.timed = (prof != NULL);
+    stats_clear(&stats, STATS_HISTOGRAMS);
+    FILE *output = ((*opts).stats_flag) ? NULL : to_stdout ? stdout : fopen((*opts).output_file, "w");
+    if (output == NULL && !(*opts).stats_flag) {
+        fprintf(stderr, "%s the output file could not be created.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    t = profile_clock();
+    if (proxy_filter(&proxy, output, &chain, pool, (*opts).stats_flag ? &stats : NULL) != 0 ||
+        (output != NULL && fclose(output) != 0)) {
+        fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, (*opts).stats_flag ? "filter (all stages)" : "filter and write", t,
+                (long long)proxy.img.channels * proxy.img.width * proxy.img.height);
+    if ((*opts).stats_flag) stats_print(stdout, &stats, input_file, (*opts).stats_flag == 2);
+    profile_chain(prof, &chain);
+    report_profile(prof, (*opts).profile_flag);
+    free_chain(&chain);
+    pool_destroy(pool);
+    proxy_free(&proxy);
+    if (!(*opts).stats_flag) fprintf(info, "bmpedit: Success!\n");
+    return EXIT_SUCCESS;
+}
+
+/* The server, which keeps the worker threads, their buffers and the compiled
+   filters of their last request between requests */
+
+#define SERVER_QUEUE 64         // accepted connections waiting for a worker
+#define SERVER_ARGS 256         // words in a request
+#define SERVER_KEY (1024 + 4096) // length of the description of the filters a chain was built from, and its cube file
+
+// Connections accepted by the server, waiting for a worker
+typedef struct {
+    int listener;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+    int fds[SERVER_QUEUE];
+    int first, count;
+    pthread_mutex_t parse_lock;     // getopt keeps its place in globals, so requests are parsed one at a time
+} server_state;
+
+// What a worker keeps between requests: its buffer, the chain built for the
+// last request with the filters it was built from, and the proxy of the last
+// preview with the key of the file and step it was read from
+typedef struct {
+    work_buffer buffer;
+    filter_chain chain;
+    color_cube cube;
+    char key[SERVER_KEY];       // empty until a chain has been built
+    proxy_image proxy;          // no pixels until a preview has been asked for
+    unsigned long long proxy_key;
+} server_worker;
+
+static const char *server_socket;       // removed when the server is stopped
+
+/* Removes the socket and exits, on SIGINT or SIGTERM */
+static void server_stop(int sig) {
+    (void)sig;
+    unlink(server_socket);
+    _exit(EXIT_SUCCESS);
+}
+
+/* Decodes the JSON string *p points at in place, leaving *p after it.
+   Returns the string, or NULL if it is not valid */
+static char *json_take(char **p) {
+    char *in = *p, *out, *text;
+    if (*in != '"') return NULL;
+    text = out = ++in;
+    while (*in != '"') {
+        if (*in == '\0') return NULL;
+        if (*in != '\\') {
+            *out++ = *in++;
+            continue;
+        }
+        in++;
+        switch (*in++) {
+            case '"': *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/': *out++ = '/'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'u': {
+                // Characters outside the Basic Multilingual Plane are not needed for file names here
+                unsigned int code = 0;
+                for (int k = 0; k < 4; k++, in++) {
+                    if (!isxdigit((unsigned char)*in)) return NULL;
+                    code = code * 16 + (isdigit((unsigned char)*in) ? *in - '0' : (tolower((unsigned char)*in) - 'a' + 10));
+                }
+                if (code == 0) return NULL;
+                if (code < 0x80) {
+                    *out++ = code;
+                } else if (code < 0x800) {
+                    *out++ = 0xc0 | (code >> 6);
+                    *out++ = 0x80 | (code & 0x3f);
+                } else {
+                    *out++ = 0xe0 | (code >> 12);
+                    *out++ = 0x80 | ((code >> 6) & 0x3f);
+                    *out++ = 0x80 | (code & 0x3f);
+                }
+                break;
+            }
+            default: return NULL;
+        }
+    }
+    *out = '\0';
+    *p = in + 1;
+    return text;
+}
+
+/* Decodes a JSON array of strings *p points at into words, from the first
+   free one. Returns the number of words, or -1 if it is not valid */
+static int json_words(char **p, char *words[SERVER_ARGS], int count) {
+    char *in = *p + 1;
+    if (**p != '[') return -1;
+    in += strspn(in, " \t");
+    while (*in != ']') {
+        if (count == SERVER_ARGS - 1 || (words[count++] = json_take(&in)) == NULL) return -1;
+        in += strspn(in, " \t");
+        if (*in == ',') in += 1 + strspn(in + 1, " \t");
+        else if (*in != ']') return -1;
+    }
+    *p = in + 1;
+    return count;
+}
+
+/* Splits a request into words, in place, after a first word standing in for
+   the program name. A request is either command-line options separated by
+   spaces, with double quotes around any word holding spaces, or JSON: an
+   array of the words, or an object with the words as "args" and the
+   directory relative paths are from as "cwd". Returns the number of words,
+   or -1 if the request is not valid */
+static int server_words(char *line, char *words[SERVER_ARGS], char **cwd) {
+    char *p = line + strspn(line, " \t");
+    int count = 1;
+    words[0] = "bmpedit";
+    *cwd = NULL;
+    if (*p == '[') {
+        count = json_words(&p, words, count);
+    } else if (*p == '{') {
+        p++;
+        for (int first = 1; count >= 0; first = 0) {
+            p += strspn(p, " \t");
+            if (*p == '}' && first) break;
+            char *key = json_take(&p);
+            p += strspn(p, " \t");
+            if (key == NULL || *p++ != ':') return -1;
+            p += strspn(p, " \t");
+            if (strcmp(key, "args") == 0) {
+                count = json_words(&p, words, count);
+            } else if (strcmp(key, "cwd") == 0) {
+                if ((*cwd = json_take(&p)) == NULL) return -1;
+            } else {
+                return -1;
+            }
+            p += strspn(p, " \t");
+            if (*p == '}') break;
+            if (*p++ != ',') return -1;
+        }
+        p++;
+    } else {
+        while (*p != '\0') {
+            char *out = p;
+            if (count == SERVER_ARGS - 1) return -1;
+            words[count++] = out;
+            while (*p != '\0' && *p != ' ' && *p != '\t') {
+                if (*p != '"') {
+                    *out++ = *p++;
+                    continue;
+                }
+                // A quoted part, where a backslash escapes a quote or a backslash
+                for (p++; *p != '"'; p++) {
+                    if (*p == '\0') return -1;
+                    if (*p == '\\' && (p[1] == '"' || p[1] == '\\')) p++;
+                    *out++ = *p;
+                }
+                p++;
+            }
+            if (*p != '\0') p += strspn(p, " \t");
+            *out = '\0';
+        }
+        return count;
+    }
+    if (count < 0 || p[strspn(p, " \t")] != '\0') return -1;
+    return count;
+}
+
+/* Returns a path of a request, joined to the directory it gave if relative,
+   or NULL if it is too long */
+static const char *server_path(char buffer[4096], const char *cwd, const char *path) {
+    if (cwd == NULL || path[0] == '/') return path;
+    size_t length = strlen(cwd);
+    if (length + strlen(path) + 2 > 4096) return NULL;
+    memcpy(buffer, cwd, length);
+    buffer[length] = '/';
+    strcpy(buffer + length + 1, path);
+    return buffer;
+}
+
+/* Describes the filters of a request, so a chain is only rebuilt when they
+   change. A cube file is described by its name, size and time changed */
+static void server_key(char key[SERVER_KEY], const options *opts, const char *cube_file, const struct stat *cube_stat) {
+    char cube[4096 + 64] = "";
+    if (cube_file != NULL) {
+        snprintf(cube, sizeof(cube), "%lld %lld %s", (long long)(*cube_stat).st_size, (long long)(*cube_stat).st_mtime,
+                 cube_file);
+    }
+    filters_key(key, SERVER_KEY, opts, cube);
+}
+
+/* Filters a proxy of the input file for a preview request, keeping the
+   proxy on the worker so previews of the same file with other settings do
+   not read it again. Returns the bytes of the proxy written (or filtered,
+   for statistics), or -1 with a message in error */
+static long long server_preview(server_worker *worker, const char *input, const char *output, const options *opts,
+                                image_stats *stats, char error[ERROR_SIZE]) {
+    unsigned long long key;
+    if (proxy_key(input, (*opts).preview, &key) != 0) {
+        snprintf(error, ERROR_SIZE, "%s: input file either does not exist or is not readable.", input);
+        return -1;
+    }
+    if ((*worker).proxy.img.data == NULL || (*worker).proxy_key != key) {
+        proxy_free(&(*worker).proxy);
+        if (proxy_read(input, (*opts).preview, &(*worker).proxy, error) < 0) return -1;
+        (*worker).proxy_key = key;
+    }
+    if ((*opts).stats_flag) stats_clear(stats, STATS_HISTOGRAMS);
+    FILE *fp = (*opts).stats_flag ? NULL : fopen(output, "w");
+    if (fp == NULL && !(*opts).stats_flag) {
+        snprintf(error, ERROR_SIZE, "%s: the output file could not be created.", output);
+        return -1;
+    }
+    int failed = proxy_filter(&(*worker).proxy, fp, &(*worker).chain, NULL, (*opts).stats_flag ? stats : NULL) != 0;
+    if (fp != NULL && fclose(fp) != 0) failed = 1;
+    if (failed) {
+        snprintf(error, ERROR_SIZE, "%s: writing the output file failed.", output);
+        return -1;
+    }
+    return (*worker).proxy.file_header.size;
+}
+
+/* Runs one request on a worker, filling in the input and output files and
+   the statistics if they are asked for. Returns the bytes read and written,
+   or -1 with a message in error */
+static long long server_run(server_state *server, server_worker *worker, char *line, char input[4096],
+                            char output[4096], image_stats *stats, int *stats_flag, char error[ERROR_SIZE]) {
+    char *words[SERVER_ARGS], *cwd, cube_buffer[4096];
+    const char *path, *cube_file = NULL;
+    options opts;
+    int count = server_words(line, words, &cwd);
+    if (count < 0) {
+        snprintf(error, ERROR_SIZE, "the request is not valid JSON or command-line options.");
+        return -1;
+    }
+    words[count] = NULL;
+    pthread_mutex_lock(&(*server).parse_lock);
+    int parsed = parse_options(count, words, &opts, error);
+    int first = optind;
+    pthread_mutex_unlock(&(*server).parse_lock);
+    *stats_flag = opts.stats_flag;
+    if (parsed < 0) return -1;
+    if (parsed > 0 || opts.map_flag || opts.stream_rows > 0 || opts.planar_flag || opts.threads != 1 ||
+        opts.list_file != NULL || opts.profile_flag || opts.roi != NULL || opts.in_place_flag || opts.save_file != NULL ||
+        opts.serve_socket != NULL || opts.client_socket != NULL || opts.cache_dir != NULL) {
+        snprintf(error, ERROR_SIZE, "-h, -m, -r, -p, -j, -l, --profile, --roi, --in-place, --save-cube, --cache, --serve "
+                 "and --client cannot be used in a request.");
+        return -1;
+    }
+    if (count - first != 1 || strcmp(words[first], "-") == 0 || (strcmp(opts.output_file, "-") == 0 && !opts.stats_flag)) {
+        snprintf(error, ERROR_SIZE, "a request must name one input file, and an output file rather than stdout.");
+        return -1;
+    }
+    if ((path = server_path(input, cwd, words[first])) == NULL || (path != input && strlen(path) >= 4096)) {
+        snprintf(error, ERROR_SIZE, "the input file name is too long.");
+        return -1;
+    }
+    if (path != input) strcpy(input, path);
+    if ((path = server_path(output, cwd, opts.output_file)) == NULL || (path != output && strlen(path) >= 4096)) {
+        snprintf(error, ERROR_SIZE, "the output file name is too long.");
+        return -1;
+    }
+    if (path != output) strcpy(output, path);
+    if (opts.preview > 0 && opts.resize != NULL) {
+        snprintf(error, ERROR_SIZE, "--preview cannot be used with --resize.");
+        return -1;
+    }
+    if (opts.preview > 0) preview_params(&opts);
+
+    /* Building the chain, unless the last request on this worker had the same filters */
+    struct stat cube_stat;
+    if (opts.cube_file != NULL) {
+        if ((cube_file = server_path(cube_buffer, cwd, opts.cube_file)) == NULL || stat(cube_file, &cube_stat) != 0) {
+            snprintf(error, ERROR_SIZE, "the cube file %s could not be read.", opts.cube_file);
+            return -1;
+        }
+    }
+    char key[SERVER_KEY];
+    server_key(key, &opts, cube_file, &cube_stat);
+    if (strcmp(key, (*worker).key) != 0) {
+        if ((*worker).key[0] != '\0') {
+            free_chain(&(*worker).chain);
+            cube_free(&(*worker).cube);
+            (*worker).key[0] = '\0';
+        }
+        if (cube_file != NULL) {
+            if (cube_read(&(*worker).cube, cube_file, error) != 0) return -1;
+            opts.params.cube = &(*worker).cube;
+            opts.filter_flag += FLAG_CUBE;
+        }
+        if (build_chain(&(*worker).chain, opts.filter_flag, &opts.params) != 0) {
+            snprintf(error, ERROR_SIZE, "memory allocation failed.");
+            return -1;
+        }
+        strcpy((*worker).key, key);
+    }
+
+    if (opts.preview > 0) return server_preview(worker, input, output, &opts, stats, error);
+
+    /* As on the command line, without filters there is nothing to write */
+    if ((*worker).chain.count == 0 && opts.resize == NULL && opts.compress == COMPRESS_KEEP && !opts.stats_flag) return 0;
+    if (opts.stats_flag) {
+        stats_clear(stats, STATS_HISTOGRAMS);
+        return filter_file(input, NULL, &(*worker).chain, opts.resize, COMPRESS_KEEP, NULL, &(*worker).buffer, stats, error);
+    }
+    long long bytes = filter_file(input, output, &(*worker).chain, opts.resize, opts.compress, NULL, &(*worker).buffer, NULL, error);
+    return (bytes < 0) ? -1 : 2 * bytes;
+}
+
+/* Answers the requests on a connection, one per line, until it is closed.
+   Each response is a line of JSON: whether the request worked (with the
+   error if not), the files read and written, the bytes they hold, the
+   statistics if asked for, and the time taken in milliseconds */
+static void server_connection(server_state *server, server_worker *worker, int fd) {
+    int out_fd = dup(fd);
+    FILE *in = fdopen(fd, "r"), *out = (out_fd >= 0) ? fdopen(out_fd, "w") : NULL;
+    if (in == NULL || out == NULL) {
+        if (in != NULL) fclose(in); else close(fd);
+        if (out != NULL) fclose(out); else if (out_fd >= 0) close(out_fd);
+        return;
+    }
+    char *line = NULL, input[4096], output[4096], error[ERROR_SIZE];
+    size_t capacity = 0;
+    image_stats stats;
+    while (getline(&line, &capacity, in) > 0) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[strspn(line, " \t")] == '\0') continue;
+        double start = profile_clock();
+        int stats_flag = 0;
+        input[0] = output[0] = '\0';
+        long long bytes = server_run(server, worker, line, input, output, &stats, &stats_flag, error);
+        if (bytes < 0) {
+            fputs("{\"ok\": false, \"error\": ", out);
+            json_string(out, error);
+        } else {
+            fputs("{\"ok\": true, \"file\": ", out);
+            json_string(out, input);
+            if (!stats_flag) {
+                fputs(", \"output\": ", out);
+                json_string(out, output);
+            }
+            fprintf(out, ", \"bytes\": %lld", bytes);
+            if (stats_flag) {
+                // The statistics are printed as a line of their own, so the line break is dropped
+                char *text = NULL;
+                size_t length = 0;
+                FILE *report = open_memstream(&text, &length);
+                if (report != NULL) {
+                    stats_print(report, &stats, input, 1);
+                    fclose(report);
+                    if (length > 0 && text[length - 1] == '\n') text[length - 1] = '\0';
+                    fprintf(out, ", \"stats\": %s", text);
+                }
+                free(text);
+            }
+        }
+        fprintf(out, ", \"ms\": %.3f}\n", (profile_clock() - start) * 1000);
+        if (fflush(out) != 0) break;        // the client has hung up
+    }
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
+/* Band 0 of the server accepts connections and queues them, and each other
+   band is a worker answering one connection at a time. Neither returns */
+static void server_band(void *arg, int band) {
+    server_state *server = arg;
+    if (band == 0) {
+        for (;;) {
+            int fd = accept((*server).listener, NULL, NULL);
+            if (fd < 0) continue;
+            pthread_mutex_lock(&(*server).lock);
+            while ((*server).count == SERVER_QUEUE) pthread_cond_wait(&(*server).space, &(*server).lock);
+            (*server).fds[((*server).first + (*server).count++) % SERVER_QUEUE] = fd;
+            pthread_cond_signal(&(*server).ready);
+            pthread_mutex_unlock(&(*server).lock);
+        }
+    }
+    server_worker worker;
+    memset(&worker, 0, sizeof(worker));
+    for (;;) {
+        pthread_mutex_lock(&(*server).lock);
+        while ((*server).count == 0) pthread_cond_wait(&(*server).ready, &(*server).lock);
+        int fd = (*server).fds[(*server).first];
+        (*server).first = ((*server).first + 1) % SERVER_QUEUE;
+        (*server).count--;
+        pthread_cond_signal(&(*server).space);
+        pthread_mutex_unlock(&(*server).lock);
+        server_connection(server, &worker, fd);
+    }
+}
+
+/* Serves requests on a Unix domain socket with a pool of workers started up
+   front, until stopped by SIGINT or SIGTERM. A socket left behind by a
+   server which is no longer running is replaced */
+static void run_server(const char *path, int workers) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "%s the socket path must be shorter than %d characters.\n", ERROR_HEADER,
+                (int)sizeof(address.sun_path));
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener >= 0 && bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int live = (probe >= 0 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0);
+        if (probe >= 0) close(probe);
+        if (live || unlink(path) != 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0) {
+            close(listener);
+            listener = -1;
+        }
+    }
+    if (listener < 0 || listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "%s the socket %s could not be created, or another server is using it.\n", ERROR_HEADER, path);
+        exit(EXIT_FAILURE);
+    }
+
+    // Stopping removes the socket, and clients which hang up do not stop the server
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    server_socket = path;
+    action.sa_handler = server_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+
+    // The tables every chain shares are filled in before the workers start
+    simd_init(SIMD_AVX2);
+    hsl_fixed_shift(0, 0, 0);
+    opterr = 0;     // problems with the options of a request go back to the client
+
+    server_state server;
+    memset(&server, 0, sizeof(server));
+    server.listener = listener;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_mutex_init(&server.parse_lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+    pthread_cond_init(&server.space, NULL);
+    thread_pool *pool = pool_create(workers + 1);
+    if (pool == NULL || pool_threads(pool) != workers + 1) {
+        fprintf(stderr, "%s the worker threads could not be started.\n", ERROR_HEADER);
+        unlink(path);
+        exit(EXIT_FAILURE);
+    }
+    printf("bmpedit: serving on %s with %d worker%s\n", path, workers, (workers == 1) ? "" : "s");
+    fflush(stdout);
+    pool_run(pool, server_band, &server, workers + 1);
+}
+
+/* Sends the command line to a server as a request, without the --client
+   option and with the working directory for relative paths, and prints the
+   response. Returns the exit status */
+static int run_client(const char *path, int argc, char *argv[]) {
+    struct sockaddr_un address;
+    char cwd[4096], *line = NULL;
+    size_t capacity = 0;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (strlen(path) >= sizeof(address.sun_path) || fd < 0 ||
+        (strcpy(address.sun_path, path), connect(fd, (struct sockaddr *)&address, sizeof(address))) != 0) {
+        fprintf(stderr, "%s no server is running on the socket %s.\n", ERROR_HEADER, path);
+        exit(EXIT_FAILURE);
+    }
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        fprintf(stderr, "%s the working directory could not be found.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    int request_fd = dup(fd);
+    FILE *request = (request_fd >= 0) ? fdopen(request_fd, "w") : NULL, *response = fdopen(fd, "r");
+    if (request == NULL || response == NULL) {
+        fprintf(stderr, "%s the request could not be sent.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    fputs("{\"cwd\": ", request);
+    json_string(request, cwd);
+    fputs(", \"args\": [", request);
+    for (int k = 1, first = 1; k < argc; k++) {
+        if (strcmp(argv[k], "--client") == 0) {
+            k++;
+        } else if (strncmp(argv[k], "--client=", 9) != 0) {
+            if (!first) fputs(", ", request);
+            json_string(request, argv[k]);
+            first = 0;
+        }
+    }
+    fputs("]}\n", request);
+    if (fclose(request) != 0 || getline(&line, &capacity, response) <= 0) {
+        fprintf(stderr, "%s the server did not answer the request.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    fclose(response);
+    fputs(line, stdout);
+    int ok = (strncmp(line, "{\"ok\": true", 11) == 0);
+    free(line);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    /* Initializing variables */
+    char *input_file, error[ERROR_SIZE];
+    options opts;
+    profile timings, *prof = NULL;
+    /* Initializing Structs */
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    image img;
+    filter_chain chain;
+    color_cube cube;
+    image_stats stats;
+
+    /* If user passes no options */
+    if (argc == 1) {
+      fprintf(stderr, "%s no valid arguments have been entered.\n"
+                      "Enter ./bmpedit -h to view usage message.\n", ERROR_HEADER);
+      exit(EXIT_FAILURE);
+    }
+
+    int parsed = parse_options(argc, argv, &opts, error);
+    if (parsed < 0) {
+        fprintf(stderr, "%s %s\n", ERROR_HEADER, error);
+        exit(EXIT_FAILURE);
+    } else if (parsed > 0) {
+        logo();
+        usage();
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Serving requests until stopped, or sending this one to a server */
+    if (opts.serve_socket != NULL) run_server(opts.serve_socket, opts.threads);
+    if (opts.client_socket != NULL) return run_client(opts.client_socket, argc, argv);
+
+    /* A .cube file is applied after the other filters */
+    if (opts.cube_file != NULL) {
+        cube_load(&cube, opts.cube_file);
+        opts.params.cube = &cube;
+        opts.filter_flag += FLAG_CUBE;
+    }
+
+    /* Saving the filters as a cube, which may be all there is to do */
+    if (opts.save_file != NULL) {
+        if (opts.filter_flag == 0 || (opts.filter_flag & (FLAG_WB | FLAG_LEVELS | FLAG_AUTO_CONTRAST))) {
+            fprintf(stderr, "%s %s\n", ERROR_HEADER, (opts.filter_flag == 0) ? "there are no filters to save as a cube." :
+                    "white balance, auto levels and auto contrast depend on the image, so they cannot be saved as a cube.");
+            exit(EXIT_FAILURE);
+        }
+        if (opts.filter_flag & FLAG_SPATIAL) {
+            fprintf(stderr, "%s blurring and sharpening depend on the neighbouring pixels, so they cannot be saved as a cube.\n",
+                    ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        if (opts.filter_flag & FLAG_TRANSFORM) {
+            fprintf(stderr, "%s rotating and flipping move the pixels rather than change their colors, so they cannot be saved "
+                    "as a cube.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        simd_init(SIMD_AVX2);
+        filter_params unbaked = opts.params;
+        unbaked.bake = 0;
+        compile_chain(&chain, opts.filter_flag, &unbaked);
+        color_cube saved;
+        char title[sizeof(chain.stages[0].name) * MAX_STAGES + 8] = "bmpedit";
+        for (int k = 0; k < chain.count; k++) {
+            strcat(title, (k == 0) ? " " : "+");
+            strcat(title, chain.stages[k].name);
+        }
+        if (cube_create(&saved, opts.params.bake ? opts.params.bake : CUBE_SIZE) != 0 ||
+            cube_from_chain(&saved, &chain, 0, chain.count) != 0) {
+            fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        free_chain(&chain);
+        FILE *fp = fopen(opts.save_file, "w");
+        if (fp == NULL || cube_save(fp, &saved, title) != 0 || fclose(fp) != 0) {
+            fprintf(stderr, "%s writing the cube file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        cube_free(&saved);
+        if (argc == optind && opts.list_file == NULL) return EXIT_SUCCESS;
+    }
+
+    /* Several inputs, a directory or a list of files are filtered as a batch */
+    struct stat input_stat;
+    if (opts.list_file != NULL || argc - optind > 1 ||
+        (argc - optind == 1 && stat(argv[optind], &input_stat) == 0 && S_ISDIR(input_stat.st_mode))) {
+        if (opts.map_flag || opts.stream_rows > 0 || opts.planar_flag || opts.profile_flag || opts.roi != NULL ||
+            opts.in_place_flag || opts.preview > 0) {
+            fprintf(stderr, "%s -m, -r, -p, --roi, --in-place, --preview and --profile cannot be used in batch mode.\n",
+                    ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        if (strchr(opts.output_file, '%') == NULL && !opts.stats_flag) {
+            fprintf(stderr, "%s in batch mode the output file must be a template using %%n or %%i.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        batch_list list = {NULL, 0, 0};
+        if (opts.list_file != NULL) batch_add_list(&list, opts.list_file);
+        for (int k = optind; k < argc; k++) batch_add(&list, argv[k]);
+        if (list.count == 0) {
+            fprintf(stderr, "%s no input files have been found.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+
+        /* The chain is compiled once and shared by every image */
+        simd_init(SIMD_AVX2);
+        thread_pool *pool = (opts.threads > 1) ? pool_create(opts.threads) : NULL;
+        compile_chain(&chain, opts.filter_flag, &opts.params);
+        result_cache cache;
+        if (opts.cache_dir != NULL) cache_setup(&cache, &opts);
+        int failed = run_batch(list.files, list.count, opts.output_file, &chain, opts.resize, opts.compress, pool, opts.stats_flag,
+                               (opts.cache_dir != NULL) ? &cache : NULL);
+        free_chain(&chain);
+        pool_destroy(pool);
+        batch_free(&list);
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /* Check for extra argument (i.e. input file) and performs simple validility test */
+    if (argc - optind == 1) {
+       input_file = *(argv + optind);       // get data from the address containing argument
+       /* Program stops if it is not readable or not in .bmp or .BMP, '-' reads from stdin */
+       if (strcmp(input_file, "-") == 0) {
+           if (opts.map_flag || opts.roi != NULL || opts.in_place_flag || opts.cache_dir != NULL || opts.preview > 0) {
+               fprintf(stderr, "%s memory mapping, regions, previews, --in-place and --cache need an input file rather than "
+                       "stdin.\n", ERROR_HEADER);
+               exit(EXIT_FAILURE);
+           }
+       } else if (!((strstr(input_file, ".bmp") != NULL) || (strstr(input_file, ".BMP") != NULL))) {   // simple check for NOT .bmp or .BMP
+           fprintf(stderr, "%s input file is not in .bmp or .BMP format.\n", ERROR_HEADER);
+           exit(EXIT_FAILURE);
+       }
+       else if (access(input_file, R_OK) != 0) {
+           fprintf(stderr, "%s input file either does not exist or is not readable.\n", ERROR_HEADER);
+           exit(EXIT_FAILURE);
+       }
+    } else {
+        fprintf(stderr, "%s no input file has been set.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Writing over the input file, which only memory maps and regions can do
+       without reading the whole image first */
+    if (opts.in_place_flag) {
+        if (!opts.map_flag && opts.roi == NULL) {
+            fprintf(stderr, "%s --in-place needs -m or --roi.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        opts.output_file = input_file;
+    }
+
+    /* Messages go to stderr when the image is written to stdout, or when the
+       statistics are printed as JSON */
+    int to_stdout = (strcmp(opts.output_file, "-") == 0) && !opts.stats_flag;
+    FILE *info = (to_stdout || opts.stats_flag == 2) ? stderr : stdout;
+    if (to_stdout && (opts.map_flag || opts.roi != NULL)) {
+        fprintf(stderr, "%s memory mapping and regions need an output file rather than stdout.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.stats_flag && opts.map_flag) {
+        fprintf(stderr, "%s --stats does not write an image, so it cannot be used with -m.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.compress != COMPRESS_KEEP && opts.map_flag) {
+        fprintf(stderr, "%s changing the compression changes the size of the image, so it cannot be done through memory maps.\n",
+                ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.resize != NULL && opts.map_flag) {
+        fprintf(stderr, "%s a resized image is a different size to the input file, so it cannot be filtered through memory maps.\n",
+                ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.roi != NULL && (opts.map_flag || opts.stream_rows > 0 || opts.planar_flag || opts.resize != NULL)) {
+        fprintf(stderr, "%s --roi reads and writes only the rows of the region, so it cannot be used with -m, -r, -p or "
+                "--resize.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if ((opts.filter_flag & FLAG_TRANSFORM) && (opts.map_flag || opts.roi != NULL)) {
+        fprintf(stderr, "%s rotating and flipping move pixels across the image, so they cannot be used with -m or --roi.\n",
+                ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if ((opts.params.transform & TRANSFORM_TRANSPOSE) && opts.stream_rows > 0) {
+        fprintf(stderr, "%s rotating by 90 or 270 degrees and transposing turn rows into columns, so they cannot be used with "
+                "-r.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.planar_flag && (opts.map_flag || opts.stream_rows > 0)) {
+        fprintf(stderr, "%s -p cannot be used with -m or -r, which filter the rows as they are in the file.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.preview > 0 && (opts.map_flag || opts.stream_rows > 0 || opts.planar_flag || opts.roi != NULL ||
+                             opts.resize != NULL)) {
+        fprintf(stderr, "%s --preview reads only some of the rows into a small image of its own, so it cannot be used with "
+                "-m, -r, -p, --roi or --resize.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Previewing the filters on a proxy of the image, which may be cached */
+    if (opts.preview > 0) return run_preview(input_file, &opts, to_stdout, info);
+
+    /* Copying the result from the cache without reading the image, if it has
+       been filtered this way before. Statistics, regions and output written
+       over the input are left out */
+    result_cache cache, *cached = NULL;
+    unsigned long long input_hash = 0;
+    struct stat output_stat;
+    if (opts.cache_dir != NULL && !opts.stats_flag && opts.roi == NULL &&
+        (opts.filter_flag != 0 || opts.resize != NULL || opts.compress != COMPRESS_KEEP) &&
+        !(stat(opts.output_file, &output_stat) == 0 && stat(input_file, &input_stat) == 0 &&
+          output_stat.st_dev == input_stat.st_dev && output_stat.st_ino == input_stat.st_ino)) {
+        cache_setup(&cache, &opts);
+        if (hash_file(input_file, &input_hash) != 0) {
+            fprintf(stderr, "%s input file either does not exist or is not readable.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        long long found = cache_fetch(&cache, input_hash, to_stdout ? NULL : opts.output_file);
+        if (found < 0) {
+            fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        if (found > 0) {
+            cache_report(&cache, 1, info);
+            fprintf(info, "bmpedit: Success!\n");
+            return EXIT_SUCCESS;
+        }
+        cached = &cache;
+    }
+
+    /* Open file for reading, read headers into structure */
+    if (opts.profile_flag) {
+        prof = &timings;
+        profile_start(prof);
+    }
+    double t = profile_clock();
+    FILE * input = (strcmp(input_file, "-") == 0) ? stdin : fopen(input_file, "r");
+    read_headers(input, &file_header, &info_header);
+    if (!opts.map_flag) profile_add(prof, "headers", t, FH_SIZE + info_size(&info_header));
+    fprintf(info, "Image width: %dpx\nImage height: %dpx\n", info_header.width, info_header.height);
+
+    if (opts.planar_flag && info_header.bpp == 32) {
+        fprintf(stderr, "%s -p cannot be used with 32-bit images, as the planes do not hold alpha.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    if (opts.compress == COMPRESS_RLE && info_header.bpp != 8 && info_header.bpp != 4) {
+        fprintf(stderr, "%s only 8 and 4-bit images can be run-length encoded.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Exits program if no filters selected, unless resizing, changing the compression or printing statistics */
+    if (opts.filter_flag == 0 && opts.resize == NULL && opts.compress == COMPRESS_KEEP && !opts.stats_flag) {
+        fprintf(info, "bmpedit: Success!\n");
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Checks for padding */
+    int padding_bytes = bmp_stride(&info_header) - ((size_t)info_header.width * info_header.bpp + 7) / 8;
+    if (padding_bytes != 0 && !RLE_COMPRESSED(info_header)) {
+        fprintf(info, "Padding Bytes: %d\n", padding_bytes);
+    }
+    if (info_header.bpp <= 8) fprintf(info, "Colors: %d\n", palette_colors(&info_header));
+    if (RLE_COMPRESSED(info_header)) fprintf(info, "Compression: RLE%d\n", info_header.bpp);
+    if (info_header.bpp <= 8 && (opts.filter_flag & FLAG_SPATIAL)) {
+        fprintf(stderr, "%s blurring and sharpening mix the colors of neighbouring pixels, so they cannot be used on "
+                "indexed color images.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (info_header.bpp <= 8 && (opts.filter_flag & FLAG_TRANSFORM)) {
+        fprintf(stderr, "%s indexed color images are only filtered through their color tables, so they cannot be rotated or "
+                "flipped.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (info_header.bpp <= 8 && opts.resize != NULL) {
+        fprintf(stderr, "%s resizing mixes the colors of neighbouring pixels, so indexed color images cannot be resized.\n",
+                ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (opts.resize != NULL) {
+        int width, height;
+        resize_size(opts.resize, info_header.width, abs(info_header.height), &width, &height);
+        fprintf(info, "Resized to: %dx%dpx\n", width, height);
+    }
+    if (opts.roi != NULL) {
+        fprintf(info, "Region: %dx%dpx at %d,%d\n", (*opts.roi).width, (*opts.roi).height, (*opts.roi).x, (*opts.roi).y);
+    }
+
+    /* Compiling filters, using the fastest kernels this CPU has */
+    simd_init(SIMD_AVX2);
+    thread_pool *pool = (opts.threads > 1) ? pool_create(opts.threads) : NULL;
+    compile_chain(&chain, opts.filter_flag, &opts.params);
+    chain.timed = (prof != NULL);
+
+    /* Filtering only the region, read and written a row at a time */
+    stats_clear(&stats, STATS_HISTOGRAMS);
+    if (opts.roi != NULL) {
+        fclose(input);
+        region_filter(input_file, opts.output_file, &chain, opts.roi, pool, prof, opts.stats_flag ? &stats : NULL);
+        if (opts.stats_flag) stats_print(stdout, &stats, input_file, opts.stats_flag == 2);
+        profile_chain(prof, &chain);
+        report_profile(prof, opts.profile_flag);
+        free_chain(&chain);
+        pool_destroy(pool);
+        if (!opts.stats_flag) fprintf(info, "bmpedit: Success!\n");
+        return EXIT_SUCCESS;
+    }
+
+    /* Filtering straight between the mapped files */
+    if (opts.map_flag) {
+        fclose(input);
+        map_filter(input_file, opts.output_file, &chain, pool, prof);
+        profile_chain(prof, &chain);
+        report_profile(prof, opts.profile_flag);
+        free_chain(&chain);
+        pool_destroy(pool);
+        cache_miss(cached, input_hash, opts.output_file, info);
+        fprintf(info, "bmpedit: Success!\n");
+        return EXIT_SUCCESS;
+    }
+
+    /* Printing the statistics of the filtered image rather than writing it,
+       for images which are not read into memory whole */
+    if (opts.stats_flag && (info_header.bpp <= 8 || opts.stream_rows > 0)) {
+        if (info_header.bpp <= 8) {
+            palette_stream(input, NULL, &file_header, &info_header, &chain, COMPRESS_KEEP, prof, &stats);
+        } else {
+            stream_filter(input, NULL, &file_header, &info_header, &chain, opts.stream_rows, &opts.io, opts.resize, pool, prof,
+                          &stats);
+        }
+        if (input != stdin) fclose(input);
+        stats_print(stdout, &stats, input_file, opts.stats_flag == 2);
+        profile_chain(prof, &chain);
+        report_profile(prof, opts.profile_flag);
+        free_chain(&chain);
+        pool_destroy(pool);
+        return EXIT_SUCCESS;
+    }
+
+    /* Filtering only the color table of an indexed image, streamed or not */
+    if (info_header.bpp <= 8) {
+        FILE * output = to_stdout ? stdout : fopen(opts.output_file, "w");
+        if (output == NULL) {
+            fprintf(stderr, "%s the output file could not be created.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        palette_stream(input, output, &file_header, &info_header, &chain, opts.compress, prof, NULL);
+        if (input != stdin) fclose(input);
+        if (fclose(output) != 0) {
+            fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        profile_chain(prof, &chain);
+        report_profile(prof, opts.profile_flag);
+        free_chain(&chain);
+        pool_destroy(pool);
+        cache_miss(cached, input_hash, to_stdout ? NULL : opts.output_file, info);
+        fprintf(info, "bmpedit: Success!\n");
+        return EXIT_SUCCESS;
+    }
+
+    /* Filtering a window of rows at a time */
+    if (opts.stream_rows > 0) {
+        FILE * output = to_stdout ? stdout : fopen(opts.output_file, "w");
+        if (output == NULL) {
+            fprintf(stderr, "%s the output file could not be created.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        stream_filter(input, output, &file_header, &info_header, &chain, opts.stream_rows, &opts.io, opts.resize, pool, prof, NULL);
+        if (input != stdin) fclose(input);
+        t = profile_clock();
+        if (fclose(output) != 0) {
+            fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+            exit(EXIT_FAILURE);
+        }
+        profile_add(prof, "write", t, 0);
+        profile_chain(prof, &chain);
+        report_profile(prof, opts.profile_flag);
+        free_chain(&chain);
+        pool_destroy(pool);
+        cache_miss(cached, input_hash, to_stdout ? NULL : opts.output_file, info);
+        fprintf(info, "bmpedit: Success!\n");
+        return EXIT_SUCCESS;
+    }
+
+    /* Allocates an image with aligned rows and reads in the pixel data,
+       along with anything stored between the headers and the pixels. When
+       resizing, only the resized image is allocated, and the input rows are
+       resized as they are read */
+    t = profile_clock();
+    size_t gap_size = header_gap(&file_header, &info_header);
+    unsigned char *gap = (unsigned char *) malloc (gap_size + 1);
+    // 32-bit images stay BGRA, 24-bit ones are widened if the chain runs faster on BGRA
+    int layout = (info_header.bpp == 32) ? LAYOUT_BGRA : opts.planar_flag ? LAYOUT_PLANAR : chain_layout(&chain);
+    resizer sizer;
+    if (opts.resize != NULL &&
+        resizer_create(&sizer, info_header.width, abs(info_header.height), info_header.bpp / 8, opts.resize,
+                       pool_threads(pool)) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (gap == NULL || image_create(&img, (opts.resize != NULL) ? sizer.x.out : info_header.width,
+                                    (opts.resize != NULL) ? sizer.y.out : abs(info_header.height), layout) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(gap, 1, gap_size, input) != gap_size ||
+        (opts.resize == NULL && image_read(input, &img, info_header.bpp) != 0)) {
+        fprintf(stderr, "%s reading the image data failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    long long image_bytes = (long long)(info_header.bpp / 8) * img.width * img.height;
+    if (opts.resize != NULL) {
+        resize_target target = {&img, 0};
+        io_stream reader;
+        io_open(&reader, input, NULL, (long long)bmp_stride(&info_header) * abs(info_header.height), 0, &opts.io);
+        resize_check(resize_read(&reader, &sizer, abs(info_header.height), bmp_stride(&info_header), RESIZE_ROWS, pool, prof,
+                                 "read", resize_store, &target));
+        io_close(&reader, prof);
+        resizer_free(&sizer);
+        resize_headers(&file_header, &info_header, img.width, img.height);
+    } else {
+        profile_add(prof, "read", t, image_bytes);
+    }
+    if (input != stdin) fclose(input);
+
+    /* Running filters, gathering the statistics in the last pass if printing them */
+    t = profile_clock();
+    transform_headers(&chain, &file_header, &info_header);
+    if (run_chain_copy(&chain, NULL, &img, pool, opts.stats_flag ? &stats : NULL) != 0) {
+        fprintf(stderr, "%s memory allocation failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "filter (all stages)", t, image_bytes);
+    profile_chain(prof, &chain);
+    free_chain(&chain);
+    pool_destroy(pool);
+    if (opts.stats_flag) {
+        stats_print(stdout, &stats, input_file, opts.stats_flag == 2);
+        image_free(&img);
+        free(gap);
+        report_profile(prof, opts.profile_flag);
+        return EXIT_SUCCESS;
     }
 
-    /* Write bmp image, close file and free malloc */
-    FILE * output = fopen(output_file, "w");
-    write_bmp(output, &file_header, &info_header, pixel_array, pixel_total);
-    fclose(output);
-    free(pixel_array);
+    /* Write bmp image, close file and free memory */
+    t = profile_clock();
+    FILE * output = to_stdout ? stdout : fopen(opts.output_file, "w");
+    if (output == NULL || write_bmp(output, &file_header, &info_header, gap, &img) != 0 || fclose(output) != 0) {
+        fprintf(stderr, "%s writing the output file failed.\n", ERROR_HEADER);
+        exit(EXIT_FAILURE);
+    }
+    profile_add(prof, "write", t, FH_SIZE + info_size(&info_header) + gap_size + image_bytes);
+    image_free(&img);
+    free(gap);
+    report_profile(prof, opts.profile_flag);
+    cache_miss(cached, input_hash, to_stdout ? NULL : opts.output_file, info);
 
-    printf("bmpedit: Success!\n");
+    fprintf(info, "bmpedit: Success!\n");
     return EXIT_SUCCESS;
 }
+#endif
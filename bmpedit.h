@@ -10,8 +10,19 @@
     - structures to store bitmap header data
     - structure to store bitmap rgb values
     - function definitions
+    - the library interface, for programs linking libbmpedit
 */
 
+#ifndef BMPEDIT_H
+#define BMPEDIT_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define FH_SIZE 14      // file header size
+#define IH_SIZE 40      // info header size, though the structure holds the longer versions too
+
 /* Data to be read into structure is of exact fit, pragma disables padding */
 #pragma pack(push, 1)
 
@@ -32,6 +43,14 @@ typedef struct {
     unsigned int h_res, v_res;
     unsigned int colors;
     unsigned int important_colors;
+    // Fields of the longer BITMAPV4HEADER and BITMAPV5HEADER, read as far as the header goes
+    unsigned int red_mask, green_mask, blue_mask, alpha_mask;
+    unsigned int color_space;
+    int endpoints[9];
+    unsigned int gamma_red, gamma_green, gamma_blue;
+    unsigned int intent;
+    unsigned int profile_data, profile_size;
+    unsigned int reserved;
 } BITMAPINFOHEADER;
 
 // Structure used to store BGR values of pixels - reversed as little endian
@@ -41,6 +60,14 @@ typedef struct {
     unsigned char red;
 } pixel;
 
+// Pixels of 32-bit images, with alpha
+typedef struct {
+    unsigned char blue;
+    unsigned char green;
+    unsigned char red;
+    unsigned char alpha;
+} quad;
+
 #pragma pack(pop)
 
 // HSL Structure
@@ -50,18 +77,614 @@ typedef struct {
     float l;
 } hsl_struct;
 
+// HSL shifts in the fixed point units of the HSL engine
+typedef struct {
+    int hue;
+    int saturation;
+    int lightness;
+} hsl_shift;
+
+/* Compression types */
+#define BI_RGB 0
+#define BI_RLE8 1
+#define BI_RLE4 2
+#define BI_BITFIELDS 3
+#define BI_ALPHABITFIELDS 6
+
+#define ROW_ALIGN 64
+
+/* Layouts of the pixels of an image in memory */
+#define LAYOUT_BGR 0
+#define LAYOUT_PLANAR 1
+#define LAYOUT_BGRA 2
+
+// An image in memory. Each row starts stride bytes after the one before, and
+// holds either packed pixels of channels bytes (BGR or BGRA) or, if plane is
+// set, separate blue, green and red planes plane bytes apart. Images made by
+// image_create have every row (and plane) aligned to ROW_ALIGN bytes
+typedef struct {
+    int width, height;
+    size_t stride;
+    size_t plane;           // 0 for packed pixels
+    int channels;           // 3 or 4 bytes per packed pixel
+    unsigned char *data;
+    int owned;              // whether data is freed with the image
+} image;
+
+// A 3D color lookup table (a cube), mapping every color to another by
+// tetrahedral interpolation between the nearest points of a size^3 grid
+typedef struct {
+    int size;                   // grid points along each axis
+    unsigned int *nodes;        // the grid, red changing fastest, then green, then blue. Each node
+                                // holds blue, green and red as 0 to 1020 from bits 0, 10 and 20
+    float scale[3], bias[3];    // position of a value along the blue, green and red axes, in
+                                // 256ths of a grid cell, as value * scale + bias
+    unsigned int axis[3][256];  // the same for every value, as the node offset of the grid
+                                // point below it << 8 | the weight of the next, out of 256
+    double domain[2][3];        // input range covered by the grid (RGB order, 0 to 1)
+} color_cube;
+
+#define CUBE_SIZE 33        // grid points when baking a filter chain
+#define MAX_CUBE_SIZE 256
+
+/* Statistics gathered for a stage, from the least work to the most */
+#define STATS_SUMS 1            // RGB totals, enough for the averages
+#define STATS_HISTOGRAMS 2      // histograms of each channel and of the luminance as well
+
+// Statistics of an image (or of the pixels going into a stage), gathered in
+// one pass with integer counts, so they are exact however large the image is
+// and totals from separate bands can be added in any order
+typedef struct {
+    int level;                          // STATS_SUMS or STATS_HISTOGRAMS
+    long int pixel_total;
+    unsigned long long sums[3];         // RGB totals
+    unsigned long long hist[4][256];    // red, green, blue and luminance histograms, at STATS_HISTOGRAMS
+} image_stats;
+
+#define IMAGE_ROW(img, i) ((*(img)).data + (size_t)(i) * (*(img)).stride)
+
+/* Macros for filter_flag */
+#define FLAG_HSL 1
+#define FLAG_CONTRAST 2
+#define FLAG_WB 4
+#define FLAG_GAMMA 8
+#define FLAG_THRESHOLD 16
+#define FLAG_GREYSCALE 32
+#define FLAG_SEPIA 64
+#define FLAG_INVERSE 128
+#define FLAG_CUBE 256
+#define FLAG_LEVELS 512
+#define FLAG_AUTO_CONTRAST 1024
+#define FLAG_BLUR 2048
+#define FLAG_BOX_BLUR 4096
+#define FLAG_SHARPEN 8192
+#define FLAG_UNSHARP 16384
+#define FLAG_TRANSFORM 32768
+#define FLAG_SPATIAL (FLAG_BLUR | FLAG_BOX_BLUR | FLAG_SHARPEN | FLAG_UNSHARP)
+
+#define LEVELS_CLIP 0.5     // percent of the pixels clipped at each end by auto levels and auto contrast
+
+/* Spatial filters */
+#define SPATIAL_GAUSSIAN 0
+#define SPATIAL_BOX 1
+#define MAX_SIGMA 50.0
+#define MAX_RADIUS 150          // 3 sigma of the widest Gaussian
+#define MAX_BOX_RADIUS 128      // so a row of box sums fits in 16 bits
+#define SPATIAL_TILE_BYTES (256 * 1024)     // intermediate rows of a tile, sized to stay in L2
+
+// A filter which works on the neighbours of each pixel, blurring by the
+// Gaussian or box kernel both ways (as it is separable) and, for sharpening,
+// adding back the difference between each pixel and the blurred image
+typedef struct {
+    int type;           // SPATIAL_GAUSSIAN or SPATIAL_BOX
+    int radius;         // pixels taken in on each side
+    short weights[2 * MAX_RADIUS + 1];      // Gaussian weights, adding up to 16384
+    int amount;         // sharpening amount in 256ths, 0 to only blur
+    int threshold;      // differences from the blurred image up to this many 256ths of a level are left alone
+} spatial_filter;
+
+/* Rotations and flips, as the flips made after an optional transpose (in
+   that order), which covers all eight ways of turning an image over */
+#define TRANSFORM_FLIP_X 1          // mirror left to right
+#define TRANSFORM_FLIP_Y 2          // mirror top to bottom
+#define TRANSFORM_TRANSPOSE 4       // swap rows and columns, about the diagonal from the top left corner
+#define TRANSFORM_ROTATE_90 (TRANSFORM_TRANSPOSE | TRANSFORM_FLIP_X)        // clockwise
+#define TRANSFORM_ROTATE_180 (TRANSFORM_FLIP_X | TRANSFORM_FLIP_Y)
+#define TRANSFORM_ROTATE_270 (TRANSFORM_TRANSPOSE | TRANSFORM_FLIP_Y)
+#define TRANSFORM_TILE_ROWS 64          // a tile of the image turned at a time, which with the rows of
+#define TRANSFORM_TILE_COLUMNS 256      // the output it fills stays in L2
+
+/* Resampling kernels for resizing */
+#define RESIZE_BOX 0
+#define RESIZE_BILINEAR 1
+#define RESIZE_LANCZOS 2
+#define MAX_RESIZE 65535        // largest width or height to resize to
+#define RESIZE_ROWS 64          // input rows read at a time when resizing as the image is read
+
+// Size to resize images to: width by height, either of which may be 0 to
+// keep the aspect ratio, or if fit is set, fit pixels along the longer side
+typedef struct {
+    int width, height;
+    int fit;
+    int kernel;         // a RESIZE_ kernel
+} resize_spec;
+
+// Resampling weights along one axis, in 14-bit fixed point adding up to 16384
+// for each output position: output position i takes weights[i * taps + k]
+// of input position start[i] + k, for taps positions
+typedef struct {
+    int in, out;
+    int taps;
+    int *start;
+    short *weights;
+} resize_axis;
+
+// Weights for resizing an image of pixels of channels bytes, across and down,
+// with a line and a list of rows for each of threads threads to work in
+typedef struct {
+    resize_axis x, y;
+    int channels;
+    int threads;
+    unsigned short *lines;
+    const unsigned char **rows;
+} resizer;
+
+// Parameters for the filters selected on the command line
+typedef struct {
+    double hue, saturation, lightness;
+    double contrast, gamma, threshold;
+    int hsl_cache;      // remember the HSL result for each color
+    int bake;           // grid points to bake the filters into a cube with, 0 to run them as they are
+    color_cube *cube;   // cube loaded from a .cube file, applied after the other filters
+    double levels_clip, contrast_clip;      // percent of the pixels auto levels and auto contrast clip at each end
+    double blur;        // sigma of the Gaussian blur
+    int box_radius;
+    double sharpen;     // amount of the 3x3 sharpen
+    double unsharp[3];      // sigma, amount and threshold of the unsharp mask
+    int transform;      // TRANSFORM_ bits of the rotations and flips, as seen from the top left corner
+} filter_params;
+
+// A filter compiled into the pipeline, applied to one row of pixels at a time
+typedef struct stage stage;
+struct stage {
+    void (*run)(stage *, pixel *row, int width);
+    void (*run_planar)(stage *, unsigned char *plane[3], int width);        // the same on the B, G and R planes of a row
+    void (*run_quad)(stage *, quad *row, int width);        // the same on a row of BGRA pixels, leaving alpha alone
+    void (*prepare)(stage *, const image_stats *);      // set for stages needing whole-image statistics
+    int stats;          // the statistics prepare needs, as a STATS_ level
+    double param[3];
+    float gain[3];
+    unsigned char lut[3][256];      // per-channel lookup tables in BGR order, for point filters
+    int op;         // the filter a lookup table stage holds, if it holds only one
+    hsl_shift shift;
+    unsigned int *cache;        // HSL results by color, if caching
+    color_cube *cube;       // the cube of a 3D lookup table stage
+    spatial_filter *spatial;        // set for spatial stages, which run over the whole image rather than a row at a time
+    int transform;          // set for transposing stages, to the TRANSFORM_ bits of the turn as the rows are stored
+    char name[48];          // the filters the stage holds, for --profile
+    double seconds;         // time spent in the stage, if the chain is timed
+    long long bytes;        // bytes the stage filtered, if the chain is timed
+};
+
+#define MAX_STAGES 16
+
+// A block of memory held by a block pool
+typedef struct {
+    void *data;
+    size_t size;
+    int used;
+} pool_block;
+
+// Blocks of memory kept for reuse by the passes of the filter chain. A block
+// given back is handed out again for the next request it is big enough for,
+// so filtering image after image stops allocating once the pool holds the
+// most blocks used at once
+typedef struct {
+    pthread_mutex_t lock;
+    pool_block *blocks;
+    int count, capacity;
+    long long allocations;      // blocks allocated from the system so far
+} block_pool;
+
+// Filters selected for an image, in the order they are applied
+typedef struct {
+    stage stages[MAX_STAGES];
+    int count;
+    int timed;      // time each stage, for --profile
+    int transform;      // TRANSFORM_ bits of the rotations and flips, which transform_headers readies the stages for
+    block_pool *blocks;     // where the passes take their buffers from, or NULL to allocate them each time
+} filter_chain;
+
+#define MAX_STEPS 32
+
+// Time and bytes moved by each step of filtering an image, for --profile
+typedef struct {
+    struct {
+        const char *name;
+        double seconds;
+        long long bytes;
+    } steps[MAX_STEPS];
+    int count;
+    double start;
+} profile;
+
+#define IO_DEPTH 2              // chunks read ahead of or written behind the filters when streaming
+#define MAX_IO_DEPTH 64
+#define IO_CHUNK (1 << 20)      // bytes read or written at a time when streaming
+#define MAX_IO_CHUNK (64 << 20)
+
+// How a streamed file is read or written: chunk bytes at a time by a thread
+// of its own, up to depth chunks ahead of or behind the filters, or by the
+// filtering thread itself if depth is 0
+typedef struct {
+    size_t chunk;
+    int depth;
+} io_spec;
+
+// A file read or written through an io_spec. The chunks are handed between
+// the filters and the thread reading or writing them in a ring
+typedef struct {
+    FILE *fp, *spool;       // spool, if set, gets a copy of everything read
+    int writing;
+    size_t chunk;
+    int depth;
+    unsigned char *data;    // depth chunks
+    size_t *length;         // bytes in each chunk
+    int head, count;        // first chunk handed over and not yet taken, and how many there are
+    size_t offset;          // bytes taken from the head chunk when reading, or put in the next one when writing
+    long long remaining;    // bytes still to read
+    int done, failed;
+    double io_seconds;      // time spent reading or writing
+    double wait_seconds;    // time the filters spent waiting for it
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} io_stream;
+
+/* SIMD levels for the row kernels */
+#define SIMD_SCALAR 0
+#define SIMD_SSE41 1
+#define SIMD_AVX2 2
+
+// Row kernels which have SIMD versions
+typedef struct {
+    void (*greyscale)(pixel *, int width);
+    void (*sepia)(pixel *, int width);
+    void (*threshold)(int cutoff, pixel *, int width);
+    void (*contrast)(double coeff, pixel *, int width);
+    void (*inverse)(pixel *, int width);
+    void (*hsl)(const hsl_shift *, pixel *, int width);
+    void (*hsl_planar)(const hsl_shift *, unsigned char *plane[3], int width);
+    void (*greyscale_quad)(quad *, int width);
+    void (*sepia_quad)(quad *, int width);
+    void (*threshold_quad)(int cutoff, quad *, int width);
+    void (*contrast_quad)(double coeff, quad *, int width);
+    void (*inverse_quad)(quad *, int width);
+    void (*hsl_quad)(const hsl_shift *, quad *, int width);
+    void (*cube)(const color_cube *, pixel *, int width);
+    void (*cube_planar)(const color_cube *, unsigned char *plane[3], int width);
+    void (*cube_quad)(const color_cube *, quad *, int width);
+    void (*convolve_line)(const unsigned char *, unsigned short *, int n, int step, const short *weights, int radius);
+    void (*convolve_columns)(const unsigned short *const *, const short *weights, int radius, const unsigned char *original,
+                             int amount, int threshold, unsigned char *, int n);
+    void (*box_columns)(int *sums, const unsigned short *add, const unsigned short *drop, float scale, unsigned char *, int n);
+    void (*resample_columns)(const unsigned char *const *, const short *weights, int taps, unsigned short *, int n);
+    void (*resample_line)(const unsigned short *, unsigned char *, const resize_axis *, int first, int last, int channels);
+    void (*mirror)(pixel *, int width);
+    void (*mirror_quad)(quad *, int width);
+    void (*transpose)(const unsigned char *, ptrdiff_t source_stride, unsigned char *, ptrdiff_t dest_stride, int rows,
+                      int columns, int channels);
+} simd_kernels;
+
+#define MAX_THREADS 256
+
+// Pool of threads which run the bands of a job together
+typedef struct {
+    pthread_t *workers;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    void (*job)(void *, int band);
+    void *arg;
+    int bands, next, finished;
+    unsigned long int generation;
+    int quit;
+} thread_pool;
+
+#define ERROR_SIZE 512
+
+// Buffer reused between images, grown as needed
+typedef struct {
+    unsigned char *data;
+    size_t capacity;
+} work_buffer;
+
+// Files to filter in batch mode
+typedef struct {
+    char **files;
+    int count, capacity;
+} batch_list;
+
+#define CACHE_LIMIT 1024        // default size of a result cache in MB
+#define CACHE_VERSION 1         // raised whenever a filter gives different results, so older results are not used
+
+// On-disk cache of filtered images. Each is named by a hash of the input file
+// and a hash of the filters and settings it went through, and the least
+// recently used are removed once they take up more than limit bytes
+typedef struct {
+    const char *dir;
+    unsigned long long filters;
+    long long limit;
+} result_cache;
+
+#define COPY_BLOCK (1 << 20)    // bytes copied at a time between files
+
+// Rectangle of the image to filter, from its top left corner
+typedef struct {
+    int x, y, width, height;
+} region;
+
+#define PREVIEW_STEP 8          // default pixels between those kept in a preview proxy
+#define MAX_PREVIEW_STEP 256
+
+// A decimated copy of an image to preview filters on: every step-th pixel of
+// every step-th row from the top left corner, with the headers of an image
+// its size and whatever was stored between the headers and the pixels
+typedef struct {
+    BITMAPFILEHEADER file_header;
+    BITMAPINFOHEADER info_header;
+    unsigned char *gap;
+    image img;
+} proxy_image;
+
+/* Compression of the indexed images written */
+#define COMPRESS_KEEP 0     // the same as the input
+#define COMPRESS_RLE 1      // run-length encoded, as RLE8 or RLE4 by the color depth
+#define COMPRESS_NONE 2
+
+#define RLE_COMPRESSED(info) ((info).compression == BI_RLE8 || (info).compression == BI_RLE4)
+#define RLE_BLOCK 65536     // bytes of encoded pixels read from a file at a time
+#define RLE_ROW_BOUND(width) (2 * (size_t)(width) + 4)     // most bytes rle_encode_row writes
+
+// Pixels next to each other in a row of a run-length encoded image: either
+// one index repeated (for RLE4, two taking turns) or literal indices
+typedef struct {
+    int x, y;               // first pixel, counting rows in the order they are in the file
+    int length;
+    unsigned char value;    // index repeated, or for RLE4 the first in the high bits and the second in the low
+    const unsigned char *literal;   // indices packed as in an uncompressed row, or NULL for a repeated run
+} rle_run;
+
+// Decodes run-length encoded pixels, held in memory or read from a file a
+// block at a time, either a run or a row at a time
+typedef struct {
+    FILE *fp;
+    long long remaining;        // bytes still to be read from the file, -1 if it ended before them
+    const unsigned char *data;  // the pixels not yet decoded are from start to end
+    unsigned char *buffer;      // blocks read from the file, NULL when decoding from memory
+    size_t start, end;
+    int width, height, bpp;
+    int x, y;                   // where the next run starts
+    int row;                    // next row rle_row decodes
+    int done;                   // set once the end of the bitmap is reached
+    int pending;                // set if run goes in a row after the last one decoded
+    rle_run run;
+} rle_reader;
+
 void read_headers(FILE *, BITMAPFILEHEADER *, BITMAPINFOHEADER *);
-void write_bmp(FILE *, BITMAPFILEHEADER *, BITMAPINFOHEADER *, pixel *, long int pixel_total);
+int read_info(FILE *, BITMAPINFOHEADER *);
+size_t info_size(BITMAPINFOHEADER *);
+size_t header_gap(BITMAPFILEHEADER *, BITMAPINFOHEADER *);
+const char *header_error(BITMAPFILEHEADER *, BITMAPINFOHEADER *);
+void check_headers(BITMAPFILEHEADER *, BITMAPINFOHEADER *);
+int palette_colors(BITMAPINFOHEADER *);
+size_t bmp_stride(BITMAPINFOHEADER *);
+size_t pixel_bytes(BITMAPFILEHEADER *, BITMAPINFOHEADER *);
+int write_bmp(FILE *, BITMAPFILEHEADER *, BITMAPINFOHEADER *, const unsigned char *gap, const image *);
+
+int image_create(image *, int width, int height, int layout);
+int image_create_in(block_pool *, image *, int width, int height, int layout);
+void image_release(block_pool *, image *);
+void image_wrap(image *, void *data, int width, int height, size_t stride, int channels);
+void image_free(image *);
+void image_copy(image *dest, const image *source);
+int image_read(FILE *, image *, int bpp);
+int image_write(FILE *, const image *, int bpp);
 
 void rgb_to_hsl(hsl_struct *, float r, float g, float b);
 void hsl_calc(hsl_struct *, double hue, double saturation, double lightness);
 void hsl_to_rgb(hsl_struct *, pixel *);
-void hsl_filter(double hue, double saturation, double lightness, BITMAPINFOHEADER *, pixel *, int padding);
-
-void wb_filter(BITMAPINFOHEADER *, pixel *, int padding);
-void gamma_filter(double gamma, BITMAPINFOHEADER *, pixel *, int padding);
-void contrast_filter(double contrast, BITMAPINFOHEADER *, pixel *, int padding);
-void greyscale_filter(BITMAPINFOHEADER *, pixel *, int padding);
-void inverse_filter(BITMAPINFOHEADER *, pixel *, int padding);
-void sepia_filter(BITMAPINFOHEADER *, pixel *, int padding);
-void threshold_filter(double threshold, BITMAPINFOHEADER *, pixel *, int padding);
+hsl_shift hsl_fixed_shift(double hue, double saturation, double lightness);
+void hsl_fixed_row(const hsl_shift *, pixel *, int width);
+void hsl_fixed_planes(const hsl_shift *, unsigned char *plane[3], int width);
+void hsl_fixed_quads(const hsl_shift *, quad *, int width);
+void hsl_cached_row(const hsl_shift *, unsigned int *cache, pixel *, int width);
+void hsl_row(double hue, double saturation, double lightness, pixel *, int width);
+void hsl_filter(double hue, double saturation, double lightness, image *);
+
+void wb_sum_row(unsigned long long sums[3], pixel *, int width);
+void wb_sum_quads(unsigned long long sums[3], quad *, int width);
+void wb_gains(const unsigned long long sums[3], long int pixel_total, float *r_gain, float *b_gain);
+void wb_row(float r_gain, float b_gain, pixel *, int width);
+void wb_filter(image *);
+void levels_lut(unsigned char lut[3][256], const image_stats *, double clip, int per_channel);
+void levels_filter(double clip, int per_channel, image *);
+void gamma_row(double gamma, pixel *, int width);
+void gamma_filter(double gamma, image *);
+double contrast_coeff(double contrast);
+void contrast_row(double coeff, pixel *, int width);
+void contrast_filter(double contrast, image *);
+void greyscale_row(pixel *, int width);
+void greyscale_filter(image *);
+void inverse_row(pixel *, int width);
+void inverse_filter(image *);
+void sepia_row(pixel *, int width);
+void greyscale_fixed_row(pixel *, int width);
+void sepia_fixed_row(pixel *, int width);
+void sepia_filter(image *);
+int threshold_cutoff(double threshold);
+void threshold_row(int cutoff, pixel *, int width);
+void threshold_filter(double threshold, image *);
+void greyscale_quads(quad *, int width);
+void sepia_quads(quad *, int width);
+void threshold_quads(int cutoff, quad *, int width);
+void contrast_quads(double coeff, quad *, int width);
+void inverse_quads(quad *, int width);
+
+void spatial_gaussian(spatial_filter *, double sigma, double amount, double threshold);
+void spatial_sharpen(spatial_filter *, double amount);
+void spatial_box(spatial_filter *, int radius);
+void convolve_line(const unsigned char *, unsigned short *, int n, int step, const short *weights, int radius);
+void convolve_columns(const unsigned short *const *, const short *weights, int radius, const unsigned char *original,
+                      int amount, int threshold, unsigned char *, int n);
+void box_line(const unsigned char *, unsigned short *, int n, int step, int radius);
+void box_columns(int *sums, const unsigned short *add, const unsigned short *drop, float scale, unsigned char *, int n);
+void spatial_image(const spatial_filter *, image *);
+void blur_filter(double sigma, image *);
+void box_blur_filter(int radius, image *);
+void sharpen_filter(double amount, image *);
+void unsharp_filter(double sigma, double amount, double threshold, image *);
+
+int resize_axis_create(resize_axis *, int in, int out, int kernel);
+void resize_axis_free(resize_axis *);
+int resizer_create(resizer *, int width, int height, int channels, const resize_spec *, int threads);
+void resizer_free(resizer *);
+void resize_size(const resize_spec *, int width, int height, int *out_width, int *out_height);
+void resize_headers(BITMAPFILEHEADER *, BITMAPINFOHEADER *, int width, int height);
+void resample_columns(const unsigned char *const *, const short *weights, int taps, unsigned short *, int n);
+void resample_line(const unsigned short *, unsigned char *, const resize_axis *, int first, int last, int channels);
+void run_resize(const resizer *, const image *source, int source_first, image *dest, int first, thread_pool *);
+int resize_image(const image *source, image *dest, int kernel, thread_pool *);
+
+int transform_compose(int first, int then);
+void transform_headers(filter_chain *, BITMAPFILEHEADER *, BITMAPINFOHEADER *);
+void mirror_row(pixel *, int width);
+void mirror_quads(quad *, int width);
+void transpose_block(const unsigned char *source, ptrdiff_t source_stride, unsigned char *dest, ptrdiff_t dest_stride,
+                     int rows, int columns, int channels);
+
+int cube_create(color_cube *, int size);
+void cube_domain(color_cube *);
+void cube_free(color_cube *);
+void cube_row(const color_cube *, pixel *, int width);
+void cube_planes(const color_cube *, unsigned char *plane[3], int width);
+void cube_quads(const color_cube *, quad *, int width);
+int cube_read(color_cube *, const char *cube_file, char error[ERROR_SIZE]);
+void cube_load(color_cube *, const char *cube_file);
+int cube_save(FILE *, const color_cube *, const char *title);
+
+simd_kernels simd_get_kernels(int level);
+int simd_detect(void);
+int simd_init(int max_level);
+const char *simd_name(int level);
+
+void free_chain(filter_chain *);
+int build_chain(filter_chain *, int filter_flag, filter_params *);
+int chain_layout(filter_chain *);
+int cube_from_chain(color_cube *, filter_chain *, int first, int last);
+int bake_chain(filter_chain *, int size);
+thread_pool *pool_create(int threads);
+void pool_run(thread_pool *, void (*job)(void *, int band), void *arg, int bands);
+void pool_destroy(thread_pool *);
+int pool_threads(thread_pool *);
+void block_pool_init(block_pool *);
+void block_pool_free(block_pool *);
+void *block_alloc(block_pool *, size_t bytes);
+void block_free(block_pool *, void *data);
+int block_reserve(block_pool *, size_t bytes, int count);
+
+void stats_clear(image_stats *, int level);
+void stats_row(image_stats *, const pixel *, int width);
+void stats_quads(image_stats *, const quad *, int width);
+void stats_planes(image_stats *, unsigned char *plane[3], int width);
+void stats_palette(image_stats *, const pixel *entries, int colors, const unsigned long long counts[256]);
+void stats_finish(image_stats *);
+void stats_add(image_stats *total, const image_stats *);
+int stats_rank(const unsigned long long hist[256], unsigned long long rank);
+void json_string(FILE *, const char *);
+void stats_print(FILE *, const image_stats *, const char *name, int json);
+
+int run_pass(filter_chain *, int first, int last, const image *source, image *, thread_pool *, image_stats *);
+int next_barrier(filter_chain *, int first, int prepared);
+int run_spatial(filter_chain *, int k, const image *source, int source_first, int height, image *dest, int first, thread_pool *);
+int run_transform(filter_chain *, int first, int k, const image *source, image *, thread_pool *, image_stats *);
+int run_chain(filter_chain *, image *, thread_pool *);
+int run_chain_copy(filter_chain *, const image *source, image *, thread_pool *, image_stats *);
+void palette_count(unsigned long long counts[256], const unsigned char *rows, int width, int height, int bpp, size_t stride);
+void palette_filter(filter_chain *, unsigned char *table, int colors, const unsigned long long counts[256]);
+int rle_open(rle_reader *, FILE *fp, const unsigned char *data, size_t bytes, int width, int height, int bpp);
+int rle_next(rle_reader *, rle_run *);
+int rle_row(rle_reader *, unsigned char *row);
+void rle_close(rle_reader *);
+int rle_count(unsigned long long counts[256], const unsigned char *data, size_t bytes, int width, int height, int bpp);
+size_t rle_encode_row(unsigned char *out, const unsigned char *row, int width, int bpp, int last);
+void palette_stream(FILE *in, FILE *out, BITMAPFILEHEADER *, BITMAPINFOHEADER *, filter_chain *, int compress,
+                    profile *, image_stats *);
+void stream_filter(FILE *in, FILE *out, BITMAPFILEHEADER *, BITMAPINFOHEADER *, filter_chain *, int rows,
+                   const io_spec *, const resize_spec *, thread_pool *, profile *, image_stats *);
+void map_filter(const char *input_file, const char *output_file, filter_chain *, thread_pool *, profile *);
+void region_filter(const char *input_file, const char *output_file, filter_chain *, const region *, thread_pool *, profile *,
+                   image_stats *);
+
+double profile_clock(void);
+void profile_start(profile *);
+void profile_add(profile *, const char *name, double start, long long bytes);
+void profile_chain(profile *, filter_chain *);
+void profile_print(FILE *, profile *, int json);
+
+void io_open(io_stream *, FILE *fp, FILE *spool, long long bytes, int writing, const io_spec *);
+void io_read(io_stream *, unsigned char *data, size_t bytes);
+void io_write(io_stream *, const unsigned char *data, size_t bytes);
+void io_close(io_stream *, profile *);
+
+long long filter_file(const char *input_file, const char *output_file, filter_chain *, const resize_spec *, int compress,
+                      thread_pool *, work_buffer *, image_stats *, char error[ERROR_SIZE]);
+int batch_output_name(char *name, size_t size, const char *template, const char *input_file, int index);
+int run_batch(char **files, int count, const char *template, filter_chain *, const resize_spec *, int compress,
+              thread_pool *, int stats_flag, const result_cache *);
+void batch_add(batch_list *, const char *path);
+void batch_add_list(batch_list *, const char *list_file);
+void batch_free(batch_list *);
+
+unsigned long long hash_bytes(const void *data, size_t size, unsigned long long seed);
+int hash_file(const char *file, unsigned long long *hash);
+long long cache_fetch(const result_cache *, unsigned long long input_hash, const char *output_file);
+int cache_store(const result_cache *, unsigned long long input_hash, const char *output_file);
+int cache_count(const result_cache *, long long hits, long long misses, long long totals[3]);
+
+long long proxy_read(const char *input_file, int step, proxy_image *, char error[ERROR_SIZE]);
+int proxy_key(const char *input_file, int step, unsigned long long *key);
+int proxy_load(const result_cache *, unsigned long long key, proxy_image *);
+int proxy_store(const result_cache *, unsigned long long key, const proxy_image *);
+int proxy_filter(const proxy_image *, FILE *output, filter_chain *, thread_pool *, image_stats *);
+void proxy_free(proxy_image *);
+
+/* The library interface. A context holds everything filtering needs between
+   images: the thread pool, a pool of blocks for the buffers of the filter
+   passes, and the message of the last error. Chains are built once with
+   build_chain and can be run by any number of contexts, each on one image
+   at a time, once the first context has picked the kernels for this CPU.
+   After the first image of each size, filtering an image in memory
+   allocates nothing. The functions return BMPEDIT_OK or one of the error
+   codes below, rather than exiting */
+
+#define BMPEDIT_OK 0
+#define BMPEDIT_ERROR_MEMORY -1         // memory ran out
+#define BMPEDIT_ERROR_FORMAT -2         // the input is not a BMP bmpedit can read, or is cut short
+#define BMPEDIT_ERROR_ARGUMENT -3       // the sizes or the chain do not suit the function
+#define BMPEDIT_ERROR_SPACE -4          // the output buffer is too small
+#define BMPEDIT_ERROR_FILE -5           // a file could not be read or written
+
+typedef struct bmpedit_context bmpedit_context;
+
+bmpedit_context *bmpedit_create(int threads);
+void bmpedit_destroy(bmpedit_context *);
+const char *bmpedit_error(const bmpedit_context *);
+long long bmpedit_allocations(const bmpedit_context *);
+int bmpedit_filter_pixels(bmpedit_context *, const filter_chain *, unsigned char *pixels, int width, int height,
+                          size_t stride, int channels);
+int bmpedit_filter_bmp(bmpedit_context *, const filter_chain *, const unsigned char *input, size_t size,
+                       unsigned char *output, size_t *output_size);
+int bmpedit_filter_file(bmpedit_context *, const filter_chain *, const char *input_file, const char *output_file);
+
+#endif